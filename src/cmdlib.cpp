@@ -34,6 +34,7 @@
 #include "inout.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <chrono>
 
 #if GDEF_OS_WINDOWS
 #include <direct.h>
@@ -290,6 +291,18 @@ double I_FloatTime( void ){
 #endif
 }
 
+
+
+/*
+   ================
+   I_PreciseTime
+   monotonic seconds, for timing work items
+   ================
+ */
+double I_PreciseTime( void ){
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
 void Q_getwd( char *out ){
 	int i = 0;
 
@@ -95,6 +95,7 @@ void ExpandWildcards( int *argc, char ***argv );
 
 
 double I_FloatTime( void );
+double I_PreciseTime( void );
 
 void    Error( const char *error, ... ) GDEF_ATTRIBUTE_NORETURN;
 int     CheckParm( const char *check );
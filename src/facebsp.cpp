@@ -390,6 +390,7 @@ tree_t *FaceBSP( face_t *list ) {
 	int count;
 
 	Sys_FPrintf( SYS_VRB, "--- FaceBSP ---\n" );
+	ProfileBeginPhase( "FaceBSP" );
 
 	tree = AllocTree();
 
@@ -418,6 +419,7 @@ tree_t *FaceBSP( face_t *list ) {
 
 	Sys_FPrintf( SYS_VRB, "%9d leafs\n", c_faceLeafs );
 
+	ProfileEndPhase();
 	return tree;
 }
 
@@ -165,12 +165,16 @@ void HelpLight()
         {"-area <F>, -areascale <F>", "Scaling factor for area lights (surfacelight)"},
         {"-border", "Add a red border to lightmaps for debugging"},
         {"-bounce <N>", "Number of bounces for radiosity"},
+        {"-bouncecheckpoint <N>", "Write the BSP every N bounces of radiosity, so an interrupted compile keeps its progress"},
+        {"-bouncecut <F>", "Sample radiosity lights of lightmaps through a light tree, splitting it until the error bound of every node is below F times the light of the luxel (e.g. 0.02)"},
         {"-bouncegrid", "Also compute radiosity on the light grid"},
         {"-bounceonly", "Only compute radiosity"},
         {"-bouncescale <F>", "Scaling factor for radiosity"},
         {"-bspfile <filename.bsp>", "BSP file to read and write"},
         {"-cheap", "Abort vertex light calculations when white is reached"},
+        {"-checkpoint", "Store finished lightmaps, grid points and bounces in `<mapname>.light.checkpoint` while lighting, so `-resume` can pick up an interrupted compile"},
         {"-cheapgrid", "Use `-cheap` style lighting for lightgrid"},
+        {"-compactsuper", "Keep the supersampled buffers of raw lightmaps no thread is working on packed as half floats and octahedral normals, to lower the memory use of large maps and high `-super` values"},
         {"-compensate <F>", "Lightmap compensate (darkening factor applied after everything else)"},
         {"-cpma, -forcevertex", "CPMA vertex lighting mode"},
         {"-dark", "Darken lightmap seams"},
@@ -208,7 +212,9 @@ void HelpLight()
         {"-gridambientscale <F>", "Scaling factor for the light grid ambient components only"},
         {"-griddirectionality <F>", "Trade off directional light in favor of ambient light in lightgrid"},
         {"-gridscale <F>", "Scaling factor for the light grid only"},
+        {"-irrcache <F>", "Trace lights at a sparse set of luxels and interpolate the rest where they differ by less than F (e.g. 0.05)"},
         {"-lightanglehl", "Enable Half Lambert lighting attenuation"},
+        {"-lightcache <path>", "Keep the lit lightmaps and grid points in this directory, keyed by a hash of their inputs, so the next compile only relights what an edit could have changed"},
         {"-lightmapdir <path>", "Directory to store external lightmaps (default: same as map name without extension)"},
         {"-lightmapsearchblocksize <N>", "Sets of lightmap search blocksize"},
         {"-lightmapsearchpower <N>", "Sets of lightmap search power"},
@@ -216,6 +222,7 @@ void HelpLight()
         {"-lightsubdiv <N>", "Size of light emitting shader subdivision"},
         {"-lomem", "Low memory but slower lighting mode"},
         {"-lowquality", "Low quality floodlight (currently breaks floodlight, do not use)"},
+        {"-membudget <N>[K|M|G]", "Implies `-compactsuper`, packed super buffers beyond this size are spilled to `<mapname>.light.scratch` and read back when a phase needs them (e.g. 8G)"},
         {"-minsamplesize <N>", "Sets minimum lightmap resolution in units/px"},
         {"-nocollapse", "Do not collapse identical lightmaps"},
         {"-nofastpoint", "Disable automatic fast mode for point lights"},
@@ -230,13 +237,16 @@ void HelpLight()
         {"-nosRGBtex", "Disable sRGB color for textures (for sampling radiosity)"},
         {"-normalmap", "Color the lightmaps according to the direction of the surface normal (same as `-debugnormals`)"},
         {"-nostyle, -nostyles", "Disable support for light styles"},
+        {"-nostitch", "Do not average the luxels along the edges of neighbouring lightmaps"},
         {"-nosurf", "Disable tracing against surfaces (only uses BSP nodes then)"},
         {"-notrace", "Disable shadow occlusion"},
+        {"-oldtracetree", "Trace shadows against the old axial trace tree instead of the BVH (for comparison)"},
         {"-patchshadows", "Cast shadows from patches"},
         {"-point <F>, -pointscale <F>", "Scaling factor for point lights (light entities)"},
         {"-q3, -invsqatten", "Use nonlinear falloff curve by default (like Q3A)"},
         {"-randomsamples", "Use random luxels selection with `-samples`"},
         {"-rawlightmapsizelimit <N>", "Limits raw lightmap size"},
+        {"-resume", "Resume an interrupted compile from its checkpoint, skipping the finished lightmaps, grid points and bounces (implies `-checkpoint`)"},
         {"-samples <N>", "Adaptive supersampling quality"},
         {"-samplescale <N>", "Scales all lightmap resolutions"},
         {"-samplesize <N>", "Sets default lightmap resolution in units/px"},
@@ -245,6 +255,7 @@ void HelpLight()
         {"-shade", "Enable phong shading at default shade angle"},
         {"-shadeangle <F>", "Enable phong shading with specified angle"},
         {"-sky <F>, -skyscale <F>", "Scaling factor for sky and sun light"},
+        {"-skyvis <N>", "Sort suns and sky light iterations into an N x N map of sky directions (at most 16), each luxel and grid point traces one ray per cell and shades all of its suns from it"},
         {"-spherical <F>, -sphericalscale <F>", "Scaling factor for spherical point lights"},
         {"-spot <F>, -spotscale <F>", "Scaling factor for spot point lights"},
         {"-srffile <filename.srf>", "Surface file to read"},
@@ -390,7 +401,9 @@ void HelpCommon()
         {"-fs_pakpath <path>", "Specify a package directory (up to 200)"},
         {"-game <gamename>", "Load settings for the given game (default: quake3)"},
         {"-help <stage>", "Prints this information"},
+        {"-profile json", "Write per-phase timings, per-thread busy/idle time and the slowest work items to <mapname>.<stage>.profile.json"},
         {"-subdivisions <N>", "Patch mesh subdivision amount"},
+        {"-threadaffinity", "Pin each worker thread to its own CPU"},
         {"-threads <N>", "Limit CPU usage to maximum usage of N threads"},
         {"-v", "Verbose mode"}
     };
@@ -38,6 +38,7 @@
 #undef max
 
 #include <vector>
+#include <algorithm>
 #include <string>
 #include "tinyformat.h"
 
@@ -780,13 +781,202 @@ float PointToPolygonFormFactor( const vec3_t point, const vec3_t normal, const w
 
 
 
+/* what the setup functions return when the sample still needs its shadow ray */
+#define CONTRIBUTION_TRACE      2
+
+
+
 /*
-   LightContributionTosample()
-   determines the amount of light reaching a sample (luxel or vertex) from a given light
+   sky visibility
+   -skyvis <N> sorts the sun and sky lights by direction into the cells of an N x N
+   octahedral map of the sphere. the first light of a cell a sample sees traces one ray
+   along the average direction of the cell's lights, and every light of the cell is shaded
+   from that ray at that sample. cells holding a single light keep tracing it exactly, as
+   do cells whose ray crossed an alphashadow or lightfilter surface
  */
 
-int LightContributionToSample( trace_t *trace ){
+static int numSkyBins;
+static vec3_t skyBinOrigins[ MAX_SKY_BINS ];
+
+static int SkyCell( const vec3_t direction ){
+	float sum, u, v, t;
+
+
+	/* project onto the octahedron and fold the lower half out */
+	sum = fabs( direction[ 0 ] ) + fabs( direction[ 1 ] ) + fabs( direction[ 2 ] );
+	u = direction[ 0 ] / sum;
+	v = direction[ 1 ] / sum;
+	if ( direction[ 2 ] < 0.0f ) {
+		t = u;
+		u = ( 1.0f - fabs( v ) ) * ( t >= 0.0f ? 1.0f : -1.0f );
+		v = ( 1.0f - fabs( t ) ) * ( v >= 0.0f ? 1.0f : -1.0f );
+	}
+
+	return std::min( (int) ( ( v * 0.5f + 0.5f ) * skyVisResolution ), skyVisResolution - 1 ) * skyVisResolution +
+		   std::min( (int) ( ( u * 0.5f + 0.5f ) * skyVisResolution ), skyVisResolution - 1 );
+}
+
+
+
+/*
+   SetupSkyVisibility()
+   puts the suns into sky bins, called once the lights are created
+ */
+
+void SetupSkyVisibility( void ){
+	int i, cell, numBinned;
+	std::vector<int> counts, bins;
+	std::vector<float> directions;
+	vec3_t direction;
+	light_t         *light;
+
+
+	numSkyBins = 0;
+	skyVisSize = 0;
+	if ( skyVisResolution <= 0 ) {
+		return;
+	}
+
+	/* count the suns in every cell */
+	counts.assign( skyVisResolution * skyVisResolution, 0 );
+	directions.assign( 3 * counts.size(), 0.0f );
+	for ( light = lights; light != NULL; light = light->next )
+	{
+		light->skyBin = 0;
+		if ( light->type != EMIT_SUN ) {
+			continue;
+		}
+		VectorNormalize( light->origin, direction );
+		cell = SkyCell( direction );
+		counts[ cell ]++;
+		VectorAdd( &directions[ 3 * cell ], direction, &directions[ 3 * cell ] );
+	}
+
+	/* cells with more than one sun become bins, traced along their average direction */
+	bins.assign( counts.size(), 0 );
+	for ( i = 0; i < (int) counts.size(); i++ )
+	{
+		if ( counts[ i ] < 2 ) {
+			continue;
+		}
+		VectorNormalize( &directions[ 3 * i ], direction );
+		VectorScale( direction, MAX_WORLD_COORD * 8.0f, skyBinOrigins[ numSkyBins ] );
+		bins[ i ] = ++numSkyBins;
+	}
+	numBinned = 0;
+	for ( light = lights; light != NULL; light = light->next )
+	{
+		if ( light->type != EMIT_SUN ) {
+			continue;
+		}
+		VectorNormalize( light->origin, direction );
+		light->skyBin = bins[ SkyCell( direction ) ];
+		if ( light->skyBin > 0 ) {
+			numBinned++;
+		}
+	}
+
+	if ( numSkyBins > 0 ) {
+		skyVisSize = 3 * ( ( numSkyBins + 63 ) / 64 );
+	}
+	Sys_Printf( "%9d sun/sky lights share %d sky visibility bins\n", numBinned, numSkyBins );
+}
+
+
+
+/*
+   SkyVisibilitySetup()
+   looks the sky bin of a sun up at the sample, returns 1 if it is open, -1 if it is blocked
+   and CONTRIBUTION_TRACE if a ray still has to be traced, along the bin when it is the
+   first of the bin at this sample
+ */
+
+static int SkyVisibilitySetup( trace_t *trace ){
+	int bin, words;
+	uint64_t bit, *traced, *open, *filtered;
+
+
+	trace->skyBinPending = 0;
+	if ( trace->skyVis == NULL || trace->light->skyBin <= 0 ) {
+		return CONTRIBUTION_TRACE;
+	}
+
+	words = skyVisSize / 3;
+	bin = trace->light->skyBin - 1;
+	bit = 1ULL << ( bin & 63 );
+	traced = &trace->skyVis[ bin >> 6 ];
+	open = traced + words;
+	filtered = open + words;
+
+	if ( *filtered & bit ) {
+		return CONTRIBUTION_TRACE;
+	}
+	if ( *traced & bit ) {
+		THREAD_STAT( skyVisReused )++;
+		return ( *open & bit ) ? 1 : -1;
+	}
+
+	/* trace the bin for every sun in it */
+	VectorAdd( trace->origin, skyBinOrigins[ bin ], trace->end );
+	SetupTrace( trace );
+	trace->forceSubsampling = 0.0f;
+	trace->skyBinPending = bin + 1;
+	THREAD_STAT( skyVisTraced )++;
+	return CONTRIBUTION_TRACE;
+}
+
+
+
+/*
+   SkyVisibilityStore()
+   notes what the ray of a sky bin found at the sample and points the trace back at its sun,
+   a ray that was filtered by a texture is traced again for the sun itself
+ */
+
+static void SkyVisibilityStore( trace_t *trace, float add ){
+	int bin, words;
+	uint64_t bit, *traced, *open, *filtered;
+
+
+	if ( trace->skyBinPending <= 0 ) {
+		return;
+	}
+
+	words = skyVisSize / 3;
+	bin = trace->skyBinPending - 1;
+	bit = 1ULL << ( bin & 63 );
+	traced = &trace->skyVis[ bin >> 6 ];
+	open = traced + words;
+	filtered = open + words;
+	trace->skyBinPending = 0;
+
+	VectorAdd( trace->origin, trace->light->origin, trace->end );
+	SetupTrace( trace );
+
+	if ( trace->forceSubsampling > 0.0f ) {
+		*filtered |= bit;
+		trace->forceSubsampling = 0.0f;
+		VectorScale( trace->light->color, add, trace->color );
+		TraceLine( trace );
+		return;
+	}
+	*traced |= bit;
+	if ( ( trace->compileFlags & C_SKY ) && !trace->opaque ) {
+		*open |= bit;
+	}
+}
+
+
+
+/*
+   LightContributionToSampleSetup()
+   the unoccluded part of LightContributionToSample(): returns CONTRIBUTION_TRACE with the
+   trace set up and the light scale in *traceAdd if the sample still needs its shadow ray
+ */
+
+static int LightContributionToSampleSetup( trace_t *trace, float *traceAdd ){
 	light_t         *light;
+	int result;
 	float angle;
 	float add;
 	float dist;
@@ -1156,17 +1346,18 @@ int LightContributionToSample( trace_t *trace ){
 		trace->testAll = qtrue;
 		VectorScale( light->color, add, trace->color );
 
-		/* trace to point */
+		/* trace to point, unless its sky bin was already traced there */
 		if ( trace->testOcclusion && !trace->forceSunlight ) {
-			/* trace */
-			TraceLine( trace );
-			trace->forceSubsampling *= add;
-			if ( !( trace->compileFlags & C_SKY ) || trace->opaque ) {
+			result = SkyVisibilitySetup( trace );
+			if ( result < 0 ) {
 				VectorClear( trace->color );
 				VectorClear( trace->directionContribution );
-
-				return -1;
 			}
+			if ( result != CONTRIBUTION_TRACE ) {
+				return result;
+			}
+			*traceAdd = add;
+			return CONTRIBUTION_TRACE;
 		}
 
 		/* return to sender */
@@ -1215,9 +1406,33 @@ int LightContributionToSample( trace_t *trace ){
 	VectorScale( light->color, add, trace->color );
 
 	/* raytrace */
-	TraceLine( trace );
-	trace->forceSubsampling *= add;
-	if ( trace->passSolid || trace->opaque ) {
+	*traceAdd = add;
+	return CONTRIBUTION_TRACE;
+}
+
+
+
+/*
+   LightContributionToSampleShadow()
+   finishes a sample after its shadow ray was traced
+ */
+
+static int LightContributionToSampleShadow( trace_t *trace, float traceAdd ){
+	if ( trace->light->type == EMIT_SUN ) {
+		SkyVisibilityStore( trace, traceAdd );
+	}
+	trace->forceSubsampling *= traceAdd;
+
+	/* sunlight has to reach the sky */
+	if ( trace->light->type == EMIT_SUN ) {
+		if ( !( trace->compileFlags & C_SKY ) || trace->opaque ) {
+			VectorClear( trace->color );
+			VectorClear( trace->directionContribution );
+
+			return -1;
+		}
+	}
+	else if ( trace->passSolid || trace->opaque ) {
 		VectorClear( trace->color );
 		VectorClear( trace->directionContribution );
 
@@ -1230,6 +1445,69 @@ int LightContributionToSample( trace_t *trace ){
 
 
 
+/*
+   LightContributionTosample()
+   determines the amount of light reaching a sample (luxel or vertex) from a given light
+ */
+
+int LightContributionToSample( trace_t *trace ){
+	int result;
+	float traceAdd;
+
+
+	/* -bouncecut: a tree of diffuse lights picks its own rays */
+	if ( trace->light->cut != NULL ) {
+		return LightCutContribution( trace );
+	}
+
+	result = LightContributionToSampleSetup( trace, &traceAdd );
+	if ( result != CONTRIBUTION_TRACE ) {
+		return result;
+	}
+	TraceLine( trace );
+	return LightContributionToSampleShadow( trace, traceAdd );
+}
+
+
+
+/*
+   LightContributionToSamplePacket()
+   LightContributionToSample() for a tile of samples and one light,
+   with the shadow rays traced as a packet (see TraceLinePacket() for the cache tile)
+ */
+
+void LightContributionToSamplePacket( trace_t **traces, int numTraces, int cacheTile, int *results ){
+	int i, numPending;
+	float traceAdds[ MAX_TRACE_PACKET ];
+	trace_t         *pending[ MAX_TRACE_PACKET ];
+
+
+	/* shade */
+	numPending = 0;
+	for ( i = 0; i < numTraces; i++ )
+	{
+		if ( traces[ i ]->light->cut != NULL ) {
+			results[ i ] = LightCutContribution( traces[ i ] );
+			continue;
+		}
+		results[ i ] = LightContributionToSampleSetup( traces[ i ], &traceAdds[ i ] );
+		if ( results[ i ] == CONTRIBUTION_TRACE ) {
+			pending[ numPending++ ] = traces[ i ];
+		}
+	}
+
+	/* shadow */
+	TraceLinePacket( pending, numPending, cacheTile );
+	for ( i = 0; i < numTraces; i++ )
+	{
+		if ( results[ i ] == CONTRIBUTION_TRACE ) {
+			results[ i ] = LightContributionToSampleShadow( traces[ i ], traceAdds[ i ] );
+		}
+	}
+}
+
+
+
 /*
    LightingAtSample()
    determines the amount of light reaching a sample (luxel or vertex)
@@ -1237,6 +1515,7 @@ int LightContributionToSample( trace_t *trace ){
 
 void LightingAtSample( trace_t *trace, byte styles[ MAX_LIGHTMAPS ], vec3_t colors[ MAX_LIGHTMAPS ] ){
 	int i, lightmapNum;
+	uint64_t skyVis[ MAX_SKY_VIS_SIZE ];
 
 
 	/* clear colors */
@@ -1256,6 +1535,12 @@ void LightingAtSample( trace_t *trace, byte styles[ MAX_LIGHTMAPS ], vec3_t colo
 		VectorCopy( ambientColor, colors[ 0 ] );
 	}
 
+	/* the suns of a sky bin share their ray at this sample */
+	if ( skyVisSize > 0 ) {
+		memset( skyVis, 0, sizeof( skyVis ) );
+		trace->skyVis = skyVis;
+	}
+
 	/* ydnar: trace to all the list of lights pre-stored in tw */
 	for ( i = 0; i < trace->numLights && trace->lights[ i ] != NULL; i++ )
 	{
@@ -1301,19 +1586,21 @@ void LightingAtSample( trace_t *trace, byte styles[ MAX_LIGHTMAPS ], vec3_t colo
 			break;
 		}
 	}
+	trace->skyVis = NULL;
 }
 
 
 
 /*
-   LightContributionToPoint()
-   for a given light, how much light/color reaches a given point in space (with no facing)
-   note: this is similar to LightContributionToSample() but optimized for omnidirectional sampling
+   LightContributionToPointSetup()
+   the unoccluded part of LightContributionToPoint(): returns CONTRIBUTION_TRACE
+   with the trace set up if the point still needs its shadow ray
  */
 
-int LightContributionToPoint( trace_t *trace ){
+static int LightContributionToPointSetup( trace_t *trace ){
 	light_t     *light;
 	float add, dist;
+	int result;
 
 
 	/* get light */
@@ -1344,7 +1631,7 @@ int LightContributionToPoint( trace_t *trace ){
 	if ( trace->origin[ 0 ] > light->maxs[ 0 ] || trace->origin[ 0 ] < light->mins[ 0 ] ||
 		 trace->origin[ 1 ] > light->maxs[ 1 ] || trace->origin[ 1 ] < light->mins[ 1 ] ||
 		 trace->origin[ 2 ] > light->maxs[ 2 ] || trace->origin[ 2 ] < light->mins[ 2 ] ) {
-		gridBoundsCulled++;
+		THREAD_STAT( gridBoundsCulled )++;
 		return qfalse;
 	}
 
@@ -1361,7 +1648,7 @@ int LightContributionToPoint( trace_t *trace ){
 
 	/* test envelope */
 	if ( dist > light->envelope ) {
-		gridEnvelopeCulled++;
+		THREAD_STAT( gridEnvelopeCulled )++;
 		return qfalse;
 	}
 
@@ -1475,14 +1762,13 @@ int LightContributionToPoint( trace_t *trace ){
 		trace->testAll = qtrue;
 		VectorScale( light->color, add, trace->color );
 
-		/* trace to point */
+		/* trace to point, unless its sky bin was already traced there */
 		if ( trace->testOcclusion && !trace->forceSunlight ) {
-			/* trace */
-			TraceLine( trace );
-			if ( !( trace->compileFlags & C_SKY ) || trace->opaque ) {
+			result = SkyVisibilitySetup( trace );
+			if ( result < 0 ) {
 				VectorClear( trace->color );
-				return -1;
 			}
+			return result;
 		}
 
 		/* return to sender */
@@ -1504,8 +1790,26 @@ int LightContributionToPoint( trace_t *trace ){
 	VectorScale( light->color, add, trace->color );
 
 	/* trace */
-	TraceLine( trace );
-	if ( trace->passSolid ) {
+	return CONTRIBUTION_TRACE;
+}
+
+
+
+/*
+   LightContributionToPointShadow()
+   finishes a point after its shadow ray was traced
+ */
+
+static int LightContributionToPointShadow( trace_t *trace ){
+	/* sunlight has to reach the sky */
+	if ( trace->light->type == EMIT_SUN ) {
+		SkyVisibilityStore( trace, trace->light->photons );
+		if ( !( trace->compileFlags & C_SKY ) || trace->opaque ) {
+			VectorClear( trace->color );
+			return -1;
+		}
+	}
+	else if ( trace->passSolid ) {
 		VectorClear( trace->color );
 		return qfalse;
 	}
@@ -1516,6 +1820,61 @@ int LightContributionToPoint( trace_t *trace ){
 
 
 
+/*
+   LightContributionToPoint()
+   for a given light, how much light/color reaches a given point in space (with no facing)
+   note: this is similar to LightContributionToSample() but optimized for omnidirectional sampling
+ */
+
+int LightContributionToPoint( trace_t *trace ){
+	int result;
+
+
+	result = LightContributionToPointSetup( trace );
+	if ( result != CONTRIBUTION_TRACE ) {
+		return result;
+	}
+	TraceLine( trace );
+	return LightContributionToPointShadow( trace );
+}
+
+
+
+/*
+   LightContributionToPointPacket()
+   LightContributionToPoint() for a tile of points and one light,
+   with the shadow rays traced as a packet (see TraceLinePacket() for the cache tile)
+   only sunlight uses the shadow cache, other lights are only blocked by structural brushes
+   here and a cached triangle can't tell whether the ray passed one
+ */
+
+void LightContributionToPointPacket( trace_t **traces, int numTraces, int cacheTile, int *results ){
+	int i, numPending;
+	trace_t         *pending[ MAX_TRACE_PACKET ];
+
+
+	/* shade */
+	numPending = 0;
+	for ( i = 0; i < numTraces; i++ )
+	{
+		results[ i ] = LightContributionToPointSetup( traces[ i ] );
+		if ( results[ i ] == CONTRIBUTION_TRACE ) {
+			pending[ numPending++ ] = traces[ i ];
+		}
+	}
+
+	/* shadow */
+	TraceLinePacket( pending, numPending, numTraces > 0 && traces[ 0 ]->light->type == EMIT_SUN ? cacheTile : -1 );
+	for ( i = 0; i < numTraces; i++ )
+	{
+		if ( results[ i ] == CONTRIBUTION_TRACE ) {
+			results[ i ] = LightContributionToPointShadow( traces[ i ] );
+		}
+	}
+}
+
+
+
 /*
    TraceGrid()
    grid samples are for quickly determining the lighting
@@ -1533,18 +1892,33 @@ typedef struct
 }
 contribution_t;
 
-void TraceGrid( int num ){
-	int i, j, x, y, z, mod, numCon, numStyles;
-	float d, step;
-	vec3_t baseOrigin, cheapColor, color, thisdir;
-	rawGridPoint_t          *gp;
-	bspGridPoint_t          *bgp;
-	contribution_t contributions[ MAX_CONTRIBUTIONS ];
-	trace_t trace;
 
-	/* get grid points */
-	gp = &rawGridPoints[ num ];
-	bgp = &bspGridPoints[ num ];
+
+/*
+   GridNudgeRandom()
+   returns a pseudorandom number between 0 and 1 from a sequence seeded by the grid point,
+   so a point is nudged to the same place whichever thread sets it up and in whatever order
+ */
+
+static vec_t GridNudgeRandom( uint32_t *seed ){
+	*seed = *seed * 1664525u + 1013904223u;
+	return (vec_t) ( *seed >> 8 ) / (vec_t) 0xFFFFFF;
+}
+
+
+
+/*
+   SetupGridPointTrace()
+   finds the origin and cluster of a grid point and sets up its trace,
+   returns qfalse if there is no valid point to sample
+ */
+
+static qboolean SetupGridPointTrace( int num, trace_t *trace ){
+	int x, y, z, mod;
+	float step;
+	vec3_t baseOrigin;
+	uint32_t seed;
+
 
 	/* get grid origin */
 	mod = num;
@@ -1554,98 +1928,79 @@ void TraceGrid( int num ){
 	mod -= y * gridBounds[ 0 ];
 	x = mod;
 
-	trace.origin[ 0 ] = gridMins[ 0 ] + x * gridSize[ 0 ];
-	trace.origin[ 1 ] = gridMins[ 1 ] + y * gridSize[ 1 ];
-	trace.origin[ 2 ] = gridMins[ 2 ] + z * gridSize[ 2 ];
+	trace->origin[ 0 ] = gridMins[ 0 ] + x * gridSize[ 0 ];
+	trace->origin[ 1 ] = gridMins[ 1 ] + y * gridSize[ 1 ];
+	trace->origin[ 2 ] = gridMins[ 2 ] + z * gridSize[ 2 ];
 
 	/* set inhibit sphere */
 	if ( gridSize[ 0 ] > gridSize[ 1 ] && gridSize[ 0 ] > gridSize[ 2 ] ) {
-		trace.inhibitRadius = gridSize[ 0 ] * 0.5f;
+		trace->inhibitRadius = gridSize[ 0 ] * 0.5f;
 	}
 	else if ( gridSize[ 1 ] > gridSize[ 0 ] && gridSize[ 1 ] > gridSize[ 2 ] ) {
-		trace.inhibitRadius = gridSize[ 1 ] * 0.5f;
+		trace->inhibitRadius = gridSize[ 1 ] * 0.5f;
 	}
 	else{
-		trace.inhibitRadius = gridSize[ 2 ] * 0.5f;
+		trace->inhibitRadius = gridSize[ 2 ] * 0.5f;
 	}
 
 	/* find point cluster */
-	trace.cluster = ClusterForPointExt( trace.origin, GRID_EPSILON );
-	if ( trace.cluster < 0 ) {
+	trace->cluster = ClusterForPointExt( trace->origin, GRID_EPSILON );
+	if ( trace->cluster < 0 ) {
 		/* try to nudge the origin around to find a valid point */
-		VectorCopy( trace.origin, baseOrigin );
+		VectorCopy( trace->origin, baseOrigin );
+		seed = (uint32_t) num * 2654435761u;
 		for ( step = 0; ( step += 0.005 ) <= 1.0; )
 		{
-			VectorCopy( baseOrigin, trace.origin );
-			trace.origin[ 0 ] += step * ( Random() - 0.5 ) * gridSize[0];
-			trace.origin[ 1 ] += step * ( Random() - 0.5 ) * gridSize[1];
-			trace.origin[ 2 ] += step * ( Random() - 0.5 ) * gridSize[2];
+			VectorCopy( baseOrigin, trace->origin );
+			trace->origin[ 0 ] += step * ( GridNudgeRandom( &seed ) - 0.5 ) * gridSize[0];
+			trace->origin[ 1 ] += step * ( GridNudgeRandom( &seed ) - 0.5 ) * gridSize[1];
+			trace->origin[ 2 ] += step * ( GridNudgeRandom( &seed ) - 0.5 ) * gridSize[2];
 
 			/* ydnar: changed to find cluster num */
-			trace.cluster = ClusterForPointExt( trace.origin, VERTEX_EPSILON );
-			if ( trace.cluster >= 0 ) {
+			trace->cluster = ClusterForPointExt( trace->origin, VERTEX_EPSILON );
+			if ( trace->cluster >= 0 ) {
 				break;
 			}
 		}
 
 		/* can't find a valid point at all */
 		if ( step > 1.0 ) {
-			return;
+			return qfalse;
 		}
 	}
 
 	/* setup trace */
-	trace.testOcclusion = !noTrace ? qtrue : qfalse;
-	trace.forceSunlight = qfalse;
-	trace.recvShadows = WORLDSPAWN_RECV_SHADOWS;
-	trace.numSurfaces = 0;
-	trace.surfaces = NULL;
-	trace.numLights = 0;
-	trace.lights = NULL;
-
-	/* clear */
-	numCon = 0;
-	VectorClear( cheapColor );
+	trace->testOcclusion = !noTrace ? qtrue : qfalse;
+	trace->forceSunlight = qfalse;
+	trace->recvShadows = WORLDSPAWN_RECV_SHADOWS;
+	trace->numSurfaces = 0;
+	trace->surfaces = NULL;
+	trace->numLights = 0;
+	trace->lights = NULL;
+	trace->skyVis = NULL;
 
-	/* trace to all the lights, find the major light direction, and divide the
-	   total light between that along the direction and the remaining in the ambient */
-	for ( trace.light = lights; trace.light != NULL; trace.light = trace.light->next )
-	{
-		float addSize;
+	return qtrue;
+}
 
 
-		/* sample light */
-		if ( !LightContributionToPoint( &trace ) ) {
-			continue;
-		}
 
-		/* handle negative light */
-		if ( trace.light->flags & LIGHT_NEGATIVE ) {
-			VectorScale( trace.color, -1.0f, trace.color );
-		}
+/*
+   StoreGridPoint()
+   adds the floodlight to the contributions of a grid point, separates them
+   into directed and ambient light and stores the point
+ */
 
-		/* add a contribution */
-		VectorCopy( trace.color, contributions[ numCon ].color );
-		VectorCopy( trace.direction, contributions[ numCon ].dir );
-		VectorClear( contributions[ numCon ].ambient );
-		contributions[ numCon ].style = trace.light->style;
-		numCon++;
+static void StoreGridPoint( int num, trace_t *trace, contribution_t *contributions, int numCon ){
+	int i, j, numStyles;
+	float d;
+	vec3_t thisdir, ambient[ MAX_LIGHTMAPS ];
+	rawGridPoint_t          *gp;
+	bspGridPoint_t          *bgp;
 
-		/* push average direction around */
-		addSize = VectorLength( trace.color );
-		VectorMA( gp->dir, addSize, trace.direction, gp->dir );
 
-		/* stop after a while */
-		if ( numCon >= ( MAX_CONTRIBUTIONS - 1 ) ) {
-			break;
-		}
-
-		/* ydnar: cheap mode */
-		VectorAdd( cheapColor, trace.color, cheapColor );
-		if ( cheapgrid && cheapColor[ 0 ] >= 255.0f && cheapColor[ 1 ] >= 255.0f && cheapColor[ 2 ] >= 255.0f ) {
-			break;
-		}
-	}
+	/* get grid points */
+	gp = &rawGridPoints[ num ];
+	bgp = &bspGridPoints[ num ];
 
 	/////// Floodlighting for point //////////////////
 	//do our floodlight ambient occlusion loop, and add a single contribution based on the brightest dir
@@ -1655,26 +2010,26 @@ void TraceGrid( int num ){
 		vec3_t dir = { 0, 0, 1 };
 		float ambientFrac = 0.25f;
 
-		trace.testOcclusion = qtrue;
-		trace.forceSunlight = qfalse;
-		trace.inhibitRadius = DEFAULT_INHIBIT_RADIUS;
-		trace.testAll = qtrue;
+		trace->testOcclusion = qtrue;
+		trace->forceSunlight = qfalse;
+		trace->inhibitRadius = DEFAULT_INHIBIT_RADIUS;
+		trace->testAll = qtrue;
 
 		for ( k = 0; k < 2; k++ )
 		{
 			if ( k == 0 ) { // upper hemisphere
-				trace.normal[0] = 0;
-				trace.normal[1] = 0;
-				trace.normal[2] = 1;
+				trace->normal[0] = 0;
+				trace->normal[1] = 0;
+				trace->normal[2] = 1;
 			}
 			else //lower hemisphere
 			{
-				trace.normal[0] = 0;
-				trace.normal[1] = 0;
-				trace.normal[2] = -1;
+				trace->normal[0] = 0;
+				trace->normal[1] = 0;
+				trace->normal[2] = -1;
 			}
 
-			f = FloodLightForSample( &trace, floodlightDistance, floodlight_lowquality );
+			f = FloodLightForSample( trace, floodlightDistance, floodlight_lowquality );
 
 			/* add a fraction as pure ambient, half as top-down direction */
 			contributions[ numCon ].color[0] = floodlightRGB[0] * floodlightIntensity * f * ( 1.0f - ambientFrac );
@@ -1777,18 +2132,18 @@ void TraceGrid( int num ){
 			VectorMA( gp->ambient[ i ], 0.125f, gp->directed[ i ], gp->ambient[ i ] );
 		}
 
-		/* set minimum light and copy off to bytes */
-		VectorCopy( gp->ambient[ i ], color );
+		/* set minimum light */
+		VectorCopy( gp->ambient[ i ], ambient[ i ] );
 		for ( j = 0; j < 3; j++ )
-			if ( color[ j ] < minGridLight[ j ] ) {
-				color[ j ] = minGridLight[ j ];
+			if ( ambient[ i ][ j ] < minGridLight[ j ] ) {
+				ambient[ i ][ j ] = minGridLight[ j ];
 			}
-
-		/* vortex: apply gridscale and gridambientscale here */
-		ColorToBytes( color, bgp->ambient[ i ], gridScale * gridAmbientScale );
-		ColorToBytes( gp->directed[ i ], bgp->directed[ i ], gridScale );
 	}
 
+	/* vortex: apply gridscale and gridambientscale here */
+	ColorsToBytes( ambient[ 0 ], 3, bgp->ambient[ 0 ], 3, MAX_LIGHTMAPS, gridScale * gridAmbientScale );
+	ColorsToBytes( gp->directed[ 0 ], 3, bgp->directed[ 0 ], 3, MAX_LIGHTMAPS, gridScale );
+
 	/* debug code */
 	#if 0
 	//%	Sys_FPrintf( SYS_VRB, "%10d %10d %10d ", &gp->ambient[ 0 ][ 0 ], &gp->ambient[ 0 ][ 1 ], &gp->ambient[ 0 ][ 2 ] );
@@ -1804,6 +2159,309 @@ void TraceGrid( int num ){
 
 
 
+/*
+   grid bricks
+   the grid is traced in bricks of GRID_BRICK x GRID_BRICK x GRID_BRICK points, sorted in
+   morton order so the bricks a thread takes one after another are close to each other.
+   bricks that can't hold a point outside of solid are left out when the grid is set up
+ */
+
+#define GRID_BRICK              TRACE_PACKET_TILE
+#define MAX_GRID_BRICK_POINTS   ( GRID_BRICK * GRID_BRICK * GRID_BRICK )
+
+static int numGridBricks = 0;
+static int                  *gridBricks = NULL;     /* brick numbers in morton order */
+static int gridBrickBounds[ 3 ];
+
+
+
+/*
+   GridBrickMorton()
+   interleaves the bits of a brick's coordinates
+ */
+
+static uint64_t GridBrickMorton( int x, int y, int z ){
+	int i;
+	uint64_t code;
+
+
+	code = 0;
+	for ( i = 0; i < 21; i++ )
+	{
+		code |= (uint64_t) ( ( x >> i ) & 1 ) << ( 3 * i );
+		code |= (uint64_t) ( ( y >> i ) & 1 ) << ( 3 * i + 1 );
+		code |= (uint64_t) ( ( z >> i ) & 1 ) << ( 3 * i + 2 );
+	}
+	return code;
+}
+
+
+
+/*
+   GridBrickInSolid_r()
+   returns qtrue if every leaf a box touches is without a cluster, so that
+   ClusterForPointExt() can't find a point anywhere in it
+ */
+
+static qboolean GridBrickInSolid_r( const vec3_t mins, const vec3_t maxs, int nodeNum ){
+	int i;
+	float dist, radius;
+	vec3_t center;
+	bspNode_t       *node;
+	bspPlane_t      *plane;
+
+
+	for ( i = 0; i < 3; i++ )
+		center[ i ] = ( mins[ i ] + maxs[ i ] ) * 0.5f;
+
+	/* same epsilon as PointInLeafNum_r() */
+	while ( nodeNum >= 0 )
+	{
+		node = &bspNodes[ nodeNum ];
+		plane = &bspPlanes[ node->planeNum ];
+		dist = DotProduct( center, plane->normal ) - plane->dist;
+		radius = fabs( plane->normal[ 0 ] ) * ( maxs[ 0 ] - center[ 0 ] ) +
+				 fabs( plane->normal[ 1 ] ) * ( maxs[ 1 ] - center[ 1 ] ) +
+				 fabs( plane->normal[ 2 ] ) * ( maxs[ 2 ] - center[ 2 ] );
+		if ( dist - radius > 0.1f ) {
+			nodeNum = node->children[ 0 ];
+		}
+		else if ( dist + radius < -0.1f ) {
+			nodeNum = node->children[ 1 ];
+		}
+		else
+		{
+			if ( !GridBrickInSolid_r( mins, maxs, node->children[ 0 ] ) ) {
+				return qfalse;
+			}
+			nodeNum = node->children[ 1 ];
+		}
+	}
+
+	return bspLeafs[ -nodeNum - 1 ].cluster < 0 ? qtrue : qfalse;
+}
+
+
+
+/*
+   SetupGridBricks()
+   sorts the grid bricks in morton order, leaving out those in solid
+ */
+
+static void SetupGridBricks( void ){
+	int i, x, y, z, numBricks, numSolid;
+	vec3_t mins, maxs;
+	std::vector<uint64_t> codes;
+
+
+	/* bricks along each axis */
+	for ( i = 0; i < 3; i++ )
+		gridBrickBounds[ i ] = ( gridBounds[ i ] + GRID_BRICK - 1 ) / GRID_BRICK;
+	numBricks = gridBrickBounds[ 0 ] * gridBrickBounds[ 1 ] * gridBrickBounds[ 2 ];
+
+	free( gridBricks );
+	gridBricks = static_cast<int*>( safe_malloc( std::max( numBricks, 1 ) * sizeof( int ) ) );
+	codes.resize( numBricks );
+	numGridBricks = 0;
+	numSolid = 0;
+	for ( z = 0; z < gridBrickBounds[ 2 ]; z++ )
+	{
+		for ( y = 0; y < gridBrickBounds[ 1 ]; y++ )
+		{
+			for ( x = 0; x < gridBrickBounds[ 0 ]; x++ )
+			{
+				/* the points of the brick, as far as SetupGridPointTrace() nudges them */
+				mins[ 0 ] = gridMins[ 0 ] + ( x * GRID_BRICK - 0.5f ) * gridSize[ 0 ] - 1.0f;
+				mins[ 1 ] = gridMins[ 1 ] + ( y * GRID_BRICK - 0.5f ) * gridSize[ 1 ] - 1.0f;
+				mins[ 2 ] = gridMins[ 2 ] + ( z * GRID_BRICK - 0.5f ) * gridSize[ 2 ] - 1.0f;
+				maxs[ 0 ] = gridMins[ 0 ] + ( std::min( x * GRID_BRICK + GRID_BRICK, gridBounds[ 0 ] ) - 0.5f ) * gridSize[ 0 ] + 1.0f;
+				maxs[ 1 ] = gridMins[ 1 ] + ( std::min( y * GRID_BRICK + GRID_BRICK, gridBounds[ 1 ] ) - 0.5f ) * gridSize[ 1 ] + 1.0f;
+				maxs[ 2 ] = gridMins[ 2 ] + ( std::min( z * GRID_BRICK + GRID_BRICK, gridBounds[ 2 ] ) - 0.5f ) * gridSize[ 2 ] + 1.0f;
+				if ( numBSPNodes > 0 && GridBrickInSolid_r( mins, maxs, 0 ) ) {
+					numSolid++;
+					continue;
+				}
+
+				i = ( z * gridBrickBounds[ 1 ] + y ) * gridBrickBounds[ 0 ] + x;
+				codes[ i ] = GridBrickMorton( x, y, z );
+				gridBricks[ numGridBricks++ ] = i;
+			}
+		}
+	}
+	std::sort( gridBricks, gridBricks + numGridBricks, [&codes]( int a, int b ){ return codes[ a ] < codes[ b ]; } );
+
+	/* emit some statistics */
+	Sys_FPrintf( SYS_VRB, "%9d grid bricks\n", numBricks );
+	Sys_FPrintf( SYS_VRB, "%9d grid bricks in solid skipped\n", numSolid );
+}
+
+
+
+/*
+   TraceGrid()
+   traces a brick of grid points against the lights culled to its bounds and clusters,
+   the shadow rays of up to a 4x4 layer of the brick to each light as a packet
+ */
+
+void TraceGrid( int num ){
+	int i, j, k, t, x, y, z, brick, bx, by, bz, numTraces, numPacket, numClusters, maxCon, cacheTile;
+	uint64_t active, cacheKey, skyVis[ MAX_GRID_BRICK_POINTS * MAX_SKY_VIS_SIZE ];
+	int nums[ MAX_GRID_BRICK_POINTS ], numCons[ MAX_GRID_BRICK_POINTS ], clusters[ MAX_GRID_BRICK_POINTS ];
+	int packetNums[ MAX_TRACE_PACKET ], results[ MAX_TRACE_PACKET ];
+	float addSize;
+	vec3_t mins, maxs, cheapColors[ MAX_GRID_BRICK_POINTS ];
+	rawGridPoint_t          *gp;
+	contribution_t          *contributions, *con;
+	trace_t traces[ MAX_GRID_BRICK_POINTS ], *packet[ MAX_TRACE_PACKET ], *trace;
+	light_t                 *light, **brickLights;
+
+
+	/* a resumed run takes the bricks it already traced from the checkpoint */
+	if ( !bouncing && CheckpointRestoreGridTile( num ) ) {
+		return;
+	}
+
+	/* get the brick */
+	brick = gridBricks[ num ];
+	bx = brick % gridBrickBounds[ 0 ];
+	by = ( brick / gridBrickBounds[ 0 ] ) % gridBrickBounds[ 1 ];
+	bz = brick / ( gridBrickBounds[ 0 ] * gridBrickBounds[ 1 ] );
+
+	/* setup the traces of its points, a layer at a time */
+	numTraces = 0;
+	numClusters = 0;
+	ClearBounds( mins, maxs );
+	for ( z = bz * GRID_BRICK; z < ( bz + 1 ) * GRID_BRICK && z < gridBounds[ 2 ]; z++ )
+	{
+		for ( y = by * GRID_BRICK; y < ( by + 1 ) * GRID_BRICK && y < gridBounds[ 1 ]; y++ )
+		{
+			for ( x = bx * GRID_BRICK; x < ( bx + 1 ) * GRID_BRICK && x < gridBounds[ 0 ]; x++ )
+			{
+				nums[ numTraces ] = ( z * gridBounds[ 1 ] + y ) * gridBounds[ 0 ] + x;
+				if ( SetupGridPointTrace( nums[ numTraces ], &traces[ numTraces ] ) ) {
+					numCons[ numTraces ] = 0;
+					VectorClear( cheapColors[ numTraces ] );
+					AddPointToBounds( traces[ numTraces ].origin, mins, maxs );
+					for ( i = 0; i < numClusters && clusters[ i ] != traces[ numTraces ].cluster; i++ ) ;
+					if ( i == numClusters ) {
+						clusters[ numClusters++ ] = traces[ numTraces ].cluster;
+					}
+					numTraces++;
+				}
+			}
+		}
+	}
+	if ( numTraces == 0 ) {
+		return;
+	}
+
+	/* a relight takes the bricks whose inputs didn't change from the light cache */
+	cacheKey = !bouncing ? LightCacheGridTileKey( traces, nums, numTraces ) : 0;
+	if ( LightCacheRestoreGridTile( cacheKey ) ) {
+		CheckpointWriteGridTile( num, nums, numTraces );
+		return;
+	}
+
+	/* the suns of a sky bin share their ray at each point */
+	if ( skyVisSize > 0 ) {
+		memset( skyVis, 0, numTraces * skyVisSize * sizeof( *skyVis ) );
+		for ( t = 0; t < numTraces; t++ )
+			traces[ t ].skyVis = &skyVis[ t * skyVisSize ];
+	}
+
+	/* one light list for the whole brick, in light list order so the contributions add up the same */
+	if ( numLights > 0 ) {
+		CreateTraceLightsForBounds( mins, maxs, NULL, numClusters, clusters, LIGHT_GRID, &traces[ 0 ] );
+	}
+	brickLights = traces[ 0 ].lights;
+
+	/* neighbouring bricks share shadow cache entries */
+	cacheTile = ( bz * GRID_BRICK / SHADOW_CACHE_TILE ) * 65536 + ( by * GRID_BRICK / SHADOW_CACHE_TILE ) * 256 +
+				bx * GRID_BRICK / SHADOW_CACHE_TILE;
+
+	/* a point gets at most one contribution per light and two from the floodlight */
+	maxCon = ( traces[ 0 ].numLights < MAX_CONTRIBUTIONS - 1 ? traces[ 0 ].numLights : MAX_CONTRIBUTIONS - 1 ) + 2;
+	contributions = static_cast<contribution_t*>( safe_malloc( numTraces * maxCon * sizeof( contribution_t ) ) );
+
+	/* trace to all the lights, find the major light direction, and divide the
+	   total light between that along the direction and the remaining in the ambient */
+	active = numTraces < 64 ? ( 1ull << numTraces ) - 1 : ~0ull;
+	for ( i = 0; i < traces[ 0 ].numLights && brickLights[ i ] != NULL && active != 0; i++ )
+	{
+		light = brickLights[ i ];
+
+		/* sample light, a packet at a time */
+		for ( t = 0; t < numTraces; )
+		{
+			numPacket = 0;
+			for ( ; t < numTraces && numPacket < MAX_TRACE_PACKET; t++ )
+			{
+				if ( active & ( 1ull << t ) ) {
+					traces[ t ].light = light;
+					packetNums[ numPacket ] = t;
+					packet[ numPacket++ ] = &traces[ t ];
+				}
+			}
+			if ( numPacket == 0 ) {
+				continue;
+			}
+			LightContributionToPointPacket( packet, numPacket, cacheTile, results );
+
+			for ( j = 0; j < numPacket; j++ )
+			{
+				if ( !results[ j ] ) {
+					continue;
+				}
+				k = packetNums[ j ];
+				trace = &traces[ k ];
+				gp = &rawGridPoints[ nums[ k ] ];
+
+				/* handle negative light */
+				if ( light->flags & LIGHT_NEGATIVE ) {
+					VectorScale( trace->color, -1.0f, trace->color );
+				}
+
+				/* add a contribution */
+				con = &contributions[ k * maxCon + numCons[ k ] ];
+				VectorCopy( trace->color, con->color );
+				VectorCopy( trace->direction, con->dir );
+				VectorClear( con->ambient );
+				con->style = light->style;
+				numCons[ k ]++;
+
+				/* push average direction around */
+				addSize = VectorLength( trace->color );
+				VectorMA( gp->dir, addSize, trace->direction, gp->dir );
+
+				/* stop after a while */
+				if ( numCons[ k ] >= ( MAX_CONTRIBUTIONS - 1 ) ) {
+					active &= ~( 1ull << k );
+					continue;
+				}
+
+				/* ydnar: cheap mode */
+				VectorAdd( cheapColors[ k ], trace->color, cheapColors[ k ] );
+				if ( cheapgrid && cheapColors[ k ][ 0 ] >= 255.0f && cheapColors[ k ][ 1 ] >= 255.0f && cheapColors[ k ][ 2 ] >= 255.0f ) {
+					active &= ~( 1ull << k );
+				}
+			}
+		}
+	}
+	FreeTraceLights( &traces[ 0 ] );
+
+	/* store the points */
+	for ( t = 0; t < numTraces; t++ )
+		StoreGridPoint( nums[ t ], &traces[ t ], &contributions[ t * maxCon ], numCons[ t ] );
+	if ( !bouncing ) {
+		CheckpointWriteGridTile( num, nums, numTraces );
+		LightCacheWriteGridTile( cacheKey, nums, numTraces );
+	}
+
+	free( contributions );
+}
+
+
+
 /*
    SetupGrid()
    calculates the size of the lightgrid and allocates memory
@@ -1892,6 +2550,9 @@ void SetupGrid( void ){
 
 	/* note it */
 	Sys_Printf( "%9d grid points\n", numRawGridPoints );
+
+	/* sort the bricks the grid is traced in */
+	SetupGridBricks();
 }
 
 void dumpLightsIntoPrefab(const char *prefix) {
@@ -1930,6 +2591,57 @@ void dumpLightsIntoPrefab(const char *prefix) {
 	}
 }
 
+/*
+   MergeThreadStats()
+   adds the counts every thread made during a threaded phase to the light statistics
+ */
+
+#define MERGE_THREAD_STAT( name )   name += ts->name; ts->name = 0
+
+void MergeThreadStats( void ){
+	int i;
+	threadStats_t   *ts;
+
+
+	for ( i = 0; i < numthreads; i++ )
+	{
+		ts = &threadStats[ i ];
+		MERGE_THREAD_STAT( numLuxelsMapped );
+		MERGE_THREAD_STAT( numLuxelsOccluded );
+		MERGE_THREAD_STAT( numLuxelsIlluminated );
+		MERGE_THREAD_STAT( numVertsIlluminated );
+		MERGE_THREAD_STAT( lightsBoundsCulled );
+		MERGE_THREAD_STAT( lightsEnvelopeCulled );
+		MERGE_THREAD_STAT( lightsPlaneCulled );
+		MERGE_THREAD_STAT( lightsClusterCulled );
+		MERGE_THREAD_STAT( gridBoundsCulled );
+		MERGE_THREAD_STAT( gridEnvelopeCulled );
+		MERGE_THREAD_STAT( numDiffuseLights );
+		MERGE_THREAD_STAT( numBrushDiffuseLights );
+		MERGE_THREAD_STAT( numTriangleDiffuseLights );
+		MERGE_THREAD_STAT( numPatchDiffuseLights );
+		MERGE_THREAD_STAT( numPacketRays );
+		MERGE_THREAD_STAT( numSingleRays );
+		MERGE_THREAD_STAT( shadowCacheHits );
+		MERGE_THREAD_STAT( shadowCacheMisses );
+		MERGE_THREAD_STAT( irrCacheTraced );
+		MERGE_THREAD_STAT( irrCacheInterpolated );
+		MERGE_THREAD_STAT( skyVisTraced );
+		MERGE_THREAD_STAT( skyVisReused );
+		MERGE_THREAD_STAT( lightCutSamples );
+		MERGE_THREAD_STAT( lightCutRays );
+		MERGE_THREAD_STAT( lightCutSize );
+		MERGE_THREAD_STAT( lightCutLights );
+		MERGE_THREAD_STAT( numUsedLuxels );
+		MERGE_THREAD_STAT( numSolidLightmaps );
+		MERGE_THREAD_STAT( numSurfsVertexForced );
+		MERGE_THREAD_STAT( numSurfsVertexApproximated );
+		MERGE_THREAD_STAT( numLuxelsStitched );
+	}
+}
+
+
+
 /*
    LightWorld()
    does what it says...
@@ -1938,11 +2650,14 @@ void dumpLightsIntoPrefab(const char *prefix) {
 void LightWorld( const char *BSPFilePath){
 	vec3_t color;
 	float f;
-	int b, bt;
+	int b, bt, resumeBounce;
 	qboolean minVertex, minGrid;
 	const char  *value;
 
 
+	/* build the gamma and sRGB tables for storing colors */
+	SetupColorTables();
+
 	/* ydnar: smooth normals */
 	if ( shade ) {
 		Sys_Printf( "--- SmoothNormals ---\n" );
@@ -2010,6 +2725,7 @@ void LightWorld( const char *BSPFilePath){
 	Sys_Printf( "%9d spotlights\n", numSpotLights );
 	Sys_Printf( "%9d diffuse (area) lights\n", numDiffuseLights );
 	Sys_Printf( "%9d sun/sky lights\n", numSunLights );
+	SetupSkyVisibility();
 
 	/* calculate lightgrid */
 	if ( !noGridLighting ) {
@@ -2018,7 +2734,7 @@ void LightWorld( const char *BSPFilePath){
 
 		Sys_Printf( "--- TraceGrid ---\n" );
 		inGrid = qtrue;
-		RunThreadsOnIndividual( numRawGridPoints, qtrue, TraceGrid );
+		RunThreadsOnIndividual( numGridBricks, qtrue, TraceGrid );
 		inGrid = qfalse;
 		Sys_Printf( "%d x %d x %d = %d grid\n",
 					gridBounds[ 0 ], gridBounds[ 1 ], gridBounds[ 2 ], numBSPGridPoints );
@@ -2038,14 +2754,24 @@ void LightWorld( const char *BSPFilePath){
 	Sys_Printf( "%9d luxels mapped\n", numLuxelsMapped );
 	Sys_Printf( "%9d luxels occluded\n", numLuxelsOccluded );
 
-	/* dirty them up */
-	if ( dirty ) {
-		Sys_Printf( "--- DirtyRawLightmap ---\n" );
-		RunThreadsOnIndividual( numRawLightmaps, qtrue, DirtyRawLightmap );
+	/* dirty them up and floodlight them, sharing the hemisphere rays when both are on */
+	if ( DirtFloodFused() ) {
+		Sys_Printf( "--- DirtyFloodlightRawLightmap ---\n" );
+		numSurfacesFloodlighten = 0;
+		RunThreadsOnIndividual( numRawLightmaps, qtrue, DirtyFloodlightRawLightmap );
+		Sys_Printf( "%9d custom lightmaps floodlighted\n", numSurfacesFloodlighten );
 	}
+	else
+	{
+		/* dirty them up */
+		if ( dirty ) {
+			Sys_Printf( "--- DirtyRawLightmap ---\n" );
+			RunThreadsOnIndividual( numRawLightmaps, qtrue, DirtyRawLightmap );
+		}
 
-	/* floodlight pass */
-	FloodlightRawLightmaps();
+		/* floodlight pass */
+		FloodlightRawLightmaps();
+	}
 
 	/* ydnar: set up light envelopes */
 	SetupEnvelopes( qfalse, fast );
@@ -2057,13 +2783,17 @@ void LightWorld( const char *BSPFilePath){
 	lightsClusterCulled = 0;
 
 	Sys_Printf( "--- IlluminateRawLightmap ---\n" );
-	RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmap );
+	IlluminateRawLightmaps();
 	Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
+	LightCacheStats();
 
 	StitchSurfaceLightmaps();
 
 	Sys_Printf( "--- IlluminateVertexes ---\n" );
-	RunThreadsOnIndividual( numBSPDrawSurfaces, qtrue, IlluminateVertexes );
+	if ( !CheckpointRestoreVertexes() ) {
+		RunThreadsOnIndividual( numBSPDrawSurfaces, qtrue, IlluminateVertexes );
+		CheckpointWriteVertexes();
+	}
 	Sys_Printf( "%9d vertexes illuminated\n", numVertsIlluminated );
 
 	/* ydnar: emit statistics on light culling */
@@ -2071,17 +2801,54 @@ void LightWorld( const char *BSPFilePath){
 	Sys_FPrintf( SYS_VRB, "%9d lights envelope culled\n", lightsEnvelopeCulled );
 	Sys_FPrintf( SYS_VRB, "%9d lights bounds culled\n", lightsBoundsCulled );
 	Sys_FPrintf( SYS_VRB, "%9d lights cluster culled\n", lightsClusterCulled );
+	Sys_FPrintf( SYS_VRB, "%9d shadow rays traced in packets\n", numPacketRays );
+	Sys_FPrintf( SYS_VRB, "%9d shadow rays traced alone\n", numSingleRays );
+	Sys_FPrintf( SYS_VRB, "%9d shadow cache hits (%.1f%%)\n", shadowCacheHits,
+				 shadowCacheHits + shadowCacheMisses > 0 ? 100.0 * shadowCacheHits / ( shadowCacheHits + shadowCacheMisses ) : 0.0 );
+	Sys_FPrintf( SYS_VRB, "%9d shadow cache misses\n", shadowCacheMisses );
+	if ( irrCacheError > 0.0f ) {
+		Sys_Printf( "%9d light samples traced by the irradiance cache\n", irrCacheTraced );
+		Sys_Printf( "%9d light samples interpolated (%.1f%%)\n", irrCacheInterpolated,
+					irrCacheTraced + irrCacheInterpolated > 0 ? 100.0 * irrCacheInterpolated / ( irrCacheTraced + irrCacheInterpolated ) : 0.0 );
+	}
+	if ( skyVisSize > 0 ) {
+		Sys_Printf( "%9d sky bin rays traced\n", skyVisTraced );
+		Sys_Printf( "%9d sun samples shaded from them\n", skyVisReused );
+	}
+	CompactSuperStats();
 
 	/* radiosity */
 	b = 1;
 	bt = bounce;
+
+	/* a resumed run picks the radiosity up at the last bounce in the checkpoint */
+	resumeBounce = bounce > 0 ? CheckpointBounce() : 0;
+	if ( resumeBounce > 0 ) {
+		b = resumeBounce;
+		bounce -= resumeBounce - 1;
+	}
+
 	while ( bounce > 0 )
 	{
-		/* store off the bsp between bounces */
-		StoreSurfaceLightmaps();
-		UnparseEntities();
-		Sys_Printf( "Writing %s\n", BSPFilePath );
-		WriteBSPFile( BSPFilePath );
+		if ( b == resumeBounce ) {
+			CheckpointRestoreBounce();
+		}
+		else
+		{
+			/* average the last pass into the bsp luxels, radiosity samples the float radiosity luxels */
+			SubsampleRawLightmaps();
+
+			/* the bsp only gets packed and written between bounces as a checkpoint */
+			if ( bounceCheckpoint > 0 && ( b - 1 ) % bounceCheckpoint == 0 ) {
+				StoreSurfaceLightmaps();
+				UnparseEntities();
+				Sys_Printf( "Writing %s\n", BSPFilePath );
+				WriteBSPFile( BSPFilePath );
+				CheckpointBSPWritten( BSPFilePath );
+			}
+
+			CheckpointWriteBounce( b );
+		}
 
 		/* note it */
 		Sys_Printf( "\n--- Radiosity (bounce %d of %d) ---\n", b, bt );
@@ -2099,6 +2866,7 @@ void LightWorld( const char *BSPFilePath){
 		SetupEnvelopes( qfalse, fastbounce );
 		if ( numLights == 0 ) {
 			Sys_Printf( "No diffuse light to calculate, ending radiosity.\n" );
+			StoreSurfaceLightmaps();
 			return;
 		}
 
@@ -2109,7 +2877,7 @@ void LightWorld( const char *BSPFilePath){
 
 			Sys_Printf( "--- BounceGrid ---\n" );
 			inGrid = qtrue;
-			RunThreadsOnIndividual( numRawGridPoints, qtrue, TraceGrid );
+			RunThreadsOnIndividual( numGridBricks, qtrue, TraceGrid );
 			inGrid = qfalse;
 			Sys_FPrintf( SYS_VRB, "%9d grid points envelope culled\n", gridEnvelopeCulled );
 			Sys_FPrintf( SYS_VRB, "%9d grid points bounds culled\n", gridBoundsCulled );
@@ -2121,10 +2889,20 @@ void LightWorld( const char *BSPFilePath){
 		lightsBoundsCulled = 0;
 		lightsClusterCulled = 0;
 
+		lightCutSamples = 0;
+		lightCutRays = 0;
+		lightCutSize = 0;
+		lightCutLights = 0;
+
 		Sys_Printf( "--- IlluminateRawLightmap ---\n" );
-		RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmap );
+		IlluminateRawLightmaps();
 		Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
 		Sys_Printf( "%9d vertexes illuminated\n", numVertsIlluminated );
+		if ( bounceCut > 0.0f && lightCutSamples > 0 ) {
+			Sys_Printf( "%9d light cuts sampled\n", lightCutSamples );
+			Sys_Printf( "%9d light cut shadow rays traced\n", lightCutRays );
+			Sys_Printf( "%9.1f average cut size of %.1f lights\n", lightCutSize / lightCutSamples, lightCutLights / lightCutSamples );
+		}
 
 		StitchSurfaceLightmaps();
 
@@ -2148,6 +2926,7 @@ void LightWorld( const char *BSPFilePath){
 	}
 
 	/* ydnar: store off lightmaps */
+	SubsampleRawLightmaps();
 	StoreSurfaceLightmaps();
 }
 
@@ -2173,6 +2952,15 @@ int LightMain( int argc, char **argv ){
 	Sys_Printf( "--- Light ---\n" );
 	Sys_Printf( "--- ProcessGameSpecific ---\n" );
 
+	/* per-thread statistics */
+	threadStats = static_cast<threadStats_t*>( safe_malloc( numthreads * sizeof( threadStats_t ) ) );
+	memset( threadStats, 0, numthreads * sizeof( threadStats_t ) );
+	threadPhaseEnd = MergeThreadStats;
+
+	/* per-thread shadow caches */
+	shadowCaches = static_cast<shadowCacheEntry_t*>( safe_malloc( numthreads * SHADOW_CACHE_SIZE * sizeof( shadowCacheEntry_t ) ) );
+	memset( shadowCaches, 0, numthreads * SHADOW_CACHE_SIZE * sizeof( shadowCacheEntry_t ) );
+
 	/* set standard game flags */
 	wolfLight = game->wolfLight;
 	if ( wolfLight == qtrue ) {
@@ -2475,6 +3263,24 @@ int LightMain( int argc, char **argv ){
 			i++;
 		}
 
+		else if (!Q_stricmp(argv[i], "-skyvis")) {
+			skyVisResolution = std::max(std::min(atoi(argv[i + 1]), MAX_SKY_VIS_RESOLUTION), 0);
+			options.push_back({
+				argv[i], argv[i + 1],
+				tfm::format("suns in the same cell of a %d x %d sky map share their shadow rays", skyVisResolution, skyVisResolution)
+			});
+			i++;
+		}
+
+		else if (!Q_stricmp(argv[i], "-irrcache")) {
+			irrCacheError = std::max((float) atof(argv[i + 1]), 0.0f);
+			options.push_back({
+				argv[i], argv[i + 1],
+				tfm::format("irradiance cache enabled, luxels are interpolated within %f relative error", irrCacheError)
+			});
+			i++;
+		}
+
 		else if (!Q_stricmp(argv[i], "-filter")) {
 			filter = qtrue;
 			options.push_back({ argv[i], "", "lightmap filtering enabled" });
@@ -2605,16 +3411,62 @@ int LightMain( int argc, char **argv ){
 			options.push_back({ argv[i], "", "only computing sunlight" });
 		}
 
+		else if (!Q_stricmp(argv[i], "-bouncecheckpoint")) {
+			bounceCheckpoint = std::max(atoi(argv[i + 1]), 0);
+			options.push_back({
+				argv[i], argv[i + 1], tfm::format("writing the bsp every %d bounce(s)", bounceCheckpoint)
+			});
+			i++;
+		}
+
+		else if (!Q_stricmp(argv[i], "-bouncecut")) {
+			bounceCut = std::max(atof(argv[i + 1]), 0.0);
+			options.push_back({
+				argv[i], argv[i + 1], tfm::format("diffuse light cut error bound is set to %f", bounceCut)
+			});
+			i++;
+		}
+
 		else if (!Q_stricmp(argv[i], "-bounceonly")) {
 			bounceOnly = qtrue;
 			options.push_back({ argv[i], "", "storing bounced light (radiosity) only" });
 		}
 
+		else if (!Q_stricmp(argv[i], "-compactsuper")) {
+			compactSuper = qtrue;
+			options.push_back({ argv[i], "", "packing the super buffers of idle raw lightmaps" });
+		}
+
+		else if (!Q_stricmp(argv[i], "-membudget")) {
+			char *suffix;
+			double budget = std::max(strtod(argv[i + 1], &suffix), 0.0);
+			if (*suffix == 'k' || *suffix == 'K') {
+				budget *= 1024.0;
+			}
+			else if (*suffix == 'm' || *suffix == 'M') {
+				budget *= 1024.0 * 1024.0;
+			}
+			else if (*suffix == 'g' || *suffix == 'G') {
+				budget *= 1024.0 * 1024.0 * 1024.0;
+			}
+			memBudget = (int64_t) budget;
+			compactSuper = memBudget > 0 ? qtrue : compactSuper;
+			options.push_back({
+				argv[i], argv[i + 1], tfm::format("keeping at most %d MB of packed super buffers in memory", (int) (memBudget >> 20))
+			});
+			i++;
+		}
+
 		else if (!Q_stricmp(argv[i], "-nocollapse")) {
 			noCollapse = qtrue;
 			options.push_back({ argv[i], "", "identical lightmap collapsing disabled" });
 		}
 
+		else if (!Q_stricmp(argv[i], "-nostitch")) {
+			noStitch = qtrue;
+			options.push_back({ argv[i], "", "lightmap edge stitching disabled" });
+		}
+
 		else if (!Q_stricmp(argv[i], "-nolightmapsearch")) {
 			lightmapSearchBlockSize = 1;
 			options.push_back({ argv[i], "", "no lightmap searching - all lightmaps will be sequential" });
@@ -2646,6 +3498,23 @@ int LightMain( int argc, char **argv ){
 			options.push_back({ argv[i], "", "phong shading enabled" });
 		}
 
+		else if (!Q_stricmp(argv[i], "-checkpoint")) {
+			lightCheckpoint = qtrue;
+			options.push_back({ argv[i], "", "finished lightmaps, grid points and bounces are stored in a checkpoint" });
+		}
+
+		else if (!Q_stricmp(argv[i], "-resume")) {
+			lightCheckpoint = qtrue;
+			lightResume = qtrue;
+			options.push_back({ argv[i], "", "resuming from the checkpoint of an interrupted run" });
+		}
+
+		else if (!Q_stricmp(argv[i], "-lightcache")) {
+			lightCacheDir = copystring(argv[i + 1]);
+			options.push_back({ argv[i], argv[i + 1], tfm::format("keeping lit lightmaps and grid points in %s", lightCacheDir) });
+			i++;
+		}
+
 		else if (!Q_stricmp(argv[i], "-bouncegrid")) {
 			bouncegrid = qtrue;
 			options.push_back({ argv[i], "", "grid lighting with radiosity enabled" });
@@ -2787,6 +3656,10 @@ int LightMain( int argc, char **argv ){
 			noSurfaces = qtrue;
 			options.push_back({ argv[i], "", "not tracing against surfaces" });
 		}
+		else if (!Q_stricmp(argv[i], "-oldtracetree")) {
+			oldTraceTree = qtrue;
+			options.push_back({ argv[i], "", "tracing against the old axial trace tree instead of the bvh" });
+		}
 		else if (!Q_stricmp(argv[i], "-dump")) {
 			dump = qtrue;
 			options.push_back({ argv[i], "", "dumping radiosity lights into numbered prefabs" });
@@ -3024,6 +3897,11 @@ int LightMain( int argc, char **argv ){
 	/* initialize the surface facet tracing */
 	SetupTraceNodes();
 
+	/* open the checkpoint, or pick up the one an interrupted run left */
+	CheckpointOpen( BSPFilePath, options );
+	LightCacheOpen( options );
+	CompactSuperOpen( BSPFilePath );
+
 	/* light the world */
 	LightWorld( BSPFilePath );
 
@@ -3032,6 +3910,10 @@ int LightMain( int argc, char **argv ){
 	Sys_Printf( "Writing %s\n", BSPFilePath );
 	WriteBSPFile( BSPFilePath );
 
+	/* the checkpoint and the scratch file are no longer needed */
+	CheckpointClose( qtrue );
+	CompactSuperClose();
+
 	/* ydnar: export lightmaps */
 	if ( exportLightmaps && !externalLightmaps ) {
 		ExportLightmaps();
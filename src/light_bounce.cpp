@@ -35,6 +35,7 @@
 
 /* dependencies */
 #include "q3map2.h"
+#include <algorithm>
 
 
 
@@ -197,6 +198,27 @@ static void RadClipWindingEpsilon( radWinding_t *in, vec3_t normal, vec_t dist,
 
 
 
+/*
+   LinearFromsRGBByte()
+   converts an sRGB texture byte to linear color through a table built on first use
+ */
+
+static float LinearFromsRGBByte( byte c ){
+	struct linearTable_t
+	{
+		float linear[ 256 ];
+		linearTable_t(){
+			for ( int i = 0; i < 256; i++ )
+				linear[ i ] = Image_LinearFloatFromsRGBFloat( i * ( 1.0 / 255.0 ) ) * 255.0;
+		}
+	};
+	static const linearTable_t table;
+
+	return table.linear[ c ];
+}
+
+
+
 /*
    RadSampleImage()
    samples a texture image for a given color
@@ -236,9 +258,9 @@ qboolean RadSampleImage( byte *pixels, int width, int height, float st[ 2 ], flo
 	color[ 3 ] = pixels[ 3 ];
 
 	if ( texturesRGB ) {
-		color[0] = Image_LinearFloatFromsRGBFloat( color[0] * ( 1.0 / 255.0 ) ) * 255.0;
-		color[1] = Image_LinearFloatFromsRGBFloat( color[1] * ( 1.0 / 255.0 ) ) * 255.0;
-		color[2] = Image_LinearFloatFromsRGBFloat( color[2] * ( 1.0 / 255.0 ) ) * 255.0;
+		color[0] = LinearFromsRGBByte( pixels[0] );
+		color[1] = LinearFromsRGBByte( pixels[1] );
+		color[2] = LinearFromsRGBByte( pixels[2] );
 	}
 
 	return qtrue;
@@ -524,19 +546,19 @@ static void RadSubdivideDiffuseLight( int lightmapNum, bspDrawSurface_t *ds, raw
 	//%	Sys_Printf( "Grad: %f %f %f\n", gradient[ 0 ], gradient[ 1 ], gradient[ 2 ] );
 
 	/* increment counts */
-	numDiffuseLights++;
+	THREAD_STAT( numDiffuseLights )++;
 	switch ( ds->surfaceType )
 	{
 	case MST_PLANAR:
-		numBrushDiffuseLights++;
+		THREAD_STAT( numBrushDiffuseLights )++;
 		break;
 
 	case MST_TRIANGLE_SOUP:
-		numTriangleDiffuseLights++;
+		THREAD_STAT( numTriangleDiffuseLights )++;
 		break;
 
 	case MST_PATCH:
-		numPatchDiffuseLights++;
+		THREAD_STAT( numPatchDiffuseLights )++;
 		break;
 	}
 
@@ -946,3 +968,400 @@ void RadCreateDiffuseLights( void ){
 	Sys_FPrintf( SYS_VRB, "%8d patch diffuse lights\n", numPatchDiffuseLights );
 	Sys_FPrintf( SYS_VRB, "%8d triangle diffuse lights\n", numTriangleDiffuseLights );
 }
+
+
+
+/*
+   light cuts
+   -bouncecut <error> replaces the diffuse lights a raw lightmap sees in a bounce with a
+   binary tree per style. a node stands for its lights through one representative light,
+   picked from its children's in proportion to their intensity, scaled up to the intensity
+   of the whole node. each luxel starts at the root and splits the node with the largest
+   error bound until every bound is below <error> times the light gathered so far, so
+   distant groups of lights cost one shadow ray. one child of a split node shares its
+   representative and reuses its ray
+ */
+
+#define MIN_LIGHT_CUT_LIGHTS    8       /* shorter light lists are traced light by light */
+#define MAX_LIGHT_CUT           256
+
+typedef struct lightCutNode_s
+{
+	vec3_t mins, maxs;                  /* origins and windings of the node's lights */
+	vec3_t intensity;                   /* photons * color summed over the node's lights */
+	float weight;                       /* sum of intensity */
+	int numLights;
+	light_t             *light;         /* representative */
+	int children[ 2 ];                  /* -1 for a leaf */
+}
+lightCutNode_t;
+
+typedef struct lightCut_s
+{
+	lightCutNode_t      *nodes;
+	int numNodes;
+}
+lightCut_t;
+
+typedef struct lightCutSample_s
+{
+	int node;
+	float bound;
+	vec3_t color, direction;            /* the node's estimate */
+	vec3_t repColor, repDirection;      /* the representative's own contribution */
+	float subsampling;
+}
+lightCutSample_t;
+
+
+
+/*
+   BuildLightCut_r()
+   builds the node for lights [first, last), splitting them at the median along the longest axis of their origins
+ */
+
+static int BuildLightCut_r( lightCut_t *cut, light_t **lights, int first, int last ){
+	int i, j, num, axis, mid;
+	vec3_t mins, maxs;
+	lightCutNode_t      *node, *a, *b;
+	light_t             *light;
+	float sum;
+
+
+	num = cut->numNodes++;
+	node = &cut->nodes[ num ];
+
+	/* leaf */
+	if ( last - first == 1 ) {
+		light = lights[ first ];
+		ClearBounds( node->mins, node->maxs );
+		AddPointToBounds( light->origin, node->mins, node->maxs );
+		if ( light->w != NULL ) {
+			for ( i = 0; i < light->w->numpoints; i++ )
+				AddPointToBounds( light->w->p[ i ], node->mins, node->maxs );
+		}
+		VectorScale( light->color, light->photons, node->intensity );
+		node->weight = node->intensity[ 0 ] + node->intensity[ 1 ] + node->intensity[ 2 ];
+		node->numLights = 1;
+		node->light = light;
+		node->children[ 0 ] = node->children[ 1 ] = -1;
+		return num;
+	}
+
+	/* split along the longest axis of the origins */
+	ClearBounds( mins, maxs );
+	for ( i = first; i < last; i++ )
+		AddPointToBounds( lights[ i ]->origin, mins, maxs );
+	axis = 0;
+	for ( i = 1; i < 3; i++ )
+	{
+		if ( maxs[ i ] - mins[ i ] > maxs[ axis ] - mins[ axis ] ) {
+			axis = i;
+		}
+	}
+	mid = ( first + last ) / 2;
+	std::nth_element( lights + first, lights + mid, lights + last,
+					  [axis]( const light_t *x, const light_t *y ){ return x->origin[ axis ] < y->origin[ axis ]; } );
+
+	i = BuildLightCut_r( cut, lights, first, mid );
+	j = BuildLightCut_r( cut, lights, mid, last );
+
+	/* the recursion may have moved the node array */
+	node = &cut->nodes[ num ];
+	a = &cut->nodes[ i ];
+	b = &cut->nodes[ j ];
+	node->children[ 0 ] = i;
+	node->children[ 1 ] = j;
+	VectorCopy( a->mins, node->mins );
+	VectorCopy( a->maxs, node->maxs );
+	AddPointToBounds( b->mins, node->mins, node->maxs );
+	AddPointToBounds( b->maxs, node->mins, node->maxs );
+	VectorAdd( a->intensity, b->intensity, node->intensity );
+	node->weight = a->weight + b->weight;
+	node->numLights = a->numLights + b->numLights;
+
+	/* pick the representative with a fixed hash of the node, so every run picks the same */
+	sum = a->weight + b->weight;
+	node->light = ( sum <= 0.0f || ( ( num * 2654435761u ) >> 8 ) * ( 1.0f / 16777216.0f ) * sum < a->weight ) ? a->light : b->light;
+
+	return num;
+}
+
+
+
+/*
+   CreateLightCuts()
+   returns a copy of a light list with the diffuse lights of every style replaced by one
+   light standing for their tree, or NULL if there are too few to bother
+ */
+
+light_t **CreateLightCuts( light_t **lights, int numLights, int *numCutLights ){
+	int i, j, n, style, numStyles, styles[ MAX_LIGHTMAPS * 4 ];
+	light_t             **cutLights, **diffuse, *light;
+	lightCut_t          *cut;
+
+
+	*numCutLights = 0;
+	if ( !bouncing || bounceCut <= 0.0f || numLights < MIN_LIGHT_CUT_LIGHTS ) {
+		return NULL;
+	}
+
+	/* find the styles of the diffuse lights */
+	numStyles = 0;
+	for ( i = 0; i < numLights; i++ )
+	{
+		if ( lights[ i ]->type != EMIT_AREA ) {
+			continue;
+		}
+		for ( j = 0; j < numStyles && styles[ j ] != lights[ i ]->style; j++ ) ;
+		if ( j == numStyles ) {
+			if ( numStyles >= (int) ( sizeof( styles ) / sizeof( styles[ 0 ] ) ) ) {
+				return NULL;
+			}
+			styles[ numStyles++ ] = lights[ i ]->style;
+		}
+	}
+	if ( numStyles == 0 ) {
+		return NULL;
+	}
+
+	/* everything else is kept as it is */
+	cutLights = static_cast<light_t **>( safe_malloc( ( numLights + numStyles ) * sizeof( *cutLights ) ) );
+	diffuse = static_cast<light_t **>( safe_malloc( numLights * sizeof( *diffuse ) ) );
+	for ( i = 0; i < numLights; i++ )
+	{
+		if ( lights[ i ]->type != EMIT_AREA ) {
+			cutLights[ ( *numCutLights )++ ] = lights[ i ];
+		}
+	}
+
+	/* one tree per style */
+	for ( style = 0; style < numStyles; style++ )
+	{
+		n = 0;
+		for ( i = 0; i < numLights; i++ )
+		{
+			if ( lights[ i ]->type == EMIT_AREA && lights[ i ]->style == styles[ style ] ) {
+				diffuse[ n++ ] = lights[ i ];
+			}
+		}
+
+		/* a lone light needs no tree */
+		if ( n == 1 ) {
+			cutLights[ ( *numCutLights )++ ] = diffuse[ 0 ];
+			continue;
+		}
+
+		cut = static_cast<lightCut_t *>( safe_malloc( sizeof( *cut ) ) );
+		cut->nodes = static_cast<lightCutNode_t *>( safe_malloc( ( 2 * n - 1 ) * sizeof( *cut->nodes ) ) );
+		cut->numNodes = 0;
+		BuildLightCut_r( cut, diffuse, 0, n );
+
+		light = static_cast<light_t *>( safe_malloc( sizeof( *light ) ) );
+		memset( light, 0, sizeof( *light ) );
+		light->type = EMIT_AREA;
+		light->flags = diffuse[ 0 ]->flags;
+		light->style = styles[ style ];
+		light->cut = cut;
+		VectorCopy( cut->nodes[ 0 ].mins, light->mins );
+		VectorCopy( cut->nodes[ 0 ].maxs, light->maxs );
+		cutLights[ ( *numCutLights )++ ] = light;
+	}
+
+	free( diffuse );
+	return cutLights;
+}
+
+
+
+/*
+   FreeLightCuts()
+   frees a list made by CreateLightCuts()
+ */
+
+void FreeLightCuts( light_t **cutLights, int numCutLights ){
+	int i;
+
+
+	if ( cutLights == NULL ) {
+		return;
+	}
+	for ( i = 0; i < numCutLights; i++ )
+	{
+		if ( cutLights[ i ]->cut != NULL ) {
+			free( cutLights[ i ]->cut->nodes );
+			free( cutLights[ i ]->cut );
+			free( cutLights[ i ] );
+		}
+	}
+	free( cutLights );
+}
+
+
+
+/*
+   LightCutBound()
+   bounds what the lights of a node can add at the sample, 0 for leaves, which are exact
+ */
+
+static float LightCutBound( const trace_t *trace, const lightCutNode_t *node ){
+	int i;
+	float d, dist, height, maxHeight;
+	vec3_t corner;
+
+
+	if ( node->children[ 0 ] < 0 ) {
+		return 0.0f;
+	}
+
+	/* how far the node reaches out in front of (or behind) the sample */
+	maxHeight = -1e30f;
+	for ( i = 0; i < 8; i++ )
+	{
+		corner[ 0 ] = ( i & 1 ) ? node->maxs[ 0 ] : node->mins[ 0 ];
+		corner[ 1 ] = ( i & 2 ) ? node->maxs[ 1 ] : node->mins[ 1 ];
+		corner[ 2 ] = ( i & 4 ) ? node->maxs[ 2 ] : node->mins[ 2 ];
+		height = DotProduct( corner, trace->normal ) - DotProduct( trace->origin, trace->normal );
+		if ( trace->twoSided && height < 0.0f ) {
+			height = -height;
+		}
+		if ( height > maxHeight ) {
+			maxHeight = height;
+		}
+	}
+	if ( maxHeight <= 0.0f ) {
+		return 0.0f;
+	}
+
+	/* the closest the lights can get, clamped like -faster clamps area lights */
+	dist = 0.0f;
+	for ( i = 0; i < 3; i++ )
+	{
+		d = node->mins[ i ] > trace->origin[ i ] ? node->mins[ i ] - trace->origin[ i ] : trace->origin[ i ] > node->maxs[ i ] ? trace->origin[ i ] - node->maxs[ i ] : 0.0f;
+		dist += d * d;
+	}
+	dist = dist > 256.0f ? dist : 256.0f;
+
+	/* the form factor falls off with the square of the distance and the cosine at the sample */
+	height = maxHeight * maxHeight / dist;
+	return node->weight / dist * ( height < 1.0f ? sqrt( height ) : 1.0f );
+}
+
+
+
+/*
+   EvaluateLightCutSample()
+   traces the representative of a node and scales it to the node
+ */
+
+static void EvaluateLightCutSample( trace_t *trace, const lightCut_t *cut, lightCutSample_t *sample, const lightCutSample_t *parent ){
+	const lightCutNode_t    *node = &cut->nodes[ sample->node ];
+	float scale;
+
+
+	sample->bound = LightCutBound( trace, node );
+
+	/* share the ray of the parent's representative */
+	if ( parent != NULL && cut->nodes[ parent->node ].light == node->light ) {
+		VectorCopy( parent->repColor, sample->repColor );
+		VectorCopy( parent->repDirection, sample->repDirection );
+		sample->subsampling = parent->subsampling;
+	}
+	else
+	{
+		trace->light = node->light;
+		LightContributionToSample( trace );
+		VectorCopy( trace->color, sample->repColor );
+		VectorCopy( trace->directionContribution, sample->repDirection );
+		sample->subsampling = trace->forceSubsampling;
+		THREAD_STAT( lightCutRays )++;
+	}
+
+	/* leaves are what they are */
+	if ( node->children[ 0 ] < 0 ) {
+		VectorCopy( sample->repColor, sample->color );
+		VectorCopy( sample->repDirection, sample->direction );
+		return;
+	}
+
+	/* the representative's share of its own photons times the photons of the node */
+	scale = node->light->photons * ( node->light->color[ 0 ] + node->light->color[ 1 ] + node->light->color[ 2 ] );
+	scale = scale > 0.0f ? ( sample->repColor[ 0 ] + sample->repColor[ 1 ] + sample->repColor[ 2 ] ) / scale : 0.0f;
+	VectorScale( node->intensity, scale, sample->color );
+	scale = node->light->photons * ( node->light->color[ 0 ] + node->light->color[ 1 ] + node->light->color[ 2 ] );
+	VectorScale( sample->repDirection, scale > 0.0f ? node->weight / scale : 0.0f, sample->direction );
+}
+
+
+
+/*
+   LightCutContribution()
+   LightContributionToSample() for a light made by CreateLightCuts()
+ */
+
+int LightCutContribution( trace_t *trace ){
+	int i, best, numSamples;
+	float total;
+	light_t             *cutLight;
+	const lightCut_t    *cut;
+	const lightCutNode_t    *node;
+	lightCutSample_t samples[ MAX_LIGHT_CUT ], parent;
+
+
+	cutLight = trace->light;
+	cut = cutLight->cut;
+
+	/* start at the root */
+	samples[ 0 ].node = 0;
+	EvaluateLightCutSample( trace, cut, &samples[ 0 ], NULL );
+	numSamples = 1;
+	total = samples[ 0 ].color[ 0 ] + samples[ 0 ].color[ 1 ] + samples[ 0 ].color[ 2 ];
+
+	/* split the worst node until all are good enough */
+	while ( numSamples < MAX_LIGHT_CUT )
+	{
+		best = 0;
+		for ( i = 1; i < numSamples; i++ )
+		{
+			if ( samples[ i ].bound > samples[ best ].bound ) {
+				best = i;
+			}
+		}
+		if ( samples[ best ].bound <= 0.0f || samples[ best ].bound <= bounceCut * total ) {
+			break;
+		}
+
+		/* replace it by its children */
+		parent = samples[ best ];
+		node = &cut->nodes[ parent.node ];
+		total -= parent.color[ 0 ] + parent.color[ 1 ] + parent.color[ 2 ];
+		samples[ best ].node = node->children[ 0 ];
+		EvaluateLightCutSample( trace, cut, &samples[ best ], &parent );
+		samples[ numSamples ].node = node->children[ 1 ];
+		EvaluateLightCutSample( trace, cut, &samples[ numSamples ], &parent );
+		total += samples[ best ].color[ 0 ] + samples[ best ].color[ 1 ] + samples[ best ].color[ 2 ];
+		total += samples[ numSamples ].color[ 0 ] + samples[ numSamples ].color[ 1 ] + samples[ numSamples ].color[ 2 ];
+		numSamples++;
+	}
+
+	/* sum the cut */
+	trace->light = cutLight;
+	VectorClear( trace->color );
+	VectorClear( trace->colorNoShadow );
+	VectorClear( trace->directionContribution );
+	trace->forceSubsampling = 0.0f;
+	for ( i = 0; i < numSamples; i++ )
+	{
+		VectorAdd( trace->color, samples[ i ].color, trace->color );
+		VectorAdd( trace->directionContribution, samples[ i ].direction, trace->directionContribution );
+		if ( samples[ i ].subsampling > trace->forceSubsampling ) {
+			trace->forceSubsampling = samples[ i ].subsampling;
+		}
+	}
+
+	THREAD_STAT( lightCutSamples )++;
+	THREAD_STAT( lightCutSize ) += numSamples;
+	THREAD_STAT( lightCutLights ) += cut->nodes[ 0 ].numLights;
+
+	return ( trace->color[ 0 ] > 0.0f || trace->color[ 1 ] > 0.0f || trace->color[ 2 ] > 0.0f ) ? 1 : 0;
+}
@@ -0,0 +1,1445 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define LIGHT_CHECKPOINT_C
+
+
+
+/* dependencies */
+#include "q3map2.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+
+
+
+/*
+   light checkpoints
+   <mapname>.light.checkpoint is a header followed by an append-only list of chunks,
+   one per finished grid tile or raw lightmap, one for the vertex lighting and one
+   with the whole lighting state at the start of every radiosity bounce. workers only
+   copy their results into a buffer, a writer thread appends them to the file. a
+   chunk carries a hash of its payload, so a chunk torn by a crash ends the list.
+   -resume checks the header against the bsp and the command line and then takes
+   every chunk it can instead of lighting that part again.
+ */
+
+#define CHECKPOINT_MAGIC        "Q3LC"
+#define CHECKPOINT_VERSION      2
+
+/* workers wait for the writer when this much is queued */
+#define CHECKPOINT_MAX_QUEUED   ( 64 << 20 )
+
+#define FNV_PRIME               1099511628211ULL
+
+#if GDEF_OS_WINDOWS
+	#define CheckpointSeek      _fseeki64
+	#define CheckpointTell      _ftelli64
+#else
+	#define CheckpointSeek      fseeko
+	#define CheckpointTell      ftello
+#endif
+
+enum
+{
+	CHUNK_GRID_TILE = 1,
+	CHUNK_LIGHTMAP,
+	CHUNK_VERTEXES,
+	CHUNK_BOUNCE,
+	CHUNK_BSP
+};
+
+typedef struct checkpointHeader_s
+{
+	char magic[ 4 ];
+	int version;
+	uint64_t bspHash;
+	uint64_t optionsHash;
+	int numRawLightmaps;
+	int numBSPDrawSurfaces;
+	int numBSPDrawVerts;
+}
+checkpointHeader_t;
+
+typedef struct checkpointChunk_s
+{
+	int type;
+	int index;
+	uint64_t size;
+	uint64_t hash;
+}
+checkpointChunk_t;
+
+static char checkpointPath[ 1024 ];
+static FILE *checkpointFile;
+static FILE *checkpointReadFile;
+
+/* writer thread and its queue, a write without a path is appended to the checkpoint */
+typedef struct checkpointWrite_s
+{
+	std::string path;
+	std::vector<byte> data;
+}
+checkpointWrite_t;
+
+static std::thread                  *checkpointWriter;
+static std::mutex checkpointMutex;
+static std::condition_variable checkpointQueueCond;
+static std::condition_variable checkpointDrainCond;
+static std::deque<checkpointWrite_t> checkpointQueue;
+static size_t checkpointQueued;
+static bool checkpointStop;
+static bool checkpointFailed;           /* a chunk couldn't be written, nothing more is appended */
+static bool cacheWriteFailed;
+
+/* payload offsets of the chunks a resumed run can use, -1 where there is none */
+static std::mutex checkpointReadMutex;
+static std::vector<int64_t> gridTileChunks;
+static std::vector<int64_t> lightmapChunks;
+static int64_t vertexChunk = -1;
+static int64_t bounceChunk = -1;
+static int bounceChunkNum;
+
+
+
+/*
+   HashBytes()
+   64 bit fnv-1a, start with HASH_INIT
+ */
+
+uint64_t HashBytes( uint64_t hash, const void *data, size_t size ){
+	const byte  *p = static_cast<const byte*>( data );
+	size_t i;
+
+
+	for ( i = 0; i < size; i++ )
+	{
+		hash ^= p[ i ];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+
+
+/*
+   HashFile()
+   hashes the bytes of a file, 0 if it can't be read
+ */
+
+static uint64_t HashFile( const char *path ){
+	FILE        *file;
+	byte buffer[ 65536 ];
+	size_t size;
+	uint64_t hash;
+
+
+	file = fopen( path, "rb" );
+	if ( file == NULL ) {
+		return 0;
+	}
+	hash = HASH_INIT;
+	while ( ( size = fread( buffer, 1, sizeof( buffer ), file ) ) > 0 )
+		hash = HashBytes( hash, buffer, size );
+	fclose( file );
+	return hash;
+}
+
+
+
+/*
+   HashOptions()
+   hashes the light switches, leaving out the ones in the NULL terminated skip list
+ */
+
+/* switches that only say where the results are kept */
+static const char *storageSwitches[] = { "-checkpoint", "-resume", "-lightcache", NULL };
+
+/* and those that can't change the first pass the light cache keeps */
+static const char *firstPassSwitches[] = { "-checkpoint", "-resume", "-lightcache", "-bounce", "-bouncecheckpoint", "-bouncegrid",
+										   "-bounceonly", "-bouncescale", "-fastbounce", "-dump", "-dumplights", "-export", NULL };
+
+static uint64_t HashOptions( const std::vector<OptionResult> &options, const char **skip ){
+	uint64_t hash;
+	int i;
+
+
+	hash = HASH_INIT;
+	for ( const OptionResult &option : options )
+	{
+		for ( i = 0; skip[ i ] != NULL; i++ )
+		{
+			if ( !Q_stricmp( option.option.c_str(), skip[ i ] ) ) {
+				break;
+			}
+		}
+		if ( skip[ i ] != NULL ) {
+			continue;
+		}
+		hash = HashBytes( hash, option.option.c_str(), option.option.size() + 1 );
+		hash = HashBytes( hash, option.value.c_str(), option.value.size() + 1 );
+	}
+	return hash;
+}
+
+
+
+/*
+   PutBytes(), GetBytes()
+   chunk payload packing
+ */
+
+static void PutBytes( std::vector<byte> &buffer, const void *data, size_t size ){
+	const byte  *p = static_cast<const byte*>( data );
+
+
+	buffer.insert( buffer.end(), p, p + size );
+}
+
+static qboolean GetBytes( const byte **p, const byte *end, void *data, size_t size ){
+	if ( (size_t) ( end - *p ) < size ) {
+		return qfalse;
+	}
+	memcpy( data, *p, size );
+	*p += size;
+	return qtrue;
+}
+
+
+
+/*
+   CheckpointWriterThread()
+   appends queued chunks to the checkpoint file and writes light cache entries
+   after a failed append the torn chunk is left as the tail, where -resume stops
+   reading, and the chunks after it are dropped instead of being written past it
+ */
+
+static void CheckpointWriterThread( void ){
+	checkpointWrite_t write;
+	std::string temp;
+	FILE            *file;
+	size_t size;
+	bool written;
+
+
+	for ( ;; )
+	{
+		{
+			std::unique_lock<std::mutex> lock( checkpointMutex );
+			checkpointQueueCond.wait( lock, [] { return checkpointStop || !checkpointQueue.empty(); } );
+			if ( checkpointQueue.empty() ) {
+				return;
+			}
+			write.path.swap( checkpointQueue.front().path );
+			write.data.swap( checkpointQueue.front().data );
+			checkpointQueue.pop_front();
+		}
+
+		/* checkpoint chunk */
+		if ( write.path.empty() ) {
+			if ( !checkpointFailed ) {
+				written = fwrite( write.data.data(), 1, write.data.size(), checkpointFile ) == write.data.size();
+				written = fflush( checkpointFile ) == 0 && written;
+				if ( !written ) {
+					Sys_FPrintf( SYS_WRN, "WARNING: Could not write to checkpoint %s, checkpointing stopped\n", checkpointPath );
+					checkpointFailed = true;
+				}
+			}
+		}
+
+		/* cache entries are renamed into place, so a reader never sees half of one */
+		else
+		{
+			temp = write.path + ".tmp";
+			file = fopen( temp.c_str(), "wb" );
+			written = false;
+			if ( file != NULL ) {
+				written = fwrite( write.data.data(), 1, write.data.size(), file ) == write.data.size();
+				written = fclose( file ) == 0 && written;
+				written = written && rename( temp.c_str(), write.path.c_str() ) == 0;
+				if ( !written ) {
+					remove( temp.c_str() );
+				}
+			}
+			if ( !written && !cacheWriteFailed ) {
+				Sys_FPrintf( SYS_WRN, "WARNING: Could not write light cache entry %s\n", write.path.c_str() );
+				cacheWriteFailed = true;
+			}
+		}
+
+		size = write.data.size();
+		write.path.clear();
+		write.data.clear();
+		write.data.shrink_to_fit();
+		{
+			std::lock_guard<std::mutex> lock( checkpointMutex );
+			checkpointQueued -= size;
+		}
+		checkpointDrainCond.notify_all();
+	}
+}
+
+/*
+   StartWriter(), StopWriter()
+   the writer is also stopped at exit, so an Error() while it runs still gets the queued
+   chunks written instead of ending in std::terminate() on a joinable thread
+ */
+
+static void StopWriter( void ){
+	if ( checkpointWriter == NULL ) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock( checkpointMutex );
+		checkpointStop = true;
+	}
+	checkpointQueueCond.notify_one();
+	checkpointWriter->join();
+	delete checkpointWriter;
+	checkpointWriter = NULL;
+}
+
+static void StartWriter( void ){
+	static bool registered = false;
+
+
+	if ( checkpointWriter != NULL ) {
+		return;
+	}
+	if ( !registered ) {
+		atexit( StopWriter );
+		registered = true;
+	}
+	checkpointQueued = 0;
+	checkpointStop = false;
+	checkpointFailed = false;
+	cacheWriteFailed = false;
+	checkpointWriter = new std::thread( CheckpointWriterThread );
+}
+
+
+
+/*
+   BeginChunk(), EndChunk(), AppendChunk()
+   a chunk is built in one buffer that starts with room for its header, then handed to the
+   writer, for the checkpoint without a path, or as a light cache file
+ */
+
+static void BeginChunk( std::vector<byte> &buffer ){
+	buffer.clear();
+	buffer.resize( sizeof( checkpointChunk_t ) );
+}
+
+static void EndChunk( int type, int index, std::vector<byte> &buffer ){
+	checkpointChunk_t chunk;
+
+
+	chunk.type = type;
+	chunk.index = index;
+	chunk.size = buffer.size() - sizeof( chunk );
+	chunk.hash = HashBytes( HASH_INIT, buffer.data() + sizeof( chunk ), chunk.size );
+	memcpy( buffer.data(), &chunk, sizeof( chunk ) );
+}
+
+static void AppendChunk( int type, int index, std::vector<byte> &buffer, const char *path = "" ){
+	/* fill in the header */
+	EndChunk( type, index, buffer );
+
+	/* queue it, waiting for the writer if it has fallen far behind */
+	{
+		std::unique_lock<std::mutex> lock( checkpointMutex );
+		checkpointDrainCond.wait( lock, [] { return checkpointQueued < CHECKPOINT_MAX_QUEUED || checkpointQueue.empty(); } );
+		checkpointQueued += buffer.size();
+		checkpointQueue.push_back( checkpointWrite_t() );
+		checkpointQueue.back().path = path;
+		checkpointQueue.back().data.swap( buffer );
+	}
+	checkpointQueueCond.notify_one();
+}
+
+
+
+/*
+   ReadChunk()
+   reads the payload of a chunk found when the checkpoint was opened
+ */
+
+static qboolean ReadChunk( int64_t offset, std::vector<byte> &payload ){
+	checkpointChunk_t chunk;
+	std::lock_guard<std::mutex> lock( checkpointReadMutex );
+
+
+	if ( offset < 0 || checkpointReadFile == NULL ) {
+		return qfalse;
+	}
+	if ( CheckpointSeek( checkpointReadFile, offset - (int64_t) sizeof( chunk ), SEEK_SET ) != 0 ||
+		 fread( &chunk, sizeof( chunk ), 1, checkpointReadFile ) != 1 ) {
+		return qfalse;
+	}
+	payload.resize( chunk.size );
+	if ( chunk.size > 0 && fread( payload.data(), chunk.size, 1, checkpointReadFile ) != 1 ) {
+		return qfalse;
+	}
+	return qtrue;
+}
+
+
+
+/*
+   ScanCheckpoint()
+   validates the header and the chunks of an existing checkpoint, returns the offset
+   after the last intact chunk or -1 if the checkpoint can't be used
+ */
+
+static int64_t ScanCheckpoint( FILE *file, const checkpointHeader_t *header ){
+	checkpointHeader_t old;
+	checkpointChunk_t chunk;
+	byte buffer[ 65536 ];
+	uint64_t hash, left, bspHash;
+	int64_t offset, fileSize;
+	size_t size;
+	qboolean bspMatches;
+
+
+	/* check the header */
+	if ( fread( &old, sizeof( old ), 1, file ) != 1 || memcmp( old.magic, CHECKPOINT_MAGIC, 4 ) ) {
+		Sys_Printf( "Checkpoint %s is not a light checkpoint\n", checkpointPath );
+		return -1;
+	}
+	if ( old.version != CHECKPOINT_VERSION ) {
+		Sys_Printf( "Checkpoint %s is version %d, expected %d\n", checkpointPath, old.version, CHECKPOINT_VERSION );
+		return -1;
+	}
+	if ( old.optionsHash != header->optionsHash ) {
+		Sys_Printf( "Checkpoint %s was written with different light switches\n", checkpointPath );
+		return -1;
+	}
+	if ( old.numRawLightmaps != header->numRawLightmaps || old.numBSPDrawSurfaces != header->numBSPDrawSurfaces ||
+		 old.numBSPDrawVerts != header->numBSPDrawVerts ) {
+		Sys_Printf( "Checkpoint %s was written for a different bsp\n", checkpointPath );
+		return -1;
+	}
+	bspMatches = old.bspHash == header->bspHash ? qtrue : qfalse;
+
+	/* walk the chunks until one is cut short or doesn't hash right */
+	CheckpointSeek( file, 0, SEEK_END );
+	fileSize = CheckpointTell( file );
+	offset = sizeof( old );
+	CheckpointSeek( file, offset, SEEK_SET );
+	while ( offset + (int64_t) sizeof( chunk ) <= fileSize )
+	{
+		if ( fread( &chunk, sizeof( chunk ), 1, file ) != 1 || chunk.size > (uint64_t) ( fileSize - offset - sizeof( chunk ) ) ) {
+			break;
+		}
+		hash = HASH_INIT;
+		for ( left = chunk.size; left > 0; left -= size )
+		{
+			size = left < sizeof( buffer ) ? (size_t) left : sizeof( buffer );
+			if ( fread( buffer, size, 1, file ) != 1 ) {
+				break;
+			}
+			hash = HashBytes( hash, buffer, size );
+		}
+		if ( left > 0 || hash != chunk.hash ) {
+			break;
+		}
+
+		/* remember where the payload is */
+		offset += sizeof( chunk );
+		switch ( chunk.type )
+		{
+		case CHUNK_GRID_TILE:
+			if ( chunk.index >= 0 ) {
+				if ( chunk.index >= (int) gridTileChunks.size() ) {
+					gridTileChunks.resize( chunk.index + 1, -1 );
+				}
+				gridTileChunks[ chunk.index ] = offset;
+			}
+			break;
+
+		case CHUNK_LIGHTMAP:
+			if ( chunk.index >= 0 && chunk.index < numRawLightmaps ) {
+				lightmapChunks[ chunk.index ] = offset;
+			}
+			break;
+
+		case CHUNK_VERTEXES:
+			vertexChunk = offset;
+			break;
+
+		case CHUNK_BOUNCE:
+			if ( chunk.index > bounceChunkNum ) {
+				bounceChunk = offset;
+				bounceChunkNum = chunk.index;
+			}
+			break;
+
+		/* -bouncecheckpoint rewrote the bsp, whose hash is then just as good */
+		case CHUNK_BSP:
+			if ( chunk.size == sizeof( bspHash ) ) {
+				memcpy( &bspHash, buffer, sizeof( bspHash ) );
+				if ( bspHash == header->bspHash ) {
+					bspMatches = qtrue;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+		offset += chunk.size;
+	}
+
+	if ( !bspMatches ) {
+		Sys_Printf( "Checkpoint %s was written for a different bsp\n", checkpointPath );
+		return -1;
+	}
+	return offset;
+}
+
+
+
+/*
+   CheckpointOpen()
+   opens the checkpoint of the bsp, picking up an existing one with -resume
+ */
+
+void CheckpointOpen( const char *BSPFilePath, const std::vector<OptionResult> &options ){
+	checkpointHeader_t header;
+	int64_t offset;
+	int i, numGridTiles, numLightmaps;
+
+
+	/* only with -checkpoint or -resume */
+	if ( !lightCheckpoint ) {
+		return;
+	}
+
+	strcpy( checkpointPath, BSPFilePath );
+	StripExtension( checkpointPath );
+	strcat( checkpointPath, ".light.checkpoint" );
+
+	/* set up the header */
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, CHECKPOINT_MAGIC, 4 );
+	header.version = CHECKPOINT_VERSION;
+	header.bspHash = HashFile( BSPFilePath );
+	header.optionsHash = HashOptions( options, storageSwitches );
+	header.numRawLightmaps = numRawLightmaps;
+	header.numBSPDrawSurfaces = numBSPDrawSurfaces;
+	header.numBSPDrawVerts = numBSPDrawVerts;
+
+	gridTileChunks.clear();
+	lightmapChunks.assign( numRawLightmaps, -1 );
+	vertexChunk = -1;
+	bounceChunk = -1;
+	bounceChunkNum = 0;
+
+	/* try to pick up where the last run left off */
+	offset = -1;
+	if ( lightResume ) {
+		checkpointReadFile = fopen( checkpointPath, "rb" );
+		if ( checkpointReadFile == NULL ) {
+			Sys_Printf( "No checkpoint %s to resume from\n", checkpointPath );
+		}
+		else
+		{
+			offset = ScanCheckpoint( checkpointReadFile, &header );
+			if ( offset < 0 ) {
+				fclose( checkpointReadFile );
+				checkpointReadFile = NULL;
+				gridTileChunks.clear();
+				lightmapChunks.assign( numRawLightmaps, -1 );
+				vertexChunk = -1;
+				bounceChunk = -1;
+				bounceChunkNum = 0;
+			}
+		}
+	}
+
+	/* new chunks go after the last intact one, overwriting any torn tail */
+	if ( offset >= 0 ) {
+		checkpointFile = fopen( checkpointPath, "r+b" );
+		if ( checkpointFile == NULL ) {
+			Error( "Could not open checkpoint %s for writing", checkpointPath );
+		}
+		CheckpointSeek( checkpointFile, offset, SEEK_SET );
+
+		numGridTiles = 0;
+		for ( i = 0; i < (int) gridTileChunks.size(); i++ )
+			numGridTiles += gridTileChunks[ i ] >= 0 ? 1 : 0;
+		numLightmaps = 0;
+		for ( i = 0; i < numRawLightmaps; i++ )
+			numLightmaps += lightmapChunks[ i ] >= 0 ? 1 : 0;
+		Sys_Printf( "Resuming from %s\n", checkpointPath );
+		Sys_Printf( "%9d grid tiles finished\n", numGridTiles );
+		Sys_Printf( "%9d of %d raw lightmaps finished\n", numLightmaps, numRawLightmaps );
+		Sys_Printf( "%9s vertex lighting finished\n", vertexChunk >= 0 ? "yes" : "no" );
+		Sys_Printf( "%9d bounces finished\n", bounceChunk >= 0 ? bounceChunkNum - 1 : 0 );
+	}
+	else
+	{
+		checkpointFile = fopen( checkpointPath, "wb" );
+		if ( checkpointFile == NULL ) {
+			Error( "Could not open checkpoint %s for writing", checkpointPath );
+		}
+		if ( fwrite( &header, sizeof( header ), 1, checkpointFile ) != 1 || fflush( checkpointFile ) != 0 ) {
+			Error( "Could not write checkpoint %s", checkpointPath );
+		}
+		Sys_Printf( "Writing checkpoint %s\n", checkpointPath );
+	}
+
+	/* start the writer */
+	StartWriter();
+}
+
+
+
+/*
+   CheckpointClose()
+   waits for the writer, and removes the checkpoint once the bsp has been written
+ */
+
+void CheckpointClose( qboolean finished ){
+	StopWriter();
+	if ( checkpointFile == NULL ) {
+		return;
+	}
+
+	fclose( checkpointFile );
+	checkpointFile = NULL;
+	if ( checkpointReadFile != NULL ) {
+		fclose( checkpointReadFile );
+		checkpointReadFile = NULL;
+	}
+
+	if ( finished ) {
+		remove( checkpointPath );
+	}
+}
+
+
+
+/*
+   CheckpointBSPWritten()
+   notes the hash of a bsp written in the middle of the run, so it can be resumed from
+ */
+
+void CheckpointBSPWritten( const char *BSPFilePath ){
+	std::vector<byte> buffer;
+	uint64_t hash;
+
+
+	if ( checkpointFile == NULL ) {
+		return;
+	}
+	hash = HashFile( BSPFilePath );
+	BeginChunk( buffer );
+	PutBytes( buffer, &hash, sizeof( hash ) );
+	AppendChunk( CHUNK_BSP, 0, buffer );
+}
+
+
+
+/*
+   CheckpointWriteGridTile(), CheckpointRestoreGridTile()
+   a tile of grid points is stored as the numbers of its traced points and their raw and bsp values
+ */
+
+static void PutGridPoints( std::vector<byte> &buffer, const int *nums, int numPoints ){
+	int i;
+
+
+	PutBytes( buffer, &numPoints, sizeof( numPoints ) );
+	for ( i = 0; i < numPoints; i++ )
+	{
+		PutBytes( buffer, &nums[ i ], sizeof( nums[ i ] ) );
+		PutBytes( buffer, &rawGridPoints[ nums[ i ] ], sizeof( *rawGridPoints ) );
+		PutBytes( buffer, &bspGridPoints[ nums[ i ] ], sizeof( *bspGridPoints ) );
+	}
+}
+
+static qboolean GetGridPoints( const byte **p, const byte *end ){
+	int i, num, numPoints;
+
+
+	if ( !GetBytes( p, end, &numPoints, sizeof( numPoints ) ) ) {
+		return qfalse;
+	}
+	for ( i = 0; i < numPoints; i++ )
+	{
+		if ( !GetBytes( p, end, &num, sizeof( num ) ) || num < 0 || num >= numRawGridPoints ||
+			 !GetBytes( p, end, &rawGridPoints[ num ], sizeof( *rawGridPoints ) ) ||
+			 !GetBytes( p, end, &bspGridPoints[ num ], sizeof( *bspGridPoints ) ) ) {
+			return qfalse;
+		}
+	}
+	return qtrue;
+}
+
+void CheckpointWriteGridTile( int tile, const int *nums, int numPoints ){
+	std::vector<byte> buffer;
+
+
+	if ( checkpointFile == NULL ) {
+		return;
+	}
+	BeginChunk( buffer );
+	PutGridPoints( buffer, nums, numPoints );
+	AppendChunk( CHUNK_GRID_TILE, tile, buffer );
+}
+
+qboolean CheckpointRestoreGridTile( int tile ){
+	std::vector<byte> payload;
+	const byte  *p;
+
+
+	if ( tile >= (int) gridTileChunks.size() || !ReadChunk( gridTileChunks[ tile ], payload ) ) {
+		return qfalse;
+	}
+	p = payload.data();
+	if ( !GetGridPoints( &p, p + payload.size() ) ) {
+		Error( "Checkpoint grid tile %d is corrupt", tile );
+	}
+	return qtrue;
+}
+
+
+
+/*
+   PutRawLightmap(), GetRawLightmap()
+   the super luxels of every style, the deluxels and the cluster flags of a raw lightmap,
+   and with bsp set the averaged bsp and radiosity luxels and what was found about them
+ */
+
+static void PutLuxels( std::vector<byte> &buffer, const float *luxels, size_t size ){
+	byte present;
+
+
+	present = luxels != NULL ? 1 : 0;
+	PutBytes( buffer, &present, 1 );
+	if ( present ) {
+		PutBytes( buffer, luxels, size );
+	}
+}
+
+static qboolean GetLuxels( const byte **p, const byte *end, float **luxels, size_t size ){
+	byte present;
+
+
+	if ( !GetBytes( p, end, &present, 1 ) ) {
+		return qfalse;
+	}
+	if ( !present ) {
+		return qtrue;
+	}
+	if ( *luxels == NULL ) {
+		*luxels = static_cast<float*>( safe_malloc( size ) );
+	}
+	return GetBytes( p, end, *luxels, size );
+}
+
+static void PutRawLightmap( std::vector<byte> &buffer, rawLightmap_t *lm, qboolean bsp ){
+	int lightmapNum;
+	size_t superSize, bspSize;
+
+
+	superSize = lm->sw * lm->sh;
+	bspSize = lm->w * lm->h;
+
+	PutBytes( buffer, &lm->sw, sizeof( lm->sw ) );
+	PutBytes( buffer, &lm->sh, sizeof( lm->sh ) );
+	PutBytes( buffer, lm->styles, sizeof( lm->styles ) );
+	AcquireSuperBuffers( lm );
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+		PutLuxels( buffer, lm->superLuxels[ lightmapNum ], superSize * SUPER_LUXEL_SIZE * sizeof( float ) );
+	PutLuxels( buffer, lm->superDeluxels, superSize * SUPER_DELUXEL_SIZE * sizeof( float ) );
+	ReleaseSuperBuffers( lm );
+	PutBytes( buffer, lm->superClusters, superSize * sizeof( *lm->superClusters ) );
+
+	if ( bsp ) {
+		PutBytes( buffer, &lm->used, sizeof( lm->used ) );
+		PutBytes( buffer, lm->solid, sizeof( lm->solid ) );
+		PutBytes( buffer, lm->solidColor, sizeof( lm->solidColor ) );
+		for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+		{
+			PutLuxels( buffer, lm->bspLuxels[ lightmapNum ], bspSize * BSP_LUXEL_SIZE * sizeof( float ) );
+			PutLuxels( buffer, lm->radLuxels[ lightmapNum ], bspSize * RAD_LUXEL_SIZE * sizeof( float ) );
+		}
+		PutLuxels( buffer, lm->bspDeluxels, bspSize * BSP_DELUXEL_SIZE * sizeof( float ) );
+	}
+}
+
+static qboolean GetRawLightmap( const byte **p, const byte *end, rawLightmap_t *lm, qboolean bsp ){
+	int lightmapNum, sw, sh;
+	size_t superSize, bspSize;
+	qboolean ok;
+
+
+	superSize = lm->sw * lm->sh;
+	bspSize = lm->w * lm->h;
+
+	if ( !GetBytes( p, end, &sw, sizeof( sw ) ) || !GetBytes( p, end, &sh, sizeof( sh ) ) ||
+		 sw != lm->sw || sh != lm->sh || !GetBytes( p, end, lm->styles, sizeof( lm->styles ) ) ) {
+		return qfalse;
+	}
+	AcquireSuperBuffers( lm );
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		if ( !GetLuxels( p, end, &lm->superLuxels[ lightmapNum ], superSize * SUPER_LUXEL_SIZE * sizeof( float ) ) ) {
+			ReleaseSuperBuffers( lm );
+			return qfalse;
+		}
+	}
+	ok = GetLuxels( p, end, &lm->superDeluxels, superSize * SUPER_DELUXEL_SIZE * sizeof( float ) );
+	ReleaseSuperBuffers( lm );
+	if ( !ok || !GetBytes( p, end, lm->superClusters, superSize * sizeof( *lm->superClusters ) ) ) {
+		return qfalse;
+	}
+
+	if ( bsp ) {
+		if ( !GetBytes( p, end, &lm->used, sizeof( lm->used ) ) ||
+			 !GetBytes( p, end, lm->solid, sizeof( lm->solid ) ) ||
+			 !GetBytes( p, end, lm->solidColor, sizeof( lm->solidColor ) ) ) {
+			return qfalse;
+		}
+		for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+		{
+			if ( !GetLuxels( p, end, &lm->bspLuxels[ lightmapNum ], bspSize * BSP_LUXEL_SIZE * sizeof( float ) ) ||
+				 !GetLuxels( p, end, &lm->radLuxels[ lightmapNum ], bspSize * RAD_LUXEL_SIZE * sizeof( float ) ) ) {
+				return qfalse;
+			}
+		}
+		if ( !GetLuxels( p, end, &lm->bspDeluxels, bspSize * BSP_DELUXEL_SIZE * sizeof( float ) ) ) {
+			return qfalse;
+		}
+	}
+	return qtrue;
+}
+
+
+
+/*
+   CheckpointWriteRawLightmap(), CheckpointRestoreRawLightmap()
+   a raw lightmap is stored once it is lit and finished
+ */
+
+void CheckpointWriteRawLightmap( int rawLightmapNum ){
+	std::vector<byte> buffer;
+
+
+	if ( checkpointFile == NULL ) {
+		return;
+	}
+	BeginChunk( buffer );
+	PutRawLightmap( buffer, &rawLightmaps[ rawLightmapNum ], qfalse );
+	AppendChunk( CHUNK_LIGHTMAP, rawLightmapNum, buffer );
+}
+
+qboolean CheckpointRestoreRawLightmap( int rawLightmapNum ){
+	std::vector<byte> payload;
+	const byte  *p;
+
+
+	if ( lightmapChunks.empty() || !ReadChunk( lightmapChunks[ rawLightmapNum ], payload ) ) {
+		return qfalse;
+	}
+	p = payload.data();
+	if ( !GetRawLightmap( &p, p + payload.size(), &rawLightmaps[ rawLightmapNum ], qfalse ) ) {
+		Error( "Checkpoint raw lightmap %d is corrupt", rawLightmapNum );
+	}
+	return qtrue;
+}
+
+
+
+/*
+   PutVertexes(), GetVertexes()
+   the vertex luxels, the vertex colors and styles of every surface
+ */
+
+static void PutVertexes( std::vector<byte> &buffer ){
+	int i, lightmapNum;
+	size_t size;
+
+
+	size = numBSPDrawVerts * VERTEX_LUXEL_SIZE * sizeof( float );
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		PutBytes( buffer, vertexLuxels[ lightmapNum ], size );
+		PutBytes( buffer, radVertexLuxels[ lightmapNum ], size );
+	}
+	for ( i = 0; i < numBSPDrawVerts; i++ )
+		PutBytes( buffer, yDrawVerts[ i ].color, sizeof( yDrawVerts[ i ].color ) );
+	for ( i = 0; i < numBSPDrawSurfaces; i++ )
+		PutBytes( buffer, bspDrawSurfaces[ i ].vertexStyles, sizeof( bspDrawSurfaces[ i ].vertexStyles ) );
+}
+
+static qboolean GetVertexes( const byte **p, const byte *end ){
+	int i, lightmapNum;
+	size_t size;
+
+
+	size = numBSPDrawVerts * VERTEX_LUXEL_SIZE * sizeof( float );
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		if ( !GetBytes( p, end, vertexLuxels[ lightmapNum ], size ) ||
+			 !GetBytes( p, end, radVertexLuxels[ lightmapNum ], size ) ) {
+			return qfalse;
+		}
+	}
+	for ( i = 0; i < numBSPDrawVerts; i++ )
+	{
+		if ( !GetBytes( p, end, yDrawVerts[ i ].color, sizeof( yDrawVerts[ i ].color ) ) ) {
+			return qfalse;
+		}
+	}
+	for ( i = 0; i < numBSPDrawSurfaces; i++ )
+	{
+		if ( !GetBytes( p, end, bspDrawSurfaces[ i ].vertexStyles, sizeof( bspDrawSurfaces[ i ].vertexStyles ) ) ) {
+			return qfalse;
+		}
+	}
+	return qtrue;
+}
+
+
+
+/*
+   CheckpointWriteVertexes(), CheckpointRestoreVertexes()
+   the vertex lighting is stored after IlluminateVertexes
+ */
+
+void CheckpointWriteVertexes( void ){
+	std::vector<byte> buffer;
+
+
+	if ( checkpointFile == NULL ) {
+		return;
+	}
+	BeginChunk( buffer );
+	PutVertexes( buffer );
+	AppendChunk( CHUNK_VERTEXES, 0, buffer );
+}
+
+qboolean CheckpointRestoreVertexes( void ){
+	std::vector<byte> payload;
+	const byte  *p;
+
+
+	if ( !ReadChunk( vertexChunk, payload ) ) {
+		return qfalse;
+	}
+	p = payload.data();
+	if ( !GetVertexes( &p, p + payload.size() ) ) {
+		Error( "Checkpoint vertex lighting is corrupt" );
+	}
+	Sys_Printf( "Restored the vertex lighting from checkpoint\n" );
+	return qtrue;
+}
+
+
+
+/*
+   CheckpointWriteBounce(), CheckpointRestoreBounce()
+   at the start of a bounce, after the last pass has been averaged, everything the rest
+   of the radiosity needs is stored: the raw lightmaps with their bsp and radiosity
+   luxels, the vertex lighting, the lightmap styles of the surfaces and the grid
+ */
+
+void CheckpointWriteBounce( int b ){
+	std::vector<byte> buffer;
+	int i;
+
+
+	if ( checkpointFile == NULL ) {
+		return;
+	}
+	BeginChunk( buffer );
+	for ( i = 0; i < numRawLightmaps; i++ )
+		PutRawLightmap( buffer, &rawLightmaps[ i ], qtrue );
+	PutVertexes( buffer );
+	for ( i = 0; i < numBSPDrawSurfaces; i++ )
+		PutBytes( buffer, bspDrawSurfaces[ i ].lightmapStyles, sizeof( bspDrawSurfaces[ i ].lightmapStyles ) );
+	if ( !noGridLighting ) {
+		PutBytes( buffer, rawGridPoints, numRawGridPoints * sizeof( *rawGridPoints ) );
+		PutBytes( buffer, bspGridPoints, numBSPGridPoints * sizeof( *bspGridPoints ) );
+	}
+	AppendChunk( CHUNK_BOUNCE, b, buffer );
+}
+
+int CheckpointBounce( void ){
+	return bounceChunk >= 0 ? bounceChunkNum : 0;
+}
+
+void CheckpointRestoreBounce( void ){
+	std::vector<byte> payload;
+	const byte  *p, *end;
+	int i;
+	qboolean ok;
+
+
+	if ( !ReadChunk( bounceChunk, payload ) ) {
+		Error( "Could not read bounce %d from checkpoint %s", bounceChunkNum, checkpointPath );
+	}
+	p = payload.data();
+	end = p + payload.size();
+	ok = qtrue;
+	for ( i = 0; i < numRawLightmaps && ok; i++ )
+		ok = GetRawLightmap( &p, end, &rawLightmaps[ i ], qtrue );
+	if ( ok ) {
+		ok = GetVertexes( &p, end );
+	}
+	for ( i = 0; i < numBSPDrawSurfaces && ok; i++ )
+		ok = GetBytes( &p, end, bspDrawSurfaces[ i ].lightmapStyles, sizeof( bspDrawSurfaces[ i ].lightmapStyles ) );
+	if ( ok && !noGridLighting ) {
+		ok = GetBytes( &p, end, rawGridPoints, numRawGridPoints * sizeof( *rawGridPoints ) );
+	}
+	if ( ok && !noGridLighting ) {
+		ok = GetBytes( &p, end, bspGridPoints, numBSPGridPoints * sizeof( *bspGridPoints ) );
+	}
+	if ( !ok ) {
+		Error( "Checkpoint bounce %d is corrupt", bounceChunkNum );
+	}
+	Sys_Printf( "Restored the lighting before bounce %d from checkpoint\n", bounceChunkNum );
+}
+
+
+
+/*
+   light cache
+   -lightcache <dir> keeps the first pass of every raw lightmap and grid tile in a file
+   named after a hash of everything that went into it: the mapped luxels with their
+   normals, dirt and floodlight, the surfaces, every light that survived culling, the
+   shadow casting geometry between them and the switches and worldspawn keys. a relight
+   after a light was moved only lights what the move could have changed.
+ */
+
+#define LIGHT_CACHE_VERSION     1
+
+static uint64_t lightCacheBase;
+static std::atomic<int> lightCacheHits, lightCacheMisses;
+
+
+
+/*
+   LightCacheOpen()
+   hashes what every cache entry depends on and makes sure the directory exists
+ */
+
+void LightCacheOpen( const std::vector<OptionResult> &options ){
+	epair_t         *ep;
+	uint64_t hash;
+	int version;
+
+
+	if ( lightCacheDir == NULL ) {
+		return;
+	}
+	Q_mkdir( lightCacheDir );
+
+	/* switches */
+	version = LIGHT_CACHE_VERSION;
+	hash = HashBytes( HASH_INIT, &version, sizeof( version ) );
+	hash ^= HashOptions( options, firstPassSwitches );
+	hash *= FNV_PRIME;
+
+	/* worldspawn keys, but not the ones the compiler writes itself */
+	for ( ep = entities[ 0 ].epairs; ep != NULL; ep = ep->next )
+	{
+		if ( !Q_strncasecmp( ep->key, "_q3map2_", 8 ) ) {
+			continue;
+		}
+		hash = HashBytes( hash, ep->key, strlen( ep->key ) + 1 );
+		hash = HashBytes( hash, ep->value, strlen( ep->value ) + 1 );
+	}
+
+	/* which clusters can see each other */
+	hash = HashBytes( hash, bspVisBytes, numBSPVisBytes );
+
+	lightCacheBase = hash;
+	lightCacheHits = 0;
+	lightCacheMisses = 0;
+
+	/* index the shadow casting geometry */
+	SetupShadowGeometryHash();
+
+	StartWriter();
+	Sys_Printf( "Using light cache %s\n", lightCacheDir );
+}
+
+
+
+/*
+   LightCacheStats()
+   prints how many lightmaps and grid tiles came from the cache
+ */
+
+void LightCacheStats( void ){
+	if ( lightCacheDir == NULL ) {
+		return;
+	}
+	Sys_Printf( "%9d raw lightmaps and grid tiles from the light cache\n", lightCacheHits.load() );
+	Sys_Printf( "%9d raw lightmaps and grid tiles lit and cached\n", lightCacheMisses.load() );
+}
+
+
+
+/*
+   HashLight()
+   hashes the parameters of a light
+ */
+
+static uint64_t HashLight( uint64_t hash, const light_t *light ){
+	int i;
+
+
+	hash = HashBytes( hash, &light->type, sizeof( light->type ) );
+	hash = HashBytes( hash, &light->flags, sizeof( light->flags ) );
+	if ( light->si != NULL ) {
+		hash = HashBytes( hash, light->si->shader, strlen( light->si->shader ) + 1 );
+	}
+	hash = HashBytes( hash, light->origin, sizeof( light->origin ) );
+	hash = HashBytes( hash, light->normal, sizeof( light->normal ) );
+	hash = HashBytes( hash, &light->dist, sizeof( light->dist ) );
+	hash = HashBytes( hash, &light->photons, sizeof( light->photons ) );
+	hash = HashBytes( hash, &light->style, sizeof( light->style ) );
+	hash = HashBytes( hash, light->color, sizeof( light->color ) );
+	hash = HashBytes( hash, &light->radiusByDist, sizeof( light->radiusByDist ) );
+	hash = HashBytes( hash, &light->fade, sizeof( light->fade ) );
+	hash = HashBytes( hash, &light->angleScale, sizeof( light->angleScale ) );
+	hash = HashBytes( hash, &light->extraDist, sizeof( light->extraDist ) );
+	hash = HashBytes( hash, &light->add, sizeof( light->add ) );
+	hash = HashBytes( hash, &light->envelope, sizeof( light->envelope ) );
+	hash = HashBytes( hash, light->mins, sizeof( light->mins ) );
+	hash = HashBytes( hash, light->maxs, sizeof( light->maxs ) );
+	hash = HashBytes( hash, &light->cluster, sizeof( light->cluster ) );
+	hash = HashBytes( hash, light->emitColor, sizeof( light->emitColor ) );
+	hash = HashBytes( hash, &light->falloffTolerance, sizeof( light->falloffTolerance ) );
+	hash = HashBytes( hash, &light->filterRadius, sizeof( light->filterRadius ) );
+	if ( light->w != NULL ) {
+		for ( i = 0; i < light->w->numpoints; i++ )
+			hash = HashBytes( hash, light->w->p[ i ], sizeof( vec3_t ) );
+	}
+	return hash;
+}
+
+
+
+/*
+   AddLightToRegion()
+   grows a box around what gets lit to cover the shadow rays to a light
+ */
+
+static void AddLightToRegion( light_t *light, const vec3_t mins, const vec3_t maxs, vec3_t regionMins, vec3_t regionMaxs ){
+	vec3_t point;
+	int i;
+
+
+	/* sun rays leave the lit box along the sun vector */
+	if ( light->type == EMIT_SUN ) {
+		VectorAdd( mins, light->origin, point );
+		AddPointToBounds( point, regionMins, regionMaxs );
+		VectorAdd( maxs, light->origin, point );
+		AddPointToBounds( point, regionMins, regionMaxs );
+		return;
+	}
+
+	AddPointToBounds( light->origin, regionMins, regionMaxs );
+	if ( light->w != NULL ) {
+		for ( i = 0; i < light->w->numpoints; i++ )
+			AddPointToBounds( light->w->p[ i ], regionMins, regionMaxs );
+	}
+}
+
+
+
+/*
+   LightCachePath()
+   the file of a cache entry
+ */
+
+static void LightCachePath( uint64_t key, const char *extension, char *path ){
+	sprintf( path, "%s/%08x%08x.%s", lightCacheDir, (unsigned int) ( key >> 32 ), (unsigned int) key, extension );
+}
+
+
+
+/*
+   ReadCacheEntry()
+   reads and checks a cache file
+ */
+
+static qboolean ReadCacheEntry( uint64_t key, const char *extension, int type, std::vector<byte> &payload ){
+	checkpointChunk_t chunk;
+	char path[ 1024 ];
+	FILE            *file;
+	qboolean ok;
+
+
+	LightCachePath( key, extension, path );
+	file = fopen( path, "rb" );
+	if ( file == NULL ) {
+		return qfalse;
+	}
+	ok = qfalse;
+	if ( fread( &chunk, sizeof( chunk ), 1, file ) == 1 && chunk.type == type && chunk.size < ( 1ULL << 40 ) ) {
+		payload.resize( chunk.size );
+		if ( ( chunk.size == 0 || fread( payload.data(), chunk.size, 1, file ) == 1 ) &&
+			 HashBytes( HASH_INIT, payload.data(), payload.size() ) == chunk.hash ) {
+			ok = qtrue;
+		}
+	}
+	fclose( file );
+	return ok;
+}
+
+
+
+/*
+   LightCacheRawLightmapKey()
+   hashes the inputs of a raw lightmap once it is mapped, dirtied and floodlit, 0 without a cache
+ */
+
+uint64_t LightCacheRawLightmapKey( int rawLightmapNum, light_t **lights, int numLights ){
+	rawLightmap_t       *lm;
+	surfaceInfo_t       *info;
+	uint64_t hash;
+	size_t superSize;
+	vec3_t mins, maxs, regionMins, regionMaxs;
+	int i, num;
+
+
+	if ( lightCacheDir == NULL ) {
+		return 0;
+	}
+	lm = &rawLightmaps[ rawLightmapNum ];
+	superSize = lm->sw * lm->sh;
+
+	/* the lightmap */
+	hash = lightCacheBase;
+	hash = HashBytes( hash, &lm->sw, sizeof( lm->sw ) );
+	hash = HashBytes( hash, &lm->sh, sizeof( lm->sh ) );
+	hash = HashBytes( hash, &lm->splotchFix, sizeof( lm->splotchFix ) );
+	hash = HashBytes( hash, &lm->brightness, sizeof( lm->brightness ) );
+	hash = HashBytes( hash, &lm->filterRadius, sizeof( lm->filterRadius ) );
+	hash = HashBytes( hash, &lm->actualSampleSize, sizeof( lm->actualSampleSize ) );
+	hash = HashBytes( hash, &lm->entityNum, sizeof( lm->entityNum ) );
+	hash = HashBytes( hash, &lm->recvShadows, sizeof( lm->recvShadows ) );
+	hash = HashBytes( hash, &lm->floodlightDirectionScale, sizeof( lm->floodlightDirectionScale ) );
+	hash = HashBytes( hash, lm->floodlightRGB, sizeof( lm->floodlightRGB ) );
+	hash = HashBytes( hash, &lm->floodlightIntensity, sizeof( lm->floodlightIntensity ) );
+	hash = HashBytes( hash, &lm->floodlightDistance, sizeof( lm->floodlightDistance ) );
+
+	/* its luxels */
+	AcquireSuperBuffers( lm );
+	hash = HashBytes( hash, lm->superOrigins, superSize * SUPER_ORIGIN_SIZE * sizeof( float ) );
+	hash = HashBytes( hash, lm->superNormals, superSize * SUPER_NORMAL_SIZE * sizeof( float ) );
+	hash = HashBytes( hash, lm->superFloodLight, superSize * SUPER_FLOODLIGHT_SIZE * sizeof( float ) );
+	ReleaseSuperBuffers( lm );
+	hash = HashBytes( hash, lm->superClusters, superSize * sizeof( *lm->superClusters ) );
+
+	/* its surfaces */
+	for ( i = 0; i < lm->numLightSurfaces; i++ )
+	{
+		num = lightSurfaces[ lm->firstLightSurface + i ];
+		info = &surfaceInfos[ num ];
+		hash = HashBytes( hash, &num, sizeof( num ) );
+		hash = HashBytes( hash, info->si->shader, strlen( info->si->shader ) + 1 );
+		hash = HashBytes( hash, &info->si->twoSided, sizeof( info->si->twoSided ) );
+		hash = HashBytes( hash, &info->si->forceSunlight, sizeof( info->si->forceSunlight ) );
+		hash = HashBytes( hash, &info->recvShadows, sizeof( info->recvShadows ) );
+	}
+
+	/* the lights, and the geometry between them and the luxels */
+	VectorCopy( lm->mins, mins );
+	VectorCopy( lm->maxs, maxs );
+	for ( i = 0; i < 3; i++ )
+	{
+		mins[ i ] -= 2 * lm->actualSampleSize;
+		maxs[ i ] += 2 * lm->actualSampleSize;
+	}
+	VectorCopy( mins, regionMins );
+	VectorCopy( maxs, regionMaxs );
+	for ( i = 0; i < numLights; i++ )
+	{
+		hash = HashLight( hash, lights[ i ] );
+		AddLightToRegion( lights[ i ], mins, maxs, regionMins, regionMaxs );
+	}
+	hash ^= ShadowGeometryHash( regionMins, regionMaxs );
+	hash *= FNV_PRIME;
+
+	/* 0 means no key */
+	return hash != 0 ? hash : 1;
+}
+
+
+
+/*
+   LightCacheRestoreRawLightmap(), LightCacheWriteRawLightmap()
+   a cached raw lightmap is the same as its checkpoint chunk
+ */
+
+qboolean LightCacheRestoreRawLightmap( int rawLightmapNum, uint64_t key ){
+	std::vector<byte> payload;
+	const byte  *p;
+
+
+	if ( key == 0 ) {
+		return qfalse;
+	}
+	if ( !ReadCacheEntry( key, "lm", CHUNK_LIGHTMAP, payload ) ) {
+		lightCacheMisses++;
+		return qfalse;
+	}
+	p = payload.data();
+	if ( !GetRawLightmap( &p, p + payload.size(), &rawLightmaps[ rawLightmapNum ], qfalse ) ) {
+		Error( "Light cache entry of raw lightmap %d is corrupt", rawLightmapNum );
+	}
+	lightCacheHits++;
+	return qtrue;
+}
+
+void LightCacheWriteRawLightmap( int rawLightmapNum, uint64_t key ){
+	std::vector<byte> buffer;
+	char path[ 1024 ];
+
+
+	if ( key == 0 ) {
+		return;
+	}
+	LightCachePath( key, "lm", path );
+	BeginChunk( buffer );
+	PutRawLightmap( buffer, &rawLightmaps[ rawLightmapNum ], qfalse );
+	AppendChunk( CHUNK_LIGHTMAP, rawLightmapNum, buffer, path );
+}
+
+
+
+/*
+   LightCacheGridTileKey()
+   hashes the inputs of a tile of grid points once their traces are set up, 0 without a cache
+ */
+
+uint64_t LightCacheGridTileKey( trace_t *traces, const int *nums, int numPoints ){
+	uint64_t hash;
+	vec3_t mins, maxs, regionMins, regionMaxs;
+	light_t         *light;
+	int i;
+
+
+	if ( lightCacheDir == NULL ) {
+		return 0;
+	}
+
+	/* the points, after nudging (the nudge only depends on the point and the bsp) */
+	hash = lightCacheBase;
+	hash = HashBytes( hash, gridMins, sizeof( gridMins ) );
+	hash = HashBytes( hash, gridSize, sizeof( gridSize ) );
+	hash = HashBytes( hash, gridBounds, sizeof( gridBounds ) );
+	ClearBounds( mins, maxs );
+	for ( i = 0; i < numPoints; i++ )
+	{
+		hash = HashBytes( hash, &nums[ i ], sizeof( nums[ i ] ) );
+		hash = HashBytes( hash, traces[ i ].origin, sizeof( traces[ i ].origin ) );
+		hash = HashBytes( hash, &traces[ i ].cluster, sizeof( traces[ i ].cluster ) );
+		AddPointToBounds( traces[ i ].origin, mins, maxs );
+	}
+	for ( i = 0; i < 3; i++ )
+	{
+		mins[ i ] -= gridSize[ i ];
+		maxs[ i ] += gridSize[ i ];
+	}
+
+	/* the lights that can reach them, and the geometry in between */
+	VectorCopy( mins, regionMins );
+	VectorCopy( maxs, regionMaxs );
+	for ( light = lights; light != NULL; light = light->next )
+	{
+		if ( !( light->flags & LIGHT_GRID ) || light->envelope <= 0.0f ||
+			 mins[ 0 ] > light->maxs[ 0 ] || maxs[ 0 ] < light->mins[ 0 ] ||
+			 mins[ 1 ] > light->maxs[ 1 ] || maxs[ 1 ] < light->mins[ 1 ] ||
+			 mins[ 2 ] > light->maxs[ 2 ] || maxs[ 2 ] < light->mins[ 2 ] ) {
+			continue;
+		}
+		hash = HashLight( hash, light );
+		AddLightToRegion( light, mins, maxs, regionMins, regionMaxs );
+	}
+	hash ^= ShadowGeometryHash( regionMins, regionMaxs );
+	hash *= FNV_PRIME;
+
+	return hash != 0 ? hash : 1;
+}
+
+
+
+/*
+   LightCacheRestoreGridTile(), LightCacheWriteGridTile()
+   a cached grid tile is the same as its checkpoint chunk
+ */
+
+qboolean LightCacheRestoreGridTile( uint64_t key ){
+	std::vector<byte> payload;
+	const byte  *p;
+
+
+	if ( key == 0 ) {
+		return qfalse;
+	}
+	if ( !ReadCacheEntry( key, "grid", CHUNK_GRID_TILE, payload ) ) {
+		lightCacheMisses++;
+		return qfalse;
+	}
+	p = payload.data();
+	if ( !GetGridPoints( &p, p + payload.size() ) ) {
+		Error( "Light cache entry of a grid tile is corrupt" );
+	}
+	lightCacheHits++;
+	return qtrue;
+}
+
+void LightCacheWriteGridTile( uint64_t key, const int *nums, int numPoints ){
+	std::vector<byte> buffer;
+	char path[ 1024 ];
+
+
+	if ( key == 0 ) {
+		return;
+	}
+	LightCachePath( key, "grid", path );
+	BeginChunk( buffer );
+	PutGridPoints( buffer, nums, numPoints );
+	AppendChunk( CHUNK_GRID_TILE, 0, buffer, path );
+}
@@ -0,0 +1,667 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define LIGHT_COMPACT_C
+
+
+
+/* dependencies */
+#include "q3map2.h"
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+
+
+/*
+   compact super buffers
+   with -compactsuper the supersampled buffers of a raw lightmap only exist as floats while
+   a phase works on it. AcquireSuperBuffers() expands them before the phase touches them
+   through the SUPER_* macros and the last ReleaseSuperBuffers() packs them again: luxels,
+   deluxels, floodlight and dirt as half floats, normals octahedral in two shorts, and the
+   origins of axial lightmaps as half float offsets from where the lightmap vectors put the
+   luxel on its plane. the clusters stay as they are, the sampling flags are scratch space
+   and are dropped
+ */
+
+typedef struct compactSuper_s
+{
+	uint16_t            *luxels[ MAX_LIGHTMAPS ];   /* NULL where the style has no luxels */
+	uint16_t            *deluxels;
+	uint16_t            *floodLight;
+	uint16_t            *originOffsets;             /* axial lightmaps */
+	float               *origins;                   /* everything else */
+	int16_t             *normals;
+	uint16_t            *dirt;
+
+	size_t bytes;                                   /* of the planes above */
+	qboolean spilled;                               /* planes are in the scratch file */
+	int present;                                    /* which planes the scratch file holds */
+}
+compactSuper_t;
+
+#define SUPER_LOCKS             64
+#define MAX_COMPACT_PLANES      ( MAX_LIGHTMAPS + 6 )
+
+static std::mutex superLocks[ SUPER_LOCKS ];
+static std::atomic<int64_t> compactBytes( 0 ), peakExpandedBytes( 0 ), expandedBytes( 0 );
+
+/* -membudget spills packed super buffers to a scratch file, each raw lightmap reuses its slot */
+typedef struct spillSlot_s
+{
+	int64_t offset;
+	size_t size;
+}
+spillSlot_t;
+
+static char scratchPath[ 1024 ];
+static FILE *scratchFile;
+static std::mutex scratchLock;
+static std::vector<spillSlot_t> spillSlots;
+static int64_t scratchEnd;
+static std::atomic<int> numSpills( 0 ), numReloads( 0 );
+
+#if GDEF_OS_WINDOWS
+	#define ScratchSeek         _fseeki64
+#else
+	#define ScratchSeek         fseeko
+#endif
+
+
+
+/*
+   FloatToHalf(), HalfToFloat()
+   ieee half floats, rounded to nearest even, values beyond the half range are clamped to it
+ */
+
+static inline uint16_t FloatToHalf( float f ){
+	union { float f; uint32_t u; } v;
+	uint32_t sign, exponent, mantissa;
+
+
+	v.f = f;
+	sign = ( v.u >> 16 ) & 0x8000;
+	exponent = ( v.u >> 23 ) & 0xff;
+	mantissa = v.u & 0x7fffff;
+
+	/* nan stays nan, everything too large becomes the largest half */
+	if ( exponent == 0xff && mantissa != 0 ) {
+		return (uint16_t) ( sign | 0x7e00 );
+	}
+	if ( exponent >= 127 + 16 ) {
+		return (uint16_t) ( sign | 0x7bff );
+	}
+
+	/* normal */
+	if ( exponent >= 127 - 14 ) {
+		v.u = ( ( exponent - 127 + 15 ) << 10 ) | ( mantissa >> 13 );
+		mantissa &= 0x1fff;
+		if ( mantissa > 0x1000 || ( mantissa == 0x1000 && ( v.u & 1 ) ) ) {
+			v.u++;
+		}
+		return (uint16_t) ( sign | ( v.u < 0x7c00 ? v.u : 0x7bff ) );
+	}
+
+	/* subnormal or zero */
+	if ( exponent < 127 - 25 ) {
+		return (uint16_t) sign;
+	}
+	mantissa |= 0x800000;
+	exponent = 127 - 14 - exponent + 13;
+	v.u = mantissa >> exponent;
+	mantissa &= ( 1u << exponent ) - 1;
+	if ( mantissa > ( 1u << ( exponent - 1 ) ) || ( mantissa == ( 1u << ( exponent - 1 ) ) && ( v.u & 1 ) ) ) {
+		v.u++;
+	}
+	return (uint16_t) ( sign | v.u );
+}
+
+static inline float HalfToFloat( uint16_t h ){
+	union { float f; uint32_t u; } v;
+	uint32_t sign, exponent, mantissa;
+
+
+	sign = (uint32_t) ( h & 0x8000 ) << 16;
+	exponent = ( h >> 10 ) & 0x1f;
+	mantissa = h & 0x3ff;
+
+	if ( exponent == 0 ) {
+		/* zero or subnormal */
+		v.f = mantissa * ( 1.0f / 16777216.0f );
+		v.u |= sign;
+		return v.f;
+	}
+	if ( exponent == 0x1f ) {
+		v.u = sign | 0x7f800000 | ( mantissa << 13 );
+		return v.f;
+	}
+	v.u = sign | ( ( exponent - 15 + 127 ) << 23 ) | ( mantissa << 13 );
+	return v.f;
+}
+
+static void PackHalfs( uint16_t **out, const float *in, size_t count ){
+	size_t i;
+
+
+	*out = static_cast<uint16_t*>( safe_malloc( count * sizeof( uint16_t ) ) );
+	for ( i = 0; i < count; i++ )
+		( *out )[ i ] = FloatToHalf( in[ i ] );
+}
+
+static void UnpackHalfs( float **out, const uint16_t *in, size_t count ){
+	size_t i;
+
+
+	*out = static_cast<float*>( safe_malloc( count * sizeof( float ) ) );
+	for ( i = 0; i < count; i++ )
+		( *out )[ i ] = HalfToFloat( in[ i ] );
+}
+
+
+
+/*
+   EncodeNormal(), DecodeNormal()
+   octahedral unit vectors in two signed shorts, unmapped luxels keep their zero normals
+ */
+
+#define ZERO_NORMAL             -32768
+
+static inline void EncodeNormal( const float *normal, int16_t *out ){
+	float d, u, v, t;
+
+
+	d = fabs( normal[ 0 ] ) + fabs( normal[ 1 ] ) + fabs( normal[ 2 ] );
+	if ( d <= 0.0f ) {
+		out[ 0 ] = out[ 1 ] = ZERO_NORMAL;
+		return;
+	}
+	u = normal[ 0 ] / d;
+	v = normal[ 1 ] / d;
+	if ( normal[ 2 ] < 0.0f ) {
+		t = u;
+		u = ( 1.0f - fabs( v ) ) * ( t >= 0.0f ? 1.0f : -1.0f );
+		v = ( 1.0f - fabs( t ) ) * ( v >= 0.0f ? 1.0f : -1.0f );
+	}
+	out[ 0 ] = (int16_t) floor( u * 32767.0f + 0.5f );
+	out[ 1 ] = (int16_t) floor( v * 32767.0f + 0.5f );
+}
+
+static inline void DecodeNormal( const int16_t *in, float *normal ){
+	float u, v, t;
+
+
+	if ( in[ 0 ] == ZERO_NORMAL ) {
+		VectorClear( normal );
+		return;
+	}
+	u = in[ 0 ] * ( 1.0f / 32767.0f );
+	v = in[ 1 ] * ( 1.0f / 32767.0f );
+	normal[ 2 ] = 1.0f - fabs( u ) - fabs( v );
+	if ( normal[ 2 ] < 0.0f ) {
+		t = u;
+		u = ( 1.0f - fabs( v ) ) * ( t >= 0.0f ? 1.0f : -1.0f );
+		v = ( 1.0f - fabs( t ) ) * ( v >= 0.0f ? 1.0f : -1.0f );
+	}
+	normal[ 0 ] = u;
+	normal[ 1 ] = v;
+	VectorNormalize( normal, normal );
+}
+
+
+
+/*
+   LuxelPlaneOrigin()
+   where an axial lightmap's vectors put a luxel on its plane, see MapSingleLuxel()
+ */
+
+static inline void LuxelPlaneOrigin( const rawLightmap_t *lm, int x, int y, vec3_t origin ){
+	int i;
+	float d;
+
+
+	VectorCopy( lm->origin, origin );
+	for ( i = 0; i < 3; i++ )
+	{
+		if ( i != lm->axisNum ) {
+			origin[ i ] += ( x * lm->vecs[ 0 ][ i ] ) + ( y * lm->vecs[ 1 ][ i ] );
+		}
+	}
+	d = DotProduct( origin, lm->plane ) - lm->plane[ 3 ];
+	d /= lm->plane[ lm->axisNum ];
+	origin[ lm->axisNum ] -= d;
+}
+
+static inline qboolean AxialOrigins( const rawLightmap_t *lm ){
+	return ( lm->vecs != NULL && lm->plane != NULL && lm->plane[ lm->axisNum ] != 0.0f ) ? qtrue : qfalse;
+}
+
+
+
+/*
+   PackSuperBuffers(), UnpackSuperBuffers()
+   moves a raw lightmap's super buffers between their float and compact forms
+ */
+
+static size_t SuperFloatBytes( const rawLightmap_t *lm ){
+	size_t size, bytes;
+	int lightmapNum;
+
+
+	size = (size_t) lm->sw * lm->sh;
+	bytes = size * ( SUPER_ORIGIN_SIZE + SUPER_NORMAL_SIZE + SUPER_FLOODLIGHT_SIZE ) * sizeof( float );
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+		bytes += lm->superLuxels[ lightmapNum ] != NULL ? size * SUPER_LUXEL_SIZE * sizeof( float ) : 0;
+	bytes += lm->superDeluxels != NULL ? size * SUPER_DELUXEL_SIZE * sizeof( float ) : 0;
+	return bytes;
+}
+
+static void PackSuperBuffers( rawLightmap_t *lm ){
+	int x, y, lightmapNum;
+	size_t size, i, bytes;
+	compactSuper_t      *cs;
+	float               *origin, *normal;
+	vec3_t planeOrigin;
+
+
+	size = (size_t) lm->sw * lm->sh;
+	expandedBytes -= SuperFloatBytes( lm );
+	cs = static_cast<compactSuper_t*>( safe_malloc( sizeof( *cs ) ) );
+	memset( cs, 0, sizeof( *cs ) );
+	bytes = 0;
+
+	/* light */
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		if ( lm->superLuxels[ lightmapNum ] != NULL ) {
+			PackHalfs( &cs->luxels[ lightmapNum ], lm->superLuxels[ lightmapNum ], size * SUPER_LUXEL_SIZE );
+			free( lm->superLuxels[ lightmapNum ] );
+			lm->superLuxels[ lightmapNum ] = NULL;
+			bytes += size * SUPER_LUXEL_SIZE * sizeof( uint16_t );
+		}
+	}
+	if ( lm->superDeluxels != NULL ) {
+		PackHalfs( &cs->deluxels, lm->superDeluxels, size * SUPER_DELUXEL_SIZE );
+		free( lm->superDeluxels );
+		lm->superDeluxels = NULL;
+		bytes += size * SUPER_DELUXEL_SIZE * sizeof( uint16_t );
+	}
+	PackHalfs( &cs->floodLight, lm->superFloodLight, size * SUPER_FLOODLIGHT_SIZE );
+	free( lm->superFloodLight );
+	lm->superFloodLight = NULL;
+	bytes += size * SUPER_FLOODLIGHT_SIZE * sizeof( uint16_t );
+
+	/* origins */
+	if ( AxialOrigins( lm ) ) {
+		cs->originOffsets = static_cast<uint16_t*>( safe_malloc( size * 3 * sizeof( uint16_t ) ) );
+		for ( y = 0; y < lm->sh; y++ )
+		{
+			for ( x = 0; x < lm->sw; x++ )
+			{
+				i = (size_t) y * lm->sw + x;
+				origin = SUPER_ORIGIN( x, y );
+				LuxelPlaneOrigin( lm, x, y, planeOrigin );
+				cs->originOffsets[ i * 3 + 0 ] = FloatToHalf( origin[ 0 ] - planeOrigin[ 0 ] );
+				cs->originOffsets[ i * 3 + 1 ] = FloatToHalf( origin[ 1 ] - planeOrigin[ 1 ] );
+				cs->originOffsets[ i * 3 + 2 ] = FloatToHalf( origin[ 2 ] - planeOrigin[ 2 ] );
+			}
+		}
+		free( lm->superOrigins );
+		bytes += size * 3 * sizeof( uint16_t );
+	}
+	else
+	{
+		cs->origins = lm->superOrigins;
+		bytes += size * SUPER_ORIGIN_SIZE * sizeof( float );
+	}
+	lm->superOrigins = NULL;
+
+	/* normals and the dirt stashed with them */
+	cs->normals = static_cast<int16_t*>( safe_malloc( size * 2 * sizeof( int16_t ) ) );
+	cs->dirt = static_cast<uint16_t*>( safe_malloc( size * sizeof( uint16_t ) ) );
+	for ( i = 0; i < size; i++ )
+	{
+		normal = lm->superNormals + i * SUPER_NORMAL_SIZE;
+		EncodeNormal( normal, &cs->normals[ i * 2 ] );
+		cs->dirt[ i ] = FloatToHalf( normal[ 3 ] );
+	}
+	free( lm->superNormals );
+	lm->superNormals = NULL;
+	bytes += size * ( 2 * sizeof( int16_t ) + sizeof( uint16_t ) );
+
+	/* sampling flags are set up again by every light */
+	free( lm->superFlags );
+	lm->superFlags = NULL;
+
+	cs->bytes = bytes;
+	lm->compact = cs;
+	compactBytes += bytes;
+}
+
+static void UnpackSuperBuffers( rawLightmap_t *lm ){
+	int x, y, lightmapNum;
+	size_t size, i;
+	compactSuper_t      *cs;
+	float               *origin, *normal;
+	int64_t expanded, peak;
+	vec3_t planeOrigin;
+
+
+	cs = lm->compact;
+	size = (size_t) lm->sw * lm->sh;
+
+	/* light */
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		if ( cs->luxels[ lightmapNum ] != NULL ) {
+			UnpackHalfs( &lm->superLuxels[ lightmapNum ], cs->luxels[ lightmapNum ], size * SUPER_LUXEL_SIZE );
+			free( cs->luxels[ lightmapNum ] );
+		}
+	}
+	if ( cs->deluxels != NULL ) {
+		UnpackHalfs( &lm->superDeluxels, cs->deluxels, size * SUPER_DELUXEL_SIZE );
+		free( cs->deluxels );
+	}
+	UnpackHalfs( &lm->superFloodLight, cs->floodLight, size * SUPER_FLOODLIGHT_SIZE );
+	free( cs->floodLight );
+
+	/* origins */
+	if ( cs->originOffsets != NULL ) {
+		lm->superOrigins = static_cast<float*>( safe_malloc( size * SUPER_ORIGIN_SIZE * sizeof( float ) ) );
+		for ( y = 0; y < lm->sh; y++ )
+		{
+			for ( x = 0; x < lm->sw; x++ )
+			{
+				i = (size_t) y * lm->sw + x;
+				origin = SUPER_ORIGIN( x, y );
+				LuxelPlaneOrigin( lm, x, y, planeOrigin );
+				origin[ 0 ] = planeOrigin[ 0 ] + HalfToFloat( cs->originOffsets[ i * 3 + 0 ] );
+				origin[ 1 ] = planeOrigin[ 1 ] + HalfToFloat( cs->originOffsets[ i * 3 + 1 ] );
+				origin[ 2 ] = planeOrigin[ 2 ] + HalfToFloat( cs->originOffsets[ i * 3 + 2 ] );
+			}
+		}
+		free( cs->originOffsets );
+	}
+	else
+	{
+		lm->superOrigins = cs->origins;
+	}
+
+	/* normals and dirt */
+	lm->superNormals = static_cast<float*>( safe_malloc( size * SUPER_NORMAL_SIZE * sizeof( float ) ) );
+	for ( i = 0; i < size; i++ )
+	{
+		normal = lm->superNormals + i * SUPER_NORMAL_SIZE;
+		DecodeNormal( &cs->normals[ i * 2 ], normal );
+		normal[ 3 ] = HalfToFloat( cs->dirt[ i ] );
+	}
+	free( cs->normals );
+	free( cs->dirt );
+
+	compactBytes -= cs->bytes;
+	free( cs );
+	lm->compact = NULL;
+
+	/* keep track of how much is expanded at once */
+	expanded = expandedBytes += SuperFloatBytes( lm );
+	peak = peakExpandedBytes;
+	while ( expanded > peak && !peakExpandedBytes.compare_exchange_weak( peak, expanded ) ) ;
+}
+
+
+
+/*
+   CompactPlanes()
+   lists the planes of a compact raw lightmap in scratch file order
+ */
+
+static int CompactPlanes( compactSuper_t *cs, const rawLightmap_t *lm, void ***planes, size_t *sizes ){
+	int n, lightmapNum;
+	size_t size;
+
+
+	size = (size_t) lm->sw * lm->sh;
+	n = 0;
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		planes[ n ] = (void**) &cs->luxels[ lightmapNum ];
+		sizes[ n++ ] = size * SUPER_LUXEL_SIZE * sizeof( uint16_t );
+	}
+	planes[ n ] = (void**) &cs->deluxels;
+	sizes[ n++ ] = size * SUPER_DELUXEL_SIZE * sizeof( uint16_t );
+	planes[ n ] = (void**) &cs->floodLight;
+	sizes[ n++ ] = size * SUPER_FLOODLIGHT_SIZE * sizeof( uint16_t );
+	planes[ n ] = (void**) &cs->originOffsets;
+	sizes[ n++ ] = size * 3 * sizeof( uint16_t );
+	planes[ n ] = (void**) &cs->origins;
+	sizes[ n++ ] = size * SUPER_ORIGIN_SIZE * sizeof( float );
+	planes[ n ] = (void**) &cs->normals;
+	sizes[ n++ ] = size * 2 * sizeof( int16_t );
+	planes[ n ] = (void**) &cs->dirt;
+	sizes[ n++ ] = size * sizeof( uint16_t );
+	return n;
+}
+
+
+
+/*
+   SpillSuperBuffers(), ReloadSuperBuffers()
+   moves the planes of a compact raw lightmap out to the scratch file and back
+ */
+
+static void SpillSuperBuffers( rawLightmap_t *lm ){
+	int i, n, num;
+	void        **planes[ MAX_COMPACT_PLANES ];
+	size_t sizes[ MAX_COMPACT_PLANES ];
+	compactSuper_t      *cs;
+	spillSlot_t         *slot;
+
+
+	cs = lm->compact;
+	num = lm - rawLightmaps;
+	n = CompactPlanes( cs, lm, planes, sizes );
+
+	std::lock_guard<std::mutex> lock( scratchLock );
+
+	/* a lightmap that grew styles since its last spill gets a new slot */
+	slot = &spillSlots[ num ];
+	if ( slot->size < cs->bytes ) {
+		slot->offset = scratchEnd;
+		slot->size = cs->bytes;
+		scratchEnd += cs->bytes;
+	}
+
+	ScratchSeek( scratchFile, slot->offset, SEEK_SET );
+	cs->present = 0;
+	for ( i = 0; i < n; i++ )
+	{
+		if ( *planes[ i ] == NULL ) {
+			continue;
+		}
+		if ( fwrite( *planes[ i ], sizes[ i ], 1, scratchFile ) != 1 ) {
+			Error( "Failed to write %s", scratchPath );
+		}
+		free( *planes[ i ] );
+		*planes[ i ] = NULL;
+		cs->present |= 1 << i;
+	}
+
+	cs->spilled = qtrue;
+	compactBytes -= cs->bytes;
+	numSpills++;
+}
+
+static void ReloadSuperBuffers( rawLightmap_t *lm ){
+	int i, n;
+	void        **planes[ MAX_COMPACT_PLANES ];
+	size_t sizes[ MAX_COMPACT_PLANES ];
+	compactSuper_t      *cs;
+
+
+	cs = lm->compact;
+	n = CompactPlanes( cs, lm, planes, sizes );
+
+	std::lock_guard<std::mutex> lock( scratchLock );
+	ScratchSeek( scratchFile, spillSlots[ lm - rawLightmaps ].offset, SEEK_SET );
+	for ( i = 0; i < n; i++ )
+	{
+		if ( !( cs->present & ( 1 << i ) ) ) {
+			continue;
+		}
+		*planes[ i ] = safe_malloc( sizes[ i ] );
+		if ( fread( *planes[ i ], sizes[ i ], 1, scratchFile ) != 1 ) {
+			Error( "Failed to read %s", scratchPath );
+		}
+	}
+
+	cs->spilled = qfalse;
+	compactBytes += cs->bytes;
+	numReloads++;
+}
+
+
+
+/*
+   AcquireSuperBuffers()
+   makes sure a raw lightmap's super buffers are floats until the matching ReleaseSuperBuffers(),
+   the first acquire allocates them, calls nest and may come from several threads at once
+ */
+
+void AcquireSuperBuffers( rawLightmap_t *lm ){
+	int64_t expanded, peak;
+
+
+	if ( !compactSuper ) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock( superLocks[ ( lm - rawLightmaps ) % SUPER_LOCKS ] );
+	if ( lm->superRefs++ > 0 ) {
+		return;
+	}
+	if ( lm->compact != NULL ) {
+		if ( lm->compact->spilled ) {
+			ReloadSuperBuffers( lm );
+		}
+		UnpackSuperBuffers( lm );
+	}
+	else if ( lm->superOrigins == NULL ) {
+		AllocateSuperBuffers( lm );
+		expanded = expandedBytes += SuperFloatBytes( lm );
+		peak = peakExpandedBytes;
+		while ( expanded > peak && !peakExpandedBytes.compare_exchange_weak( peak, expanded ) ) ;
+	}
+}
+
+
+
+/*
+   ReleaseSuperBuffers()
+   packs a raw lightmap's super buffers once the last user is done with them, and spills
+   them to the scratch file when the budget is used up
+ */
+
+void ReleaseSuperBuffers( rawLightmap_t *lm ){
+	if ( !compactSuper ) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock( superLocks[ ( lm - rawLightmaps ) % SUPER_LOCKS ] );
+	if ( --lm->superRefs > 0 ) {
+		return;
+	}
+	PackSuperBuffers( lm );
+	if ( scratchFile != NULL && compactBytes + expandedBytes > memBudget ) {
+		SpillSuperBuffers( lm );
+	}
+}
+
+
+
+/*
+   CompactSuperStats()
+   prints how much the compact super buffers take and the most that was expanded at once
+ */
+
+void CompactSuperStats( void ){
+	if ( !compactSuper ) {
+		return;
+	}
+	Sys_Printf( "%9d MB of compact super buffers\n", (int) ( compactBytes >> 20 ) );
+	Sys_Printf( "%9d MB of super buffers expanded at most\n", (int) ( peakExpandedBytes >> 20 ) );
+	if ( scratchFile != NULL ) {
+		Sys_Printf( "%9d raw lightmaps spilled to the scratch file\n", (int) numSpills );
+		Sys_Printf( "%9d raw lightmaps read back\n", (int) numReloads );
+		Sys_Printf( "%9d MB of scratch file\n", (int) ( scratchEnd >> 20 ) );
+	}
+}
+
+
+
+/*
+   CompactSuperOpen()
+   opens the scratch file -membudget spills super buffers to
+ */
+
+void CompactSuperOpen( const char *BSPFilePath ){
+	if ( memBudget <= 0 ) {
+		return;
+	}
+
+	strcpy( scratchPath, BSPFilePath );
+	StripExtension( scratchPath );
+	strcat( scratchPath, ".light.scratch" );
+	scratchFile = fopen( scratchPath, "w+b" );
+	if ( scratchFile == NULL ) {
+		Error( "Failed to open %s", scratchPath );
+	}
+	spillSlots.assign( numRawLightmaps, spillSlot_t{ 0, 0 } );
+	scratchEnd = 0;
+	Sys_Printf( "Spilling super buffers beyond %d MB to %s\n", (int) ( memBudget >> 20 ), scratchPath );
+}
+
+
+
+/*
+   CompactSuperClose()
+   removes the scratch file
+ */
+
+void CompactSuperClose( void ){
+	if ( scratchFile == NULL ) {
+		return;
+	}
+	fclose( scratchFile );
+	scratchFile = NULL;
+	remove( scratchPath );
+	spillSlots.clear();
+}
@@ -42,6 +42,25 @@
 
 
 
+/* triangle block width follows the instruction set the compiler targets (-march=native) */
+#if defined( __AVX512F__ ) && defined( __AVX512VL__ )
+	#include <immintrin.h>
+	#define TRACE_SIMD_AVX512       1
+	#define TRACE_BLOCK_LANES       8
+#elif defined( __AVX2__ )
+	#include <immintrin.h>
+	#define TRACE_SIMD_AVX2         1
+	#define TRACE_BLOCK_LANES       8
+#elif defined( __SSE4_2__ ) || defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+	#include <nmmintrin.h>
+	#define TRACE_SIMD_SSE          1
+	#define TRACE_BLOCK_LANES       4
+#else
+	#define TRACE_BLOCK_LANES       4
+#endif
+
+
+
 #define Vector2Copy( a, b )     ( ( b )[ 0 ] = ( a )[ 0 ], ( b )[ 1 ] = ( a )[ 1 ] )
 #define Vector4Copy( a, b )     ( ( b )[ 0 ] = ( a )[ 0 ], ( b )[ 1 ] = ( a )[ 1 ], ( b )[ 2 ] = ( a )[ 2 ], ( b )[ 3 ] = ( a )[ 3 ] )
 
@@ -59,10 +78,20 @@
 #define MAX_TW_VERTS            24 // vortex: increased from 12 to 24 for ability co compile some insane maps with large curve count
 
 #define TRACE_ON_EPSILON        0.1f
+#define BARY_EPSILON            0.01f
 
 #define TRACE_LEAF              -1
 #define TRACE_LEAF_SOLID        -2
 
+#define BVH_MAX_LEAF_TRIANGLES  TRACE_BLOCK_LANES
+#define BVH_MAX_DEPTH           64
+#define BVH_NUM_BINS            16
+#define BVH_TRAVERSAL_COST      1.0f
+#define BVH_BLOCK_COST          2.0f
+#define BVH_NODE_ALIGN          64
+
+#define BVH_LEAF_BLOCKS( n )    ( ( ( n ) + TRACE_BLOCK_LANES - 1 ) / TRACE_BLOCK_LANES )
+
 typedef struct traceVert_s
 {
 	vec3_t xyz;
@@ -101,9 +130,45 @@ typedef struct traceNode_s
 	int children[ 2 ];
 	int numItems, maxItems;
 	int                         *items;
+	int bvhNodeNum;                 /* leaf triangle hierarchy, -1 with the old tree */
 }
 traceNode_t;
 
+/* 32 bytes, two nodes per cache line; the first child of an interior node directly follows it */
+typedef struct traceBVHNode_s
+{
+	vec3_t mins;
+	int offset;                     /* first triangle, then triangle block (leaf) or second child (interior) */
+	vec3_t maxs;
+	int numTriangles;               /* 0 == interior node */
+}
+traceBVHNode_t;
+
+/* the triangles of a bvh leaf in structure-of-arrays form, one triangle per lane */
+typedef struct alignas( BVH_NODE_ALIGN ) traceTriangleBlock_s
+{
+	float v0[ 3 ][ TRACE_BLOCK_LANES ];
+	float edge1[ 3 ][ TRACE_BLOCK_LANES ];
+	float edge2[ 3 ][ TRACE_BLOCK_LANES ];
+	int castShadows[ TRACE_BLOCK_LANES ];
+	int firstTriangle;
+	int numTriangles;
+
+	/* lane bitmasks */
+	int worldMask;                  /* castShadows == 1 */
+	int skyMask;                    /* C_SKY */
+	int skipGridMask;               /* skipGrid */
+	int filterMask;                 /* alphashadow/lightfilter with an image, needs texel lookups */
+}
+traceTriangleBlock_t;
+
+typedef struct bvhRef_s
+{
+	vec3_t mins, maxs, center;
+	int triangleNum;
+}
+bvhRef_t;
+
 
 int noDrawContentFlags, noDrawSurfaceFlags, noDrawCompileFlags;
 
@@ -120,6 +185,12 @@ int headNodeNum = 0, skyboxNodeNum = 0, maxTraceDepth = 0, numTraceLeafNodes = 0
 int numTraceNodes = 0, maxTraceNodes = 0;
 traceNode_t                     *traceNodes = NULL;
 
+int numBVHNodes = 0, maxBVHNodes = 0, maxBVHDepth = 0;
+traceBVHNode_t                  *bvhNodes = NULL;
+
+int numTraceBlocks = 0;
+traceTriangleBlock_t            *traceBlocks = NULL;
+
 
 
 /* -------------------------------------------------------------------------------
@@ -197,6 +268,7 @@ static int AllocTraceNode( void ){
 	/* add the node */
 	memset( &traceNodes[ numTraceNodes ], 0, sizeof( traceNode_t ) );
 	traceNodes[ numTraceNodes ].type = TRACE_LEAF;
+	traceNodes[ numTraceNodes ].bvhNodeNum = -1;
 	ClearBounds( traceNodes[ numTraceNodes ].mins, traceNodes[ numTraceNodes ].maxs );
 
 	/* Sys_Printf("alloc node %d\n", numTraceNodes); */
@@ -883,6 +955,362 @@ static int TriangulateTraceNode_r( int nodeNum ){
 
 
 
+/* -------------------------------------------------------------------------------
+
+   bounding volume hierarchy setup
+
+   ------------------------------------------------------------------------------- */
+
+/*
+   AllocBVHNode()
+   allocates a new bvh node from the preallocated node block
+ */
+
+static int AllocBVHNode( void ){
+	/* the block is sized for the worst case up front, so node pointers stay valid */
+	if ( numBVHNodes >= maxBVHNodes ) {
+		Error( "MAX_BVH_NODES (%d) exceeded", maxBVHNodes );
+	}
+
+	memset( &bvhNodes[ numBVHNodes ], 0, sizeof( *bvhNodes ) );
+	ClearBounds( bvhNodes[ numBVHNodes ].mins, bvhNodes[ numBVHNodes ].maxs );
+	numBVHNodes++;
+	return ( numBVHNodes - 1 );
+}
+
+
+
+/*
+   BoundTraceTriangle()
+   bounds a triangle the way TraceTriangle() sees it (grown by the barycentric epsilon)
+ */
+
+static void BoundTraceTriangle( int num, bvhRef_t *ref ){
+	int i;
+	traceTriangle_t *tt;
+	vec3_t corner;
+	static const float bary[ 3 ][ 2 ] =
+	{
+		{ -BARY_EPSILON, -BARY_EPSILON },
+		{ 1.0f + 2.0f * BARY_EPSILON, -BARY_EPSILON },
+		{ -BARY_EPSILON, 1.0f + 2.0f * BARY_EPSILON }
+	};
+
+
+	tt = &traceTriangles[ num ];
+	ref->triangleNum = num;
+	ClearBounds( ref->mins, ref->maxs );
+	for ( i = 0; i < 3; i++ )
+	{
+		VectorMA( tt->v[ 0 ].xyz, bary[ i ][ 0 ], tt->edge1, corner );
+		VectorMA( corner, bary[ i ][ 1 ], tt->edge2, corner );
+		AddPointToBounds( corner, ref->mins, ref->maxs );
+	}
+	for ( i = 0; i < 3; i++ )
+	{
+		ref->mins[ i ] -= TRACE_ON_EPSILON;
+		ref->maxs[ i ] += TRACE_ON_EPSILON;
+		ref->center[ i ] = 0.5f * ( ref->mins[ i ] + ref->maxs[ i ] );
+	}
+}
+
+
+
+/*
+   BoundsArea()
+   returns the surface area of an axial bounding box
+ */
+
+static float BoundsArea( const vec3_t mins, const vec3_t maxs ){
+	vec3_t size;
+
+
+	VectorSubtract( maxs, mins, size );
+	if ( size[ 0 ] < 0.0f || size[ 1 ] < 0.0f || size[ 2 ] < 0.0f ) {
+		return 0.0f;
+	}
+	return 2.0f * ( size[ 0 ] * size[ 1 ] + size[ 1 ] * size[ 2 ] + size[ 2 ] * size[ 0 ] );
+}
+
+
+
+/*
+   BuildBVHNode_r()
+   recursively splits a triangle reference list using the binned surface area heuristic,
+   storing the nodes depth first so the first child of a node is its neighbour in memory
+ */
+
+static int BuildBVHNode_r( bvhRef_t *refs, int first, int count, int depth ){
+	int i, j, nodeNum, axis, bin, split, bestAxis, bestSplit, mid, secondNum;
+	int binCounts[ BVH_NUM_BINS ], rightCounts[ BVH_NUM_BINS ], leftCount;
+	float scale, area, cost, bestCost, rightAreas[ BVH_NUM_BINS ];
+	vec3_t binMins[ BVH_NUM_BINS ], binMaxs[ BVH_NUM_BINS ];
+	vec3_t centerMins, centerMaxs, mins, maxs;
+	traceBVHNode_t  *node;
+	bvhRef_t temp;
+
+
+	/* allocate the node and bound its triangles */
+	nodeNum = AllocBVHNode();
+	node = &bvhNodes[ nodeNum ];
+	ClearBounds( centerMins, centerMaxs );
+	for ( i = first; i < first + count; i++ )
+	{
+		AddPointToBounds( refs[ i ].mins, node->mins, node->maxs );
+		AddPointToBounds( refs[ i ].maxs, node->mins, node->maxs );
+		AddPointToBounds( refs[ i ].center, centerMins, centerMaxs );
+	}
+
+	/* track depth */
+	if ( depth > maxBVHDepth ) {
+		maxBVHDepth = depth;
+	}
+
+	/* a leaf costs one test per triangle block, so only a cheaper split is worth it */
+	area = BoundsArea( node->mins, node->maxs );
+	bestCost = count > BVH_MAX_LEAF_TRIANGLES ? 1e30f : BVH_BLOCK_COST * BVH_LEAF_BLOCKS( count );
+	bestAxis = -1;
+	bestSplit = 0;
+
+	/* find the cheapest binned split on every axis */
+	for ( axis = 0; axis < 3 && depth < BVH_MAX_DEPTH && count > 1 && area > 0.0f; axis++ )
+	{
+		if ( centerMaxs[ axis ] - centerMins[ axis ] <= 0.0f ) {
+			continue;
+		}
+		scale = BVH_NUM_BINS / ( centerMaxs[ axis ] - centerMins[ axis ] );
+
+		/* bin the references by center */
+		for ( bin = 0; bin < BVH_NUM_BINS; bin++ )
+		{
+			binCounts[ bin ] = 0;
+			ClearBounds( binMins[ bin ], binMaxs[ bin ] );
+		}
+		for ( i = first; i < first + count; i++ )
+		{
+			bin = std::min( (int) ( ( refs[ i ].center[ axis ] - centerMins[ axis ] ) * scale ), BVH_NUM_BINS - 1 );
+			binCounts[ bin ]++;
+			AddPointToBounds( refs[ i ].mins, binMins[ bin ], binMaxs[ bin ] );
+			AddPointToBounds( refs[ i ].maxs, binMins[ bin ], binMaxs[ bin ] );
+		}
+
+		/* sweep from the right to get the area and count on the far side of every split */
+		ClearBounds( mins, maxs );
+		rightCounts[ 0 ] = 0;
+		for ( split = BVH_NUM_BINS - 1; split > 0; split-- )
+		{
+			AddPointToBounds( binMins[ split ], mins, maxs );
+			AddPointToBounds( binMaxs[ split ], mins, maxs );
+			rightCounts[ split ] = binCounts[ split ] + ( split < BVH_NUM_BINS - 1 ? rightCounts[ split + 1 ] : 0 );
+			rightAreas[ split ] = BoundsArea( mins, maxs );
+		}
+
+		/* sweep from the left and cost each split */
+		ClearBounds( mins, maxs );
+		leftCount = 0;
+		for ( split = 1; split < BVH_NUM_BINS; split++ )
+		{
+			AddPointToBounds( binMins[ split - 1 ], mins, maxs );
+			AddPointToBounds( binMaxs[ split - 1 ], mins, maxs );
+			leftCount += binCounts[ split - 1 ];
+			if ( leftCount == 0 || rightCounts[ split ] == 0 ) {
+				continue;
+			}
+			cost = BVH_TRAVERSAL_COST + BVH_BLOCK_COST *
+				   ( BoundsArea( mins, maxs ) * BVH_LEAF_BLOCKS( leftCount ) + rightAreas[ split ] * BVH_LEAF_BLOCKS( rightCounts[ split ] ) ) / area;
+			if ( cost < bestCost ) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	/* partition the references around the best split */
+	if ( bestAxis >= 0 ) {
+		scale = BVH_NUM_BINS / ( centerMaxs[ bestAxis ] - centerMins[ bestAxis ] );
+		i = first;
+		j = first + count - 1;
+		while ( i <= j )
+		{
+			bin = std::min( (int) ( ( refs[ i ].center[ bestAxis ] - centerMins[ bestAxis ] ) * scale ), BVH_NUM_BINS - 1 );
+			if ( bin < bestSplit ) {
+				i++;
+			}
+			else
+			{
+				temp = refs[ i ];
+				refs[ i ] = refs[ j ];
+				refs[ j ] = temp;
+				j--;
+			}
+		}
+		mid = i;
+	}
+
+	/* too many coincident triangles to bin, split them in half */
+	else if ( count > BVH_MAX_LEAF_TRIANGLES && depth < BVH_MAX_DEPTH ) {
+		mid = first + count / 2;
+	}
+
+	/* make a leaf */
+	else
+	{
+		node->offset = first;
+		node->numTriangles = count;
+		return nodeNum;
+	}
+
+	/* build children, the first one lands at nodeNum + 1 */
+	BuildBVHNode_r( refs, first, mid - first, depth + 1 );
+	secondNum = BuildBVHNode_r( refs, mid, first + count - mid, depth + 1 );
+	bvhNodes[ nodeNum ].offset = secondNum;
+	return nodeNum;
+}
+
+
+
+/*
+   FiltersLight()
+   qtrue if light passing a surface depends on its texture (alphashadow/lightfilter with an image)
+ */
+
+static inline qboolean FiltersLight( const shaderInfo_t *si ){
+	return ( si->compileFlags & ( C_ALPHASHADOW | C_LIGHTFILTER ) ) && si->lightImage != NULL && si->lightImage->pixels != NULL ? qtrue : qfalse;
+}
+
+
+
+/*
+   SetupTriangleBlock()
+   packs the triangles of a bvh leaf into lanes, with their shadow group and surface flags as lane masks
+ */
+
+static void SetupTriangleBlock( traceTriangleBlock_t *tb, int firstTriangle, int numTriangles ){
+	int i, j, bit;
+	traceTriangle_t *tt;
+	traceInfo_t     *ti;
+	shaderInfo_t    *si;
+
+
+	/* unused lanes are zero sized and never pass the determinant test */
+	memset( tb, 0, sizeof( *tb ) );
+	tb->firstTriangle = firstTriangle;
+	tb->numTriangles = numTriangles;
+
+	for ( i = 0; i < numTriangles; i++ )
+	{
+		tt = &traceTriangles[ firstTriangle + i ];
+		ti = &traceInfos[ tt->infoNum ];
+		si = ti->si;
+		bit = 1 << i;
+
+		for ( j = 0; j < 3; j++ )
+		{
+			tb->v0[ j ][ i ] = tt->v[ 0 ].xyz[ j ];
+			tb->edge1[ j ][ i ] = tt->edge1[ j ];
+			tb->edge2[ j ][ i ] = tt->edge2[ j ];
+		}
+		tb->castShadows[ i ] = ti->castShadows;
+
+		if ( ti->castShadows == 1 ) {
+			tb->worldMask |= bit;
+		}
+		if ( si->compileFlags & C_SKY ) {
+			tb->skyMask |= bit;
+		}
+		if ( ti->skipGrid ) {
+			tb->skipGridMask |= bit;
+		}
+		if ( FiltersLight( si ) ) {
+			tb->filterMask |= bit;
+		}
+	}
+}
+
+
+
+/*
+   SetupTraceBVH()
+   replaces the triangle list of every trace leaf with a bvh, storing the
+   triangles of each leaf contiguously in bvh leaf order
+ */
+
+static void SetupTraceBVH( void ){
+	int i, j, numTriangles;
+	traceNode_t     *node;
+	bvhRef_t        *refs;
+	traceTriangle_t *triangles;
+	void            *block;
+
+
+	/* a tree with non-empty leaves never needs more than 2n - 1 nodes */
+	maxBVHNodes = std::max( 2 * numTraceTriangles, 1 );
+	block = safe_malloc( maxBVHNodes * sizeof( *bvhNodes ) + BVH_NODE_ALIGN );
+	bvhNodes = reinterpret_cast<traceBVHNode_t*>( ( reinterpret_cast<size_t>( block ) + BVH_NODE_ALIGN - 1 ) & ~( (size_t) BVH_NODE_ALIGN - 1 ) );
+	numBVHNodes = 0;
+
+	refs = static_cast<bvhRef_t*>( safe_malloc( std::max( numTraceTriangles, 1 ) * sizeof( *refs ) ) );
+	triangles = static_cast<traceTriangle_t*>( safe_malloc( std::max( numTraceTriangles, 1 ) * sizeof( *triangles ) ) );
+	numTriangles = 0;
+
+	/* walk the leaves */
+	for ( i = 0; i < numTraceNodes; i++ )
+	{
+		node = &traceNodes[ i ];
+		if ( node->type >= 0 || node->numItems <= 0 ) {
+			continue;
+		}
+
+		/* build the leaf hierarchy over this leaf's part of the reference list */
+		for ( j = 0; j < node->numItems; j++ )
+			BoundTraceTriangle( node->items[ j ], &refs[ numTriangles + j ] );
+		node->bvhNodeNum = BuildBVHNode_r( refs, numTriangles, node->numItems, 0 );
+
+		/* store triangles in bvh leaf order */
+		for ( j = numTriangles; j < numTriangles + node->numItems; j++ )
+			triangles[ j ] = traceTriangles[ refs[ j ].triangleNum ];
+		numTriangles += node->numItems;
+
+		/* the item list is no longer needed, numItems stays for testAll */
+		free( node->items );
+		node->items = NULL;
+		node->maxItems = 0;
+	}
+
+	/* swap in the reordered triangles */
+	free( refs );
+	free( traceTriangles );
+	traceTriangles = triangles;
+	numTraceTriangles = maxTraceTriangles = numTriangles;
+
+	/* repack every bvh leaf into a triangle block */
+	numTraceBlocks = 0;
+	for ( i = 0; i < numBVHNodes; i++ )
+	{
+		if ( bvhNodes[ i ].numTriangles > 0 ) {
+			numTraceBlocks++;
+		}
+	}
+	block = safe_malloc( std::max( numTraceBlocks, 1 ) * sizeof( *traceBlocks ) + BVH_NODE_ALIGN );
+	traceBlocks = reinterpret_cast<traceTriangleBlock_t*>( ( reinterpret_cast<size_t>( block ) + BVH_NODE_ALIGN - 1 ) & ~( (size_t) BVH_NODE_ALIGN - 1 ) );
+	numTraceBlocks = 0;
+	for ( i = 0; i < numBVHNodes; i++ )
+	{
+		if ( bvhNodes[ i ].numTriangles > 0 ) {
+			SetupTriangleBlock( &traceBlocks[ numTraceBlocks ], bvhNodes[ i ].offset, bvhNodes[ i ].numTriangles );
+			bvhNodes[ i ].offset = numTraceBlocks++;
+		}
+	}
+
+	/* emit some stats */
+	Sys_FPrintf( SYS_VRB, "%9d bvh nodes (%.2fMB)\n", numBVHNodes, (float) ( numBVHNodes * sizeof( *bvhNodes ) ) / ( 1024.0f * 1024.0f ) );
+	Sys_FPrintf( SYS_VRB, "%9d max bvh depth\n", maxBVHDepth );
+	Sys_FPrintf( SYS_VRB, "%9d %d-wide triangle blocks (%.2fMB)\n", numTraceBlocks, TRACE_BLOCK_LANES, (float) ( numTraceBlocks * sizeof( *traceBlocks ) ) / ( 1024.0f * 1024.0f ) );
+}
+
+
+
 /* -------------------------------------------------------------------------------
 
    shadow casting item setup (triangles, patches, entities)
@@ -1320,8 +1748,8 @@ void SetupTraceNodes( void ){
 	/* populate the tree with triangles from the world and shadow casting entities */
 	PopulateTraceNodes();
 
-	/* create the raytracing bsp */
-	if ( loMem == qfalse ) {
+	/* create the raytracing bsp (the bvh does its own subdivision without clipping triangles) */
+	if ( loMem == qfalse && oldTraceTree ) {
 		SubdivideTraceNode_r( headNodeNum, 0 );
 		SubdivideTraceNode_r( skyboxNodeNum, 0 );
 	}
@@ -1340,6 +1768,11 @@ void SetupTraceNodes( void ){
 	Sys_FPrintf( SYS_VRB, "%9d average windings per leaf node\n", numTraceWindings / ( numTraceLeafNodes + 1 ) );
 	Sys_FPrintf( SYS_VRB, "%9d max trace depth\n", maxTraceDepth );
 
+	/* replace the leaf triangle lists with a bvh */
+	if ( !oldTraceTree ) {
+		SetupTraceBVH();
+	}
+
 	/* free trace windings */
 	free( traceWindings );
 	numTraceWindings = 0;
@@ -1381,6 +1814,160 @@ void SetupTraceNodes( void ){
 }
 
 
+/*
+   SetupShadowGeometryHash()
+   sums the hashes of the trace triangles and solid leaves over a coarse grid of the world,
+   so ShadowGeometryHash() can tell in constant time whether anything in a box changed.
+   sums instead of xors, so an item in several cells of a box can't cancel itself out
+ */
+
+#define GEOMETRY_HASH_CELLS     64
+#define GEOMETRY_HASH_MIN_CELL  64.0f
+
+static int geometryHashCells[ 3 ];
+static vec3_t geometryHashOrigin, geometryHashCellSize;
+static std::vector<uint64_t> geometryHashSums;
+
+static int GeometryHashCell( float value, int axis ){
+	int cell;
+
+
+	cell = (int) floor( ( value - geometryHashOrigin[ axis ] ) / geometryHashCellSize[ axis ] );
+	return std::min( std::max( cell, 0 ), geometryHashCells[ axis ] - 1 );
+}
+
+static size_t GeometryHashIndex( int x, int y, int z ){
+	return ( (size_t) z * ( geometryHashCells[ 1 ] + 1 ) + y ) * ( geometryHashCells[ 0 ] + 1 ) + x;
+}
+
+static void AddGeometryHash( const vec3_t mins, const vec3_t maxs, uint64_t hash ){
+	int i, lo[ 3 ], hi[ 3 ], corner;
+
+
+	/* mark the corners of the cell range, the prefix sums spread it over the range */
+	for ( i = 0; i < 3; i++ )
+	{
+		lo[ i ] = GeometryHashCell( mins[ i ], i );
+		hi[ i ] = GeometryHashCell( maxs[ i ], i ) + 1;
+	}
+	for ( corner = 0; corner < 8; corner++ )
+	{
+		geometryHashSums[ GeometryHashIndex( ( corner & 1 ) ? hi[ 0 ] : lo[ 0 ], ( corner & 2 ) ? hi[ 1 ] : lo[ 1 ], ( corner & 4 ) ? hi[ 2 ] : lo[ 2 ] ) ] +=
+			( ( ( corner & 1 ) + ( ( corner >> 1 ) & 1 ) + ( ( corner >> 2 ) & 1 ) ) & 1 ) ? 0 - hash : hash;
+	}
+}
+
+static void PrefixSumGeometryHash( void ){
+	int x, y, z;
+	int sx = geometryHashCells[ 0 ] + 1, sy = geometryHashCells[ 1 ] + 1, sz = geometryHashCells[ 2 ] + 1;
+
+
+	for ( z = 0; z < sz; z++ )
+		for ( y = 0; y < sy; y++ )
+			for ( x = 1; x < sx; x++ )
+				geometryHashSums[ GeometryHashIndex( x, y, z ) ] += geometryHashSums[ GeometryHashIndex( x - 1, y, z ) ];
+	for ( z = 0; z < sz; z++ )
+		for ( y = 1; y < sy; y++ )
+			for ( x = 0; x < sx; x++ )
+				geometryHashSums[ GeometryHashIndex( x, y, z ) ] += geometryHashSums[ GeometryHashIndex( x, y - 1, z ) ];
+	for ( z = 1; z < sz; z++ )
+		for ( y = 0; y < sy; y++ )
+			for ( x = 0; x < sx; x++ )
+				geometryHashSums[ GeometryHashIndex( x, y, z ) ] += geometryHashSums[ GeometryHashIndex( x, y, z - 1 ) ];
+}
+
+void SetupShadowGeometryHash( void ){
+	int i, j, x, y, z;
+	vec3_t mins, maxs, size;
+	traceTriangle_t     *tt;
+	traceInfo_t         *ti;
+	bspLeaf_t           *leaf;
+	uint64_t hash;
+	std::vector<uint64_t> cells;
+
+
+	/* size the grid to the world */
+	VectorSubtract( bspModels[ 0 ].maxs, bspModels[ 0 ].mins, size );
+	for ( i = 0; i < 3; i++ )
+	{
+		geometryHashCells[ i ] = std::max( std::min( (int) ceil( size[ i ] / GEOMETRY_HASH_MIN_CELL ), GEOMETRY_HASH_CELLS ), 1 );
+		geometryHashCellSize[ i ] = std::max( size[ i ] / geometryHashCells[ i ], GEOMETRY_HASH_MIN_CELL );
+		geometryHashOrigin[ i ] = bspModels[ 0 ].mins[ i ];
+	}
+	geometryHashSums.assign( (size_t) ( geometryHashCells[ 0 ] + 1 ) * ( geometryHashCells[ 1 ] + 1 ) * ( geometryHashCells[ 2 ] + 1 ), 0 );
+
+	/* shadow casting triangles */
+	for ( i = 0; i < numTraceTriangles; i++ )
+	{
+		tt = &traceTriangles[ i ];
+		ti = &traceInfos[ tt->infoNum ];
+		hash = HashBytes( HASH_INIT, ti->si->shader, strlen( ti->si->shader ) + 1 );
+		hash = HashBytes( hash, &ti->castShadows, sizeof( ti->castShadows ) );
+		hash = HashBytes( hash, &ti->skipGrid, sizeof( ti->skipGrid ) );
+		ClearBounds( mins, maxs );
+		for ( j = 0; j < 3; j++ )
+		{
+			hash = HashBytes( hash, &tt->v[ j ], sizeof( tt->v[ j ] ) );
+			AddPointToBounds( tt->v[ j ].xyz, mins, maxs );
+		}
+		AddGeometryHash( mins, maxs, hash );
+	}
+
+	/* solid leaves, luxels and grid points are nudged out of them */
+	for ( i = 0; i < numBSPLeafs; i++ )
+	{
+		leaf = &bspLeafs[ i ];
+		if ( leaf->cluster != -1 ) {
+			continue;
+		}
+		hash = HashBytes( HASH_INIT, leaf->mins, sizeof( leaf->mins ) );
+		hash = HashBytes( hash, leaf->maxs, sizeof( leaf->maxs ) );
+		VectorCopy( leaf->mins, mins );
+		VectorCopy( leaf->maxs, maxs );
+		AddGeometryHash( mins, maxs, hash );
+	}
+
+	/* the first pass gives the sum of every cell, the second the sum of every box from the origin */
+	PrefixSumGeometryHash();
+	cells.assign( geometryHashSums.size(), 0 );
+	for ( z = 0; z < geometryHashCells[ 2 ]; z++ )
+		for ( y = 0; y < geometryHashCells[ 1 ]; y++ )
+			for ( x = 0; x < geometryHashCells[ 0 ]; x++ )
+				cells[ GeometryHashIndex( x + 1, y + 1, z + 1 ) ] = geometryHashSums[ GeometryHashIndex( x, y, z ) ];
+	geometryHashSums.swap( cells );
+	PrefixSumGeometryHash();
+}
+
+
+
+/*
+   ShadowGeometryHash()
+   the sum of the hashes of the geometry in the cells a box touches
+ */
+
+uint64_t ShadowGeometryHash( const vec3_t mins, const vec3_t maxs ){
+	int i, lo[ 3 ], hi[ 3 ], corner;
+	uint64_t hash, sum;
+
+
+	for ( i = 0; i < 3; i++ )
+	{
+		lo[ i ] = GeometryHashCell( mins[ i ], i );
+		hi[ i ] = GeometryHashCell( maxs[ i ], i ) + 1;
+	}
+	hash = 0;
+	for ( corner = 0; corner < 8; corner++ )
+	{
+		sum = geometryHashSums[ GeometryHashIndex( ( corner & 1 ) ? hi[ 0 ] : lo[ 0 ], ( corner & 2 ) ? hi[ 1 ] : lo[ 1 ], ( corner & 4 ) ? hi[ 2 ] : lo[ 2 ] ) ];
+		hash += ( ( ( corner & 1 ) + ( ( corner >> 1 ) & 1 ) + ( ( corner >> 2 ) & 1 ) ) & 1 ) ? sum : 0 - sum;
+	}
+
+	/* the sum of a box that lost or gained nothing is unchanged */
+	return hash;
+}
+
+
+
 
 /* -------------------------------------------------------------------------------
 
@@ -1394,7 +1981,6 @@ void SetupTraceNodes( void ){
    based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
  */
 
-#define BARY_EPSILON            0.01f
 #define ASLF_EPSILON            0.0001f /* so to not get double shadows */
 #define COPLANAR_EPSILON        0.25f   //%	0.000001f
 #define NEAR_SHADOW_EPSILON     1.5f    //%	1.25f
@@ -1578,40 +2164,297 @@ qboolean TraceTriangle( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace ){
 
 
 /*
-   TraceWinding() - ydnar
-   temporary hack
+   IntersectTriangleBlock()
+   moller-trumbore against every lane of a triangle block at once, with the same
+   bounds as TraceTriangle(); returns the mask of lanes hit and their depths
  */
 
-qboolean TraceWinding( traceWinding_t *tw, trace_t *trace ){
-	int i;
-	traceTriangle_t tt;
-
+#if defined( TRACE_SIMD_AVX512 ) || defined( TRACE_SIMD_AVX2 )
+	typedef __m256 traceLane_t;
+	#define LaneSet( f )            _mm256_set1_ps( f )
+	#define LaneLoad( p )           _mm256_load_ps( p )
+	#define LaneStore( p, a )       _mm256_storeu_ps( p, a )
+	#define LaneAdd( a, b )         _mm256_add_ps( a, b )
+	#define LaneSub( a, b )         _mm256_sub_ps( a, b )
+	#define LaneMul( a, b )         _mm256_mul_ps( a, b )
+	#define LaneDiv( a, b )         _mm256_div_ps( a, b )
+	#define LaneAbs( a )            _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), a )
+	#define LaneMin( a, b )         _mm256_min_ps( a, b )
+	#define LaneMax( a, b )         _mm256_max_ps( a, b )
+	#if defined( TRACE_SIMD_AVX512 )
+		/* avx-512 compares straight into mask registers */
+		#define LaneGE( a, b )      ( (int) _mm256_cmp_ps_mask( a, b, _CMP_GE_OQ ) )
+		#define LaneLE( a, b )      ( (int) _mm256_cmp_ps_mask( a, b, _CMP_LE_OQ ) )
+		#define LaneGT( a, b )      ( (int) _mm256_cmp_ps_mask( a, b, _CMP_GT_OQ ) )
+		#define LaneLT( a, b )      ( (int) _mm256_cmp_ps_mask( a, b, _CMP_LT_OQ ) )
+	#else
+		#define LaneGE( a, b )      _mm256_movemask_ps( _mm256_cmp_ps( a, b, _CMP_GE_OQ ) )
+		#define LaneLE( a, b )      _mm256_movemask_ps( _mm256_cmp_ps( a, b, _CMP_LE_OQ ) )
+		#define LaneGT( a, b )      _mm256_movemask_ps( _mm256_cmp_ps( a, b, _CMP_GT_OQ ) )
+		#define LaneLT( a, b )      _mm256_movemask_ps( _mm256_cmp_ps( a, b, _CMP_LT_OQ ) )
+	#endif
+#elif defined( TRACE_SIMD_SSE )
+	typedef __m128 traceLane_t;
+	#define LaneSet( f )            _mm_set1_ps( f )
+	#define LaneLoad( p )           _mm_load_ps( p )
+	#define LaneStore( p, a )       _mm_storeu_ps( p, a )
+	#define LaneAdd( a, b )         _mm_add_ps( a, b )
+	#define LaneSub( a, b )         _mm_sub_ps( a, b )
+	#define LaneMul( a, b )         _mm_mul_ps( a, b )
+	#define LaneDiv( a, b )         _mm_div_ps( a, b )
+	#define LaneAbs( a )            _mm_andnot_ps( _mm_set1_ps( -0.0f ), a )
+	#define LaneMin( a, b )         _mm_min_ps( a, b )
+	#define LaneMax( a, b )         _mm_max_ps( a, b )
+	#define LaneGE( a, b )          _mm_movemask_ps( _mm_cmpge_ps( a, b ) )
+	#define LaneLE( a, b )          _mm_movemask_ps( _mm_cmple_ps( a, b ) )
+	#define LaneGT( a, b )          _mm_movemask_ps( _mm_cmpgt_ps( a, b ) )
+	#define LaneLT( a, b )          _mm_movemask_ps( _mm_cmplt_ps( a, b ) )
+#endif
+
+#if defined( TRACE_SIMD_AVX512 ) || defined( TRACE_SIMD_AVX2 ) || defined( TRACE_SIMD_SSE )
+
+static inline int IntersectTriangleBlock( const traceTriangleBlock_t *tb, const trace_t *trace, float *depths ){
+	traceLane_t dir[ 3 ], tvec[ 3 ], pvec[ 3 ], qvec[ 3 ], edge1[ 3 ], edge2[ 3 ];
+	traceLane_t det, invDet, u, v, depth;
+	int mask;
+
+
+	/* load edges */
+	edge1[ 0 ] = LaneLoad( tb->edge1[ 0 ] );
+	edge1[ 1 ] = LaneLoad( tb->edge1[ 1 ] );
+	edge1[ 2 ] = LaneLoad( tb->edge1[ 2 ] );
+	edge2[ 0 ] = LaneLoad( tb->edge2[ 0 ] );
+	edge2[ 1 ] = LaneLoad( tb->edge2[ 1 ] );
+	edge2[ 2 ] = LaneLoad( tb->edge2[ 2 ] );
 
-	/* initial setup */
-	tt.infoNum = tw->infoNum;
-	tt.v[ 0 ] = tw->v[ 0 ];
+	/* begin calculating determinant - also used to calculate u parameter */
+	dir[ 0 ] = LaneSet( trace->direction[ 0 ] );
+	dir[ 1 ] = LaneSet( trace->direction[ 1 ] );
+	dir[ 2 ] = LaneSet( trace->direction[ 2 ] );
+	pvec[ 0 ] = LaneSub( LaneMul( dir[ 1 ], edge2[ 2 ] ), LaneMul( dir[ 2 ], edge2[ 1 ] ) );
+	pvec[ 1 ] = LaneSub( LaneMul( dir[ 2 ], edge2[ 0 ] ), LaneMul( dir[ 0 ], edge2[ 2 ] ) );
+	pvec[ 2 ] = LaneSub( LaneMul( dir[ 0 ], edge2[ 1 ] ), LaneMul( dir[ 1 ], edge2[ 0 ] ) );
 
-	/* walk vertex list */
-	for ( i = 1; i + 1 < tw->numVerts; i++ )
-	{
-		/* set verts */
-		tt.v[ 1 ] = tw->v[ i ];
-		tt.v[ 2 ] = tw->v[ i + 1 ];
+	/* if determinant is near zero, trace lies in plane of triangle */
+	det = LaneAdd( LaneAdd( LaneMul( edge1[ 0 ], pvec[ 0 ] ), LaneMul( edge1[ 1 ], pvec[ 1 ] ) ), LaneMul( edge1[ 2 ], pvec[ 2 ] ) );
+	mask = LaneGE( LaneAbs( det ), LaneSet( COPLANAR_EPSILON ) );
+	if ( !mask ) {
+		return 0;
+	}
+	invDet = LaneDiv( LaneSet( 1.0f ), det );
 
-		/* find vectors for two edges sharing the first vert */
-		VectorSubtract( tt.v[ 1 ].xyz, tt.v[ 0 ].xyz, tt.edge1 );
-		VectorSubtract( tt.v[ 2 ].xyz, tt.v[ 0 ].xyz, tt.edge2 );
+	/* calculate distance from first vertex to ray origin */
+	tvec[ 0 ] = LaneSub( LaneSet( trace->origin[ 0 ] ), LaneLoad( tb->v0[ 0 ] ) );
+	tvec[ 1 ] = LaneSub( LaneSet( trace->origin[ 1 ] ), LaneLoad( tb->v0[ 1 ] ) );
+	tvec[ 2 ] = LaneSub( LaneSet( trace->origin[ 2 ] ), LaneLoad( tb->v0[ 2 ] ) );
 
-		/* trace it */
-		if ( TraceTriangle( &traceInfos[ tt.infoNum ], &tt, trace ) ) {
-			return qtrue;
-		}
+	/* calculate u parameter and test bounds */
+	u = LaneMul( LaneAdd( LaneAdd( LaneMul( tvec[ 0 ], pvec[ 0 ] ), LaneMul( tvec[ 1 ], pvec[ 1 ] ) ), LaneMul( tvec[ 2 ], pvec[ 2 ] ) ), invDet );
+	mask &= LaneGE( u, LaneSet( -BARY_EPSILON ) ) & LaneLE( u, LaneSet( 1.0f + BARY_EPSILON ) );
+	if ( !mask ) {
+		return 0;
 	}
 
-	/* done */
-	return qfalse;
-}
-
+	/* prepare to test v parameter */
+	qvec[ 0 ] = LaneSub( LaneMul( tvec[ 1 ], edge1[ 2 ] ), LaneMul( tvec[ 2 ], edge1[ 1 ] ) );
+	qvec[ 1 ] = LaneSub( LaneMul( tvec[ 2 ], edge1[ 0 ] ), LaneMul( tvec[ 0 ], edge1[ 2 ] ) );
+	qvec[ 2 ] = LaneSub( LaneMul( tvec[ 0 ], edge1[ 1 ] ), LaneMul( tvec[ 1 ], edge1[ 0 ] ) );
+
+	/* calculate v parameter and test bounds */
+	v = LaneMul( LaneAdd( LaneAdd( LaneMul( dir[ 0 ], qvec[ 0 ] ), LaneMul( dir[ 1 ], qvec[ 1 ] ) ), LaneMul( dir[ 2 ], qvec[ 2 ] ) ), invDet );
+	mask &= LaneGE( v, LaneSet( -BARY_EPSILON ) ) & LaneLE( LaneAdd( u, v ), LaneSet( 1.0f + BARY_EPSILON ) );
+	if ( !mask ) {
+		return 0;
+	}
+
+	/* calculate t (depth) */
+	depth = LaneMul( LaneAdd( LaneAdd( LaneMul( edge2[ 0 ], qvec[ 0 ] ), LaneMul( edge2[ 1 ], qvec[ 1 ] ) ), LaneMul( edge2[ 2 ], qvec[ 2 ] ) ), invDet );
+	mask &= LaneGT( depth, LaneSet( trace->inhibitRadius ) ) & LaneLT( depth, LaneSet( trace->distance ) );
+	LaneStore( depths, depth );
+	return mask;
+}
+
+#else
+
+static inline int IntersectTriangleBlock( const traceTriangleBlock_t *tb, const trace_t *trace, float *depths ){
+	int i, j, mask;
+	float tvec[ 3 ], pvec[ 3 ], qvec[ 3 ], edge1[ 3 ], edge2[ 3 ];
+	float det, invDet, u, v;
+
+
+	/* plain lane loop for targets without vector units */
+	mask = 0;
+	for ( i = 0; i < tb->numTriangles; i++ )
+	{
+		for ( j = 0; j < 3; j++ )
+		{
+			edge1[ j ] = tb->edge1[ j ][ i ];
+			edge2[ j ] = tb->edge2[ j ][ i ];
+			tvec[ j ] = trace->origin[ j ] - tb->v0[ j ][ i ];
+		}
+		CrossProduct( trace->direction, edge2, pvec );
+		det = DotProduct( edge1, pvec );
+		if ( fabs( det ) < COPLANAR_EPSILON ) {
+			continue;
+		}
+		invDet = 1.0f / det;
+		u = DotProduct( tvec, pvec ) * invDet;
+		if ( u < -BARY_EPSILON || u > ( 1.0f + BARY_EPSILON ) ) {
+			continue;
+		}
+		CrossProduct( tvec, edge1, qvec );
+		v = DotProduct( trace->direction, qvec ) * invDet;
+		if ( v < -BARY_EPSILON || ( u + v ) > ( 1.0f + BARY_EPSILON ) ) {
+			continue;
+		}
+		depths[ i ] = DotProduct( edge2, qvec ) * invDet;
+		if ( depths[ i ] <= trace->inhibitRadius || depths[ i ] >= trace->distance ) {
+			continue;
+		}
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+#endif
+
+
+
+/*
+   TraceTriangleBlock()
+   tests a bvh leaf's triangle block, finishing the lanes hit in triangle order like TraceTriangle();
+   alphashadow and lightfilter lanes go through TraceTriangle() for their texel lookups
+ */
+
+static qboolean TraceTriangleBlock( const traceTriangleBlock_t *tb, trace_t *trace ){
+	int i, j, mask, hits;
+	float depths[ TRACE_BLOCK_LANES ];
+	traceTriangle_t *tt;
+	traceInfo_t     *ti;
+	shaderInfo_t    *si;
+
+
+	/* filter lanes by shadow group and flags */
+	mask = ( 1 << tb->numTriangles ) - 1;
+	if ( trace->compileFlags & C_SKY ) {
+		mask &= ~tb->skyMask;
+	}
+	if ( inGrid ) {
+		mask &= ~tb->skipGridMask;
+	}
+	if ( trace->recvShadows == 1 ) {
+		/* receive shadows from worldspawn group only */
+		mask &= tb->worldMask;
+	}
+	else if ( ( mask & ~tb->worldMask ) || trace->recvShadows < 0 ) {
+		/* receive shadows from same group (and worldspawn group if > 1) */
+		for ( i = 0; i < tb->numTriangles; i++ )
+		{
+			if ( abs( tb->castShadows[ i ] ) != abs( trace->recvShadows ) &&
+				 ( trace->recvShadows < 0 || tb->castShadows[ i ] != 1 ) ) {
+				mask &= ~( 1 << i );
+			}
+		}
+	}
+	if ( !mask ) {
+		return qfalse;
+	}
+
+	/* intersect */
+	hits = IntersectTriangleBlock( tb, trace, depths ) & mask;
+
+	/* finish hits in triangle order */
+	for ( i = 0; hits; i++, hits >>= 1 )
+	{
+		if ( !( hits & 1 ) ) {
+			continue;
+		}
+		tt = &traceTriangles[ tb->firstTriangle + i ];
+		ti = &traceInfos[ tt->infoNum ];
+		si = ti->si;
+
+		/* texture dependent shadows */
+		if ( tb->filterMask & ( 1 << i ) ) {
+			if ( TraceTriangle( ti, tt, trace ) ) {
+				return qtrue;
+			}
+			continue;
+		}
+
+		/* an earlier lane may have hit sky: don't double-trace against it */
+		if ( trace->compileFlags & si->compileFlags & C_SKY ) {
+			continue;
+		}
+
+		/* if hitpoint is really close to trace origin (sample point), then check for self-shadowing */
+		if ( depths[ i ] <= SELF_SHADOW_EPSILON ) {
+			for ( j = 0; j < trace->numSurfaces; j++ )
+			{
+				if ( ti->surfaceNum == trace->surfaces[ j ] ) {
+					break;
+				}
+			}
+			if ( j < trace->numSurfaces ) {
+				continue;
+			}
+		}
+
+		/* stack compile flags */
+		trace->compileFlags |= si->compileFlags;
+
+		/* don't trace against sky */
+		if ( si->compileFlags & C_SKY ) {
+			continue;
+		}
+
+		/* opaque */
+		VectorMA( trace->origin, depths[ i ], trace->direction, trace->hit );
+		VectorClear( trace->color );
+		trace->opaque = qtrue;
+		trace->occluder = tb->firstTriangle + i;
+		return qtrue;
+	}
+
+	return qfalse;
+}
+
+
+
+/*
+   TraceWinding() - ydnar
+   temporary hack
+ */
+
+qboolean TraceWinding( traceWinding_t *tw, trace_t *trace ){
+	int i;
+	traceTriangle_t tt;
+
+
+	/* initial setup */
+	tt.infoNum = tw->infoNum;
+	tt.v[ 0 ] = tw->v[ 0 ];
+
+	/* walk vertex list */
+	for ( i = 1; i + 1 < tw->numVerts; i++ )
+	{
+		/* set verts */
+		tt.v[ 1 ] = tw->v[ i ];
+		tt.v[ 2 ] = tw->v[ i + 1 ];
+
+		/* find vectors for two edges sharing the first vert */
+		VectorSubtract( tt.v[ 1 ].xyz, tt.v[ 0 ].xyz, tt.edge1 );
+		VectorSubtract( tt.v[ 2 ].xyz, tt.v[ 0 ].xyz, tt.edge2 );
+
+		/* trace it */
+		if ( TraceTriangle( &traceInfos[ tt.infoNum ], &tt, trace ) ) {
+			return qtrue;
+		}
+	}
+
+	/* done */
+	return qfalse;
+}
+
 
 
 
@@ -1720,38 +2563,133 @@ static qboolean TraceLine_r( int nodeNum, vec3_t origin, vec3_t end, trace_t *tr
 
 
 /*
-   TraceLine() - ydnar
-   rewrote this function a bit :)
+   TraceBVHBounds()
+   clips the trace to a bvh node's bounds, returning the entry distance
  */
 
-void TraceLine( trace_t *trace ){
-	int i, j;
-	traceNode_t     *node;
-	traceTriangle_t *tt;
-	traceInfo_t     *ti;
+static inline qboolean TraceBVHBounds( const traceBVHNode_t *node, const vec3_t origin, const vec3_t invDirection, float distance, float *entry ){
+	int i;
+	float near, far, t0, t1;
+
+
+	near = 0.0f;
+	far = distance;
+	for ( i = 0; i < 3; i++ )
+	{
+		t0 = ( node->mins[ i ] - origin[ i ] ) * invDirection[ i ];
+		t1 = ( node->maxs[ i ] - origin[ i ] ) * invDirection[ i ];
+		near = std::max( near, std::min( t0, t1 ) );
+		far = std::min( far, std::max( t0, t1 ) );
+	}
+	*entry = near;
+	return near <= far ? qtrue : qfalse;
+}
+
+
+
+/*
+   TraceBVH()
+   tests the triangles of a leaf bvh front to back,
+   returns qtrue at the first opaque hit
+ */
+
+static qboolean TraceBVH( int nodeNum, trace_t *trace ){
+	int i, numStack, stack[ BVH_MAX_DEPTH + 1 ], children[ 2 ];
+	qboolean hit0, hit1;
+	float entry[ 2 ];
+	vec3_t invDirection;
+	traceBVHNode_t  *node;
+
+
+	/* setup slab test */
+	for ( i = 0; i < 3; i++ )
+		invDirection[ i ] = fabs( trace->direction[ i ] ) > 1e-12f ? 1.0f / trace->direction[ i ] : 1e30f;
 
+	/* check root */
+	if ( !TraceBVHBounds( &bvhNodes[ nodeNum ], trace->origin, invDirection, trace->distance, &entry[ 0 ] ) ) {
+		return qfalse;
+	}
+
+	/* walk the tree */
+	numStack = 0;
+	while ( 1 )
+	{
+		node = &bvhNodes[ nodeNum ];
 
+		/* leaf? */
+		if ( node->numTriangles > 0 ) {
+			if ( TraceTriangleBlock( &traceBlocks[ node->offset ], trace ) ) {
+				return qtrue;
+			}
+		}
+
+		/* descend into the nearer child, deferring the other */
+		else
+		{
+			children[ 0 ] = nodeNum + 1;
+			children[ 1 ] = node->offset;
+			hit0 = TraceBVHBounds( &bvhNodes[ children[ 0 ] ], trace->origin, invDirection, trace->distance, &entry[ 0 ] );
+			hit1 = TraceBVHBounds( &bvhNodes[ children[ 1 ] ], trace->origin, invDirection, trace->distance, &entry[ 1 ] );
+			if ( hit0 && hit1 ) {
+				i = entry[ 1 ] < entry[ 0 ] ? 1 : 0;
+				stack[ numStack++ ] = children[ !i ];
+				nodeNum = children[ i ];
+				continue;
+			}
+			if ( hit0 || hit1 ) {
+				nodeNum = children[ hit1 ];
+				continue;
+			}
+		}
+
+		/* pop */
+		if ( numStack == 0 ) {
+			return qfalse;
+		}
+		nodeNum = stack[ --numStack ];
+	}
+}
+
+
+
+/*
+   TraceLineStart()
+   sets up the trace output, returns qfalse if there is nothing to trace
+ */
+
+static qboolean TraceLineStart( trace_t *trace ){
 	/* setup output (note: this code assumes the input data is completely filled out) */
 	trace->passSolid = qfalse;
 	trace->opaque = qfalse;
 	trace->compileFlags = 0;
+	trace->occluder = -1;
 	trace->numTestNodes = 0;
 
 	/* early outs */
 	if ( !trace->recvShadows || !trace->testOcclusion || trace->distance <= 0.00001f ) {
-		return;
+		return qfalse;
 	}
 
-	/* trace through nodes */
-	TraceLine_r( headNodeNum, trace->origin, trace->end, trace );
+	return qtrue;
+}
+
+
+
+/*
+   TraceLineWalked()
+   called after the trace tree walk, returns qtrue if the collected leaves need to be tested
+ */
+
+static qboolean TraceLineWalked( trace_t *trace ){
+	/* solid */
 	if ( trace->passSolid && !trace->testAll ) {
 		trace->opaque = qtrue;
-		return;
+		return qfalse;
 	}
 
 	/* skip surfaces? */
 	if ( noSurfaces ) {
-		return;
+		return qfalse;
 	}
 
 	/* testall means trace through sky */
@@ -1762,22 +2700,673 @@ void TraceLine( trace_t *trace ){
 		TraceLine_r( skyboxNodeNum, trace->origin, trace->end, trace );
 	}
 
+	return qtrue;
+}
+
+
+
+/*
+   traceSegments_t
+   the segments of a packet of traces while they walk the trace tree,
+   laid out for classifying TRACE_BLOCK_LANES of them at once
+ */
+
+typedef struct
+{
+	alignas( BVH_NODE_ALIGN ) float origin[ 3 ][ MAX_TRACE_PACKET ];
+	alignas( BVH_NODE_ALIGN ) float end[ 3 ][ MAX_TRACE_PACKET ];
+}
+traceSegments_t;
+
+
+
+/*
+   ClassifyTraceSegments()
+   gets the plane distances of a packet's segment ends and the masks of
+   the segments entirely in front of and entirely behind a trace node
+ */
+
+static inline void ClassifyTraceSegments( const traceNode_t *node, const traceSegments_t *segs, float *front, float *back, int *frontRays, int *backRays ){
+	int i;
+
+
+	*frontRays = *backRays = 0;
+	for ( i = 0; i < MAX_TRACE_PACKET; i += TRACE_BLOCK_LANES )
+	{
+#if defined( TRACE_SIMD_AVX512 ) || defined( TRACE_SIMD_AVX2 ) || defined( TRACE_SIMD_SSE )
+		int inFront;
+		traceLane_t f, b, d;
+
+		d = LaneSet( node->plane[ 3 ] );
+		if ( node->type < 3 ) {
+			f = LaneSub( LaneLoad( &segs->origin[ node->type ][ i ] ), d );
+			b = LaneSub( LaneLoad( &segs->end[ node->type ][ i ] ), d );
+		}
+		else
+		{
+			f = LaneAdd( LaneAdd( LaneMul( LaneLoad( &segs->origin[ 0 ][ i ] ), LaneSet( node->plane[ 0 ] ) ),
+								  LaneMul( LaneLoad( &segs->origin[ 1 ][ i ] ), LaneSet( node->plane[ 1 ] ) ) ),
+						 LaneMul( LaneLoad( &segs->origin[ 2 ][ i ] ), LaneSet( node->plane[ 2 ] ) ) );
+			b = LaneAdd( LaneAdd( LaneMul( LaneLoad( &segs->end[ 0 ][ i ] ), LaneSet( node->plane[ 0 ] ) ),
+								  LaneMul( LaneLoad( &segs->end[ 1 ][ i ] ), LaneSet( node->plane[ 1 ] ) ) ),
+						 LaneMul( LaneLoad( &segs->end[ 2 ][ i ] ), LaneSet( node->plane[ 2 ] ) ) );
+			f = LaneSub( f, d );
+			b = LaneSub( b, d );
+		}
+		LaneStore( &front[ i ], f );
+		LaneStore( &back[ i ], b );
+		inFront = LaneGE( f, LaneSet( -TRACE_ON_EPSILON ) ) & LaneGE( b, LaneSet( -TRACE_ON_EPSILON ) );
+		*frontRays |= inFront << i;
+		*backRays |= ( LaneLT( f, LaneSet( TRACE_ON_EPSILON ) ) & LaneLT( b, LaneSet( TRACE_ON_EPSILON ) ) & ~inFront ) << i;
+#else
+		int j;
+
+		for ( j = i; j < i + TRACE_BLOCK_LANES; j++ )
+		{
+			if ( node->type < 3 ) {
+				front[ j ] = segs->origin[ node->type ][ j ] - node->plane[ 3 ];
+				back[ j ] = segs->end[ node->type ][ j ] - node->plane[ 3 ];
+			}
+			else
+			{
+				front[ j ] = segs->origin[ 0 ][ j ] * node->plane[ 0 ] + segs->origin[ 1 ][ j ] * node->plane[ 1 ] + segs->origin[ 2 ][ j ] * node->plane[ 2 ] - node->plane[ 3 ];
+				back[ j ] = segs->end[ 0 ][ j ] * node->plane[ 0 ] + segs->end[ 1 ][ j ] * node->plane[ 1 ] + segs->end[ 2 ][ j ] * node->plane[ 2 ] - node->plane[ 3 ];
+			}
+			if ( front[ j ] >= -TRACE_ON_EPSILON && back[ j ] >= -TRACE_ON_EPSILON ) {
+				*frontRays |= ( 1 << j );
+			}
+			else if ( front[ j ] < TRACE_ON_EPSILON && back[ j ] < TRACE_ON_EPSILON ) {
+				*backRays |= ( 1 << j );
+			}
+		}
+#endif
+	}
+}
+
+
+
+/*
+   TracePacket_r()
+   TraceLine_r() for a packet of traces: every trace walks the same nodes with the same
+   segments and in the same order as it would on its own, but traces going the same
+   way walk together; returns the mask of traces that ended in solid
+ */
+
+static int TracePacket_r( int nodeNum, trace_t **traces, const traceSegments_t *segs, int rays ){
+	int i, j, side, frontRays, backRays, splitRays[ 2 ], stopped;
+	alignas( BVH_NODE_ALIGN ) float front[ MAX_TRACE_PACKET ];
+	alignas( BVH_NODE_ALIGN ) float back[ MAX_TRACE_PACKET ];
+	float frac;
+	vec3_t origin, end;
+	traceSegments_t split;
+	traceNode_t     *node;
+
+
+	while ( 1 )
+	{
+		/* a lone trace walks on its own */
+		if ( ( rays & ( rays - 1 ) ) == 0 ) {
+			i = 0;
+			while ( !( rays & ( 1 << i ) ) )
+				i++;
+			for ( j = 0; j < 3; j++ )
+			{
+				origin[ j ] = segs->origin[ j ][ i ];
+				end[ j ] = segs->end[ j ][ i ];
+			}
+			return TraceLine_r( nodeNum, origin, end, traces[ i ] ) ? rays : 0;
+		}
+
+		/* bogus node number or solid leaf ends tracing */
+		if ( nodeNum < 0 || traceNodes[ nodeNum ].type == TRACE_LEAF_SOLID ) {
+			for ( i = 0; ( rays >> i ) != 0; i++ )
+			{
+				if ( rays & ( 1 << i ) ) {
+					for ( j = 0; j < 3; j++ )
+						traces[ i ]->hit[ j ] = segs->origin[ j ][ i ];
+					traces[ i ]->passSolid = qtrue;
+				}
+			}
+			return rays;
+		}
+
+		/* get node */
+		node = &traceNodes[ nodeNum ];
+
+		/* leafnode? */
+		if ( node->type < 0 ) {
+			if ( node->numItems > 0 ) {
+				for ( i = 0; ( rays >> i ) != 0; i++ )
+				{
+					if ( ( rays & ( 1 << i ) ) && traces[ i ]->numTestNodes < MAX_TRACE_TEST_NODES ) {
+						traces[ i ]->testNodes[ traces[ i ]->numTestNodes++ ] = nodeNum;
+					}
+				}
+			}
+			return 0;
+		}
+
+		/* ydnar 2003-09-07: don't test branches of the bsp with nothing in them when testall is enabled */
+		if ( node->numItems == 0 ) {
+			for ( i = 0; ( rays >> i ) != 0; i++ )
+			{
+				if ( ( rays & ( 1 << i ) ) && traces[ i ]->testAll ) {
+					rays &= ~( 1 << i );
+				}
+			}
+			if ( rays == 0 ) {
+				return 0;
+			}
+		}
+
+		/* classify beginning and end points, following the traces that all go the same way */
+		ClassifyTraceSegments( node, segs, front, back, &frontRays, &backRays );
+		if ( ( rays & frontRays ) == rays ) {
+			nodeNum = node->children[ 0 ];
+			continue;
+		}
+		if ( ( rays & backRays ) == rays ) {
+			nodeNum = node->children[ 1 ];
+			continue;
+		}
+		break;
+	}
+
+	/* split the others at their intercept points */
+	frontRays &= rays;
+	backRays &= rays;
+	splitRays[ 0 ] = splitRays[ 1 ] = 0;
+	split = *segs;
+	for ( i = 0; ( rays >> i ) != 0; i++ )
+	{
+		if ( !( rays & ~( frontRays | backRays ) & ( 1 << i ) ) ) {
+			continue;
+		}
+		side = front[ i ] < 0;
+		splitRays[ side ] |= ( 1 << i );
+		frac = front[ i ] / ( front[ i ] - back[ i ] );
+		for ( j = 0; j < 3; j++ )
+			split.end[ j ][ i ] = segs->origin[ j ][ i ] + ( segs->end[ j ][ i ] - segs->origin[ j ][ i ] ) * frac;
+	}
+
+	/* the front child: whole front segments and the first half of those split front first */
+	stopped = 0;
+	if ( frontRays | splitRays[ 0 ] ) {
+		stopped |= TracePacket_r( node->children[ 0 ], traces, &split, ( frontRays | splitRays[ 0 ] ) );
+	}
+
+	/* the back child: whole back segments, the second half of those split front first
+	   and the first half of those split back first */
+	for ( i = 0; ( splitRays[ 0 ] >> i ) != 0; i++ )
+	{
+		if ( splitRays[ 0 ] & ( 1 << i ) ) {
+			for ( j = 0; j < 3; j++ )
+			{
+				split.origin[ j ][ i ] = split.end[ j ][ i ];
+				split.end[ j ][ i ] = segs->end[ j ][ i ];
+			}
+		}
+	}
+	rays = ( backRays | splitRays[ 0 ] | splitRays[ 1 ] ) & ~stopped;
+	if ( rays ) {
+		stopped |= TracePacket_r( node->children[ 1 ], traces, &split, rays );
+	}
+
+	/* the front child again: the second half of those split back first */
+	for ( i = 0; ( splitRays[ 1 ] >> i ) != 0; i++ )
+	{
+		if ( splitRays[ 1 ] & ( 1 << i ) ) {
+			for ( j = 0; j < 3; j++ )
+			{
+				split.origin[ j ][ i ] = split.end[ j ][ i ];
+				split.end[ j ][ i ] = segs->end[ j ][ i ];
+			}
+		}
+	}
+	rays = splitRays[ 1 ] & ~stopped;
+	if ( rays ) {
+		stopped |= TracePacket_r( node->children[ 0 ], traces, &split, rays );
+	}
+
+	return stopped;
+}
+
+
+
+/*
+   TraceNodeItems()
+   tests a trace leaf's triangles one by one (old trace tree),
+   returns qtrue at the first opaque hit
+ */
+
+static qboolean TraceNodeItems( const traceNode_t *node, trace_t *trace ){
+	int i;
+	traceTriangle_t *tt;
+	traceInfo_t     *ti;
+
+
+	/* walk node item list */
+	for ( i = 0; i < node->numItems; i++ )
+	{
+		tt = &traceTriangles[ node->items[ i ] ];
+		ti = &traceInfos[ tt->infoNum ];
+		if ( TraceTriangle( ti, tt, trace ) ) {
+			if ( !FiltersLight( ti->si ) ) {
+				trace->occluder = node->items[ i ];
+			}
+			return qtrue;
+		}
+		//%	if( TraceWinding( &traceWindings[ node->items[ i ] ], trace ) )
+		//%		return qtrue;
+	}
+
+	return qfalse;
+}
+
+
+
+/*
+   TraceLineLeaves()
+   tests the triangles of the leaves collected by the trace tree walk in order
+ */
+
+static void TraceLineLeaves( trace_t *trace ){
+	int i;
+	traceNode_t     *node;
+
+
 	/* walk node list */
 	for ( i = 0; i < trace->numTestNodes; i++ )
 	{
 		/* get node */
 		node = &traceNodes[ trace->testNodes[ i ] ];
 
-		/* walk node item list */
-		for ( j = 0; j < node->numItems; j++ )
-		{
-			tt = &traceTriangles[ node->items[ j ] ];
-			ti = &traceInfos[ tt->infoNum ];
-			if ( TraceTriangle( ti, tt, trace ) ) {
+		/* trace the leaf bvh */
+		if ( node->bvhNodeNum >= 0 ) {
+			if ( TraceBVH( node->bvhNodeNum, trace ) ) {
 				return;
 			}
-			//%	if( TraceWinding( &traceWindings[ node->items[ j ] ], trace ) )
-			//%		return;
+			continue;
+		}
+
+		/* trace the leaf triangles */
+		if ( TraceNodeItems( node, trace ) ) {
+			return;
+		}
+	}
+}
+
+
+
+/*
+   TraceLine() - ydnar
+   rewrote this function a bit :)
+ */
+
+void TraceLine( trace_t *trace ){
+	if ( !TraceLineStart( trace ) ) {
+		return;
+	}
+
+	/* trace through nodes */
+	TraceLine_r( headNodeNum, trace->origin, trace->end, trace );
+	if ( TraceLineWalked( trace ) ) {
+		TraceLineLeaves( trace );
+	}
+}
+
+
+
+/*
+   tracePacket_t
+   the slab test inputs of a packet of traces, laid out for testing TRACE_BLOCK_LANES traces at once
+ */
+
+typedef struct
+{
+	alignas( BVH_NODE_ALIGN ) float origin[ 3 ][ MAX_TRACE_PACKET ];
+	alignas( BVH_NODE_ALIGN ) float invDirection[ 3 ][ MAX_TRACE_PACKET ];
+	alignas( BVH_NODE_ALIGN ) float distance[ MAX_TRACE_PACKET ];
+	vec3_t mins, maxs;
+}
+tracePacket_t;
+
+
+
+/*
+   TraceBVHPacketBounds()
+   clips a packet of traces to a bvh node's bounds: the node is first culled against the
+   bounds of the whole packet, then slab tested per trace like TraceBVHBounds();
+   returns the mask of traces that enter it
+ */
+
+static inline int TraceBVHPacketBounds( const traceBVHNode_t *node, const tracePacket_t *tp, int rays, float *entries ){
+	int i, hits;
+
+
+	/* interval cull: every trace segment lies inside the packet bounds */
+	if ( node->mins[ 0 ] > tp->maxs[ 0 ] || node->maxs[ 0 ] < tp->mins[ 0 ] ||
+		 node->mins[ 1 ] > tp->maxs[ 1 ] || node->maxs[ 1 ] < tp->mins[ 1 ] ||
+		 node->mins[ 2 ] > tp->maxs[ 2 ] || node->maxs[ 2 ] < tp->mins[ 2 ] ) {
+		return 0;
+	}
+
+	/* slab test the traces a block of lanes at a time */
+	hits = 0;
+	for ( i = 0; ( rays >> i ) != 0; i += TRACE_BLOCK_LANES )
+	{
+#if defined( TRACE_SIMD_AVX512 ) || defined( TRACE_SIMD_AVX2 ) || defined( TRACE_SIMD_SSE )
+		int j;
+		traceLane_t near, far, t0, t1;
+
+		near = LaneSet( 0.0f );
+		far = LaneLoad( &tp->distance[ i ] );
+		for ( j = 0; j < 3; j++ )
+		{
+			t0 = LaneMul( LaneSub( LaneSet( node->mins[ j ] ), LaneLoad( &tp->origin[ j ][ i ] ) ), LaneLoad( &tp->invDirection[ j ][ i ] ) );
+			t1 = LaneMul( LaneSub( LaneSet( node->maxs[ j ] ), LaneLoad( &tp->origin[ j ][ i ] ) ), LaneLoad( &tp->invDirection[ j ][ i ] ) );
+			near = LaneMax( near, LaneMin( t0, t1 ) );
+			far = LaneMin( far, LaneMax( t0, t1 ) );
+		}
+		LaneStore( &entries[ i ], near );
+		hits |= LaneLE( near, far ) << i;
+#else
+		int j, k;
+		float near, far, t0, t1;
+
+		for ( k = i; k < i + TRACE_BLOCK_LANES; k++ )
+		{
+			near = 0.0f;
+			far = tp->distance[ k ];
+			for ( j = 0; j < 3; j++ )
+			{
+				t0 = ( node->mins[ j ] - tp->origin[ j ][ k ] ) * tp->invDirection[ j ][ k ];
+				t1 = ( node->maxs[ j ] - tp->origin[ j ][ k ] ) * tp->invDirection[ j ][ k ];
+				near = std::max( near, std::min( t0, t1 ) );
+				far = std::min( far, std::max( t0, t1 ) );
+			}
+			entries[ k ] = near;
+			if ( near <= far ) {
+				hits |= 1 << k;
+			}
+		}
+#endif
+	}
+	return hits & rays;
+}
+
+
+
+/*
+   TraceBVHPacket()
+   TraceBVH() for a packet of traces that share a leaf: every trace still visits the
+   nodes it enters in its own front to back order, so the results are the same as
+   tracing them one by one; returns the mask of traces that are not yet opaque
+ */
+
+static int TraceBVHPacket( int nodeNum, trace_t **traces, const tracePacket_t *tp, int active ){
+	int i, rays, numStack, stackNodes[ 2 * BVH_MAX_DEPTH + 2 ], stackRays[ 2 * BVH_MAX_DEPTH + 2 ], children[ 2 ], hits[ 2 ], flip;
+	alignas( BVH_NODE_ALIGN ) float entries[ 2 ][ MAX_TRACE_PACKET ];
+	traceBVHNode_t  *node;
+
+
+	/* check root */
+	rays = TraceBVHPacketBounds( &bvhNodes[ nodeNum ], tp, active, entries[ 0 ] );
+
+	/* walk the tree */
+	numStack = 0;
+	while ( 1 )
+	{
+		/* drop traces that went opaque in the meantime */
+		rays &= active;
+		node = &bvhNodes[ nodeNum ];
+
+		/* leaf? */
+		if ( node->numTriangles > 0 ) {
+			for ( i = 0; ( rays >> i ) != 0; i++ )
+			{
+				if ( ( rays & ( 1 << i ) ) && TraceTriangleBlock( &traceBlocks[ node->offset ], traces[ i ] ) ) {
+					active &= ~( 1 << i );
+				}
+			}
+		}
+
+		/* descend */
+		else if ( rays != 0 )
+		{
+			children[ 0 ] = nodeNum + 1;
+			children[ 1 ] = node->offset;
+			hits[ 0 ] = TraceBVHPacketBounds( &bvhNodes[ children[ 0 ] ], tp, rays, entries[ 0 ] );
+			hits[ 1 ] = TraceBVHPacketBounds( &bvhNodes[ children[ 1 ] ], tp, rays, entries[ 1 ] );
+
+			/* traces entering both children that are nearer to the second one */
+			flip = 0;
+			for ( i = 0; ( ( hits[ 0 ] & hits[ 1 ] ) >> i ) != 0; i++ )
+			{
+				if ( ( hits[ 0 ] & hits[ 1 ] & ( 1 << i ) ) && entries[ 1 ][ i ] < entries[ 0 ][ i ] ) {
+					flip |= ( 1 << i );
+				}
+			}
+
+			/* visit the first child with the unflipped traces, then the second child with all
+			   of them, then the first child again with the flipped ones */
+			if ( hits[ 0 ] & flip ) {
+				stackNodes[ numStack ] = children[ 0 ];
+				stackRays[ numStack++ ] = hits[ 0 ] & flip;
+			}
+			if ( hits[ 1 ] ) {
+				stackNodes[ numStack ] = children[ 1 ];
+				stackRays[ numStack++ ] = hits[ 1 ];
+			}
+			if ( hits[ 0 ] & ~flip ) {
+				nodeNum = children[ 0 ];
+				rays = hits[ 0 ] & ~flip;
+				continue;
+			}
+		}
+
+		/* pop */
+		if ( numStack == 0 || active == 0 ) {
+			return active;
+		}
+		numStack--;
+		nodeNum = stackNodes[ numStack ];
+		rays = stackRays[ numStack ];
+	}
+}
+
+
+
+/*
+   TraceLeavesPacket()
+   TraceLineLeaves() for a packet of traces that collected the same leaves
+ */
+
+static void TraceLeavesPacket( trace_t **traces, int numTraces ){
+	int i, j, active;
+	tracePacket_t tp;
+	traceNode_t     *node;
+
+
+	/* setup slab tests and the packet bounds, unused lanes never enter a node */
+	ClearBounds( tp.mins, tp.maxs );
+	for ( i = 0; i < MAX_TRACE_PACKET; i++ )
+	{
+		if ( i >= numTraces ) {
+			for ( j = 0; j < 3; j++ )
+			{
+				tp.origin[ j ][ i ] = 0.0f;
+				tp.invDirection[ j ][ i ] = 0.0f;
+			}
+			tp.distance[ i ] = -1.0f;
+			continue;
+		}
+		for ( j = 0; j < 3; j++ )
+		{
+			tp.origin[ j ][ i ] = traces[ i ]->origin[ j ];
+			tp.invDirection[ j ][ i ] = fabs( traces[ i ]->direction[ j ] ) > 1e-12f ? 1.0f / traces[ i ]->direction[ j ] : 1e30f;
+		}
+		tp.distance[ i ] = traces[ i ]->distance;
+		AddPointToBounds( traces[ i ]->origin, tp.mins, tp.maxs );
+		AddPointToBounds( traces[ i ]->end, tp.mins, tp.maxs );
+	}
+
+	/* walk the shared node list */
+	active = ( 1 << numTraces ) - 1;
+	for ( i = 0; i < traces[ 0 ]->numTestNodes && active != 0; i++ )
+	{
+		/* get node */
+		node = &traceNodes[ traces[ 0 ]->testNodes[ i ] ];
+
+		/* trace the leaf bvh */
+		if ( node->bvhNodeNum >= 0 ) {
+			active = TraceBVHPacket( node->bvhNodeNum, traces, &tp, active );
+			continue;
+		}
+
+		/* trace the leaf triangles */
+		for ( j = 0; j < numTraces; j++ )
+		{
+			if ( ( active & ( 1 << j ) ) && TraceNodeItems( node, traces[ j ] ) ) {
+				active &= ~( 1 << j );
+			}
+		}
+	}
+}
+
+
+
+/*
+   ShadowCacheEntry()
+   the calling thread's shadow cache slot for a light and a tile of samples; slots are
+   shared by colliding keys, which only costs a wasted triangle test
+ */
+
+static shadowCacheEntry_t *ShadowCacheEntry( const light_t *light, int tile ){
+	unsigned int hash;
+
+
+	hash = (unsigned int) ( (size_t) light / sizeof( light_t ) ) * 2654435761u + (unsigned int) tile * 40503u;
+	hash ^= hash >> 16;
+	return &shadowCaches[ GetThreadNum() * SHADOW_CACHE_SIZE + ( hash & ( SHADOW_CACHE_SIZE - 1 ) ) ];
+}
+
+
+
+/*
+   TraceLinePacket()
+   traces a packet of coherent traces (e.g. a tile of luxels to one light) with the same
+   results as calling TraceLine() on each; traces that pass through the same trace leaves
+   share a bvh traversal, the others fall back to single traces
+
+   with a cache tile >= 0 all traces go to the same light and the triangle that last
+   shadowed that tile from it is tested first, a hit is opaque without walking the tree
+ */
+
+void TraceLinePacket( trace_t **traces, int numTraces, int cacheTile ){
+	int i, j, numPending, numWalked, numKept, numRays, occluder;
+	traceSegments_t segs;
+	trace_t         *pending[ MAX_TRACE_PACKET ], *rays[ MAX_TRACE_PACKET ];
+	shadowCacheEntry_t  *cache;
+	traceTriangle_t *tt;
+
+
+	/* sanity check */
+	if ( numTraces > MAX_TRACE_PACKET ) {
+		Error( "TraceLinePacket: %d traces > MAX_TRACE_PACKET (%d)", numTraces, MAX_TRACE_PACKET );
+	}
+
+	/* get the last occluder of the tile (not for traces on through sky, which
+	   only see the triangles of the leaves the tree walk collects beyond it) */
+	cache = NULL;
+	tt = NULL;
+	if ( cacheTile >= 0 && numTraces > 0 && shadowCaches != NULL && !noSurfaces && !traces[ 0 ]->testAll ) {
+		cache = ShadowCacheEntry( traces[ 0 ]->light, cacheTile );
+		if ( cache->light == traces[ 0 ]->light && cache->tile == cacheTile ) {
+			tt = &traceTriangles[ cache->triangleNum ];
+		}
+	}
+
+	/* walk the trace tree */
+	numPending = 0;
+	for ( i = 0; i < numTraces; i++ )
+	{
+		if ( TraceLineStart( traces[ i ] ) ) {
+			/* shadowed by the cached triangle */
+			if ( cache != NULL ) {
+				if ( tt != NULL && TraceTriangle( &traceInfos[ tt->infoNum ], tt, traces[ i ] ) ) {
+					THREAD_STAT( shadowCacheHits )++;
+					traces[ i ]->occluder = cache->triangleNum;
+					continue;
+				}
+				THREAD_STAT( shadowCacheMisses )++;
+			}
+
+			for ( j = 0; j < 3; j++ )
+			{
+				segs.origin[ j ][ numPending ] = traces[ i ]->origin[ j ];
+				segs.end[ j ][ numPending ] = traces[ i ]->end[ j ];
+			}
+			pending[ numPending++ ] = traces[ i ];
+		}
+	}
+	for ( i = numPending; i < MAX_TRACE_PACKET; i++ )
+	{
+		for ( j = 0; j < 3; j++ )
+			segs.origin[ j ][ i ] = segs.end[ j ][ i ] = 0.0f;
+	}
+	if ( numPending > 0 ) {
+		TracePacket_r( headNodeNum, pending, &segs, ( 1 << numPending ) - 1 );
+	}
+	for ( i = 0, numWalked = numPending, numPending = 0; i < numWalked; i++ )
+	{
+		if ( TraceLineWalked( pending[ i ] ) ) {
+			pending[ numPending++ ] = pending[ i ];
+		}
+	}
+
+	/* group the traces by leaf list */
+	while ( numPending > 0 )
+	{
+		rays[ 0 ] = pending[ 0 ];
+		numRays = 1;
+		numKept = 0;
+		for ( i = 1; i < numPending; i++ )
+		{
+			if ( pending[ i ]->numTestNodes == rays[ 0 ]->numTestNodes &&
+				 !memcmp( pending[ i ]->testNodes, rays[ 0 ]->testNodes, rays[ 0 ]->numTestNodes * sizeof( int ) ) ) {
+				rays[ numRays++ ] = pending[ i ];
+			}
+			else{
+				pending[ numKept++ ] = pending[ i ];
+			}
+		}
+		numPending = numKept;
+
+		/* diverged */
+		if ( numRays == 1 ) {
+			THREAD_STAT( numSingleRays )++;
+			TraceLineLeaves( rays[ 0 ] );
+			continue;
+		}
+
+		THREAD_STAT( numPacketRays ) += numRays;
+		TraceLeavesPacket( rays, numRays );
+	}
+
+	/* remember the last occluder of the tile */
+	if ( cache != NULL ) {
+		occluder = -1;
+		for ( i = 0; i < numTraces; i++ )
+		{
+			if ( traces[ i ]->occluder >= 0 ) {
+				occluder = traces[ i ]->occluder;
+			}
+		}
+		if ( occluder >= 0 ) {
+			cache->light = traces[ 0 ]->light;
+			cache->tile = cacheTile;
+			cache->triangleNum = occluder;
 		}
 	}
 }
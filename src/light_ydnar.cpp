@@ -35,101 +35,227 @@
 
 /* dependencies */
 #include "q3map2.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 
 
 
 
 /*
-   ColorToBytes()
-   ydnar: moved to here 2001-02-04
+   color tables
+   lightmap gamma is looked up with linear interpolation between samples of the gamma curve,
+   which stays well below a byte level for lightmap gammas up to 4 outside of the darkest few
+   values, those and gammas past 4 still take pow(). sRGB encoding is a search through the
+   256 linear values the encoded byte steps up at, so it gives the bytes the formula would
  */
 
-void ColorToBytes( const float *color, byte *colorBytes, float scale ){
-	int i;
-	float max, gamma;
-	vec3_t sample;
-	float inv, dif;
+#define GAMMA_TABLE_SCALE       1024                /* samples per unit of color / 255 */
+#define GAMMA_TABLE_MAX         4                   /* brighter colors take pow() */
+#define GAMMA_TABLE_SIZE        ( GAMMA_TABLE_SCALE * GAMMA_TABLE_MAX )
+#define COLOR_BATCH             64
 
+static float gammaTable[ GAMMA_TABLE_SIZE + 2 ];
+static float sRGBSteps[ 256 ];
+static qboolean gammaIdentity, gammaTabled;
 
-	/* ydnar: scaling necessary for simulating r_overbrightBits on external lightmaps */
-	if ( scale <= 0.0f ) {
-		scale = 1.0f;
-	}
+static float sRGBByteFromLinear( float c ){
+	return floor( Image_sRGBFloatFromLinearFloat( c * ( 1.0 / 255.0 ) ) * 255.0 + 0.5 );
+}
+
+
+
+/*
+   SetupColorTables()
+   builds the gamma and sRGB tables from the lightmap color switches
+ */
 
-	/* make a local copy */
-	VectorScale( color, scale, sample );
+void SetupColorTables( void ){
+	int i, k;
+	float gamma, lo, hi, mid;
 
-	/* muck with it */
+
+	/* gamma curve */
 	gamma = 1.0f / lightmapGamma;
-	for ( i = 0; i < 3; i++ )
+	gammaIdentity = ( gamma == 1.0f ) ? qtrue : qfalse;
+	gammaTabled = ( !gammaIdentity && gamma >= 0.25f ) ? qtrue : qfalse;
+	for ( i = 0; i <= GAMMA_TABLE_SIZE + 1; i++ )
+		gammaTable[ i ] = pow( (float) i / GAMMA_TABLE_SCALE, gamma );
+
+	/* the smallest linear value each sRGB byte starts at */
+	sRGBSteps[ 0 ] = 0.0f;
+	for ( k = 1; k < 256; k++ )
 	{
-		/* handle negative light */
-		if ( sample[ i ] < 0.0f ) {
-			sample[ i ] = 0.0f;
-			continue;
+		lo = sRGBSteps[ k - 1 ];
+		hi = 255.0f;
+		while ( nextafterf( lo, hi ) < hi )
+		{
+			mid = lo + ( hi - lo ) * 0.5f;
+			if ( mid <= lo || mid >= hi ) {
+				mid = nextafterf( lo, hi );
+			}
+			if ( sRGBByteFromLinear( mid ) >= k ) {
+				hi = mid;
+			}
+			else{
+				lo = mid;
+			}
 		}
-
-		/* gamma */
-		sample[ i ] = pow( sample[ i ] / 255.0f, gamma ) * 255.0f;
+		sRGBSteps[ k ] = hi;
 	}
+}
 
-	if ( lightmapExposure == 0 ) {
-		/* clamp with color normalization */
-		max = sample[ 0 ];
-		if ( sample[ 1 ] > max ) {
-			max = sample[ 1 ];
-		}
-		if ( sample[ 2 ] > max ) {
-			max = sample[ 2 ];
-		}
-		if ( max > 255.0f ) {
-			VectorScale( sample, ( 255.0f / max ), sample );
-		}
+
+
+/*
+   ColorsToBytes()
+   converts a run of colors to bytes, colorStride floats and byteStride bytes apart. the colors go
+   through in blocks of one channel at a time so the compiler can vectorize the steps
+ */
+
+void ColorsToBytes( const float *colors, int colorStride, byte *colorBytes, int byteStride, int numColors, float scale ){
+	int i, j, n, k, step;
+	float max, gamma, v, f, inv, dif, compensate;
+	int index;
+	float sample[ 3 ][ COLOR_BATCH ];
+
+
+	/* ydnar: scaling necessary for simulating r_overbrightBits on external lightmaps */
+	if ( scale <= 0.0f ) {
+		scale = 1.0f;
 	}
-	else
+	gamma = 1.0f / lightmapGamma;
+	compensate = 1.0f / lightmapCompensate;
+
+	for ( ; numColors > 0; numColors -= n, colors += n * colorStride, colorBytes += n * byteStride )
 	{
-		inv = 1.f / lightmapExposure;
-		//Exposure
+		n = ( numColors < COLOR_BATCH ? numColors : COLOR_BATCH );
 
-		max = sample[ 0 ];
-		if ( sample[ 1 ] > max ) {
-			max = sample[ 1 ];
-		}
-		if ( sample[ 2 ] > max ) {
-			max = sample[ 2 ];
+		/* make a local copy, negative light is black */
+		for ( i = 0; i < n; i++ )
+		{
+			for ( j = 0; j < 3; j++ )
+			{
+				v = colors[ i * colorStride + j ] * scale;
+				sample[ j ][ i ] = ( v < 0.0f ? 0.0f : v );
+			}
 		}
 
-		dif = ( 1 -  exp( -max * inv ) )  *  255;
+		/* gamma */
+		for ( j = 0; j < 3 && !gammaIdentity; j++ )
+		{
+			for ( i = 0; i < n; i++ )
+			{
+				v = sample[ j ][ i ] / 255.0f;
+				f = v * GAMMA_TABLE_SCALE;
+				if ( gammaTabled && f >= 2.0f && f < GAMMA_TABLE_SIZE ) {
+					index = (int) f;
+					f -= index;
+					sample[ j ][ i ] = ( gammaTable[ index ] + f * ( gammaTable[ index + 1 ] - gammaTable[ index ] ) ) * 255.0f;
+				}
+				else{
+					sample[ j ][ i ] = pow( v, gamma ) * 255.0f;
+				}
+			}
+		}
 
-		if ( max > 0 ) {
-			dif = dif / max;
+		if ( lightmapExposure == 0 ) {
+			/* clamp with color normalization */
+			for ( i = 0; i < n; i++ )
+			{
+				max = sample[ 0 ][ i ];
+				if ( sample[ 1 ][ i ] > max ) {
+					max = sample[ 1 ][ i ];
+				}
+				if ( sample[ 2 ][ i ] > max ) {
+					max = sample[ 2 ][ i ];
+				}
+				if ( max > 255.0f ) {
+					f = 255.0f / max;
+					sample[ 0 ][ i ] *= f;
+					sample[ 1 ][ i ] *= f;
+					sample[ 2 ][ i ] *= f;
+				}
+			}
 		}
 		else
 		{
-			dif = 0;
+			//Exposure
+			inv = 1.f / lightmapExposure;
+			for ( i = 0; i < n; i++ )
+			{
+				max = sample[ 0 ][ i ];
+				if ( sample[ 1 ][ i ] > max ) {
+					max = sample[ 1 ][ i ];
+				}
+				if ( sample[ 2 ][ i ] > max ) {
+					max = sample[ 2 ][ i ];
+				}
+
+				dif = ( 1 -  exp( -max * inv ) )  *  255;
+				if ( max > 0 ) {
+					dif = dif / max;
+				}
+				else
+				{
+					dif = 0;
+				}
+
+				sample[ 0 ][ i ] *= dif;
+				sample[ 1 ][ i ] *= dif;
+				sample[ 2 ][ i ] *= dif;
+			}
+		}
+
+		/* compensate for ingame overbrighting/bitshifting */
+		for ( j = 0; j < 3; j++ )
+		{
+			for ( i = 0; i < n; i++ )
+				sample[ j ][ i ] *= compensate;
 		}
 
-		for ( i = 0; i < 3; i++ )
+		/* sRGB lightmaps */
+		if ( lightmapsRGB ) {
+			for ( j = 0; j < 3; j++ )
+			{
+				for ( i = 0; i < n; i++ )
+				{
+					v = sample[ j ][ i ];
+					if ( v > 255.0f ) {
+						sample[ j ][ i ] = sRGBByteFromLinear( v );
+						continue;
+					}
+					k = 0;
+					for ( step = 128; step > 0; step >>= 1 )
+					{
+						if ( sRGBSteps[ k + step ] <= v ) {
+							k += step;
+						}
+					}
+					sample[ j ][ i ] = k;
+				}
+			}
+		}
+
+		/* store it off */
+		for ( i = 0; i < n; i++ )
 		{
-			sample[i] *= dif;
+			colorBytes[ i * byteStride + 0 ] = sample[ 0 ][ i ];
+			colorBytes[ i * byteStride + 1 ] = sample[ 1 ][ i ];
+			colorBytes[ i * byteStride + 2 ] = sample[ 2 ][ i ];
 		}
 	}
+}
 
 
-	/* compensate for ingame overbrighting/bitshifting */
-	VectorScale( sample, ( 1.0f / lightmapCompensate ), sample );
 
-	/* sRGB lightmaps */
-	if ( lightmapsRGB ) {
-		sample[0] = floor( Image_sRGBFloatFromLinearFloat( sample[0] * ( 1.0 / 255.0 ) ) * 255.0 + 0.5 );
-		sample[1] = floor( Image_sRGBFloatFromLinearFloat( sample[1] * ( 1.0 / 255.0 ) ) * 255.0 + 0.5 );
-		sample[2] = floor( Image_sRGBFloatFromLinearFloat( sample[2] * ( 1.0 / 255.0 ) ) * 255.0 + 0.5 );
-	}
+/*
+   ColorToBytes()
+   ydnar: moved to here 2001-02-04
+ */
 
-	/* store it off */
-	colorBytes[ 0 ] = sample[ 0 ];
-	colorBytes[ 1 ] = sample[ 1 ];
-	colorBytes[ 2 ] = sample[ 2 ];
+void ColorToBytes( const float *color, byte *colorBytes, float scale ){
+	ColorsToBytes( color, 3, colorBytes, 3, 1, scale );
 }
 
 
@@ -143,22 +269,129 @@ void ColorToBytes( const float *color, byte *colorBytes, float scale ){
 /*
    SmoothNormals()
    smooths together coincident vertex normals across the bsp
+   coincident vertexes are found through a hash of their positions quantized to SMOOTH_CELL_SIZE,
+   the groups are formed in vertex order like a scan of all later vertexes would, and averaged on
+   all threads afterwards
  */
 
 #define MAX_SAMPLES             256
 #define THETA_EPSILON           0.000001
 #define EQUAL_NORMAL_EPSILON    0.01
+#define SMOOTH_CELL_SIZE        1.0f
+#define SMOOTH_DOT_EPSILON      0.0001  /* dots this close to the shade angle fall back to acos() */
+
+static int          *smoothGroups, *smoothIndexes;
+
+
+
+/*
+   SmoothCell()
+   returns the hash bucket of a quantized vertex position
+ */
+
+static int SmoothCell( int x, int y, int z, int mask ){
+	return (int) ( ( ( (uint32_t) x * 73856093u ) ^ ( (uint32_t) y * 19349663u ) ^ ( (uint32_t) z * 83492791u ) ) & (uint32_t) mask );
+}
+
+
+
+/*
+   SmoothAngle()
+   tests if two normals are within the shade angle of each other, the cosine of the shade angle
+   decides unless the dot is too close to it to tell, then the angle is taken like it used to
+ */
+
+static qboolean SmoothAngle( const float *normal, const float *normal2, float shadeAngle, double shadeCos ){
+	float dot, testAngle;
+
+
+	/* check shade angle, the cosine only orders angles between 0 and pi */
+	dot = DotProduct( normal, normal2 );
+	if ( shadeAngle > THETA_EPSILON && shadeAngle < Q_PI && dot >= -1.0f && dot <= 1.0f ) {
+		if ( dot < shadeCos - SMOOTH_DOT_EPSILON ) {
+			return qfalse;
+		}
+		if ( dot > shadeCos + SMOOTH_DOT_EPSILON ) {
+			return qtrue;
+		}
+	}
+
+	if ( dot > 1.0 ) {
+		dot = 1.0;
+	}
+	else if ( dot < -1.0 ) {
+		dot = -1.0;
+	}
+	testAngle = acos( dot ) + THETA_EPSILON;
+	return testAngle < shadeAngle ? qtrue : qfalse;
+}
+
+
+
+/*
+   SmoothNormalGroup()
+   averages the normals of a group of coincident vertexes
+ */
+
+static void SmoothNormalGroup( int groupNum ){
+	int i, j, k, numVerts, numVotes;
+	int                 *indexes;
+	vec3_t average, diff;
+	vec3_t votes[ MAX_SAMPLES ];
+
+
+	/* get the group */
+	indexes = smoothIndexes + smoothGroups[ groupNum ];
+	numVerts = smoothGroups[ groupNum + 1 ] - smoothGroups[ groupNum ];
+
+	/* clear */
+	VectorClear( average );
+	numVotes = 0;
+
+	for ( i = 0; i < numVerts; i++ )
+	{
+		j = indexes[ i ];
+
+		/* see if this normal has already been voted */
+		for ( k = 0; k < numVotes; k++ )
+		{
+			VectorSubtract( bspDrawVerts[ j ].normal, votes[ k ], diff );
+			if ( fabs( diff[ 0 ] ) < EQUAL_NORMAL_EPSILON &&
+				 fabs( diff[ 1 ] ) < EQUAL_NORMAL_EPSILON &&
+				 fabs( diff[ 2 ] ) < EQUAL_NORMAL_EPSILON ) {
+				break;
+			}
+		}
+
+		/* add a new vote? */
+		if ( k == numVotes && numVotes < MAX_SAMPLES ) {
+			VectorAdd( average, bspDrawVerts[ j ].normal, average );
+			VectorCopy( bspDrawVerts[ j ].normal, votes[ numVotes ] );
+			numVotes++;
+		}
+	}
+
+	/* average normal */
+	if ( VectorNormalize( average, average ) > 0 ) {
+		/* smooth */
+		for ( i = 0; i < numVerts; i++ )
+			VectorCopy( average, yDrawVerts[ indexes[ i ] ].normal );
+	}
+}
+
+
 
 void SmoothNormals( void ){
-	int i, j, k, f, cs, numVerts, numVotes, fOld, start;
-	float shadeAngle, defaultShadeAngle, maxShadeAngle, dot, testAngle;
+	int i, j, k, c, f, cs, x, y, z, numVerts, fOld, start;
+	int numBuckets, mask, numGroups, numIndexes, bucket[ 8 ], cursor[ 8 ], numBucketsSeen, mins[ 3 ], maxs[ 3 ];
+	float shadeAngle, defaultShadeAngle, maxShadeAngle;
 	bspDrawSurface_t    *ds;
 	shaderInfo_t        *si;
 	float               *shadeAngles;
+	double              *shadeCosines;
 	byte                *smoothed;
-	vec3_t average, diff;
+	int                 *buckets, *sorted;
 	int indexes[ MAX_SAMPLES ];
-	vec3_t votes[ MAX_SAMPLES ];
 
 
 	/* allocate shade angle table */
@@ -221,6 +454,43 @@ void SmoothNormals( void ){
 	fOld = -1;
 	start = I_FloatTime();
 
+	/* cosines of the shade angles */
+	shadeCosines = static_cast<double*>(safe_malloc(numBSPDrawVerts * sizeof( double )));
+	for ( i = 0; i < numBSPDrawVerts; i++ )
+		shadeCosines[ i ] = cos( shadeAngles[ i ] - THETA_EPSILON );
+
+	/* hash the vertexes that can still be smoothed by quantized position */
+	for ( numBuckets = 64; numBuckets < numBSPDrawVerts; numBuckets <<= 1 ) ;
+	mask = numBuckets - 1;
+	buckets = static_cast<int*>(safe_malloc(( numBuckets + 1 ) * sizeof( int )));
+	sorted = static_cast<int*>(safe_malloc(( numBSPDrawVerts + 1 ) * sizeof( int )));
+	memset( buckets, 0, ( numBuckets + 1 ) * sizeof( int ) );
+	for ( i = 0; i < numBSPDrawVerts; i++ )
+	{
+		if ( !( smoothed[ i >> 3 ] & ( 1 << ( i & 7 ) ) ) ) {
+			buckets[ SmoothCell( (int) floor( yDrawVerts[ i ].xyz[ 0 ] / SMOOTH_CELL_SIZE ), (int) floor( yDrawVerts[ i ].xyz[ 1 ] / SMOOTH_CELL_SIZE ),
+								 (int) floor( yDrawVerts[ i ].xyz[ 2 ] / SMOOTH_CELL_SIZE ), mask ) + 1 ]++;
+		}
+	}
+	for ( i = 0; i < numBuckets; i++ )
+		buckets[ i + 1 ] += buckets[ i ];
+	for ( i = 0; i < numBSPDrawVerts; i++ )
+	{
+		if ( !( smoothed[ i >> 3 ] & ( 1 << ( i & 7 ) ) ) ) {
+			sorted[ buckets[ SmoothCell( (int) floor( yDrawVerts[ i ].xyz[ 0 ] / SMOOTH_CELL_SIZE ), (int) floor( yDrawVerts[ i ].xyz[ 1 ] / SMOOTH_CELL_SIZE ),
+										 (int) floor( yDrawVerts[ i ].xyz[ 2 ] / SMOOTH_CELL_SIZE ), mask ) ]++ ] = i;
+		}
+	}
+	for ( i = numBuckets; i > 0; i-- )
+		buckets[ i ] = buckets[ i - 1 ];
+	buckets[ 0 ] = 0;
+
+	/* groups of coincident vertexes */
+	smoothGroups = static_cast<int*>(safe_malloc(( numBSPDrawVerts + 1 ) * sizeof( int )));
+	smoothIndexes = static_cast<int*>(safe_malloc(( numBSPDrawVerts + 1 ) * sizeof( int )));
+	numGroups = 0;
+	numIndexes = 0;
+
 	/* go through the list of vertexes */
 	for ( i = 0; i < numBSPDrawVerts; i++ )
 	{
@@ -236,14 +506,51 @@ void SmoothNormals( void ){
 			continue;
 		}
 
-		/* clear */
-		VectorClear( average );
-		numVerts = 0;
-		numVotes = 0;
+		/* get the cells a coincident vertex can be in */
+		for ( k = 0; k < 3; k++ )
+		{
+			mins[ k ] = (int) floor( ( yDrawVerts[ i ].xyz[ k ] - 2 * EQUAL_EPSILON ) / SMOOTH_CELL_SIZE );
+			maxs[ k ] = (int) floor( ( yDrawVerts[ i ].xyz[ k ] + 2 * EQUAL_EPSILON ) / SMOOTH_CELL_SIZE );
+		}
+
+		/* find the later vertexes in their buckets, each bucket lists its vertexes in ascending order */
+		numBucketsSeen = 0;
+		for ( z = mins[ 2 ]; z <= maxs[ 2 ]; z++ )
+		{
+			for ( y = mins[ 1 ]; y <= maxs[ 1 ]; y++ )
+			{
+				for ( x = mins[ 0 ]; x <= maxs[ 0 ]; x++ )
+				{
+					/* cells can share a bucket */
+					c = SmoothCell( x, y, z, mask );
+					for ( k = 0; k < numBucketsSeen && bucket[ k ] != c; k++ ) ;
+					if ( k < numBucketsSeen ) {
+						continue;
+					}
+					bucket[ numBucketsSeen ] = c;
+					cursor[ numBucketsSeen ] = (int) ( std::lower_bound( sorted + buckets[ c ], sorted + buckets[ c + 1 ], i ) - sorted );
+					numBucketsSeen++;
+				}
+			}
+		}
 
-		/* build a table of coincident vertexes */
-		for ( j = i; j < numBSPDrawVerts && numVerts < MAX_SAMPLES; j++ )
+		/* build a table of coincident vertexes, merging the buckets in vertex order */
+		numVerts = 0;
+		while ( numVerts < MAX_SAMPLES )
 		{
+			/* take the lowest vertex left */
+			c = -1;
+			for ( k = 0; k < numBucketsSeen; k++ )
+			{
+				if ( cursor[ k ] < buckets[ bucket[ k ] + 1 ] && ( c < 0 || sorted[ cursor[ k ] ] < sorted[ cursor[ c ] ] ) ) {
+					c = k;
+				}
+			}
+			if ( c < 0 ) {
+				break;
+			}
+			j = sorted[ cursor[ c ]++ ];
+
 			/* already smoothed? */
 			if ( smoothed[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) {
 				continue;
@@ -255,46 +562,20 @@ void SmoothNormals( void ){
 			}
 
 			/* use smallest shade angle */
-			shadeAngle = ( shadeAngles[ i ] < shadeAngles[ j ] ? shadeAngles[ i ] : shadeAngles[ j ] );
-
-			/* check shade angle */
-			dot = DotProduct( bspDrawVerts[ i ].normal, bspDrawVerts[ j ].normal );
-			if ( dot > 1.0 ) {
-				dot = 1.0;
-			}
-			else if ( dot < -1.0 ) {
-				dot = -1.0;
+			if ( shadeAngles[ i ] < shadeAngles[ j ] ) {
+				if ( !SmoothAngle( bspDrawVerts[ i ].normal, bspDrawVerts[ j ].normal, shadeAngles[ i ], shadeCosines[ i ] ) ) {
+					continue;
+				}
 			}
-			testAngle = acos( dot ) + THETA_EPSILON;
-			if ( testAngle >= shadeAngle ) {
-				//Sys_Printf( "F(%3.3f >= %3.3f) ", RAD2DEG( testAngle ), RAD2DEG( shadeAngle ) );
+			else if ( !SmoothAngle( bspDrawVerts[ i ].normal, bspDrawVerts[ j ].normal, shadeAngles[ j ], shadeCosines[ j ] ) ) {
 				continue;
 			}
-			//Sys_Printf( "P(%3.3f < %3.3f) ", RAD2DEG( testAngle ), RAD2DEG( shadeAngle ) );
 
 			/* add to the list */
 			indexes[ numVerts++ ] = j;
 
 			/* flag vertex */
 			smoothed[ j >> 3 ] |= ( 1 << ( j & 7 ) );
-
-			/* see if this normal has already been voted */
-			for ( k = 0; k < numVotes; k++ )
-			{
-				VectorSubtract( bspDrawVerts[ j ].normal, votes[ k ], diff );
-				if ( fabs( diff[ 0 ] ) < EQUAL_NORMAL_EPSILON &&
-					 fabs( diff[ 1 ] ) < EQUAL_NORMAL_EPSILON &&
-					 fabs( diff[ 2 ] ) < EQUAL_NORMAL_EPSILON ) {
-					break;
-				}
-			}
-
-			/* add a new vote? */
-			if ( k == numVotes && numVotes < MAX_SAMPLES ) {
-				VectorAdd( average, bspDrawVerts[ j ].normal, average );
-				VectorCopy( bspDrawVerts[ j ].normal, votes[ numVotes ] );
-				numVotes++;
-			}
 		}
 
 		/* don't average for less than 2 verts */
@@ -302,17 +583,24 @@ void SmoothNormals( void ){
 			continue;
 		}
 
-		/* average normal */
-		if ( VectorNormalize( average, average ) > 0 ) {
-			/* smooth */
-			for ( j = 0; j < numVerts; j++ )
-				VectorCopy( average, yDrawVerts[ indexes[ j ] ].normal );
-		}
+		/* store the group */
+		smoothGroups[ numGroups++ ] = numIndexes;
+		memcpy( smoothIndexes + numIndexes, indexes, numVerts * sizeof( int ) );
+		numIndexes += numVerts;
 	}
+	smoothGroups[ numGroups ] = numIndexes;
+
+	/* average the groups */
+	RunThreadsOnIndividual( numGroups, qfalse, SmoothNormalGroup );
 
 	/* free the tables */
 	free( shadeAngles );
+	free( shadeCosines );
 	free( smoothed );
+	free( buckets );
+	free( sorted );
+	free( smoothGroups );
+	free( smoothIndexes );
 
 	/* print time */
 	Sys_Printf( " (%i)\n", (int) ( I_FloatTime() - start ) );
@@ -672,7 +960,7 @@ static int MapSingleLuxel( rawLightmap_t *lm, surfaceInfo_t *info, bspDrawVert_t
 		( *cluster ) = CLUSTER_OCCLUDED;
 		VectorClear( origin );
 		VectorClear( normal );
-		numLuxelsOccluded++;
+		THREAD_STAT( numLuxelsOccluded )++;
 		return ( *cluster );
 	}
 
@@ -696,7 +984,7 @@ static int MapSingleLuxel( rawLightmap_t *lm, surfaceInfo_t *info, bspDrawVert_t
 	luxel[ 3 ] = 1.0f;
 
 	/* add to count */
-	numLuxelsMapped++;
+	THREAD_STAT( numLuxelsMapped )++;
 
 	/* return ok */
 	return ( *cluster );
@@ -1024,6 +1312,7 @@ void MapRawLightmap( int rawLightmapNum ){
 
 	/* get lightmap */
 	lm = &rawLightmaps[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
 
 	/* -----------------------------------------------------------------
 	   map referenced surfaces onto the raw lightmap
@@ -1220,6 +1509,7 @@ void MapRawLightmap( int rawLightmapNum ){
 
 	/* non-planar surfaces stop here */
 	if ( lm->plane == NULL ) {
+		ReleaseSuperBuffers( lm );
 		return;
 	}
 
@@ -1380,6 +1670,9 @@ void MapRawLightmap( int rawLightmapNum ){
 		}
 	}
 	#endif
+
+	/* done with the super buffers */
+	ReleaseSuperBuffers( lm );
 }
 
 
@@ -1429,28 +1722,13 @@ void SetupDirt( void ){
 
 
 /*
-   DirtForSample()
-   calculates dirt value for a given sample
+   DirtBasis()
+   gets the tangent space dirt vectors are transformed into for a normal
  */
 
-float DirtForSample( trace_t *trace ){
-	int i;
-	float gatherDirt, outDirt, angle, elevation, ooDepth;
-	vec3_t normal, worldUp, myUp, myRt, temp, direction, displacement;
-
-
-	/* dummy check */
-	if ( !dirty ) {
-		return 1.0f;
-	}
-	if ( trace == NULL || trace->cluster < 0 ) {
-		return 0.0f;
-	}
+static void DirtBasis( const vec3_t normal, vec3_t myRt, vec3_t myUp ){
+	vec3_t worldUp;
 
-	/* setup */
-	gatherDirt = 0.0f;
-	ooDepth = 1.0f / dirtDepth;
-	VectorCopy( trace->normal, normal );
 
 	/* check if the normal is aligned to the world-up */
 	if ( normal[ 0 ] == 0.0f && normal[ 1 ] == 0.0f && ( normal[ 2 ] == 1.0f || normal[ 2 ] == -1.0f ) ) {
@@ -1471,6 +1749,66 @@ float DirtForSample( trace_t *trace ){
 		CrossProduct( myRt, normal, myUp );
 		VectorNormalize( myUp, myUp );
 	}
+}
+
+
+
+/*
+   DirtForGather()
+   turns the occlusion a sample gathered over numRays rays into its dirt value
+ */
+
+static float DirtForGather( float gatherDirt, int numRays ){
+	float outDirt;
+
+
+	/* early out */
+	if ( gatherDirt <= 0.0f ) {
+		return 1.0f;
+	}
+
+	/* apply gain (does this even do much? heh) */
+	outDirt = pow( gatherDirt / numRays, dirtGain );
+	if ( outDirt > 1.0f ) {
+		outDirt = 1.0f;
+	}
+
+	/* apply scale */
+	outDirt *= dirtScale;
+	if ( outDirt > 1.0f ) {
+		outDirt = 1.0f;
+	}
+
+	/* return to sender */
+	return 1.0f - outDirt;
+}
+
+
+
+/*
+   DirtForSample()
+   calculates dirt value for a given sample
+ */
+
+float DirtForSample( trace_t *trace ){
+	int i;
+	float gatherDirt, angle, elevation, ooDepth;
+	vec3_t normal, myUp, myRt, temp, direction, displacement;
+
+
+	/* dummy check */
+	if ( !dirty ) {
+		return 1.0f;
+	}
+	if ( trace == NULL || trace->cluster < 0 ) {
+		return 0.0f;
+	}
+
+	/* setup */
+	gatherDirt = 0.0f;
+	ooDepth = 1.0f / dirtDepth;
+	VectorCopy( trace->normal, normal );
+	DirtBasis( normal, myRt, myUp );
 
 	/* 1 = random mode, 0 (well everything else) = non-random mode */
 	if ( dirtMode == 1 ) {
@@ -1538,79 +1876,132 @@ float DirtForSample( trace_t *trace ){
 		gatherDirt += 1.0f - ooDepth * VectorLength( displacement );
 	}
 
-	/* early out */
-	if ( gatherDirt <= 0.0f ) {
-		return 1.0f;
+	return DirtForGather( gatherDirt, numDirtVectors + 1 );
+}
+
+
+
+/*
+   DirtForSamplePacket()
+   DirtForSample() for a tile of samples: each ordered dirt vector is traced
+   from all of them as a packet (random mode traces sample by sample)
+ */
+
+void DirtForSamplePacket( trace_t **traces, int numTraces, float *dirts ){
+	int i, t, numPacket;
+	float gatherDirt[ MAX_TRACE_PACKET ], ooDepth;
+	vec3_t myUp[ MAX_TRACE_PACKET ], myRt[ MAX_TRACE_PACKET ], direction, displacement;
+	trace_t         *packet[ MAX_TRACE_PACKET ], *trace;
+
+
+	/* random vectors aren't shared between samples */
+	if ( !dirty || dirtMode == 1 ) {
+		for ( t = 0; t < numTraces; t++ )
+			dirts[ t ] = DirtForSample( traces[ t ] );
+		return;
 	}
 
-	/* apply gain (does this even do much? heh) */
-	outDirt = pow( gatherDirt / ( numDirtVectors + 1 ), dirtGain );
-	if ( outDirt > 1.0f ) {
-		outDirt = 1.0f;
+	/* setup */
+	ooDepth = 1.0f / dirtDepth;
+	numPacket = 0;
+	for ( t = 0; t < numTraces; t++ )
+	{
+		if ( traces[ t ]->cluster >= 0 ) {
+			gatherDirt[ numPacket ] = 0.0f;
+			DirtBasis( traces[ t ]->normal, myRt[ numPacket ], myUp[ numPacket ] );
+			packet[ numPacket++ ] = traces[ t ];
+		}
 	}
 
-	/* apply scale */
-	outDirt *= dirtScale;
-	if ( outDirt > 1.0f ) {
-		outDirt = 1.0f;
+	/* iterate through ordered vectors, then the direct ray */
+	for ( i = 0; i <= numDirtVectors; i++ )
+	{
+		for ( t = 0; t < numPacket; t++ )
+		{
+			trace = packet[ t ];
+
+			/* transform vector into tangent space */
+			if ( i < numDirtVectors ) {
+				direction[ 0 ] = myRt[ t ][ 0 ] * dirtVectors[ i ][ 0 ] + myUp[ t ][ 0 ] * dirtVectors[ i ][ 1 ] + trace->normal[ 0 ] * dirtVectors[ i ][ 2 ];
+				direction[ 1 ] = myRt[ t ][ 1 ] * dirtVectors[ i ][ 0 ] + myUp[ t ][ 1 ] * dirtVectors[ i ][ 1 ] + trace->normal[ 1 ] * dirtVectors[ i ][ 2 ];
+				direction[ 2 ] = myRt[ t ][ 2 ] * dirtVectors[ i ][ 0 ] + myUp[ t ][ 2 ] * dirtVectors[ i ][ 1 ] + trace->normal[ 2 ] * dirtVectors[ i ][ 2 ];
+			}
+			else{
+				VectorCopy( trace->normal, direction );
+			}
+
+			/* set endpoint */
+			VectorMA( trace->origin, dirtDepth, direction, trace->end );
+			SetupTrace( trace );
+			VectorSet( trace->color, 1.0f, 1.0f, 1.0f );
+		}
+
+		/* trace */
+		TraceLinePacket( packet, numPacket, -1 );
+		for ( t = 0; t < numPacket; t++ )
+		{
+			trace = packet[ t ];
+			if ( trace->opaque ) {
+				VectorSubtract( trace->hit, trace->origin, displacement );
+				gatherDirt[ t ] += 1.0f - ooDepth * VectorLength( displacement );
+			}
+		}
 	}
 
-	/* return to sender */
-	return 1.0f - outDirt;
+	/* get dirt */
+	for ( t = 0, i = 0; t < numTraces; t++ )
+	{
+		if ( traces[ t ]->cluster < 0 ) {
+			dirts[ t ] = 0.0f;
+		}
+		else{
+			dirts[ t ] = DirtForGather( gatherDirt[ i++ ], numDirtVectors + 1 );
+		}
+	}
 }
 
 
 
 /*
-   DirtyRawLightmap()
-   calculates dirty fraction for each luxel
+   SetupDirtTrace()
+   sets up the trace dirt rays of a raw lightmap are cast with,
+   returns qtrue if its surfaces shouldn't be dirtied
  */
 
-void DirtyRawLightmap( int rawLightmapNum ){
-	int i, x, y, sx, sy, *cluster;
-	float               *origin, *normal, *dirt, *dirt2, average, samples;
-	rawLightmap_t       *lm;
+static qboolean SetupDirtTrace( rawLightmap_t *lm, trace_t *trace ){
+	int i;
 	surfaceInfo_t       *info;
-	trace_t trace;
 	qboolean noDirty;
 
 
-	/* bail if this number exceeds the number of raw lightmaps */
-	if ( rawLightmapNum >= numRawLightmaps ) {
-		return;
-	}
-
-	/* get lightmap */
-	lm = &rawLightmaps[ rawLightmapNum ];
-
 	/* setup trace */
-	trace.testOcclusion = qtrue;
-	trace.forceSunlight = qfalse;
-	trace.recvShadows = lm->recvShadows;
-	trace.numSurfaces = lm->numLightSurfaces;
-	trace.surfaces = &lightSurfaces[ lm->firstLightSurface ];
-	trace.inhibitRadius = 0.0f;
-	trace.testAll = qfalse;
+	trace->testOcclusion = qtrue;
+	trace->forceSunlight = qfalse;
+	trace->recvShadows = lm->recvShadows;
+	trace->numSurfaces = lm->numLightSurfaces;
+	trace->surfaces = &lightSurfaces[ lm->firstLightSurface ];
+	trace->inhibitRadius = 0.0f;
+	trace->testAll = qfalse;
 
 	/* twosided lighting (may or may not be a good idea for lightmapped stuff) */
-	trace.twoSided = qfalse;
-	for ( i = 0; i < trace.numSurfaces; i++ )
+	trace->twoSided = qfalse;
+	for ( i = 0; i < trace->numSurfaces; i++ )
 	{
 		/* get surface */
-		info = &surfaceInfos[ trace.surfaces[ i ] ];
+		info = &surfaceInfos[ trace->surfaces[ i ] ];
 
 		/* check twosidedness */
 		if ( info->si->twoSided ) {
-			trace.twoSided = qtrue;
+			trace->twoSided = qtrue;
 			break;
 		}
 	}
 
 	noDirty = qfalse;
-	for ( i = 0; i < trace.numSurfaces; i++ )
+	for ( i = 0; i < trace->numSurfaces; i++ )
 	{
 		/* get surface */
-		info = &surfaceInfos[ trace.surfaces[ i ] ];
+		info = &surfaceInfos[ trace->surfaces[ i ] ];
 
 		/* check twosidedness */
 		if ( info->si->noDirty ) {
@@ -1619,45 +2010,21 @@ void DirtyRawLightmap( int rawLightmapNum ){
 		}
 	}
 
-	/* gather dirt */
-	for ( y = 0; y < lm->sh; y++ )
-	{
-		for ( x = 0; x < lm->sw; x++ )
-		{
-			/* get luxel */
-			cluster = SUPER_CLUSTER( x, y );
-			origin = SUPER_ORIGIN( x, y );
-			normal = SUPER_NORMAL( x, y );
-			dirt = SUPER_DIRT( x, y );
+	return noDirty;
+}
 
-			/* set default dirt */
-			*dirt = 0.0f;
 
-			/* only look at mapped luxels */
-			if ( *cluster < 0 ) {
-				continue;
-			}
 
-			/* don't apply dirty on this surface */
-			if ( noDirty ) {
-				*dirt = 1.0f;
-				continue;
-			}
-
-			/* copy to trace */
-			trace.cluster = *cluster;
-			VectorCopy( origin, trace.origin );
-			VectorCopy( normal, trace.normal );
+/*
+   FilterDirtRawLightmap()
+   blurs the dirt of each mapped luxel with its mapped neighbours
+ */
 
-			/* get dirt */
-			*dirt = DirtForSample( &trace );
-		}
-	}
+static void FilterDirtRawLightmap( rawLightmap_t *lm ){
+	int x, y, sx, sy, *cluster;
+	float               *dirt, *dirt2, average, samples;
 
-	/* testing no filtering */
-	//%	return;
 
-	/* filter dirt */
 	for ( y = 0; y < lm->sh; y++ )
 	{
 		for ( x = 0; x < lm->sw; x++ )
@@ -1712,6 +2079,94 @@ void DirtyRawLightmap( int rawLightmapNum ){
 
 
 
+/*
+   DirtyRawLightmap()
+   calculates dirty fraction for each luxel
+ */
+
+void DirtyRawLightmap( int rawLightmapNum ){
+	int i, x, y, tx, ty, *cluster, numTraces;
+	float               *origin, *normal, *dirt;
+	float               *dirts[ MAX_TRACE_PACKET ], tileDirts[ MAX_TRACE_PACKET ];
+	rawLightmap_t       *lm;
+	trace_t trace, traces[ MAX_TRACE_PACKET ], *packet[ MAX_TRACE_PACKET ];
+	qboolean noDirty;
+
+
+	/* bail if this number exceeds the number of raw lightmaps */
+	if ( rawLightmapNum >= numRawLightmaps ) {
+		return;
+	}
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
+
+	/* setup trace */
+	noDirty = SetupDirtTrace( lm, &trace );
+
+	/* every luxel of a tile gets its own copy of the trace */
+	for ( i = 0; i < MAX_TRACE_PACKET; i++ )
+	{
+		traces[ i ] = trace;
+		packet[ i ] = &traces[ i ];
+	}
+
+	/* gather dirt, a tile of luxels at a time */
+	for ( ty = 0; ty < lm->sh; ty += TRACE_PACKET_TILE )
+	{
+		for ( tx = 0; tx < lm->sw; tx += TRACE_PACKET_TILE )
+		{
+			numTraces = 0;
+			for ( y = ty; y < ty + TRACE_PACKET_TILE && y < lm->sh; y++ )
+			{
+				for ( x = tx; x < tx + TRACE_PACKET_TILE && x < lm->sw; x++ )
+				{
+					/* get luxel */
+					cluster = SUPER_CLUSTER( x, y );
+					origin = SUPER_ORIGIN( x, y );
+					normal = SUPER_NORMAL( x, y );
+					dirt = SUPER_DIRT( x, y );
+
+					/* set default dirt */
+					*dirt = 0.0f;
+
+					/* only look at mapped luxels */
+					if ( *cluster < 0 ) {
+						continue;
+					}
+
+					/* don't apply dirty on this surface */
+					if ( noDirty ) {
+						*dirt = 1.0f;
+						continue;
+					}
+
+					/* copy to trace */
+					traces[ numTraces ].cluster = *cluster;
+					VectorCopy( origin, traces[ numTraces ].origin );
+					VectorCopy( normal, traces[ numTraces ].normal );
+					dirts[ numTraces++ ] = dirt;
+				}
+			}
+
+			/* get dirt */
+			DirtForSamplePacket( packet, numTraces, tileDirts );
+			for ( i = 0; i < numTraces; i++ )
+				*dirts[ i ] = tileDirts[ i ];
+		}
+	}
+
+	/* testing no filtering */
+	//%	return;
+
+	/* filter dirt */
+	FilterDirtRawLightmap( lm );
+	ReleaseSuperBuffers( lm );
+}
+
+
+
 /*
    SubmapRawLuxel()
    calculates the pvs cluster, origin, normal of a sub-luxel
@@ -1980,75 +2435,548 @@ static void RandomSubsampleRawLuxel( rawLightmap_t *lm, trace_t *trace, vec3_t s
 
 
 /*
-   IlluminateRawLightmap()
-   illuminates the luxels
+   raw lightmap scheduling
+   luxel count times samples times surviving lights is a decent guess of what a raw
+   lightmap costs to illuminate. IlluminateRawLightmaps() hands them out most expensive
+   first, and cuts lightmaps that would otherwise keep one thread busy long after the
+   rest are done into bands of luxel rows that are lit in parallel.
  */
 
+#define MIN_TILE_ROWS           8
+#define TILES_PER_THREAD        4
+
+typedef struct lightmapCost_s
+{
+	float cost;
+	int numMappedLuxels;
+	int numLights;
+	qboolean tileable;
+	qboolean restored;
+	uint64_t cacheKey;              /* light cache entry of the first pass, 0 when not cached */
+	int numTiles;
+	std::atomic<int> tilesLeft;
+}
+lightmapCost_t;
+
+typedef struct lightmapWork_s
+{
+	int rawLightmapNum;
+	int firstRow, lastRow;
+	double time;
+}
+lightmapWork_t;
+
+static lightmapCost_t *lightmapCosts;
+static lightmapWork_t *lightmapWork;
+
+
+
+/*
+   SetupRawLightmapTrace()
+   sets up a trace for lighting a raw lightmap
+ */
+
+static void SetupRawLightmapTrace( rawLightmap_t *lm, trace_t *trace ){
+	int i;
+	surfaceInfo_t       *info;
+
+
+	/* setup trace */
+	trace->testOcclusion = !noTrace ? qtrue : qfalse;
+	trace->forceSunlight = qfalse;
+	trace->recvShadows = lm->recvShadows;
+	trace->numSurfaces = lm->numLightSurfaces;
+	trace->surfaces = &lightSurfaces[ lm->firstLightSurface ];
+	trace->inhibitRadius = DEFAULT_INHIBIT_RADIUS;
+	trace->skyVis = NULL;
+
+	/* twosided lighting (may or may not be a good idea for lightmapped stuff) */
+	trace->twoSided = qfalse;
+	for ( i = 0; i < trace->numSurfaces; i++ )
+	{
+		/* get surface */
+		info = &surfaceInfos[ trace->surfaces[ i ] ];
+
+		/* check twosidedness */
+		if ( info->si->twoSided ) {
+			trace->twoSided = qtrue;
+			break;
+		}
+	}
+}
+
+
+
 #define STACK_LL_SIZE           ( SUPER_LUXEL_SIZE * 64 * 64 )
 #define LIGHT_LUXEL( x, y )     ( lightLuxels + ( ( ( ( y ) * lm->sw ) + ( x ) ) * SUPER_LUXEL_SIZE ) )
 #define LIGHT_DELUXEL( x, y )       ( lightDeluxels + ( ( ( ( y ) * lm->sw ) + ( x ) ) * SUPER_DELUXEL_SIZE ) )
 
-void IlluminateRawLightmap( int rawLightmapNum ){
-	int i, t, x, y, sx, sy, size, luxelFilterRadius, lightmapNum;
-	int                 *cluster, *cluster2, mapped, lighted, totalLighted;
+/* -irrcache: lights are traced at the corners of cells this many luxels wide, cells
+   whose corners disagree are split in four until they are a luxel wide */
+#define IRRCACHE_CELL_SIZE      4
+#define IRRCACHE_NORMAL_EPSILON 0.98f   /* corners with normals further apart are never interpolated between */
+
+#define IRRCACHE_QUEUED         1
+#define IRRCACHE_TRACED         2
+#define IRRCACHE_FORCED         4       /* the trace asked for subsampling, a shadow edge is close */
+#define IRRCACHE_INTERPOLATED   8
+
+typedef struct irrCell_s
+{
+	int x0, y0, x1, y1;
+	qboolean centerTraced;                  /* large cells also have their center checked against the corners */
+}
+irrCell_t;
+
+typedef struct irrCache_s
+{
+	int firstRow;                       /* first row of the lightmap the storage covers */
+	unsigned char       *flags;         /* sw * rows, as ( y - firstRow ) * sw + x */
+	int                 *points;        /* sw * rows luxels to trace, as y * sw + x */
+	irrCell_t           *cells[ 3 ];    /* current, next and accepted cells, sw * rows each */
+}
+irrCache_t;
+
+
+
+/*
+   LightRawLuxelPacket()
+   traces the light at up to MAX_TRACE_PACKET luxels of a raw lightmap and stores its
+   contribution in the per-light luxels, returns the number of luxels it lit
+   skyVis and irrFlags only cover the rows from scratchFirstRow on
+ */
+
+static int LightRawLuxelPacket( rawLightmap_t *lm, trace_t **packet, light_t *light, const int *tileX, const int *tileY, int numTraces,
+								int cacheTile, float *lightLuxels, float *lightDeluxels, uint64_t *skyVis, qboolean subsample, unsigned char *irrFlags,
+								int scratchFirstRow ){
+	int t, x, y, lighted, results[ MAX_TRACE_PACKET ];
+	float               *lightLuxel, *lightDeluxel;
+	unsigned char       *flag;
+	trace_t             *trace;
+
+
+	/* setup traces */
+	for ( t = 0; t < numTraces; t++ )
+	{
+		trace = packet[ t ];
+		trace->light = light;
+		trace->cluster = *SUPER_CLUSTER( tileX[ t ], tileY[ t ] );
+		VectorCopy( SUPER_ORIGIN( tileX[ t ], tileY[ t ] ), trace->origin );
+		VectorCopy( SUPER_NORMAL( tileX[ t ], tileY[ t ] ), trace->normal );
+		trace->skyVis = skyVis != NULL ? &skyVis[ ( ( tileY[ t ] - scratchFirstRow ) * lm->sw + tileX[ t ] ) * skyVisSize ] : NULL;
+	}
+
+	/* get light for these samples */
+	LightContributionToSamplePacket( packet, numTraces, cacheTile, results );
+
+	lighted = 0;
+	for ( t = 0; t < numTraces; t++ )
+	{
+		/* get particulars */
+		trace = packet[ t ];
+		x = tileX[ t ];
+		y = tileY[ t ];
+		lightLuxel = LIGHT_LUXEL( x, y );
+		lightDeluxel = LIGHT_DELUXEL( x, y );
+		flag = SUPER_FLAG( x, y );
+
+		/* set contribution count */
+		lightLuxel[ 3 ] = 1.0f;
+		VectorCopy( trace->color, lightLuxel );
+
+		/* add the contribution to the deluxemap */
+		if ( deluxemap ) {
+			VectorCopy( trace->directionContribution, lightDeluxel );
+		}
+
+		/* note it for the irradiance cache */
+		if ( irrFlags != NULL ) {
+			irrFlags[ ( y - scratchFirstRow ) * lm->sw + x ] |= IRRCACHE_TRACED | ( trace->forceSubsampling > 1.0f ? IRRCACHE_FORCED : 0 );
+		}
+
+		/* check for evilness */
+		if ( trace->forceSubsampling > 1.0f && subsample ) {
+			lighted++;
+			*flag |= FLAG_FORCE_SUBSAMPLING; /* force */
+		}
+		/* add to count */
+		else if ( trace->color[ 0 ] || trace->color[ 1 ] || trace->color[ 2 ] ) {
+			lighted++;
+		}
+	}
+
+	return lighted;
+}
+
+
+
+/*
+   IrradianceQueueLuxel()
+   adds a mapped luxel to the list the irradiance cache traces next
+ */
+
+static inline void IrradianceQueueLuxel( rawLightmap_t *lm, irrCache_t *ic, int *numPoints, int x, int y ){
+	unsigned char       *flag = &ic->flags[ ( y - ic->firstRow ) * lm->sw + x ];
+
+	if ( *flag & IRRCACHE_QUEUED ) {
+		return;
+	}
+	*flag |= IRRCACHE_QUEUED;
+	if ( *SUPER_CLUSTER( x, y ) >= 0 ) {
+		ic->points[ ( *numPoints )++ ] = y * lm->sw + x;
+	}
+}
+
+
+
+/*
+   IrradianceCellAgrees()
+   tests if the traced corners of a cell are close enough to interpolate the luxels between
+   them: all mapped, on the same side of any shadow edge, facing the same way and, when lit,
+   within irrCacheError of the brightest. once its center is traced, that has to match the
+   interpolated value too, which catches shadows and light spots that miss every corner
+ */
+
+static qboolean IrradianceCellAgrees( rawLightmap_t *lm, irrCache_t *ic, const irrCell_t *cell, float *lightLuxels ){
+	int i, x, y, lit;
+	float brightness, minBrightness, maxBrightness, center, *lightLuxel, *normal;
+
+
+	lit = 0;
+	center = 0.0f;
+	minBrightness = maxBrightness = 0.0f;
+	normal = SUPER_NORMAL( cell->x0, cell->y0 );
+	for ( i = 0; i < 4; i++ )
+	{
+		x = ( i & 1 ) ? cell->x1 : cell->x0;
+		y = ( i & 2 ) ? cell->y1 : cell->y0;
+
+		/* corners in the void or by a shadow edge need their neighbours traced */
+		if ( *SUPER_CLUSTER( x, y ) < 0 || ( ic->flags[ ( y - ic->firstRow ) * lm->sw + x ] & IRRCACHE_FORCED ) ) {
+			return qfalse;
+		}
+		if ( DotProduct( normal, SUPER_NORMAL( x, y ) ) < IRRCACHE_NORMAL_EPSILON ) {
+			return qfalse;
+		}
+
+		lightLuxel = LIGHT_LUXEL( x, y );
+		brightness = lightLuxel[ 0 ] + lightLuxel[ 1 ] + lightLuxel[ 2 ];
+		if ( brightness > 0.0f ) {
+			lit++;
+		}
+		if ( i == 0 || brightness < minBrightness ) {
+			minBrightness = brightness;
+		}
+		if ( i == 0 || brightness > maxBrightness ) {
+			maxBrightness = brightness;
+		}
+		center += 0.25f * brightness;
+	}
+
+	/* a shadow edge crossing the cell */
+	if ( lit != 0 && lit != 4 ) {
+		return qfalse;
+	}
+
+	/* smooth enough to interpolate */
+	if ( ( maxBrightness - minBrightness ) > irrCacheError * maxBrightness ) {
+		return qfalse;
+	}
+
+	/* the center has to be where the corners put it */
+	if ( cell->centerTraced ) {
+		x = ( cell->x0 + cell->x1 ) / 2;
+		y = ( cell->y0 + cell->y1 ) / 2;
+		if ( *SUPER_CLUSTER( x, y ) < 0 || ( ic->flags[ ( y - ic->firstRow ) * lm->sw + x ] & IRRCACHE_FORCED ) ) {
+			return qfalse;
+		}
+		lightLuxel = LIGHT_LUXEL( x, y );
+		brightness = lightLuxel[ 0 ] + lightLuxel[ 1 ] + lightLuxel[ 2 ];
+		if ( fabs( brightness - center ) > irrCacheError * ( brightness > maxBrightness ? brightness : maxBrightness ) ) {
+			return qfalse;
+		}
+	}
+
+	return qtrue;
+}
+
+
+
+/*
+   IrradianceCacheRawLuxels()
+   -irrcache version of the initial per-light pass over rows [firstRow, lastRow): the light
+   is traced at the corners of IRRCACHE_CELL_SIZE cells, cells are split until their
+   corners agree and the luxels inside agreeing cells are interpolated bilinearly from their
+   corners, deluxels included. returns the number of luxels it lit
+ */
+
+static int IrradianceCacheRawLuxels( rawLightmap_t *lm, int rawLightmapNum, irrCache_t *ic, trace_t **packet, light_t *light, int firstRow, int lastRow,
+									 float *lightLuxels, float *lightDeluxels, uint64_t *skyVis, qboolean subsample ){
+	int i, j, t, x, y, lighted, numPoints, numCells, numNext, numAccepted, numTraced, numInterpolated, mx, my, cacheTile;
+	int numXs, numYs, xs[ 4 ], ys[ 4 ], tileX[ MAX_TRACE_PACKET ], tileY[ MAX_TRACE_PACKET ];
+	float u, v, w[ 4 ], *lightLuxel, *lightDeluxel, *corner;
+	irrCell_t           *cells, *next, *accepted, *cell, *swap;
+
+
+	/* clear flags */
+	memset( &ic->flags[ ( firstRow - ic->firstRow ) * lm->sw ], 0, lm->sw * ( lastRow - firstRow ) );
+	cells = ic->cells[ 0 ];
+	next = ic->cells[ 1 ];
+	accepted = ic->cells[ 2 ];
+	numCells = numAccepted = numPoints = 0;
+	lighted = numTraced = numInterpolated = 0;
+
+	/* lay the top level cells out on a lattice aligned to the whole lightmap, so row tiles agree on shared rows */
+	for ( y = firstRow; y < lastRow - 1; y = ( y / IRRCACHE_CELL_SIZE + 1 ) * IRRCACHE_CELL_SIZE )
+	{
+		for ( x = 0; x < lm->sw - 1; x += IRRCACHE_CELL_SIZE )
+		{
+			cell = &cells[ numCells++ ];
+			cell->x0 = x;
+			cell->y0 = y;
+			cell->x1 = x + IRRCACHE_CELL_SIZE < lm->sw - 1 ? x + IRRCACHE_CELL_SIZE : lm->sw - 1;
+			cell->y1 = ( y / IRRCACHE_CELL_SIZE + 1 ) * IRRCACHE_CELL_SIZE < lastRow - 1 ? ( y / IRRCACHE_CELL_SIZE + 1 ) * IRRCACHE_CELL_SIZE : lastRow - 1;
+			cell->centerTraced = qfalse;
+		}
+	}
+
+	/* single row or column lightmaps have degenerate cells */
+	if ( numCells == 0 ) {
+		for ( y = firstRow; y < lastRow; y++ )
+		{
+			for ( x = 0; x < lm->sw; x++ )
+			{
+				cell = &cells[ numCells++ ];
+				cell->x0 = cell->x1 = x;
+				cell->y0 = cell->y1 = y;
+				cell->centerTraced = qfalse;
+			}
+		}
+	}
+
+	/* queue the top level corners */
+	for ( i = 0; i < numCells; i++ )
+	{
+		cell = &cells[ i ];
+		IrradianceQueueLuxel( lm, ic, &numPoints, cell->x0, cell->y0 );
+		IrradianceQueueLuxel( lm, ic, &numPoints, cell->x1, cell->y0 );
+		IrradianceQueueLuxel( lm, ic, &numPoints, cell->x0, cell->y1 );
+		IrradianceQueueLuxel( lm, ic, &numPoints, cell->x1, cell->y1 );
+	}
+
+	while ( numCells > 0 )
+	{
+		/* trace the queued luxels, a packet at a time */
+		for ( i = 0; i < numPoints; i += MAX_TRACE_PACKET )
+		{
+			for ( t = 0; t < MAX_TRACE_PACKET && i + t < numPoints; t++ )
+			{
+				tileX[ t ] = ic->points[ i + t ] % lm->sw;
+				tileY[ t ] = ic->points[ i + t ] / lm->sw;
+			}
+			cacheTile = ( rawLightmapNum & 0x7fff ) * 65536 + ( tileY[ 0 ] / SHADOW_CACHE_TILE ) * 256 + tileX[ 0 ] / SHADOW_CACHE_TILE;
+			lighted += LightRawLuxelPacket( lm, packet, light, tileX, tileY, t, cacheTile, lightLuxels, lightDeluxels, skyVis, subsample, ic->flags, ic->firstRow );
+			numTraced += t;
+		}
+		numPoints = 0;
+
+		/* accept the cells whose corners agree, split the others */
+		numNext = 0;
+		for ( i = 0; i < numCells; i++ )
+		{
+			cell = &cells[ i ];
+
+			/* cells a luxel wide have nothing between their corners */
+			if ( cell->x1 - cell->x0 <= 1 && cell->y1 - cell->y0 <= 1 ) {
+				continue;
+			}
+			if ( IrradianceCellAgrees( lm, ic, cell, lightLuxels ) ) {
+				/* cells with more than a luxel between their corners get their center traced before they are trusted */
+				if ( !cell->centerTraced && ( cell->x1 - cell->x0 > 2 || cell->y1 - cell->y0 > 2 ) ) {
+					IrradianceQueueLuxel( lm, ic, &numPoints, ( cell->x0 + cell->x1 ) / 2, ( cell->y0 + cell->y1 ) / 2 );
+					next[ numNext ] = *cell;
+					next[ numNext++ ].centerTraced = qtrue;
+				}
+				else{
+					accepted[ numAccepted++ ] = *cell;
+				}
+				continue;
+			}
+
+			/* split along the sides that are still more than a luxel long */
+			numXs = numYs = 0;
+			xs[ numXs++ ] = cell->x0;
+			if ( cell->x1 - cell->x0 > 1 ) {
+				xs[ numXs++ ] = ( cell->x0 + cell->x1 ) / 2;
+			}
+			xs[ numXs++ ] = cell->x1;
+			ys[ numYs++ ] = cell->y0;
+			if ( cell->y1 - cell->y0 > 1 ) {
+				ys[ numYs++ ] = ( cell->y0 + cell->y1 ) / 2;
+			}
+			ys[ numYs++ ] = cell->y1;
+
+			for ( my = 0; my < numYs; my++ )
+			{
+				for ( mx = 0; mx < numXs; mx++ )
+					IrradianceQueueLuxel( lm, ic, &numPoints, xs[ mx ], ys[ my ] );
+			}
+			for ( my = 0; my < numYs - 1; my++ )
+			{
+				for ( mx = 0; mx < numXs - 1; mx++ )
+				{
+					next[ numNext ].x0 = xs[ mx ];
+					next[ numNext ].y0 = ys[ my ];
+					next[ numNext ].x1 = xs[ mx + 1 ];
+					next[ numNext ].y1 = ys[ my + 1 ];
+					next[ numNext++ ].centerTraced = qfalse;
+				}
+			}
+		}
+
+		/* descend */
+		swap = cells;
+		cells = next;
+		next = swap;
+		numCells = numNext;
+	}
+
+	/* interpolate the luxels inside agreeing cells that weren't traced by a neighbour */
+	for ( i = 0; i < numAccepted; i++ )
+	{
+		cell = &accepted[ i ];
+		for ( y = cell->y0; y <= cell->y1; y++ )
+		{
+			v = cell->y1 > cell->y0 ? (float) ( y - cell->y0 ) / ( cell->y1 - cell->y0 ) : 0.0f;
+			for ( x = cell->x0; x <= cell->x1; x++ )
+			{
+				if ( *SUPER_CLUSTER( x, y ) < 0 || ( ic->flags[ ( y - ic->firstRow ) * lm->sw + x ] & ( IRRCACHE_TRACED | IRRCACHE_INTERPOLATED ) ) ) {
+					continue;
+				}
+				ic->flags[ ( y - ic->firstRow ) * lm->sw + x ] |= IRRCACHE_INTERPOLATED;
+				u = cell->x1 > cell->x0 ? (float) ( x - cell->x0 ) / ( cell->x1 - cell->x0 ) : 0.0f;
+				w[ 0 ] = ( 1.0f - u ) * ( 1.0f - v );
+				w[ 1 ] = u * ( 1.0f - v );
+				w[ 2 ] = ( 1.0f - u ) * v;
+				w[ 3 ] = u * v;
+
+				lightLuxel = LIGHT_LUXEL( x, y );
+				lightDeluxel = LIGHT_DELUXEL( x, y );
+				VectorClear( lightLuxel );
+				if ( deluxemap ) {
+					VectorClear( lightDeluxel );
+				}
+				for ( j = 0; j < 4; j++ )
+				{
+					corner = LIGHT_LUXEL( ( j & 1 ) ? cell->x1 : cell->x0, ( j & 2 ) ? cell->y1 : cell->y0 );
+					VectorMA( lightLuxel, w[ j ], corner, lightLuxel );
+					if ( deluxemap ) {
+						corner = LIGHT_DELUXEL( ( j & 1 ) ? cell->x1 : cell->x0, ( j & 2 ) ? cell->y1 : cell->y0 );
+						VectorMA( lightDeluxel, w[ j ], corner, lightDeluxel );
+					}
+				}
+				lightLuxel[ 3 ] = 1.0f;
+				numInterpolated++;
+
+				if ( lightLuxel[ 0 ] || lightLuxel[ 1 ] || lightLuxel[ 2 ] ) {
+					lighted++;
+				}
+			}
+		}
+	}
+
+	THREAD_STAT( irrCacheTraced ) += numTraced;
+	THREAD_STAT( irrCacheInterpolated ) += numInterpolated;
+
+	return lighted;
+}
+
+
+
+/*
+   LuxelFilterRadius()
+   returns how many luxels the contribution of a light is filtered across on a raw lightmap
+ */
+
+static int LuxelFilterRadius( rawLightmap_t *lm, light_t *light ){
+	int luxelFilterRadius;
+	float filterRadius;
+
+
+	/* determine filter radius */
+	filterRadius = lm->filterRadius > light->filterRadius
+				   ? lm->filterRadius
+				   : light->filterRadius;
+	if ( filterRadius < 0.0f ) {
+		filterRadius = 0.0f;
+	}
+
+	/* set luxel filter radius */
+	luxelFilterRadius = lm->sampleSize != 0 ? superSample * filterRadius / lm->sampleSize : 0;
+	if ( luxelFilterRadius == 0 && ( filterRadius > 0.0f || filter ) ) {
+		luxelFilterRadius = 1;
+	}
+
+	return luxelFilterRadius;
+}
+
+
+
+/*
+   IlluminateRawLightmapRows()
+   illuminates the luxels in rows [firstRow, lastRow) of a raw lightmap
+ */
+
+static void IlluminateRawLightmapRows( int rawLightmapNum, int firstRow, int lastRow ){
+	int i, t, x, y, tx, ty, sx, sy, size, luxelFilterRadius, lightmapNum, lightFirstRow, lightLastRow, scratchFirstRow;
+	int                 *cluster, mapped, lighted, totalLighted, numTraces, cacheTile;
+	int tileX[ MAX_TRACE_PACKET ], tileY[ MAX_TRACE_PACKET ];
+	int numListLights, numCutLights;
 	size_t llSize, ldSize;
+	qboolean subsample;
+	irrCache_t irrCache;
+	light_t             **listLights, **cutLights;
+	uint64_t            *skyVis;
 	rawLightmap_t       *lm;
-	surfaceInfo_t       *info;
-	qboolean filterColor, filterDir;
 	float brightness;
-	float               *origin, *normal, *dirt, *luxel, *luxel2, *deluxel, *deluxel2;
+	float               *origin, *normal, *dirt, *luxel, *deluxel;
 	unsigned char           *flag;
-	float               *lightLuxels, *lightDeluxels, *lightLuxel, *lightDeluxel, samples, filterRadius, weight;
+	float               *lightLuxels, *lightDeluxels, *lightLuxel, *lightDeluxel, samples, weight;
 	vec3_t color, direction, averageColor, averageDir, total, temp, temp2;
 	float tests[ 4 ][ 2 ] = { { 0.0f, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 } };
-	trace_t trace;
+	trace_t trace, traces[ MAX_TRACE_PACKET ], *packet[ MAX_TRACE_PACKET ];
 	float stackLightLuxels[ STACK_LL_SIZE ];
 
 
-	/* bail if this number exceeds the number of raw lightmaps */
-	if ( rawLightmapNum >= numRawLightmaps ) {
-		return;
-	}
-
 	/* get lightmap */
 	lm = &rawLightmaps[ rawLightmapNum ];
 
 	/* setup trace */
-	trace.testOcclusion = !noTrace ? qtrue : qfalse;
-	trace.forceSunlight = qfalse;
-	trace.recvShadows = lm->recvShadows;
-	trace.numSurfaces = lm->numLightSurfaces;
-	trace.surfaces = &lightSurfaces[ lm->firstLightSurface ];
-	trace.inhibitRadius = DEFAULT_INHIBIT_RADIUS;
+	SetupRawLightmapTrace( lm, &trace );
 
-	/* twosided lighting (may or may not be a good idea for lightmapped stuff) */
-	trace.twoSided = qfalse;
-	for ( i = 0; i < trace.numSurfaces; i++ )
-	{
-		/* get surface */
-		info = &surfaceInfos[ trace.surfaces[ i ] ];
+	/* cull lights again, holding on to the lists from the cost estimate would keep one per lightmap alive */
+	CreateTraceLightsForBounds( lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace );
 
-		/* check twosidedness */
-		if ( info->si->twoSided ) {
-			trace.twoSided = qtrue;
-			break;
-		}
+	/* -bouncecut: the diffuse lights are sampled through light trees */
+	listLights = trace.lights;
+	numListLights = trace.numLights;
+	cutLights = CreateLightCuts( trace.lights, trace.numLights, &numCutLights );
+	if ( cutLights != NULL ) {
+		trace.lights = cutLights;
+		trace.numLights = numCutLights;
 	}
 
-	/* create a culled light list for this raw lightmap */
-	CreateTraceLightsForBounds( lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace );
-
 	/* -----------------------------------------------------------------
 	   fill pass
 	   ----------------------------------------------------------------- */
 
 	/* set counts */
-	numLuxelsIlluminated += ( lm->sw * lm->sh );
+	THREAD_STAT( numLuxelsIlluminated ) += ( lm->sw * ( lastRow - firstRow ) );
 
 	/* test debugging state */
 	if ( debugSurfaces || debugAxis || debugCluster || debugOrigin || dirtDebug || normalmap ) {
 		/* debug fill the luxels */
-		for ( y = 0; y < lm->sh; y++ )
+		for ( y = firstRow; y < lastRow; y++ )
 		{
 			for ( x = 0; x < lm->sw; x++ )
 			{
@@ -2127,11 +3055,39 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 			lightDeluxels = NULL;
 		}
 
+		/* the scratch storage below only covers the rows any light's filter reaches from ours */
+		luxelFilterRadius = 0;
+		for ( i = 0; i < trace.numLights; i++ )
+			luxelFilterRadius = std::max( luxelFilterRadius, LuxelFilterRadius( lm, trace.lights[ i ] ) );
+		scratchFirstRow = std::max( firstRow - luxelFilterRadius, 0 );
+		size = lm->sw * ( std::min( lastRow + luxelFilterRadius, lm->sh ) - scratchFirstRow );
+
+		/* allocate irradiance cache storage */
+		memset( &irrCache, 0, sizeof( irrCache ) );
+		if ( irrCacheError > 0.0f ) {
+			irrCache.firstRow = scratchFirstRow;
+			irrCache.flags = static_cast<unsigned char *>(safe_malloc(size));
+			irrCache.points = static_cast<int *>(safe_malloc(size * sizeof( int )));
+			for ( i = 0; i < 3; i++ )
+				irrCache.cells[ i ] = static_cast<irrCell_t *>(safe_malloc(size * sizeof( irrCell_t )));
+		}
+
+		/* allocate sky visibility storage when suns share sky bins here */
+		skyVis = NULL;
+		for ( i = 0; i < trace.numLights && skyVisSize > 0; i++ )
+		{
+			if ( trace.lights[ i ]->skyBin > 0 ) {
+				skyVis = static_cast<uint64_t *>(safe_malloc(size * skyVisSize * sizeof( uint64_t )));
+				memset( skyVis, 0, size * skyVisSize * sizeof( uint64_t ) );
+				break;
+			}
+		}
+
 		/* clear luxels */
 		//%	memset( lm->superLuxels[ 0 ], 0, llSize );
 
 		/* set ambient color */
-		for ( y = 0; y < lm->sh; y++ )
+		for ( y = firstRow; y < lastRow; y++ )
 		{
 			for ( x = 0; x < lm->sw; x++ )
 			{
@@ -2166,11 +3122,11 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 		}
 
 		/* clear styled lightmaps */
-		size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
+		size = lm->sw * ( lastRow - firstRow ) * SUPER_LUXEL_SIZE * sizeof( float );
 		for ( lightmapNum = 1; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
 		{
 			if ( lm->superLuxels[ lightmapNum ] != NULL ) {
-				memset( lm->superLuxels[ lightmapNum ], 0, size );
+				memset( SUPER_LUXEL( lightmapNum, 0, firstRow ), 0, size );
 			}
 		}
 
@@ -2178,6 +3134,13 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 		//%	if( trace.numLights <= 0 )
 		//%		Sys_Printf( "Lightmap %9d: 0 lights, axis: %.2f, %.2f, %.2f\n", rawLightmapNum, lm->axis[ 0 ], lm->axis[ 1 ], lm->axis[ 2 ] );
 
+		/* every luxel of a tile gets its own copy of the trace */
+		for ( t = 0; t < MAX_TRACE_PACKET; t++ )
+		{
+			traces[ t ] = trace;
+			packet[ t ] = &traces[ t ];
+		}
+
 		/* walk light list */
 		for ( i = 0; i < trace.numLights; i++ )
 		{
@@ -2199,90 +3162,60 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 				continue;
 			}
 
+			/* set luxel filter radius */
+			luxelFilterRadius = LuxelFilterRadius( lm, trace.light );
+
+			/* the filter reaches into the rows around ours, so light those too */
+			lightFirstRow = firstRow - luxelFilterRadius > 0 ? firstRow - luxelFilterRadius : 0;
+			lightLastRow = lastRow + luxelFilterRadius < lm->sh ? lastRow + luxelFilterRadius : lm->sh;
+
 			/* setup */
-			memset( lightLuxels, 0, llSize );
+			memset( LIGHT_LUXEL( 0, lightFirstRow ), 0, lm->sw * ( lightLastRow - lightFirstRow ) * SUPER_LUXEL_SIZE * sizeof( float ) );
 			if ( deluxemap ) {
-				memset( lightDeluxels, 0, ldSize );
+				memset( LIGHT_DELUXEL( 0, lightFirstRow ), 0, lm->sw * ( lightLastRow - lightFirstRow ) * SUPER_DELUXEL_SIZE * sizeof( float ) );
 			}
 			totalLighted = 0;
 
-			/* determine filter radius */
-			filterRadius = lm->filterRadius > trace.light->filterRadius
-						   ? lm->filterRadius
-						   : trace.light->filterRadius;
-			if ( filterRadius < 0.0f ) {
-				filterRadius = 0.0f;
-			}
-
-			/* set luxel filter radius */
-			luxelFilterRadius = lm->sampleSize != 0 ? superSample * filterRadius / lm->sampleSize : 0;
-			if ( luxelFilterRadius == 0 && ( filterRadius > 0.0f || filter ) ) {
-				luxelFilterRadius = 1;
-			}
-
 			/* allocate sampling flags storage */
 			if ( ( lightSamples > 1 || lightRandomSamples ) && luxelFilterRadius == 0 ) {
 				size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( unsigned char );
 				if ( lm->superFlags == NULL ) {
 					lm->superFlags = static_cast<unsigned char*>(safe_malloc(size));
-				}
-				memset( (void *) lm->superFlags, 0, size );
-			}
-
-			/* initial pass, one sample per luxel */
-			for ( y = 0; y < lm->sh; y++ )
-			{
-				for ( x = 0; x < lm->sw; x++ )
-				{
-					/* get cluster */
-					cluster = SUPER_CLUSTER( x, y );
-					if ( *cluster < 0 ) {
-						continue;
-					}
-
-					/* get particulars */
-					lightLuxel = LIGHT_LUXEL( x, y );
-					lightDeluxel = LIGHT_DELUXEL( x, y );
-					origin = SUPER_ORIGIN( x, y );
-					normal = SUPER_NORMAL( x, y );
-					flag = SUPER_FLAG( x, y );
-
-#if 0
-					////////// 27's temp hack for testing edge clipping ////
-					if ( origin[0] == 0 && origin[1] == 0 && origin[2] == 0 ) {
-						lightLuxel[ 1 ] = 255;
-						lightLuxel[ 3 ] = 1.0f;
-						totalLighted++;
-					}
-					else
-#endif
-					{
-						/* set contribution count */
-						lightLuxel[ 3 ] = 1.0f;
-
-						/* setup trace */
-						trace.cluster = *cluster;
-						VectorCopy( origin, trace.origin );
-						VectorCopy( normal, trace.normal );
+				}
+				memset( (void *) lm->superFlags, 0, size );
+			}
 
-						/* get light for this sample */
-						LightContributionToSample( &trace );
-						VectorCopy( trace.color, lightLuxel );
+			/* initial pass, sparse with the irradiance cache */
+			subsample = ( ( lightSamples > 1 || lightRandomSamples ) && luxelFilterRadius == 0 ) ? qtrue : qfalse;
+			if ( irrCache.flags != NULL ) {
+				totalLighted = IrradianceCacheRawLuxels( lm, rawLightmapNum, &irrCache, packet, trace.light, lightFirstRow, lightLastRow,
+														 lightLuxels, lightDeluxels, skyVis, subsample );
+			}
 
-						/* add the contribution to the deluxemap */
-						if ( deluxemap ) {
-							VectorCopy( trace.directionContribution, lightDeluxel );
+			/* or one sample per luxel, traced a tile of luxels at a time */
+			else
+			{
+				for ( ty = lightFirstRow; ty < lightLastRow; ty += TRACE_PACKET_TILE )
+				{
+					for ( tx = 0; tx < lm->sw; tx += TRACE_PACKET_TILE )
+					{
+						/* setup traces */
+						numTraces = 0;
+						for ( y = ty; y < ty + TRACE_PACKET_TILE && y < lightLastRow; y++ )
+						{
+							for ( x = tx; x < tx + TRACE_PACKET_TILE && x < lm->sw; x++ )
+							{
+								/* only look at mapped luxels */
+								if ( *SUPER_CLUSTER( x, y ) >= 0 ) {
+									tileX[ numTraces ] = x;
+									tileY[ numTraces++ ] = y;
+								}
+							}
 						}
 
-						/* check for evilness */
-						if ( trace.forceSubsampling > 1.0f && ( lightSamples > 1 || lightRandomSamples ) && luxelFilterRadius == 0 ) {
-							totalLighted++;
-							*flag |= FLAG_FORCE_SUBSAMPLING; /* force */
-						}
-						/* add to count */
-						else if ( trace.color[ 0 ] || trace.color[ 1 ] || trace.color[ 2 ] ) {
-							totalLighted++;
-						}
+						/* get light for these samples, neighbouring tiles share shadow cache entries */
+						cacheTile = ( rawLightmapNum & 0x7fff ) * 65536 + ( ty / SHADOW_CACHE_TILE ) * 256 + tx / SHADOW_CACHE_TILE;
+						totalLighted += LightRawLuxelPacket( lm, packet, trace.light, tileX, tileY, numTraces, cacheTile, lightLuxels, lightDeluxels, skyVis, subsample, NULL, scratchFirstRow );
 					}
 				}
 			}
@@ -2296,7 +3229,7 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 			/* 2003-09-27: changed it so filtering disamples supersampling, as it would waste time */
 			if ( ( lightSamples > 1 || lightRandomSamples ) && luxelFilterRadius == 0 ) {
 				/* walk luxels */
-				for ( y = 0; y < ( lm->sh - 1 ); y++ )
+				for ( y = lightFirstRow; y < ( lightLastRow - 1 ); y++ )
 				{
 					for ( x = 0; x < ( lm->sw - 1 ); x++ )
 					{
@@ -2421,7 +3354,7 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 			}
 
 			/* copy to permanent luxels */
-			for ( y = 0; y < lm->sh; y++ )
+			for ( y = firstRow; y < lastRow; y++ )
 			{
 				for ( x = 0; x < lm->sw; x++ )
 				{
@@ -2551,10 +3484,38 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 		if ( deluxemap ) {
 			free( lightDeluxels );
 		}
+
+		if ( irrCache.flags != NULL ) {
+			free( irrCache.flags );
+			free( irrCache.points );
+			for ( i = 0; i < 3; i++ )
+				free( irrCache.cells[ i ] );
+		}
+
+		free( skyVis );
 	}
 
 	/* free light list */
+	FreeLightCuts( cutLights, numCutLights );
+	trace.lights = listLights;
+	trace.numLights = numListLights;
 	FreeTraceLights( &trace );
+}
+
+
+
+/*
+   FinishIlluminatedRawLightmap()
+   applies floodlight and dirt and fills in unmapped luxels once all rows have been lit
+ */
+
+static void FinishIlluminatedRawLightmap( rawLightmap_t *lm ){
+	int x, y, sx, sy, lightmapNum;
+	int                 *cluster, *cluster2;
+	qboolean filterColor, filterDir;
+	float               *normal, *dirt, *luxel, *luxel2, *deluxel, *deluxel2, samples;
+	vec3_t averageColor, averageDir;
+
 
 	/* floodlight pass */
 	if ( g_floodlight ) {
@@ -2778,6 +3739,280 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 
 
 
+/*
+   IlluminateRawLightmap()
+   illuminates the luxels
+ */
+
+void IlluminateRawLightmap( int rawLightmapNum ){
+	/* bail if this number exceeds the number of raw lightmaps */
+	if ( rawLightmapNum >= numRawLightmaps ) {
+		return;
+	}
+
+	AcquireSuperBuffers( &rawLightmaps[ rawLightmapNum ] );
+	IlluminateRawLightmapRows( rawLightmapNum, 0, rawLightmaps[ rawLightmapNum ].sh );
+	FinishIlluminatedRawLightmap( &rawLightmaps[ rawLightmapNum ] );
+	if ( !bouncing ) {
+		CheckpointWriteRawLightmap( rawLightmapNum );
+		LightCacheWriteRawLightmap( rawLightmapNum, lightmapCosts[ rawLightmapNum ].cacheKey );
+	}
+	ReleaseSuperBuffers( &rawLightmaps[ rawLightmapNum ] );
+}
+
+
+
+/*
+   EstimateRawLightmapCost()
+   culls the lights for a raw lightmap and guesses how long it will take to illuminate
+ */
+
+static void EstimateRawLightmapCost( int rawLightmapNum ){
+	int i, x, y, samples;
+	rawLightmap_t       *lm;
+	lightmapCost_t      *lc;
+	trace_t trace;
+
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	lc = &lightmapCosts[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
+
+	/* a resumed run takes the lightmaps it already finished from the checkpoint */
+	lc->restored = !bouncing && CheckpointRestoreRawLightmap( rawLightmapNum ) ? qtrue : qfalse;
+	lc->cacheKey = 0;
+	if ( lc->restored ) {
+		lc->numLights = 0;
+		lc->numMappedLuxels = 0;
+		lc->cost = 0.0f;
+		lc->tileable = qfalse;
+		ReleaseSuperBuffers( lm );
+		return;
+	}
+
+	/* cull the lights, only the count is kept, the illumination pass culls them again */
+	SetupRawLightmapTrace( lm, &trace );
+	CreateTraceLightsForBounds( lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace );
+	lc->numLights = trace.numLights;
+
+	/* a relight takes the lightmaps whose inputs didn't change from the light cache */
+	lc->cacheKey = !bouncing ? LightCacheRawLightmapKey( rawLightmapNum, trace.lights, trace.numLights ) : 0;
+	if ( LightCacheRestoreRawLightmap( rawLightmapNum, lc->cacheKey ) ) {
+		FreeTraceLights( &trace );
+		CheckpointWriteRawLightmap( rawLightmapNum );
+		lc->restored = qtrue;
+		lc->cacheKey = 0;
+		lc->numLights = 0;
+		lc->numMappedLuxels = 0;
+		lc->cost = 0.0f;
+		lc->tileable = qfalse;
+		ReleaseSuperBuffers( lm );
+		return;
+	}
+
+	/* count mapped luxels */
+	lc->numMappedLuxels = 0;
+	for ( y = 0; y < lm->sh; y++ )
+	{
+		for ( x = 0; x < lm->sw; x++ )
+		{
+			if ( *SUPER_CLUSTER( x, y ) >= 0 ) {
+				lc->numMappedLuxels++;
+			}
+		}
+	}
+
+	/* one trace per luxel per light, more where it gets supersampled, plus the per-luxel filtering */
+	samples = ( lightSamples > 1 || lightRandomSamples ) ? lightSamples : 1;
+	lc->cost = (float) lc->numMappedLuxels * samples * lc->numLights + lm->sw * lm->sh;
+
+	/* luxels can only be lit independently of the rows next to them without supersampling, and
+	   every light has to land in the first lightmap style so tiles never pick styles concurrently */
+	lc->tileable = ( numthreads > 1 && lm->sh >= 2 * MIN_TILE_ROWS && lm->superLuxels[ 0 ] != NULL &&
+					 !( lightSamples > 1 || lightRandomSamples ) &&
+					 !( debugSurfaces || debugAxis || debugCluster || debugOrigin || dirtDebug || normalmap ) ) ? qtrue : qfalse;
+	for ( i = 0; i < trace.numLights && lc->tileable; i++ )
+	{
+		if ( trace.lights[ i ]->style != lm->styles[ 0 ] ) {
+			lc->tileable = qfalse;
+		}
+	}
+	FreeTraceLights( &trace );
+	ReleaseSuperBuffers( lm );
+}
+
+
+
+/*
+   IlluminateRawLightmapWork()
+   RunThreadsOnIndividual callback for one entry of the sorted work list
+ */
+
+static void IlluminateRawLightmapWork( int num ){
+	lightmapWork_t      *work;
+	double start;
+
+
+	work = &lightmapWork[ num ];
+	start = I_PreciseTime();
+
+	if ( lightmapCosts[ work->rawLightmapNum ].numTiles == 1 ) {
+		IlluminateRawLightmap( work->rawLightmapNum );
+	}
+	else
+	{
+		AcquireSuperBuffers( &rawLightmaps[ work->rawLightmapNum ] );
+		IlluminateRawLightmapRows( work->rawLightmapNum, work->firstRow, work->lastRow );
+
+		/* the last tile to finish does the passes that need the whole lightmap */
+		if ( lightmapCosts[ work->rawLightmapNum ].tilesLeft.fetch_sub( 1 ) == 1 ) {
+			FinishIlluminatedRawLightmap( &rawLightmaps[ work->rawLightmapNum ] );
+			if ( !bouncing ) {
+				CheckpointWriteRawLightmap( work->rawLightmapNum );
+				LightCacheWriteRawLightmap( work->rawLightmapNum, lightmapCosts[ work->rawLightmapNum ].cacheKey );
+			}
+		}
+		ReleaseSuperBuffers( &rawLightmaps[ work->rawLightmapNum ] );
+	}
+
+	work->time = I_PreciseTime() - start;
+}
+
+
+
+/*
+   CompareRawLightmapCost()
+   qsort callback, most expensive first
+ */
+
+static int CompareRawLightmapCost( const void *a, const void *b ){
+	int an = *( (const int*) a ), bn = *( (const int*) b );
+
+	if ( lightmapCosts[ an ].cost > lightmapCosts[ bn ].cost ) {
+		return -1;
+	}
+	if ( lightmapCosts[ an ].cost < lightmapCosts[ bn ].cost ) {
+		return 1;
+	}
+	return an - bn;
+}
+
+
+
+/*
+   IlluminateRawLightmaps()
+   illuminates all raw lightmaps, most expensive first
+ */
+
+void IlluminateRawLightmaps( void ){
+	int i, j, num, numWork, numTiled, numTiles, tileRows, *order;
+	float totalCost, tileCost;
+	double *times;
+	rawLightmap_t       *lm;
+	lightmapCost_t      *lc;
+
+
+	ProfileBeginPhase( "IlluminateRawLightmap" );
+
+	/* cull lights and estimate costs */
+	lightmapCosts = new lightmapCost_t[ numRawLightmaps ];
+	RunThreadsOnIndividual( numRawLightmaps, qfalse, EstimateRawLightmapCost );
+
+	/* sort */
+	order = static_cast<int*>( safe_malloc( numRawLightmaps * sizeof( int ) ) );
+	totalCost = 0.0f;
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		order[ i ] = i;
+		totalCost += lightmapCosts[ i ].cost;
+	}
+	qsort( order, numRawLightmaps, sizeof( int ), CompareRawLightmapCost );
+
+	/* anything costing more than this gets split */
+	tileCost = totalCost / ( numthreads * TILES_PER_THREAD );
+
+	/* count work items */
+	numWork = 0;
+	numTiled = 0;
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		lm = &rawLightmaps[ i ];
+		lc = &lightmapCosts[ i ];
+		numTiles = lc->restored ? 0 : 1;
+		if ( lc->tileable && lc->cost > tileCost ) {
+			numTiles = (int) ceil( lc->cost / tileCost );
+			if ( numTiles > lm->sh / MIN_TILE_ROWS ) {
+				numTiles = lm->sh / MIN_TILE_ROWS;
+			}
+			if ( numTiles > 1 ) {
+				numTiled++;
+			}
+		}
+		lc->numTiles = numTiles;
+		lc->tilesLeft = numTiles;
+		numWork += numTiles;
+	}
+
+	/* build the work list, largest first */
+	lightmapWork = static_cast<lightmapWork_t*>( safe_malloc( numWork * sizeof( *lightmapWork ) ) );
+	numWork = 0;
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		num = order[ i ];
+		lm = &rawLightmaps[ num ];
+		numTiles = lightmapCosts[ num ].numTiles;
+		if ( numTiles == 0 ) {
+			continue;
+		}
+		tileRows = lm->sh / numTiles;
+		for ( j = 0; j < numTiles; j++ )
+		{
+			lightmapWork[ numWork ].rawLightmapNum = num;
+			lightmapWork[ numWork ].firstRow = j * tileRows;
+			lightmapWork[ numWork ].lastRow = j == numTiles - 1 ? lm->sh : ( j + 1 ) * tileRows;
+			lightmapWork[ numWork ].time = 0.0;
+			numWork++;
+		}
+	}
+	if ( numTiled > 0 ) {
+		Sys_FPrintf( SYS_VRB, "%9d large lightmaps split into %d work items\n", numTiled, numWork - numRawLightmaps + numTiled );
+	}
+
+	/* illuminate */
+	RunThreadsOnIndividual( numWork, qtrue, IlluminateRawLightmapWork );
+
+	/* log estimated against measured cost so the model can be checked */
+	if ( verbose ) {
+		times = static_cast<double*>( safe_malloc( numRawLightmaps * sizeof( double ) ) );
+		memset( times, 0, numRawLightmaps * sizeof( double ) );
+		for ( i = 0; i < numWork; i++ )
+			times[ lightmapWork[ i ].rawLightmapNum ] += lightmapWork[ i ].time;
+		Sys_FPrintf( SYS_VRB, "--- IlluminateRawLightmap costs ---\n" );
+		for ( i = 0; i < numRawLightmaps; i++ )
+		{
+			num = order[ i ];
+			lc = &lightmapCosts[ num ];
+			Sys_FPrintf( SYS_VRB, "Lightmap %6d: %4d x %4d, %7d luxels, %5d lights, cost %12.0f, %10.3f ms\n",
+						 num, rawLightmaps[ num ].sw, rawLightmaps[ num ].sh, lc->numMappedLuxels, lc->numLights, lc->cost, times[ num ] * 1000.0 );
+		}
+		free( times );
+	}
+
+	/* free any light list that couldn't be given back right away */
+	ResetTraceLightArenas();
+
+	delete[] lightmapCosts;
+	lightmapCosts = NULL;
+	free( lightmapWork );
+	lightmapWork = NULL;
+	free( order );
+
+	ProfileEndPhase();
+}
+
+
+
 /*
    IlluminateVertexes()
    light the surface vertexes
@@ -2817,6 +4052,7 @@ void IlluminateVertexes( int num ){
 		trace.numSurfaces = 1;
 		trace.surfaces = &num;
 		trace.inhibitRadius = DEFAULT_INHIBIT_RADIUS;
+		trace.skyVis = NULL;
 
 		/* twosided lighting */
 		trace.twoSided = info->si->twoSided ? qtrue : qfalse;
@@ -2995,7 +4231,7 @@ void IlluminateVertexes( int num ){
 			}
 
 			/* another happy customer */
-			numVertsIlluminated++;
+			THREAD_STAT( numVertsIlluminated )++;
 		}
 
 		/* set average color */
@@ -3037,12 +4273,15 @@ void IlluminateVertexes( int num ){
 				if ( bouncing || bounce == 0 || !bounceOnly ) {
 					VectorAdd( vertLuxel, radVertLuxel, vertLuxel );
 				}
-				if ( !info->si->noVertexLight ) {
-					ColorToBytes( vertLuxel, verts[ i ].color[ lightmapNum ], info->si->vertexScale );
-				}
 			}
 		}
 
+		/* store the vertex colors to bytes */
+		if ( !info->si->noVertexLight ) {
+			for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+				ColorsToBytes( VERTEX_LUXEL( lightmapNum, ds->firstVert ), VERTEX_LUXEL_SIZE, verts[ 0 ].color[ lightmapNum ], sizeof( *verts ), ds->numVerts, info->si->vertexScale );
+		}
+
 		/* free light list */
 		FreeTraceLights( &trace );
 
@@ -3063,6 +4302,7 @@ void IlluminateVertexes( int num ){
 	maxRadius = maxRadius > lm->sh ? maxRadius : lm->sh;
 
 	/* walk the surface verts */
+	AcquireSuperBuffers( lm );
 	verts = yDrawVerts + ds->firstVert;
 	for ( i = 0; i < ds->numVerts; i++ )
 	{
@@ -3156,14 +4396,20 @@ void IlluminateVertexes( int num ){
 
 			/* store into floating point storage */
 			VectorAdd( vertLuxel, radVertLuxel, vertLuxel );
-			numVertsIlluminated++;
+			THREAD_STAT( numVertsIlluminated )++;
+		}
+	}
 
-			/* store into bytes (for vertex approximation) */
-			if ( !info->si->noVertexLight ) {
-				ColorToBytes( vertLuxel, verts[ i ].color[ lightmapNum ], 1.0f );
+	/* store into bytes (for vertex approximation) */
+	if ( !info->si->noVertexLight ) {
+		for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+		{
+			if ( lm->superLuxels[ lightmapNum ] != NULL ) {
+				ColorsToBytes( VERTEX_LUXEL( lightmapNum, ds->firstVert ), VERTEX_LUXEL_SIZE, verts[ 0 ].color[ lightmapNum ], sizeof( *verts ), ds->numVerts, 1.0f );
 			}
 		}
 	}
+	ReleaseSuperBuffers( lm );
 }
 
 
@@ -3529,48 +4775,345 @@ int ShaderForPointInLeaf( vec3_t point, int leafNum, float epsilon, int wantCont
 			if ( dot > epsilon ) {
 				inside = qfalse;
 			}
-			else
+			else
+			{
+				shader = &bspShaders[ side->shaderNum ];
+				allSurfaceFlags |= shader->surfaceFlags;
+				allContentFlags |= shader->contentFlags;
+			}
+		}
+
+		/* handle if inside */
+		if ( inside ) {
+			/* if there are desired flags, check for same and continue if they aren't matched */
+			if ( wantContentFlags && !( wantContentFlags & allContentFlags ) ) {
+				continue;
+			}
+			if ( wantSurfaceFlags && !( wantSurfaceFlags & allSurfaceFlags ) ) {
+				continue;
+			}
+
+			/* store the cumulative flags and return the brush shader (which is mostly useless) */
+			*surfaceFlags = allSurfaceFlags;
+			*contentFlags = allContentFlags;
+			return brush->shaderNum;
+		}
+	}
+
+	/* if the point made it this far, it's not inside any brushes */
+	return -1;
+}
+
+
+
+/*
+   ChopBounds()
+   chops a bounding box by the plane defined by origin and normal
+   returns qfalse if the bounds is entirely clipped away
+
+   this is not exactly the fastest way to do this...
+ */
+
+qboolean ChopBounds( vec3_t mins, vec3_t maxs, vec3_t origin, vec3_t normal ){
+	/* FIXME: rewrite this so it doesn't use bloody brushes */
+	return qtrue;
+}
+
+
+
+/* -------------------------------------------------------------------------------
+
+   light index
+
+   ------------------------------------------------------------------------------- */
+
+#define LIGHT_INDEX_MAX_CELLS   32          /* cells along each axis of the light grid */
+#define LIGHT_INDEX_MIN_CELL    128.0f      /* smallest light grid cell size in units */
+#define LIGHT_INDEX_LARGE       512         /* lights reaching more cells than this are tested by every query */
+#define LIGHT_ARENA_BLOCK       65536       /* light list pointers per arena block */
+
+typedef struct indexedLight_s
+{
+	light_t             *light;
+	const uint64_t      *visRow;            /* pvs of the light's cluster, NULL if it has none */
+}
+indexedLight_t;
+
+typedef struct lightArenaBlock_s
+{
+	struct lightArenaBlock_s    *next;
+	int size, used;
+	light_t                     **lights;
+}
+lightArenaBlock_t;
+
+typedef struct lightIndexThread_s
+{
+	uint64_t                    *candidates;    /* one bit per indexed light */
+	uint64_t                    *clusters;      /* one bit per pvs cluster */
+	lightArenaBlock_t           *arena;
+}
+lightIndexThread_t;
+
+static int numIndexedLights, numLightWords;
+static indexedLight_t           *indexedLights = NULL;
+static uint64_t                 *alwaysTestedLights = NULL;     /* suns and lights too large for the grid */
+
+static vec3_t lightGridMins, lightGridScale;
+static int lightGridSize[ 3 ];
+static int                      *lightCellFirst = NULL, *lightCellLights = NULL;
+
+static int numVisClusters, numVisWords;
+static uint64_t                 *visRows = NULL;
+
+static int numLightIndexThreads = 0;
+static lightIndexThread_t       *lightIndexThreads = NULL;
+
+
+
+/*
+   SetupLightVisRows()
+   copies the pvs into 64 bit rows, each with its own cluster set, so testing a light
+   against a set of clusters takes an AND per row word
+ */
+
+static void SetupLightVisRows( void ){
+	int i, leafBytes;
+	uint64_t        *row;
+
+
+	/* already done or not vised */
+	if ( visRows != NULL || numBSPVisBytes <= VIS_HEADER_SIZE ) {
+		return;
+	}
+
+	/* copy the rows */
+	numVisClusters = ( (int*) bspVisBytes )[ 0 ];
+	leafBytes = ( (int*) bspVisBytes )[ 1 ];
+	numVisWords = ( leafBytes + 7 ) / 8;
+	visRows = static_cast<uint64_t*>( safe_malloc( std::max( numVisClusters * numVisWords, 1 ) * sizeof( uint64_t ) ) );
+	memset( visRows, 0, numVisClusters * numVisWords * sizeof( uint64_t ) );
+	for ( i = 0; i < numVisClusters; i++ )
+	{
+		row = &visRows[ i * numVisWords ];
+		memcpy( row, bspVisBytes + VIS_HEADER_SIZE + i * leafBytes, leafBytes );
+
+		/* ClusterVisible() always sees a cluster from itself */
+		row[ i >> 6 ] |= 1ull << ( i & 63 );
+	}
+}
+
+
+
+/*
+   LightGridCell()
+   the light grid cell along an axis that a coordinate falls in, clamped to the grid
+ */
+
+static inline int LightGridCell( float v, int axis ){
+	int cell;
+
+
+	cell = (int) floor( ( v - lightGridMins[ axis ] ) * lightGridScale[ axis ] );
+	if ( cell < 0 ) {
+		return 0;
+	}
+	if ( cell >= lightGridSize[ axis ] ) {
+		return lightGridSize[ axis ] - 1;
+	}
+	return cell;
+}
+
+
+
+/*
+   SetupLightIndex()
+   puts the lights into a contiguous array in list order and files each one into the cells
+   of a uniform grid its envelope reaches, so CreateTraceLightsForBounds() only has to look
+   at the lights of the cells a bounding box touches
+ */
+
+static void SetupLightIndex( void ){
+	int i, j, x, y, z, num, numCells, numEntries, lo[ 3 ], hi[ 3 ];
+	int                 *cellCounts;
+	float size;
+	vec3_t mins, maxs;
+	light_t             *light;
+	indexedLight_t      *il;
+
+
+	/* free the old index */
+	free( indexedLights );
+	free( alwaysTestedLights );
+	free( lightCellFirst );
+	free( lightCellLights );
+	SetupLightVisRows();
+
+	/* copy the lights */
+	numIndexedLights = 0;
+	for ( light = lights; light != NULL; light = light->next )
+		numIndexedLights++;
+	numLightWords = ( numIndexedLights + 63 ) / 64;
+	indexedLights = static_cast<indexedLight_t*>( safe_malloc( std::max( numIndexedLights, 1 ) * sizeof( indexedLight_t ) ) );
+	alwaysTestedLights = static_cast<uint64_t*>( safe_malloc( std::max( numLightWords, 1 ) * sizeof( uint64_t ) ) );
+	memset( alwaysTestedLights, 0, numLightWords * sizeof( uint64_t ) );
+	for ( i = 0, light = lights; light != NULL; i++, light = light->next )
+	{
+		il = &indexedLights[ i ];
+		il->light = light;
+		il->visRow = ( visRows != NULL && light->cluster >= 0 && light->cluster < numVisClusters ) ? &visRows[ light->cluster * numVisWords ] : NULL;
+	}
+
+	/* size the grid to the world, the border cells take everything beyond it */
+	VectorCopy( bspModels[ 0 ].mins, mins );
+	VectorCopy( bspModels[ 0 ].maxs, maxs );
+	for ( j = 0; j < 3; j++ )
+	{
+		if ( mins[ j ] > maxs[ j ] ) {
+			mins[ j ] = maxs[ j ] = 0.0f;
+		}
+		lightGridMins[ j ] = mins[ j ];
+		size = std::max( ( maxs[ j ] - mins[ j ] ) / LIGHT_INDEX_MAX_CELLS, LIGHT_INDEX_MIN_CELL );
+		lightGridSize[ j ] = std::min( (int) ceil( ( maxs[ j ] - mins[ j ] ) / size ), LIGHT_INDEX_MAX_CELLS );
+		lightGridSize[ j ] = std::max( lightGridSize[ j ], 1 );
+		lightGridScale[ j ] = 1.0f / size;
+	}
+	numCells = lightGridSize[ 0 ] * lightGridSize[ 1 ] * lightGridSize[ 2 ];
+
+	/* count the lights of each cell, the bounds are padded so rounding can't lose a light */
+	cellCounts = static_cast<int*>( safe_malloc( numCells * sizeof( int ) ) );
+	memset( cellCounts, 0, numCells * sizeof( int ) );
+	numEntries = 0;
+	for ( num = 0; num < 2; num++ )
+	{
+		for ( i = 0; i < numIndexedLights; i++ )
+		{
+			light = indexedLights[ i ].light;
+			if ( light->envelope <= 0.0f ) {
+				continue;
+			}
+			if ( light->type == EMIT_SUN ) {
+				alwaysTestedLights[ i >> 6 ] |= 1ull << ( i & 63 );
+				continue;
+			}
+			for ( j = 0; j < 3; j++ )
 			{
-				shader = &bspShaders[ side->shaderNum ];
-				allSurfaceFlags |= shader->surfaceFlags;
-				allContentFlags |= shader->contentFlags;
+				lo[ j ] = LightGridCell( light->origin[ j ] - light->envelope - 1.0f, j );
+				hi[ j ] = LightGridCell( light->origin[ j ] + light->envelope + 1.0f, j );
 			}
-		}
-
-		/* handle if inside */
-		if ( inside ) {
-			/* if there are desired flags, check for same and continue if they aren't matched */
-			if ( wantContentFlags && !( wantContentFlags & allContentFlags ) ) {
+			if ( ( hi[ 0 ] - lo[ 0 ] + 1 ) * ( hi[ 1 ] - lo[ 1 ] + 1 ) * ( hi[ 2 ] - lo[ 2 ] + 1 ) > LIGHT_INDEX_LARGE ) {
+				alwaysTestedLights[ i >> 6 ] |= 1ull << ( i & 63 );
 				continue;
 			}
-			if ( wantSurfaceFlags && !( wantSurfaceFlags & allSurfaceFlags ) ) {
-				continue;
+			for ( z = lo[ 2 ]; z <= hi[ 2 ]; z++ )
+			{
+				for ( y = lo[ 1 ]; y <= hi[ 1 ]; y++ )
+				{
+					for ( x = lo[ 0 ]; x <= hi[ 0 ]; x++ )
+					{
+						j = ( z * lightGridSize[ 1 ] + y ) * lightGridSize[ 0 ] + x;
+						if ( num == 0 ) {
+							cellCounts[ j ]++;
+						}
+						else{
+							lightCellLights[ lightCellFirst[ j ] + cellCounts[ j ]++ ] = i;
+						}
+					}
+				}
 			}
+		}
 
-			/* store the cumulative flags and return the brush shader (which is mostly useless) */
-			*surfaceFlags = allSurfaceFlags;
-			*contentFlags = allContentFlags;
-			return brush->shaderNum;
+		/* lay the cells out after the counting pass */
+		if ( num == 0 ) {
+			lightCellFirst = static_cast<int*>( safe_malloc( ( numCells + 1 ) * sizeof( int ) ) );
+			for ( j = 0; j < numCells; j++ )
+			{
+				lightCellFirst[ j ] = numEntries;
+				numEntries += cellCounts[ j ];
+				cellCounts[ j ] = 0;
+			}
+			lightCellFirst[ numCells ] = numEntries;
+			lightCellLights = static_cast<int*>( safe_malloc( std::max( numEntries, 1 ) * sizeof( int ) ) );
 		}
 	}
+	free( cellCounts );
 
-	/* if the point made it this far, it's not inside any brushes */
-	return -1;
+	/* per-thread query scratch */
+	if ( numLightIndexThreads < numthreads ) {
+		lightIndexThreads = static_cast<lightIndexThread_t*>( realloc( lightIndexThreads, numthreads * sizeof( lightIndexThread_t ) ) );
+		memset( &lightIndexThreads[ numLightIndexThreads ], 0, ( numthreads - numLightIndexThreads ) * sizeof( lightIndexThread_t ) );
+		numLightIndexThreads = numthreads;
+	}
+	for ( i = 0; i < numLightIndexThreads; i++ )
+	{
+		free( lightIndexThreads[ i ].candidates );
+		lightIndexThreads[ i ].candidates = static_cast<uint64_t*>( safe_malloc( std::max( numLightWords, 1 ) * sizeof( uint64_t ) ) );
+		if ( lightIndexThreads[ i ].clusters == NULL && visRows != NULL ) {
+			lightIndexThreads[ i ].clusters = static_cast<uint64_t*>( safe_malloc( std::max( numVisWords, 1 ) * sizeof( uint64_t ) ) );
+			memset( lightIndexThreads[ i ].clusters, 0, numVisWords * sizeof( uint64_t ) );
+		}
+	}
+
+	/* emit some statistics */
+	Sys_FPrintf( SYS_VRB, "%9d lights indexed in %d x %d x %d cells (%d entries)\n",
+				 numIndexedLights, lightGridSize[ 0 ], lightGridSize[ 1 ], lightGridSize[ 2 ], numEntries );
 }
 
 
 
 /*
-   ChopBounds()
-   chops a bounding box by the plane defined by origin and normal
-   returns qfalse if the bounds is entirely clipped away
+   AllocTraceLights()
+   takes a light list from the calling thread's arena
+ */
 
-   this is not exactly the fastest way to do this...
+static light_t **AllocTraceLights( int count ){
+	lightArenaBlock_t   *block;
+	lightIndexThread_t  *lt;
+
+
+	/* find room */
+	lt = &lightIndexThreads[ GetThreadNum() ];
+	block = lt->arena;
+	if ( block == NULL || block->size - block->used < count ) {
+		block = static_cast<lightArenaBlock_t*>( safe_malloc( sizeof( *block ) ) );
+		block->size = std::max( count, LIGHT_ARENA_BLOCK );
+		block->used = 0;
+		block->lights = static_cast<light_t**>( safe_malloc( block->size * sizeof( light_t* ) ) );
+		block->next = lt->arena;
+		lt->arena = block;
+	}
+
+	/* take it */
+	block->used += count;
+	return &block->lights[ block->used - count ];
+}
+
+
+
+/*
+   ResetTraceLightArenas()
+   frees every light list at once, keeping one block per thread for the next phase
  */
 
-qboolean ChopBounds( vec3_t mins, vec3_t maxs, vec3_t origin, vec3_t normal ){
-	/* FIXME: rewrite this so it doesn't use bloody brushes */
-	return qtrue;
+void ResetTraceLightArenas( void ){
+	int i;
+	lightArenaBlock_t   *block, *next;
+
+
+	for ( i = 0; i < numLightIndexThreads; i++ )
+	{
+		block = lightIndexThreads[ i ].arena;
+		if ( block == NULL ) {
+			continue;
+		}
+		for ( next = block->next; next != NULL; next = block->next )
+		{
+			block->next = next->next;
+			free( next->lights );
+			free( next );
+		}
+		block->used = 0;
+	}
 }
 
 
@@ -3595,6 +5138,7 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag ){
 
 	/* early out for weird cases where there are no lights */
 	if ( lights == NULL ) {
+		SetupLightIndex();
 		return;
 	}
 
@@ -3908,6 +5452,48 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag ){
 	/* emit some statistics */
 	Sys_Printf( "%9d total lights\n", numLights );
 	Sys_Printf( "%9d culled lights\n", numCulledLights );
+
+	/* index them for CreateTraceLightsForBounds() */
+	SetupLightIndex();
+}
+
+
+
+/*
+   LightVisibleToClusters()
+   ClusterVisible() from the light's cluster to any of the clusters, which are
+   set in words minWord to maxWord of the thread's cluster row
+ */
+
+static inline qboolean LightVisibleToClusters( const indexedLight_t *il, const lightIndexThread_t *lt, int numClusters, const int *clusters, int minWord, int maxWord ){
+	int i;
+
+
+	/* not vised: visible from any valid cluster */
+	if ( visRows == NULL ) {
+		if ( il->light->cluster < 0 ) {
+			return qfalse;
+		}
+		for ( i = 0; i < numClusters; i++ )
+		{
+			if ( clusters[ i ] >= 0 ) {
+				return qtrue;
+			}
+		}
+		return qfalse;
+	}
+
+	/* and the light's pvs row with the clusters */
+	if ( il->visRow == NULL ) {
+		return qfalse;
+	}
+	for ( i = minWord; i <= maxWord; i++ )
+	{
+		if ( il->visRow[ i ] & lt->clusters[ i ] ) {
+			return qtrue;
+		}
+	}
+	return qfalse;
 }
 
 
@@ -3918,8 +5504,11 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag ){
  */
 
 void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int numClusters, int *clusters, int flags, trace_t *trace ){
-	int i;
+	int i, j, y, z, lo[ 3 ], hi[ 3 ], minWord, maxWord, numEntries, numTested;
+	uint64_t word, bit;
 	light_t     *light;
+	indexedLight_t      *il;
+	lightIndexThread_t  *lt;
 	vec3_t origin, dir, nullVector = { 0.0f, 0.0f, 0.0f };
 	float radius, dist, length;
 
@@ -3932,8 +5521,9 @@ void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int nu
 	/* debug code */
 	//% Sys_Printf( "CTWLFB: (%4.1f %4.1f %4.1f) (%4.1f %4.1f %4.1f)\n", mins[ 0 ], mins[ 1 ], mins[ 2 ], maxs[ 0 ], maxs[ 1 ], maxs[ 2 ] );
 
-	/* allocate the light list */
-	trace->lights = static_cast<light_t**>(safe_malloc(sizeof( light_t*) * (numLights + 1)));
+	/* allocate the light list, the part left unused is given back at the end */
+	lt = &lightIndexThreads[ GetThreadNum() ];
+	trace->lights = AllocTraceLights( numIndexedLights + 1 );
 	trace->numLights = 0;
 
 	/* calculate spherical bounds */
@@ -3952,99 +5542,162 @@ void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int nu
 		length = 0;
 	}
 
-	/* test each light and see if it reaches the sphere */
-	/* note: the attenuation code MUST match LightingAtSample() */
-	for ( light = lights; light; light = light->next )
-	{
-		/* check zero sized envelope */
-		if ( light->envelope <= 0 ) {
-			lightsEnvelopeCulled++;
-			continue;
+	/* set the pvs clusters to test against */
+	minWord = numVisWords;
+	maxWord = -1;
+	if ( numClusters > 0 && clusters != NULL && visRows != NULL ) {
+		for ( i = 0; i < numClusters; i++ )
+		{
+			if ( clusters[ i ] >= 0 && clusters[ i ] < numVisClusters ) {
+				j = clusters[ i ] >> 6;
+				lt->clusters[ j ] |= 1ull << ( clusters[ i ] & 63 );
+				minWord = std::min( minWord, j );
+				maxWord = std::max( maxWord, j );
+			}
 		}
+	}
 
-		/* check flags */
-		if ( !( light->flags & flags ) ) {
-			continue;
+	/* gather the lights filed in the grid cells the sphere touches */
+	for ( j = 0; j < 3; j++ )
+	{
+		lo[ j ] = LightGridCell( origin[ j ] - radius, j );
+		hi[ j ] = LightGridCell( origin[ j ] + radius, j );
+	}
+	numEntries = 0;
+	for ( z = lo[ 2 ]; z <= hi[ 2 ]; z++ )
+	{
+		for ( y = lo[ 1 ]; y <= hi[ 1 ]; y++ )
+		{
+			j = ( z * lightGridSize[ 1 ] + y ) * lightGridSize[ 0 ];
+			numEntries += lightCellFirst[ j + hi[ 0 ] + 1 ] - lightCellFirst[ j + lo[ 0 ] ];
+		}
+	}
+	if ( numEntries >= numIndexedLights ) {
+		/* big bounds reach most lights, testing them all is cheaper */
+		memset( lt->candidates, 0xff, numLightWords * sizeof( uint64_t ) );
+		if ( numIndexedLights & 63 ) {
+			lt->candidates[ numLightWords - 1 ] = ( 1ull << ( numIndexedLights & 63 ) ) - 1;
+		}
+	}
+	else
+	{
+		memcpy( lt->candidates, alwaysTestedLights, numLightWords * sizeof( uint64_t ) );
+		for ( z = lo[ 2 ]; z <= hi[ 2 ]; z++ )
+		{
+			for ( y = lo[ 1 ]; y <= hi[ 1 ]; y++ )
+			{
+				j = ( z * lightGridSize[ 1 ] + y ) * lightGridSize[ 0 ];
+				for ( i = lightCellFirst[ j + lo[ 0 ] ]; i < lightCellFirst[ j + hi[ 0 ] + 1 ]; i++ )
+					lt->candidates[ lightCellLights[ i ] >> 6 ] |= 1ull << ( lightCellLights[ i ] & 63 );
+			}
 		}
+	}
+
+	/* test each light that may reach the sphere, in light list order */
+	/* note: the attenuation code MUST match LightingAtSample() */
+	numTested = 0;
+	for ( i = 0; i < numLightWords; i++ )
+	{
+		word = lt->candidates[ i ];
+		for ( j = i * 64, bit = 1; word != 0; j++, bit <<= 1 )
+		{
+			if ( !( word & bit ) ) {
+				continue;
+			}
+			word &= ~bit;
+			il = &indexedLights[ j ];
+			light = il->light;
+			numTested++;
+
+			/* check zero sized envelope */
+			if ( light->envelope <= 0 ) {
+				THREAD_STAT( lightsEnvelopeCulled )++;
+				continue;
+			}
 
-		/* sunlight skips all this nonsense */
-		if ( light->type != EMIT_SUN ) {
-			/* sun only? */
-			if ( sunOnly ) {
+			/* check flags */
+			if ( !( light->flags & flags ) ) {
 				continue;
 			}
 
-			/* check against pvs cluster */
-			if ( numClusters > 0 && clusters != NULL ) {
-				for ( i = 0; i < numClusters; i++ )
-				{
-					if ( ClusterVisible( light->cluster, clusters[ i ] ) ) {
-						break;
-					}
+			/* sunlight skips all this nonsense */
+			if ( light->type != EMIT_SUN ) {
+				/* sun only? */
+				if ( sunOnly ) {
+					continue;
 				}
 
-				/* fixme! */
-				if ( i == numClusters ) {
-					lightsClusterCulled++;
+				/* check against pvs cluster */
+				if ( numClusters > 0 && clusters != NULL && !LightVisibleToClusters( il, lt, numClusters, clusters, minWord, maxWord ) ) {
+					THREAD_STAT( lightsClusterCulled )++;
 					continue;
 				}
-			}
 
-			/* if the light's bounding sphere intersects with the bounding sphere then this light needs to be tested */
-			VectorSubtract( light->origin, origin, dir );
-			dist = VectorLength( dir );
-			dist -= light->envelope;
-			dist -= radius;
-			if ( dist > 0 ) {
-				lightsEnvelopeCulled++;
-				continue;
+				/* if the light's bounding sphere intersects with the bounding sphere then this light needs to be tested */
+				VectorSubtract( light->origin, origin, dir );
+				dist = VectorLength( dir );
+				dist -= light->envelope;
+				dist -= radius;
+				if ( dist > 0 ) {
+					THREAD_STAT( lightsEnvelopeCulled )++;
+					continue;
+				}
 			}
 
-			/* check bounding box against light's pvs envelope (note: this code never eliminated any lights, so disabling it) */
-			#if 0
-			skip = qfalse;
-			for ( i = 0; i < 3; i++ )
-			{
-				if ( mins[ i ] > light->maxs[ i ] || maxs[ i ] < light->mins[ i ] ) {
-					skip = qtrue;
+			/* planar surfaces (except twosided surfaces) have a couple more checks */
+			if ( length > 0.0f && trace->twoSided == qfalse ) {
+				/* lights coplanar with a surface won't light it */
+				if ( !( light->flags & LIGHT_TWOSIDED ) && DotProduct( light->normal, normal ) > 0.999f ) {
+					THREAD_STAT( lightsPlaneCulled )++;
+					continue;
 				}
-			}
-			if ( skip ) {
-				lightsBoundsCulled++;
-				continue;
-			}
-			#endif
-		}
 
-		/* planar surfaces (except twosided surfaces) have a couple more checks */
-		if ( length > 0.0f && trace->twoSided == qfalse ) {
-			/* lights coplanar with a surface won't light it */
-			if ( !( light->flags & LIGHT_TWOSIDED ) && DotProduct( light->normal, normal ) > 0.999f ) {
-				lightsPlaneCulled++;
-				continue;
+				/* check to see if light is behind the plane */
+				if ( DotProduct( light->origin, normal ) - DotProduct( origin, normal ) < -1.0f ) {
+					THREAD_STAT( lightsPlaneCulled )++;
+					continue;
+				}
 			}
 
-			/* check to see if light is behind the plane */
-			if ( DotProduct( light->origin, normal ) - DotProduct( origin, normal ) < -1.0f ) {
-				lightsPlaneCulled++;
-				continue;
-			}
+			/* add this light */
+			trace->lights[ trace->numLights++ ] = light;
 		}
-
-		/* add this light */
-		trace->lights[ trace->numLights++ ] = light;
 	}
 
+	/* lights the grid skipped are out of reach */
+	THREAD_STAT( lightsEnvelopeCulled ) += numIndexedLights - numTested;
+
+	/* clear the pvs clusters */
+	for ( i = minWord; i <= maxWord; i++ )
+		lt->clusters[ i ] = 0;
+
 	/* make last night null */
 	trace->lights[ trace->numLights ] = NULL;
+
+	/* give the unused part of the list back */
+	lt->arena->used -= numIndexedLights - trace->numLights;
 }
 
 
 
+/*
+   FreeTraceLights()
+   light lists live in per-thread arenas, the most recent list of the thread is given
+   back right away, the rest once the phase that culled them is done
+ */
+
 void FreeTraceLights( trace_t *trace ){
-	if ( trace->lights != NULL ) {
-		free( trace->lights );
+	lightArenaBlock_t   *block;
+
+
+	if ( trace->lights == NULL ) {
+		return;
+	}
+	block = lightIndexThreads[ GetThreadNum() ].arena;
+	if ( block != NULL && trace->lights + trace->numLights + 1 == &block->lights[ block->used ] ) {
+		block->used -= trace->numLights + 1;
 	}
+	trace->lights = NULL;
 }
 
 
@@ -4444,6 +6097,7 @@ void FloodLightRawLightmap( int rawLightmapNum ){
 	}
 	/* get lightmap */
 	lm = &rawLightmaps[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
 
 	/* global pass */
 	if ( g_floodlight && floodlightIntensity ) {
@@ -4455,6 +6109,7 @@ void FloodLightRawLightmap( int rawLightmapNum ){
 		FloodLightRawLightmapPass( lm, lm->floodlightRGB, lm->floodlightIntensity, lm->floodlightDistance, qfalse, lm->floodlightDirectionScale );
 		numSurfacesFloodlighten += 1;
 	}
+	ReleaseSuperBuffers( lm );
 }
 
 void FloodlightRawLightmaps(){
@@ -4469,6 +6124,223 @@ void FloodlightRawLightmaps(){
 	Sys_Printf( "%9d custom lightmaps floodlighted\n", numSurfacesFloodlighten );
 }
 
+/*
+   DirtFloodForSamplePacket()
+   gathers dirt and floodlight for a tile of samples from a single set of rays:
+   the floodlight vectors and the direct ray are traced as far as the longer of
+   the dirt depth and the floodlight distance, each hit nearer than the dirt
+   depth adds dirt and each vector adds floodlight by its hit distance
+ */
+
+static void DirtFloodForSamplePacket( trace_t **traces, int numTraces, float floodLightDistance, float *dirts, float *floods ){
+	int i, t, numPacket;
+	float gatherDirt[ MAX_TRACE_PACKET ], gatherFlood[ MAX_TRACE_PACKET ];
+	float ooDepth, ooDistance, depth, d, contribution;
+	vec3_t myUp[ MAX_TRACE_PACKET ], myRt[ MAX_TRACE_PACKET ], direction, displacement;
+	trace_t         *packet[ MAX_TRACE_PACKET ], *trace;
+
+
+	/* setup */
+	ooDepth = 1.0f / dirtDepth;
+	ooDistance = 1.0f / floodLightDistance;
+	depth = dirtDepth > floodLightDistance ? dirtDepth : floodLightDistance;
+	numPacket = 0;
+	for ( t = 0; t < numTraces; t++ )
+	{
+		if ( traces[ t ]->cluster >= 0 ) {
+			gatherDirt[ numPacket ] = 0.0f;
+			gatherFlood[ numPacket ] = 0.0f;
+			DirtBasis( traces[ t ]->normal, myRt[ numPacket ], myUp[ numPacket ] );
+			packet[ numPacket++ ] = traces[ t ];
+		}
+	}
+
+	/* iterate through ordered vectors, then the direct ray */
+	for ( i = 0; i <= numFloodVectors; i++ )
+	{
+		for ( t = 0; t < numPacket; t++ )
+		{
+			trace = packet[ t ];
+
+			/* transform vector into tangent space */
+			if ( i < numFloodVectors ) {
+				direction[ 0 ] = myRt[ t ][ 0 ] * floodVectors[ i ][ 0 ] + myUp[ t ][ 0 ] * floodVectors[ i ][ 1 ] + trace->normal[ 0 ] * floodVectors[ i ][ 2 ];
+				direction[ 1 ] = myRt[ t ][ 1 ] * floodVectors[ i ][ 0 ] + myUp[ t ][ 1 ] * floodVectors[ i ][ 1 ] + trace->normal[ 1 ] * floodVectors[ i ][ 2 ];
+				direction[ 2 ] = myRt[ t ][ 2 ] * floodVectors[ i ][ 0 ] + myUp[ t ][ 2 ] * floodVectors[ i ][ 1 ] + trace->normal[ 2 ] * floodVectors[ i ][ 2 ];
+			}
+			else{
+				VectorCopy( trace->normal, direction );
+			}
+
+			/* set endpoint */
+			VectorMA( trace->origin, depth, direction, trace->end );
+			SetupTrace( trace );
+			VectorSet( trace->color, 1.0f, 1.0f, 1.0f );
+		}
+
+		/* trace */
+		TraceLinePacket( packet, numPacket, -1 );
+		for ( t = 0; t < numPacket; t++ )
+		{
+			trace = packet[ t ];
+			d = depth;
+			if ( trace->opaque ) {
+				VectorSubtract( trace->hit, trace->origin, displacement );
+				d = VectorLength( displacement );
+				if ( d < dirtDepth ) {
+					gatherDirt[ t ] += 1.0f - ooDepth * d;
+				}
+			}
+
+			/* the direct ray only adds dirt */
+			if ( i == numFloodVectors ) {
+				continue;
+			}
+
+			/* sky and translucent surfaces let all floodlight through */
+			if ( trace->compileFlags & ( C_SKY | C_TRANSLUCENT ) ) {
+				contribution = 1.0f;
+			}
+			else{
+				contribution = d * ooDistance;
+				if ( contribution > 1.0f ) {
+					contribution = 1.0f;
+				}
+			}
+			gatherFlood[ t ] += contribution;
+		}
+	}
+
+	/* get dirt and floodlight */
+	for ( t = 0, i = 0; t < numTraces; t++ )
+	{
+		if ( traces[ t ]->cluster < 0 ) {
+			dirts[ t ] = 0.0f;
+			floods[ t ] = 0.0f;
+		}
+		else{
+			dirts[ t ] = DirtForGather( gatherDirt[ i ], numFloodVectors + 1 );
+			floods[ t ] = gatherFlood[ i ] / numFloodVectors;
+			if ( floods[ t ] > 1.0f ) {
+				floods[ t ] = 1.0f;
+			}
+			i++;
+		}
+	}
+}
+
+
+
+/*
+   DirtFloodFused()
+   dirt and the global floodlight are gathered in one pass when both are on
+ */
+
+qboolean DirtFloodFused( void ){
+	return ( dirty && dirtMode == 0 && !g_noFloodLight && g_floodlight && floodlightIntensity && !floodlight_lowquality ) ? qtrue : qfalse;
+}
+
+
+
+/*
+   DirtyFloodlightRawLightmap()
+   DirtyRawLightmap() and the global FloodLightRawLightmap() pass in one walk
+   over the luxels, each ray of a luxel adds to both its dirt and floodlight
+ */
+
+void DirtyFloodlightRawLightmap( int rawLightmapNum ){
+	int i, x, y, tx, ty, *cluster, numTraces;
+	float               *origin, *normal, *dirt, *floodlight, floodLightAmount;
+	float               *dirts[ MAX_TRACE_PACKET ], *floodlights[ MAX_TRACE_PACKET ];
+	float tileDirts[ MAX_TRACE_PACKET ], tileFloods[ MAX_TRACE_PACKET ];
+	rawLightmap_t       *lm;
+	trace_t trace, traces[ MAX_TRACE_PACKET ], *packet[ MAX_TRACE_PACKET ];
+	qboolean noDirty;
+
+
+	/* bail if this number exceeds the number of raw lightmaps */
+	if ( rawLightmapNum >= numRawLightmaps ) {
+		return;
+	}
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
+
+	/* setup trace */
+	noDirty = SetupDirtTrace( lm, &trace );
+
+	/* every luxel of a tile gets its own copy of the trace */
+	for ( i = 0; i < MAX_TRACE_PACKET; i++ )
+	{
+		traces[ i ] = trace;
+		packet[ i ] = &traces[ i ];
+	}
+
+	/* gather dirt and floodlight, a tile of luxels at a time */
+	for ( ty = 0; ty < lm->sh; ty += TRACE_PACKET_TILE )
+	{
+		for ( tx = 0; tx < lm->sw; tx += TRACE_PACKET_TILE )
+		{
+			numTraces = 0;
+			for ( y = ty; y < ty + TRACE_PACKET_TILE && y < lm->sh; y++ )
+			{
+				for ( x = tx; x < tx + TRACE_PACKET_TILE && x < lm->sw; x++ )
+				{
+					/* get luxel */
+					cluster = SUPER_CLUSTER( x, y );
+					origin = SUPER_ORIGIN( x, y );
+					normal = SUPER_NORMAL( x, y );
+					dirt = SUPER_DIRT( x, y );
+					floodlight = SUPER_FLOODLIGHT( x, y );
+
+					/* set defaults */
+					*dirt = 0.0f;
+					*floodlight = 0.0f;
+
+					/* only look at mapped luxels */
+					if ( *cluster < 0 ) {
+						continue;
+					}
+
+					/* copy to trace */
+					traces[ numTraces ].cluster = *cluster;
+					VectorCopy( origin, traces[ numTraces ].origin );
+					VectorCopy( normal, traces[ numTraces ].normal );
+					dirts[ numTraces ] = dirt;
+					floodlights[ numTraces++ ] = floodlight;
+				}
+			}
+
+			/* get dirt and floodlight */
+			DirtFloodForSamplePacket( packet, numTraces, floodlightDistance, tileDirts, tileFloods );
+			for ( i = 0; i < numTraces; i++ )
+			{
+				/* don't apply dirty on this surface */
+				*dirts[ i ] = noDirty ? 1.0f : tileDirts[ i ];
+
+				/* add floodlight */
+				floodlight = floodlights[ i ];
+				floodLightAmount = tileFloods[ i ] * floodlightIntensity;
+				floodlight[ 0 ] += floodlightRGB[ 0 ] * floodLightAmount;
+				floodlight[ 1 ] += floodlightRGB[ 1 ] * floodLightAmount;
+				floodlight[ 2 ] += floodlightRGB[ 2 ] * floodLightAmount;
+				floodlight[ 3 ] += floodlightDirectionScale;
+			}
+		}
+	}
+
+	/* filter dirt */
+	FilterDirtRawLightmap( lm );
+
+	/* custom pass */
+	if ( lm->floodlightIntensity ) {
+		FloodLightRawLightmapPass( lm, lm->floodlightRGB, lm->floodlightIntensity, lm->floodlightDistance, qfalse, lm->floodlightDirectionScale );
+		numSurfacesFloodlighten += 1;
+	}
+	ReleaseSuperBuffers( lm );
+}
+
 /*
    FloodLightIlluminate()
    illuminate floodlight into lightmap luxels
@@ -308,6 +308,55 @@ static int CompareLightSurface( const void *a, const void *b ){
 
 
 
+/*
+   AllocateSuperBuffers()
+   allocates and clears the supersampled buffers of a raw lightmap, except for the clusters
+ */
+
+void AllocateSuperBuffers( rawLightmap_t *lm ){
+	int size;
+
+
+	/* allocate sampling lightmap storage */
+	size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
+	if ( lm->superLuxels[ 0 ] == NULL ) {
+		lm->superLuxels[ 0 ] = static_cast<float*>(safe_malloc(size));
+	}
+	memset( lm->superLuxels[ 0 ], 0, size );
+
+	/* allocate origin map storage */
+	size = lm->sw * lm->sh * SUPER_ORIGIN_SIZE * sizeof( float );
+	if ( lm->superOrigins == NULL ) {
+		lm->superOrigins = static_cast<float*>(safe_malloc(size));
+	}
+	memset( lm->superOrigins, 0, size );
+
+	/* allocate normal map storage */
+	size = lm->sw * lm->sh * SUPER_NORMAL_SIZE * sizeof( float );
+	if ( lm->superNormals == NULL ) {
+		lm->superNormals = static_cast<float*>(safe_malloc(size));
+	}
+	memset( lm->superNormals, 0, size );
+
+	/* allocate floodlight map storage */
+	size = lm->sw * lm->sh * SUPER_FLOODLIGHT_SIZE * sizeof( float );
+	if ( lm->superFloodLight == NULL ) {
+		lm->superFloodLight = static_cast<float*>(safe_malloc(size));
+	}
+	memset( lm->superFloodLight, 0, size );
+
+	/* allocate sampling deluxel storage */
+	if ( deluxemap ) {
+		size = lm->sw * lm->sh * SUPER_DELUXEL_SIZE * sizeof( float );
+		if ( lm->superDeluxels == NULL ) {
+			lm->superDeluxels = static_cast<float*>(safe_malloc(size));
+		}
+		memset( lm->superDeluxels, 0, size );
+	}
+}
+
+
+
 /*
    FinishRawLightmap()
    allocates a raw lightmap's necessary buffers
@@ -397,33 +446,10 @@ void FinishRawLightmap( rawLightmap_t *lm ){
 		memset( lm->radLuxels[ 0 ], 0, size );
 	}
 
-	/* allocate sampling lightmap storage */
-	size = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
-	if ( lm->superLuxels[ 0 ] == NULL ) {
-		lm->superLuxels[ 0 ] = static_cast<float*>(safe_malloc(size));
-	}
-	memset( lm->superLuxels[ 0 ], 0, size );
-
-	/* allocate origin map storage */
-	size = lm->sw * lm->sh * SUPER_ORIGIN_SIZE * sizeof( float );
-	if ( lm->superOrigins == NULL ) {
-		lm->superOrigins = static_cast<float*>(safe_malloc(size));
-	}
-	memset( lm->superOrigins, 0, size );
-
-	/* allocate normal map storage */
-	size = lm->sw * lm->sh * SUPER_NORMAL_SIZE * sizeof( float );
-	if ( lm->superNormals == NULL ) {
-		lm->superNormals = static_cast<float*>(safe_malloc(size));
-	}
-	memset( lm->superNormals, 0, size );
-
-	/* allocate floodlight map storage */
-	size = lm->sw * lm->sh * SUPER_FLOODLIGHT_SIZE * sizeof( float );
-	if ( lm->superFloodLight == NULL ) {
-		lm->superFloodLight = static_cast<float*>(safe_malloc(size));
+	/* allocate sampling storage, with -compactsuper it waits for the first AcquireSuperBuffers() */
+	if ( !compactSuper ) {
+		AllocateSuperBuffers( lm );
 	}
-	memset( lm->superFloodLight, 0, size );
 
 	/* allocate cluster map storage */
 	size = lm->sw * lm->sh * sizeof( int );
@@ -437,13 +463,6 @@ void FinishRawLightmap( rawLightmap_t *lm ){
 
 	/* deluxemap allocation */
 	if ( deluxemap ) {
-		/* allocate sampling deluxel storage */
-		size = lm->sw * lm->sh * SUPER_DELUXEL_SIZE * sizeof( float );
-		if ( lm->superDeluxels == NULL ) {
-			lm->superDeluxels = static_cast<float*>(safe_malloc(size));
-		}
-		memset( lm->superDeluxels, 0, size );
-
 		/* allocate bsp deluxel storage */
 		size = lm->w * lm->h * BSP_DELUXEL_SIZE * sizeof( float );
 		if ( lm->bspDeluxels == NULL ) {
@@ -1236,163 +1255,313 @@ void SetupSurfaceLightmaps( void ){
 /*
    StitchSurfaceLightmaps()
    stitches lightmap edges
-   2002-11-20 update: use this func only for stitching nonplanar patch lightmap seams
+   the lit luxels on the edges of every raw lightmap are put into a spatial hash with cells of
+   the largest lightmap sample size, and every edge luxel is averaged with the edge luxels within half a
+   sample size of it found in the cells around it. a raw lightmap only writes its own luxels and
+   reads the copies in the hash, so the raw lightmaps are stitched in parallel
  */
 
-#define MAX_STITCH_CANDIDATES   32
-#define MAX_STITCH_LUXELS       64
+typedef struct stitchLuxel_s
+{
+	vec3_t origin, normal, color;
+	float samples, sampleSize;
+	int lightmapNum, x, y, cell[ 3 ];
+}
+stitchLuxel_t;
 
-void StitchSurfaceLightmaps( void ){
-	int i, j, x, y, x2, y2, *cluster, *cluster2,
-		numStitched, numCandidates, numLuxels, f, fOld, start;
-	rawLightmap_t   *lm, *a, *b, *c[ MAX_STITCH_CANDIDATES ];
-	float           *luxel, *luxel2, *origin, *origin2, *normal, *normal2,
-					 sampleSize, average[ 3 ], totalColor, ootc;
+static stitchLuxel_t    **stitchLists, *stitchLuxels;
+static int              *stitchFirst, *stitchCount;
+static int              *stitchBuckets, *stitchSorted, stitchBucketMask;
+static float stitchCellSize;
 
 
-	/* disabled for now */
-	return;
 
-	/* note it */
-	Sys_Printf( "--- StitchSurfaceLightmaps ---\n" );
+/*
+   StitchBucket()
+   returns the hash bucket of a stitch cell
+ */
+
+static int StitchBucket( const int cell[ 3 ] ){
+	return (int) ( ( ( (uint32_t) cell[ 0 ] * 73856093u ) ^ ( (uint32_t) cell[ 1 ] * 19349663u ) ^ ( (uint32_t) cell[ 2 ] * 83492791u ) ) & (uint32_t) stitchBucketMask );
+}
 
-	/* init pacifier */
-	fOld = -1;
-	start = I_FloatTime();
 
-	/* walk the list of raw lightmaps */
-	numStitched = 0;
-	for ( i = 0; i < numRawLightmaps; i++ )
+
+/*
+   StitchEdgeLuxel()
+   a luxel is on an edge when a luxel around it is unmapped or off the lightmap
+ */
+
+static qboolean StitchEdgeLuxel( rawLightmap_t *lm, int x, int y ){
+	int sx, sy;
+
+
+	for ( sy = y - 1; sy <= y + 1; sy++ )
 	{
-		/* print pacifier */
-		f = 10 * i / numRawLightmaps;
-		if ( f != fOld ) {
-			fOld = f;
-			Sys_Printf( "%i...", f );
+		for ( sx = x - 1; sx <= x + 1; sx++ )
+		{
+			if ( sx < 0 || sy < 0 || sx >= lm->sw || sy >= lm->sh ||
+				 *SUPER_CLUSTER( sx, sy ) == CLUSTER_UNMAPPED ) {
+				return qtrue;
+			}
 		}
+	}
 
-		/* get lightmap a */
-		a = &rawLightmaps[ i ];
+	return qfalse;
+}
 
-		/* walk rest of lightmaps */
-		numCandidates = 0;
-		for ( j = i + 1; j < numRawLightmaps && numCandidates < MAX_STITCH_CANDIDATES; j++ )
-		{
-			/* get lightmap b */
-			b = &rawLightmaps[ j ];
 
-			/* test bounding box */
-			if ( a->mins[ 0 ] > b->maxs[ 0 ] || a->maxs[ 0 ] < b->mins[ 0 ] ||
-				 a->mins[ 1 ] > b->maxs[ 1 ] || a->maxs[ 1 ] < b->mins[ 1 ] ||
-				 a->mins[ 2 ] > b->maxs[ 2 ] || a->maxs[ 2 ] < b->mins[ 2 ] ) {
+
+/*
+   GatherStitchLuxels()
+   copies the lit edge luxels of a raw lightmap for the stitch hash
+ */
+
+static void GatherStitchLuxels( int rawLightmapNum ){
+	int x, y, count, maxCount;
+	rawLightmap_t   *lm;
+	stitchLuxel_t   *sl;
+	float           *luxel;
+
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
+
+	/* walk luxels */
+	maxCount = 2 * ( lm->sw + lm->sh );
+	sl = static_cast<stitchLuxel_t*>(safe_malloc(maxCount * sizeof( stitchLuxel_t )));
+	count = 0;
+	for ( y = 0; y < lm->sh; y++ )
+	{
+		for ( x = 0; x < lm->sw; x++ )
+		{
+			/* ignore unmapped/unlit luxels */
+			if ( *SUPER_CLUSTER( x, y ) == CLUSTER_UNMAPPED ) {
 				continue;
 			}
+			luxel = SUPER_LUXEL( 0, x, y );
+			if ( luxel[ 3 ] <= 0.0f || !StitchEdgeLuxel( lm, x, y ) ) {
+				continue;
+			}
+
+			/* grow the list, a surface with holes has more edge luxels than the border holds */
+			if ( count >= maxCount ) {
+				maxCount *= 2;
+				sl = static_cast<stitchLuxel_t*>(realloc( sl, maxCount * sizeof( stitchLuxel_t ) ));
+				if ( sl == NULL ) {
+					Error( "realloc() failed (GatherStitchLuxels)" );
+				}
+			}
 
-			/* add candidate */
-			c[ numCandidates++ ] = b;
+			/* copy it */
+			VectorCopy( SUPER_ORIGIN( x, y ), sl[ count ].origin );
+			VectorCopy( SUPER_NORMAL( x, y ), sl[ count ].normal );
+			VectorCopy( luxel, sl[ count ].color );
+			sl[ count ].samples = luxel[ 3 ];
+			sl[ count ].sampleSize = lm->actualSampleSize;
+			sl[ count ].lightmapNum = rawLightmapNum;
+			sl[ count ].x = x;
+			sl[ count ].y = y;
+			count++;
 		}
+	}
 
-		/* walk luxels */
-		for ( y = 0; y < a->sh; y++ )
-		{
-			for ( x = 0; x < a->sw; x++ )
-			{
-				/* ignore unmapped/unlit luxels */
-				lm = a;
-				cluster = SUPER_CLUSTER( x, y );
-				if ( *cluster == CLUSTER_UNMAPPED ) {
-					continue;
-				}
-				luxel = SUPER_LUXEL( 0, x, y );
-				if ( luxel[ 3 ] <= 0.0f ) {
-					continue;
-				}
+	ReleaseSuperBuffers( lm );
 
-				/* get particulars */
-				origin = SUPER_ORIGIN( x, y );
-				normal = SUPER_NORMAL( x, y );
+	/* store */
+	stitchLists[ rawLightmapNum ] = sl;
+	stitchCount[ rawLightmapNum ] = count;
+}
 
-				/* walk candidate list */
-				for ( j = 0; j < numCandidates; j++ )
-				{
-					/* get candidate */
-					b = c[ j ];
-					lm = b;
 
-					/* set samplesize to the smaller of the pair */
-					sampleSize = 0.5f * ( a->actualSampleSize < b->actualSampleSize ? a->actualSampleSize : b->actualSampleSize );
 
-					/* test bounding box */
-					if ( origin[ 0 ] < ( b->mins[ 0 ] - sampleSize ) || ( origin[ 0 ] > b->maxs[ 0 ] + sampleSize ) ||
-						 origin[ 1 ] < ( b->mins[ 1 ] - sampleSize ) || ( origin[ 1 ] > b->maxs[ 1 ] + sampleSize ) ||
-						 origin[ 2 ] < ( b->mins[ 2 ] - sampleSize ) || ( origin[ 2 ] > b->maxs[ 2 ] + sampleSize ) ) {
-						continue;
-					}
+/*
+   StitchRawLightmap()
+   averages the edge luxels of a raw lightmap with the edge luxels next to them
+ */
 
-					/* walk candidate luxels */
-					VectorClear( average );
-					numLuxels = 0;
-					totalColor = 0.0f;
-					for ( y2 = 0; y2 < b->sh && numLuxels < MAX_STITCH_LUXELS; y2++ )
+static void StitchRawLightmap( int rawLightmapNum ){
+	int i, j, k, cell[ 3 ], mins[ 3 ], maxs[ 3 ], numMatched;
+	rawLightmap_t   *lm;
+	stitchLuxel_t   *a, *b;
+	float           *luxel, range, sampleSize, totalColor;
+	vec3_t average;
+	qboolean acquired;
+
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	acquired = qfalse;
+
+	/* walk the edge luxels of this lightmap */
+	for ( i = 0; i < stitchCount[ rawLightmapNum ]; i++ )
+	{
+		a = &stitchLuxels[ stitchFirst[ rawLightmapNum ] + i ];
+
+		/* get the cells within reach */
+		range = 0.5f * a->sampleSize;
+		for ( k = 0; k < 3; k++ )
+		{
+			mins[ k ] = (int) floor( ( a->origin[ k ] - range ) / stitchCellSize );
+			maxs[ k ] = (int) floor( ( a->origin[ k ] + range ) / stitchCellSize );
+		}
+
+		/* start with the luxel itself so both sides of a seam end up with the same color */
+		VectorCopy( a->color, average );
+		totalColor = a->samples;
+		numMatched = 0;
+
+		/* walk the cells */
+		for ( cell[ 2 ] = mins[ 2 ]; cell[ 2 ] <= maxs[ 2 ]; cell[ 2 ]++ )
+		{
+			for ( cell[ 1 ] = mins[ 1 ]; cell[ 1 ] <= maxs[ 1 ]; cell[ 1 ]++ )
+			{
+				for ( cell[ 0 ] = mins[ 0 ]; cell[ 0 ] <= maxs[ 0 ]; cell[ 0 ]++ )
+				{
+					k = StitchBucket( cell );
+					for ( j = stitchBuckets[ k ]; j < stitchBuckets[ k + 1 ]; j++ )
 					{
-						for ( x2 = 0; x2 < b->sw && numLuxels < MAX_STITCH_LUXELS; x2++ )
-						{
-							/* ignore same luxels */
-							if ( a == b && abs( x - x2 ) <= 1 && abs( y - y2 ) <= 1 ) {
-								continue;
-							}
+						b = &stitchLuxels[ stitchSorted[ j ] ];
 
-							/* ignore unmapped/unlit luxels */
-							cluster2 = SUPER_CLUSTER( x2, y2 );
-							if ( *cluster2 == CLUSTER_UNMAPPED ) {
-								continue;
-							}
-							luxel2 = SUPER_LUXEL( 0, x2, y2 );
-							if ( luxel2[ 3 ] <= 0.0f ) {
-								continue;
-							}
+						/* other cells share the bucket */
+						if ( b->cell[ 0 ] != cell[ 0 ] || b->cell[ 1 ] != cell[ 1 ] || b->cell[ 2 ] != cell[ 2 ] ) {
+							continue;
+						}
 
-							/* get particulars */
-							origin2 = SUPER_ORIGIN( x2, y2 );
-							normal2 = SUPER_NORMAL( x2, y2 );
+						/* ignore same luxels */
+						if ( b->lightmapNum == a->lightmapNum && abs( a->x - b->x ) <= 1 && abs( a->y - b->y ) <= 1 ) {
+							continue;
+						}
 
-							/* test normal */
-							if ( DotProduct( normal, normal2 ) < 0.5f ) {
-								continue;
-							}
+						/* test normal */
+						if ( DotProduct( a->normal, b->normal ) < 0.5f ) {
+							continue;
+						}
 
-							/* test bounds */
-							if ( fabs( origin[ 0 ] - origin2[ 0 ] ) > sampleSize ||
-								 fabs( origin[ 1 ] - origin2[ 1 ] ) > sampleSize ||
-								 fabs( origin[ 2 ] - origin2[ 2 ] ) > sampleSize ) {
-								continue;
-							}
+						/* set samplesize to the smaller of the pair */
+						sampleSize = 0.5f * ( a->sampleSize < b->sampleSize ? a->sampleSize : b->sampleSize );
 
-							/* add luxel */
-							//%	VectorSet( luxel2, 255, 0, 255 );
-							VectorAdd( average, luxel2, average );
-							totalColor += luxel2[ 3 ];
+						/* test bounds */
+						if ( fabs( a->origin[ 0 ] - b->origin[ 0 ] ) > sampleSize ||
+							 fabs( a->origin[ 1 ] - b->origin[ 1 ] ) > sampleSize ||
+							 fabs( a->origin[ 2 ] - b->origin[ 2 ] ) > sampleSize ) {
+							continue;
 						}
-					}
 
-					/* early out */
-					if ( numLuxels == 0 ) {
-						continue;
+						/* add luxel */
+						VectorAdd( average, b->color, average );
+						totalColor += b->samples;
+						numMatched++;
 					}
-
-					/* scale average */
-					ootc = 1.0f / totalColor;
-					VectorScale( average, ootc, luxel );
-					luxel[ 3 ] = 1.0f;
-					numStitched++;
 				}
 			}
 		}
+
+		/* early out */
+		if ( numMatched == 0 ) {
+			continue;
+		}
+
+		/* store the average */
+		if ( !acquired ) {
+			AcquireSuperBuffers( lm );
+			acquired = qtrue;
+		}
+		luxel = SUPER_LUXEL( 0, a->x, a->y );
+		VectorScale( average, 1.0f / totalColor, luxel );
+		luxel[ 3 ] = 1.0f;
+		THREAD_STAT( numLuxelsStitched )++;
+	}
+
+	if ( acquired ) {
+		ReleaseSuperBuffers( lm );
+	}
+}
+
+
+
+void StitchSurfaceLightmaps( void ){
+	int i, j, k, numLuxels, numBuckets;
+	stitchLuxel_t   *sl;
+
+
+	/* disabled? */
+	if ( noStitch ) {
+		return;
+	}
+
+	/* note it */
+	Sys_Printf( "--- StitchSurfaceLightmaps ---\n" );
+
+	/* copy the edge luxels */
+	stitchLists = static_cast<stitchLuxel_t**>(safe_malloc(numRawLightmaps * sizeof( stitchLuxel_t* )));
+	stitchFirst = static_cast<int*>(safe_malloc(numRawLightmaps * sizeof( int )));
+	stitchCount = static_cast<int*>(safe_malloc(numRawLightmaps * sizeof( int )));
+	RunThreadsOnIndividual( numRawLightmaps, qfalse, GatherStitchLuxels );
+
+	/* put them in one list in lightmap order and size the cells by the coarsest lightmap */
+	numLuxels = 0;
+	stitchCellSize = 0.0f;
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		stitchFirst[ i ] = numLuxels;
+		numLuxels += stitchCount[ i ];
+		if ( stitchCount[ i ] > 0 && rawLightmaps[ i ].actualSampleSize > stitchCellSize ) {
+			stitchCellSize = (float) rawLightmaps[ i ].actualSampleSize;
+		}
+	}
+	if ( stitchCellSize <= 0.0f ) {
+		stitchCellSize = sampleSize > 0 ? (float) sampleSize : (float) DEFAULT_LIGHTMAP_SAMPLE_SIZE;
+	}
+	stitchLuxels = static_cast<stitchLuxel_t*>(safe_malloc(( numLuxels > 0 ? numLuxels : 1 ) * sizeof( stitchLuxel_t )));
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		if ( stitchCount[ i ] > 0 ) {
+			memcpy( stitchLuxels + stitchFirst[ i ], stitchLists[ i ], stitchCount[ i ] * sizeof( stitchLuxel_t ) );
+		}
+		free( stitchLists[ i ] );
+	}
+	free( stitchLists );
+
+	/* hash them by cell */
+	for ( numBuckets = 64; numBuckets < numLuxels; numBuckets <<= 1 ) ;
+	stitchBucketMask = numBuckets - 1;
+	stitchBuckets = static_cast<int*>(safe_malloc(( numBuckets + 1 ) * sizeof( int )));
+	stitchSorted = static_cast<int*>(safe_malloc(( numLuxels > 0 ? numLuxels : 1 ) * sizeof( int )));
+	memset( stitchBuckets, 0, ( numBuckets + 1 ) * sizeof( int ) );
+	for ( i = 0; i < numLuxels; i++ )
+	{
+		sl = &stitchLuxels[ i ];
+		for ( k = 0; k < 3; k++ )
+			sl->cell[ k ] = (int) floor( sl->origin[ k ] / stitchCellSize );
+		stitchBuckets[ StitchBucket( sl->cell ) + 1 ]++;
+	}
+	for ( i = 0; i < numBuckets; i++ )
+		stitchBuckets[ i + 1 ] += stitchBuckets[ i ];
+	for ( i = 0; i < numLuxels; i++ )
+	{
+		j = StitchBucket( stitchLuxels[ i ].cell );
+		stitchSorted[ stitchBuckets[ j ]++ ] = i;
 	}
+	for ( i = numBuckets; i > 0; i-- )
+		stitchBuckets[ i ] = stitchBuckets[ i - 1 ];
+	stitchBuckets[ 0 ] = 0;
+
+	/* stitch */
+	numLuxelsStitched = 0;
+	RunThreadsOnIndividual( numRawLightmaps, qtrue, StitchRawLightmap );
+
+	/* clean up */
+	free( stitchLuxels );
+	free( stitchFirst );
+	free( stitchCount );
+	free( stitchBuckets );
+	free( stitchSorted );
 
 	/* emit statistics */
-	Sys_Printf( " (%i)\n", (int) ( I_FloatTime() - start ) );
-	Sys_FPrintf( SYS_VRB, "%9d luxels stitched\n", numStitched );
+	Sys_Printf( "%9d edge luxels\n", numLuxels );
+	Sys_Printf( "%9d luxels stitched\n", numLuxelsStitched );
 }
 
 
@@ -1788,7 +1957,7 @@ static qboolean ApproximateLightmap( rawLightmap_t *lm ){
 			 ( info->maxs[ 1 ] - info->mins[ 1 ] ) <= ( 2.0f * info->sampleSize ) &&
 			 ( info->maxs[ 2 ] - info->mins[ 2 ] ) <= ( 2.0f * info->sampleSize ) ) {
 			info->approximated = qtrue;
-			numSurfsVertexForced++;
+			THREAD_STAT( numSurfsVertexForced )++;
 			continue;
 		}
 
@@ -1871,7 +2040,7 @@ static qboolean ApproximateLightmap( rawLightmap_t *lm ){
 			approximated = qfalse;
 		}
 		else{
-			numSurfsVertexApproximated++;
+			THREAD_STAT( numSurfsVertexApproximated )++;
 		}
 	}
 
@@ -1882,45 +2051,115 @@ static qboolean ApproximateLightmap( rawLightmap_t *lm ){
 
 
 /*
-   TestOutLightmapStamp()
-   tests a stamp on a given lightmap for validity
+   stamps
+   the luxels a surface lightmap covers, as runs along its rows. output lightmaps keep their
+   used luxels as rows of 64 bit words next to lightBits, with the bits past the right edge
+   set, so a run is tested against 64 luxels per and and a row of the output lightmap is
+   tested for every x origin at once
  */
 
-static qboolean TestOutLightmapStamp( rawLightmap_t *lm, int lightmapNum, outLightmap_t *olm, int x, int y ){
-	int sx, sy, ox, oy, offset;
+typedef struct stampRun_s
+{
+	int x, y, length;
+}
+stampRun_t;
+
+typedef struct outStamp_s
+{
+	int numRuns;
+	stampRun_t          *runs;
+}
+outStamp_t;
+
+static void SetupOutStamp( rawLightmap_t *lm, int lightmapNum, outStamp_t *stamp ){
+	int x, y, start;
 	float       *luxel;
 
 
-	/* bounds check */
-	if ( x < 0 || y < 0 || ( x + lm->w ) > olm->customWidth || ( y + lm->h ) > olm->customHeight ) {
-		return qfalse;
-	}
+	stamp->numRuns = 0;
+	stamp->runs = static_cast<stampRun_t*>( safe_malloc( ( lm->h * ( ( lm->w + 1 ) / 2 ) + 1 ) * sizeof( stampRun_t ) ) );
 
-	/* solid lightmaps test a 1x1 stamp */
+	/* solid lightmaps stamp a single luxel */
 	if ( lm->solid[ lightmapNum ] ) {
-		offset = ( y * olm->customWidth ) + x;
-		if ( olm->lightBits[ offset >> 3 ] & ( 1 << ( offset & 7 ) ) ) {
-			return qfalse;
-		}
-		return qtrue;
+		stamp->runs[ 0 ].x = 0;
+		stamp->runs[ 0 ].y = 0;
+		stamp->runs[ 0 ].length = 1;
+		stamp->numRuns = 1;
+		return;
 	}
 
-	/* test the stamp */
-	for ( sy = 0; sy < lm->h; sy++ )
+	for ( y = 0; y < lm->h; y++ )
 	{
-		for ( sx = 0; sx < lm->w; sx++ )
+		start = -1;
+		for ( x = 0; x <= lm->w; x++ )
 		{
-			/* get luxel */
-			luxel = BSP_LUXEL( lightmapNum, sx, sy );
-			if ( luxel[ 0 ] < 0.0f ) {
-				continue;
+			luxel = x < lm->w ? BSP_LUXEL( lightmapNum, x, y ) : NULL;
+			if ( luxel != NULL && luxel[ 0 ] >= 0.0f ) {
+				if ( start < 0 ) {
+					start = x;
+				}
 			}
+			else if ( start >= 0 ) {
+				stamp->runs[ stamp->numRuns ].x = start;
+				stamp->runs[ stamp->numRuns ].y = y;
+				stamp->runs[ stamp->numRuns ].length = x - start;
+				stamp->numRuns++;
+				start = -1;
+			}
+		}
+	}
+}
+
+static inline uint64_t RowBits( const uint64_t *row, int rowWords, int x ){
+	int w, b;
+
 
-			/* get bsp lightmap coords and test */
-			ox = x + sx;
-			oy = y + sy;
-			offset = ( oy * olm->customWidth ) + ox;
-			if ( olm->lightBits[ offset >> 3 ] & ( 1 << ( offset & 7 ) ) ) {
+	w = x >> 6;
+	b = x & 63;
+	if ( w >= rowWords ) {
+		return ~0ULL;
+	}
+	if ( b == 0 ) {
+		return row[ w ];
+	}
+	return ( row[ w ] >> b ) | ( ( w + 1 < rowWords ? row[ w + 1 ] : ~0ULL ) << ( 64 - b ) );
+}
+
+static void ShiftRow( const uint64_t *row, int rowWords, int shift, uint64_t *out ){
+	int i;
+
+
+	for ( i = 0; i < rowWords; i++ )
+		out[ i ] = RowBits( row, rowWords, ( i << 6 ) + shift );
+}
+
+
+
+/*
+   TestOutLightmapStamp()
+   tests a stamp on a given lightmap for validity
+ */
+
+static qboolean TestOutLightmapStamp( rawLightmap_t *lm, int lightmapNum, const outStamp_t *stamp, outLightmap_t *olm, int x, int y ){
+	int i, sx, length;
+	const uint64_t      *row;
+	uint64_t mask;
+
+
+	/* bounds check */
+	if ( x < 0 || y < 0 || ( x + lm->w ) > olm->customWidth || ( y + lm->h ) > olm->customHeight ) {
+		return qfalse;
+	}
+
+	/* test the runs a word at a time */
+	for ( i = 0; i < stamp->numRuns; i++ )
+	{
+		row = olm->lightRows + ( y + stamp->runs[ i ].y ) * olm->rowWords;
+		for ( sx = 0; sx < stamp->runs[ i ].length; sx += 64 )
+		{
+			length = stamp->runs[ i ].length - sx;
+			mask = length >= 64 ? ~0ULL : ( 1ULL << length ) - 1;
+			if ( RowBits( row, olm->rowWords, x + stamp->runs[ i ].x + sx ) & mask ) {
 				return qfalse;
 			}
 		}
@@ -1933,15 +2172,69 @@ static qboolean TestOutLightmapStamp( rawLightmap_t *lm, int lightmapNum, outLig
 
 
 /*
-   SetupOutLightmap()
-   sets up an output lightmap
+   FindOutLightmapStampRow()
+   finds the first x origin on a row of an output lightmap the stamp fits at, the same one a
+   walk of TestOutLightmapStamp() over x would find, -1 if there is none
  */
 
-static void SetupOutLightmap( rawLightmap_t *lm, outLightmap_t *olm ){
-	/* dummy check */
-	if ( lm == NULL || olm == NULL ) {
-		return;
-	}
+static int FindOutLightmapStampRow( const outStamp_t *stamp, outLightmap_t *olm, int y, const uint64_t *origins, uint64_t *blocked, uint64_t *dilated, uint64_t *shifted ){
+	int i, j, span, length;
+	const uint64_t      *row;
+	uint64_t fits;
+
+
+	memset( blocked, 0, olm->rowWords * sizeof( uint64_t ) );
+	for ( i = 0; i < stamp->numRuns; i++ )
+	{
+		/* a run starting at x is blocked by any used luxel in x .. x + length - 1 */
+		row = olm->lightRows + ( y + stamp->runs[ i ].y ) * olm->rowWords;
+		length = stamp->runs[ i ].length;
+		memcpy( dilated, row, olm->rowWords * sizeof( uint64_t ) );
+		for ( span = 1; span * 2 <= length; span *= 2 )
+		{
+			ShiftRow( dilated, olm->rowWords, span, shifted );
+			for ( j = 0; j < olm->rowWords; j++ )
+				dilated[ j ] |= shifted[ j ];
+		}
+		if ( span < length ) {
+			ShiftRow( dilated, olm->rowWords, length - span, shifted );
+			for ( j = 0; j < olm->rowWords; j++ )
+				dilated[ j ] |= shifted[ j ];
+		}
+
+		/* move it over to the stamp origin */
+		ShiftRow( dilated, olm->rowWords, stamp->runs[ i ].x, shifted );
+		for ( j = 0; j < olm->rowWords; j++ )
+			blocked[ j ] |= shifted[ j ];
+	}
+
+	/* first origin that is tried and not blocked */
+	for ( j = 0; j < olm->rowWords; j++ )
+	{
+		fits = origins[ j ] & ~blocked[ j ];
+		if ( fits ) {
+			for ( i = 0; !( fits & ( 1ULL << i ) ); i++ ) ;
+			return ( j << 6 ) + i;
+		}
+	}
+	return -1;
+}
+
+
+
+/*
+   SetupOutLightmap()
+   sets up an output lightmap
+ */
+
+static void SetupOutLightmap( rawLightmap_t *lm, outLightmap_t *olm ){
+	int y;
+
+
+	/* dummy check */
+	if ( lm == NULL || olm == NULL ) {
+		return;
+	}
 
 	/* is this a "normal" bsp-stored lightmap? */
 	if ( ( lm->customWidth == game->lightmapSize && lm->customHeight == game->lightmapSize ) || externalLightmaps ) {
@@ -1970,6 +2263,13 @@ static void SetupOutLightmap( rawLightmap_t *lm, outLightmap_t *olm ){
 	/* allocate buffers */
 	olm->lightBits = static_cast<byte*>(safe_malloc((olm->customWidth * olm->customHeight / 8) + 8));
 	memset( olm->lightBits, 0, ( olm->customWidth * olm->customHeight / 8 ) + 8 );
+	olm->rowWords = ( olm->customWidth + 63 ) >> 6;
+	olm->lightRows = static_cast<uint64_t*>(safe_malloc(olm->rowWords * olm->customHeight * sizeof( uint64_t )));
+	memset( olm->lightRows, 0, olm->rowWords * olm->customHeight * sizeof( uint64_t ) );
+	if ( olm->customWidth & 63 ) {
+		for ( y = 0; y < olm->customHeight; y++ )
+			olm->lightRows[ y * olm->rowWords + olm->rowWords - 1 ] = ~0ULL << ( olm->customWidth & 63 );
+	}
 	olm->bspLightBytes = static_cast<byte*>(safe_malloc(olm->customWidth * olm->customHeight * 3));
 	memset( olm->bspLightBytes, 0, olm->customWidth * olm->customHeight * 3 );
 	if ( deluxemap ) {
@@ -1990,11 +2290,11 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 	int i, j, k, lightmapNum, xMax, yMax, x = -1, y = -1, sx, sy, ox, oy, offset;
 	outLightmap_t       *olm;
 	surfaceInfo_t       *info;
-	float               *luxel, *deluxel;
-	vec3_t color, direction;
-	byte                *pixel;
+	float               *luxel;
 	qboolean ok;
-	int xIncrement, yIncrement;
+	int xIncrement, yIncrement, rowWords;
+	outStamp_t stamp;
+	uint64_t            *origins, *blocked, *dilated, *shifted;
 
 
 	/* set default lightmap number (-3 = LIGHTMAP_BY_VERTEX) */
@@ -2002,10 +2302,17 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 		lm->outLightmapNums[ lightmapNum ] = -3;
 
 	/* can this lightmap be approximated with vertex color? */
-	if ( ApproximateLightmap( lm ) ) {
+	if ( lm->approximated ) {
 		return;
 	}
 
+	/* row scratch for the output lightmaps this one can go on */
+	rowWords = ( lm->customWidth + 63 ) >> 6;
+	origins = static_cast<uint64_t*>(safe_malloc(4 * rowWords * sizeof( uint64_t )));
+	blocked = origins + rowWords;
+	dilated = blocked + rowWords;
+	shifted = dilated + rowWords;
+
 	/* walk list */
 	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
 	{
@@ -2019,6 +2326,9 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 			continue;
 		}
 
+		/* get the luxels to stamp */
+		SetupOutStamp( lm, lightmapNum, &stamp );
+
 		/* if this is a styled lightmap, try some normalized locations first */
 		ok = qfalse;
 		if ( lightmapNum > 0 && outLightmaps != NULL ) {
@@ -2046,7 +2356,7 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 					if ( j == 0 ) {
 						x = lm->lightmapX[ 0 ];
 						y = lm->lightmapY[ 0 ];
-						ok = TestOutLightmapStamp( lm, lightmapNum, olm, x, y );
+						ok = TestOutLightmapStamp( lm, lightmapNum, &stamp, olm, x, y );
 					}
 
 					/* try shifting */
@@ -2058,7 +2368,7 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 							{
 								x = lm->lightmapX[ 0 ] + sx * ( olm->customWidth >> 1 );  //%	lm->w;
 								y = lm->lightmapY[ 0 ] + sy * ( olm->customHeight >> 1 ); //%	lm->h;
-								ok = TestOutLightmapStamp( lm, lightmapNum, olm, x, y );
+								ok = TestOutLightmapStamp( lm, lightmapNum, &stamp, olm, x, y );
 
 								if ( ok ) {
 									break;
@@ -2139,20 +2449,22 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 					yIncrement = 1;
 				}
 
-				/* walk the origin around the lightmap */
-				for ( y = 0; y < yMax; y += yIncrement )
-				{
-					for ( x = 0; x < xMax; x += xIncrement )
-					{
-						/* find a fine tract of lauhnd */
-						ok = TestOutLightmapStamp( lm, lightmapNum, olm, x, y );
+				/* the stamp has to stay inside the lightmap */
+				xMax = Q_min( xMax, olm->customWidth - lm->w + 1 );
+				yMax = Q_min( yMax, olm->customHeight - lm->h + 1 );
 
-						if ( ok ) {
-							break;
-						}
-					}
+				/* the x origins the walk tries */
+				memset( origins, 0, rowWords * sizeof( uint64_t ) );
+				for ( x = 0; x < xMax; x += xIncrement )
+					origins[ x >> 6 ] |= 1ULL << ( x & 63 );
 
-					if ( ok ) {
+				/* walk the origin around the lightmap, a row at a time */
+				for ( y = 0; y < yMax; y += yIncrement )
+				{
+					/* find a fine tract of lauhnd */
+					x = FindOutLightmapStampRow( &stamp, olm, y, origins, blocked, dilated, shifted );
+					if ( x >= 0 ) {
+						ok = qtrue;
 						break;
 					}
 				}
@@ -2237,9 +2549,98 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 			yMax = lm->h;
 		}
 
-		/* mark the bits used */
+		/* mark the bits used, the luxels are converted to bytes once every lightmap is placed */
+		for ( y = 0; y < yMax; y++ )
+		{
+			for ( x = 0; x < xMax; x++ )
+			{
+				/* get luxel */
+				luxel = BSP_LUXEL( lightmapNum, x, y );
+				if ( luxel[ 0 ] < 0.0f && !lm->solid[ lightmapNum ] ) {
+					continue;
+				}
+
+				/* get bsp lightmap coords  */
+				ox = x + lm->lightmapX[ lightmapNum ];
+				oy = y + lm->lightmapY[ lightmapNum ];
+				offset = ( oy * olm->customWidth ) + ox;
+
+				/* flag pixel as used */
+				olm->lightBits[ offset >> 3 ] |= ( 1 << ( offset & 7 ) );
+				olm->lightRows[ oy * olm->rowWords + ( ox >> 6 ) ] |= 1ULL << ( ox & 63 );
+				olm->freeLuxels--;
+			}
+		}
+
+		free( stamp.runs );
+	}
+
+	free( origins );
+}
+
+
+
+/*
+   ApproximateRawLightmap()
+   tests if a raw lightmap can be approximated with vertex colors before it is placed
+ */
+
+static void ApproximateRawLightmap( int rawLightmapNum ){
+	rawLightmap_t *lm = &rawLightmaps[ rawLightmapNum ];
+
+	lm->approximated = ApproximateLightmap( lm );
+}
+
+
+
+/*
+   StoreRawLightmapBytes()
+   converts the luxels of a placed raw lightmap to the bytes of its output lightmaps,
+   surface lightmaps never overlap so raw lightmaps can be stored in parallel
+ */
+
+static void StoreRawLightmapBytes( int rawLightmapNum ){
+	int i, lightmapNum, xMax, yMax, x, y, ox, oy, numRow;
+	rawLightmap_t       *lm;
+	outLightmap_t       *olm;
+	float               *luxel, *deluxel;
+	vec3_t direction, *rowColors;
+	byte                *pixel, *rowBytes;
+	int                 *rowOffsets;
+
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+
+	/* a row of colors is converted to bytes at once */
+	rowColors = static_cast<vec3_t*>(safe_malloc(lm->w * sizeof( vec3_t )));
+	rowBytes = static_cast<byte*>(safe_malloc(lm->w * 3));
+	rowOffsets = static_cast<int*>(safe_malloc(lm->w * sizeof( int )));
+
+	/* walk list */
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+	{
+		/* twinned and approximated lightmaps aren't stored */
+		if ( lm->styles[ lightmapNum ] == LS_NONE || lm->twins[ lightmapNum ] != NULL || lm->outLightmapNums[ lightmapNum ] < 0 ) {
+			continue;
+		}
+		olm = &outLightmaps[ lm->outLightmapNums[ lightmapNum ] ];
+
+		/* set maxs */
+		if ( lm->solid[ lightmapNum ] ) {
+			xMax = 1;
+			yMax = 1;
+		}
+		else
+		{
+			xMax = lm->w;
+			yMax = lm->h;
+		}
+
+		/* store the luxels */
 		for ( y = 0; y < yMax; y++ )
 		{
+			numRow = 0;
 			for ( x = 0; x < xMax; x++ )
 			{
 				/* get luxel */
@@ -2252,22 +2653,22 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 				/* set minimum light */
 				if ( lm->solid[ lightmapNum ] ) {
 					if ( debug ) {
-						VectorSet( color, 255.0f, 0.0f, 0.0f );
+						VectorSet( rowColors[ numRow ], 255.0f, 0.0f, 0.0f );
 					}
 					else{
-						VectorCopy( lm->solidColor[ lightmapNum ], color );
+						VectorCopy( lm->solidColor[ lightmapNum ], rowColors[ numRow ] );
 					}
 				}
 				else{
-					VectorCopy( luxel, color );
+					VectorCopy( luxel, rowColors[ numRow ] );
 				}
 
 				/* styles are not affected by minlight */
 				if ( lightmapNum == 0 ) {
 					for ( i = 0; i < 3; i++ )
 					{
-						if ( color[ i ] < minLight[ i ] ) {
-							color[ i ] = minLight[ i ];
+						if ( rowColors[ numRow ][ i ] < minLight[ i ] ) {
+							rowColors[ numRow ][ i ] = minLight[ i ];
 						}
 					}
 				}
@@ -2275,15 +2676,9 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 				/* get bsp lightmap coords  */
 				ox = x + lm->lightmapX[ lightmapNum ];
 				oy = y + lm->lightmapY[ lightmapNum ];
-				offset = ( oy * olm->customWidth ) + ox;
-
-				/* flag pixel as used */
-				olm->lightBits[ offset >> 3 ] |= ( 1 << ( offset & 7 ) );
-				olm->freeLuxels--;
 
-				/* store color */
-				pixel = olm->bspLightBytes + ( ( ( oy * olm->customWidth ) + ox ) * 3 );
-				ColorToBytes( color, pixel, lm->brightness );
+				/* store color once the row is converted */
+				rowOffsets[ numRow++ ] = ( ( oy * olm->customWidth ) + ox ) * 3;
 
 				/* store direction */
 				if ( deluxemap ) {
@@ -2296,8 +2691,22 @@ static void FindOutLightmaps( rawLightmap_t *lm ){
 						pixel[ i ] = (byte)( 127.5f + direction[ i ] );
 				}
 			}
+
+			/* store colors */
+			ColorsToBytes( rowColors[ 0 ], 3, rowBytes, 3, numRow, lm->brightness );
+			for ( i = 0; i < numRow; i++ )
+			{
+				pixel = olm->bspLightBytes + rowOffsets[ i ];
+				pixel[ 0 ] = rowBytes[ i * 3 + 0 ];
+				pixel[ 1 ] = rowBytes[ i * 3 + 1 ];
+				pixel[ 2 ] = rowBytes[ i * 3 + 2 ];
+			}
 		}
 	}
+
+	free( rowColors );
+	free( rowBytes );
+	free( rowOffsets );
 }
 
 
@@ -2465,470 +2874,450 @@ void FillOutLightmap( outLightmap_t *olm ){
 }
 
 /*
-   StoreSurfaceLightmaps()
-   stores the surface lightmaps into the bsp as byte rgb triplets
+   SubsampleRawLightmaps()
+   averages the supersampled luxels of the last illumination pass into the bsp luxels,
+   and the radiosity luxels the next bounce samples. runs once after every pass,
+   StoreSurfaceLightmaps() packs the bsp luxels into the bsp whenever it is wanted
  */
 
-void StoreSurfaceLightmaps()
-{
-	int i, j, k, x, y, lx, ly, sx, sy, *cluster, mappedSamples;
-	int style, size, lightmapNum, lightmapNum2;
+/*
+   SubsampleRawLightmap()
+   averages the super luxels of one raw lightmap into its bsp luxels, RunThreadsOnIndividual callback
+ */
+
+static void SubsampleRawLightmap( int rawLightmapNum ){
+	int j, x, y, lx, ly, sx, sy, *cluster, mappedSamples;
+	int size, lightmapNum;
 	float               *normal, *luxel, *bspLuxel, *bspLuxel2, *radLuxel, samples, occludedSamples;
 	vec3_t sample, occludedSample, dirSample, colorMins, colorMaxs;
 	float               *deluxel, *bspDeluxel, *bspDeluxel2;
-	byte                *lb;
-	int numUsed, numTwins, numTwinLuxels, numStored;
-	float lmx, lmy, efficiency;
-	vec3_t color;
-	bspDrawSurface_t    *ds, *parent, dsTemp;
-	surfaceInfo_t       *info;
-	rawLightmap_t       *lm, *lm2;
-	outLightmap_t       *olm;
-	bspDrawVert_t       *dv, *ydv, *dvParent;
-	char dirname[ 1024 ], filename[ 1024 ];
-	shaderInfo_t        *csi;
-	char lightmapName[ 128 ];
-	const char              *rgbGenValues[ 256 ];
-	const char              *alphaGenValues[ 256 ];
-
-
-	/* note it */
-	Sys_Printf( "--- StoreSurfaceLightmaps ---\n" );
-
-	/* setup */
-	if ( lmCustomDir ) {
-		strcpy( dirname, lmCustomDir );
-	}
-	else
-	{
-		strcpy( dirname, source );
-		StripExtension( dirname );
-	}
-	memset( rgbGenValues, 0, sizeof( rgbGenValues ) );
-	memset( alphaGenValues, 0, sizeof( alphaGenValues ) );
+	vec3_t worldUp, myNormal, myTangent, myBinormal;
+	float dist;
+	rawLightmap_t       *lm;
 
-	/* -----------------------------------------------------------------
-	   average the sampled luxels into the bsp luxels
-	   ----------------------------------------------------------------- */
 
-	/* note it */
-	Sys_Printf( "Subsampling..." );
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	AcquireSuperBuffers( lm );
 
-	/* walk the list of raw lightmaps */
-	numUsed = 0;
-	numTwins = 0;
-	numTwinLuxels = 0;
-	numSolidLightmaps = 0;
-	for ( i = 0; i < numRawLightmaps; i++ )
+	/* walk individual lightmaps */
+	for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
 	{
-		/* get lightmap */
-		lm = &rawLightmaps[ i ];
-
-		/* walk individual lightmaps */
-		for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
-		{
-			/* early outs */
-			if ( lm->superLuxels[ lightmapNum ] == NULL ) {
-				continue;
-			}
+		/* early outs */
+		if ( lm->superLuxels[ lightmapNum ] == NULL ) {
+			continue;
+		}
 
-			/* allocate bsp luxel storage */
-			if ( lm->bspLuxels[ lightmapNum ] == NULL ) {
-				size = lm->w * lm->h * BSP_LUXEL_SIZE * sizeof( float );
-				lm->bspLuxels[ lightmapNum ] = static_cast<float*>(safe_malloc(size));
-				memset( lm->bspLuxels[ lightmapNum ], 0, size );
-			}
+		/* allocate bsp luxel storage */
+		if ( lm->bspLuxels[ lightmapNum ] == NULL ) {
+			size = lm->w * lm->h * BSP_LUXEL_SIZE * sizeof( float );
+			lm->bspLuxels[ lightmapNum ] = static_cast<float*>(safe_malloc(size));
+			memset( lm->bspLuxels[ lightmapNum ], 0, size );
+		}
 
-			/* allocate radiosity lightmap storage */
-			if ( bounce ) {
-				size = lm->w * lm->h * RAD_LUXEL_SIZE * sizeof( float );
-				if ( lm->radLuxels[ lightmapNum ] == NULL ) {
-					lm->radLuxels[ lightmapNum ] = static_cast<float*>(safe_malloc(size));
-				}
-				memset( lm->radLuxels[ lightmapNum ], 0, size );
+		/* allocate radiosity lightmap storage */
+		if ( bounce ) {
+			size = lm->w * lm->h * RAD_LUXEL_SIZE * sizeof( float );
+			if ( lm->radLuxels[ lightmapNum ] == NULL ) {
+				lm->radLuxels[ lightmapNum ] = static_cast<float*>(safe_malloc(size));
 			}
+			memset( lm->radLuxels[ lightmapNum ], 0, size );
+		}
 
-			/* average supersampled luxels */
-			for ( y = 0; y < lm->h; y++ )
+		/* average supersampled luxels */
+		for ( y = 0; y < lm->h; y++ )
+		{
+			for ( x = 0; x < lm->w; x++ )
 			{
-				for ( x = 0; x < lm->w; x++ )
+				/* subsample */
+				samples = 0.0f;
+				occludedSamples = 0.0f;
+				mappedSamples = 0;
+				VectorClear( sample );
+				VectorClear( occludedSample );
+				VectorClear( dirSample );
+				for ( ly = 0; ly < superSample; ly++ )
 				{
-					/* subsample */
-					samples = 0.0f;
-					occludedSamples = 0.0f;
-					mappedSamples = 0;
-					VectorClear( sample );
-					VectorClear( occludedSample );
-					VectorClear( dirSample );
-					for ( ly = 0; ly < superSample; ly++ )
+					for ( lx = 0; lx < superSample; lx++ )
 					{
-						for ( lx = 0; lx < superSample; lx++ )
-						{
-							/* sample luxel */
-							sx = x * superSample + lx;
-							sy = y * superSample + ly;
-							luxel = SUPER_LUXEL( lightmapNum, sx, sy );
-							deluxel = SUPER_DELUXEL( sx, sy );
-							normal = SUPER_NORMAL( sx, sy );
-							cluster = SUPER_CLUSTER( sx, sy );
+						/* sample luxel */
+						sx = x * superSample + lx;
+						sy = y * superSample + ly;
+						luxel = SUPER_LUXEL( lightmapNum, sx, sy );
+						deluxel = SUPER_DELUXEL( sx, sy );
+						normal = SUPER_NORMAL( sx, sy );
+						cluster = SUPER_CLUSTER( sx, sy );
+
+						/* sample deluxemap */
+						if ( deluxemap && lightmapNum == 0 ) {
+							VectorAdd( dirSample, deluxel, dirSample );
+						}
 
-							/* sample deluxemap */
-							if ( deluxemap && lightmapNum == 0 ) {
-								VectorAdd( dirSample, deluxel, dirSample );
-							}
+						/* keep track of used/occluded samples */
+						if ( *cluster != CLUSTER_UNMAPPED ) {
+							mappedSamples++;
+						}
+
+						/* handle lightmap border? */
+						if ( lightmapBorder && ( sx == 0 || sx == ( lm->sw - 1 ) || sy == 0 || sy == ( lm->sh - 1 ) ) && luxel[ 3 ] > 0.0f ) {
+							VectorSet( sample, 255.0f, 0.0f, 0.0f );
+							samples += 1.0f;
+						}
 
-							/* keep track of used/occluded samples */
-							if ( *cluster != CLUSTER_UNMAPPED ) {
-								mappedSamples++;
+						/* handle debug */
+						else if ( debug && *cluster < 0 ) {
+							if ( *cluster == CLUSTER_UNMAPPED ) {
+								VectorSet( luxel, 255, 204, 0 );
+							}
+							else if ( *cluster == CLUSTER_OCCLUDED ) {
+								VectorSet( luxel, 255, 0, 255 );
 							}
+							else if ( *cluster == CLUSTER_FLOODED ) {
+								VectorSet( luxel, 0, 32, 255 );
+							}
+							VectorAdd( occludedSample, luxel, occludedSample );
+							occludedSamples += 1.0f;
+						}
 
-							/* handle lightmap border? */
-							if ( lightmapBorder && ( sx == 0 || sx == ( lm->sw - 1 ) || sy == 0 || sy == ( lm->sh - 1 ) ) && luxel[ 3 ] > 0.0f ) {
-								VectorSet( sample, 255.0f, 0.0f, 0.0f );
-								samples += 1.0f;
+						/* normal luxel handling */
+						else if ( luxel[ 3 ] > 0.0f ) {
+							/* handle lit or flooded luxels */
+							if ( *cluster > 0 || *cluster == CLUSTER_FLOODED ) {
+								VectorAdd( sample, luxel, sample );
+								samples += luxel[ 3 ];
 							}
 
-							/* handle debug */
-							else if ( debug && *cluster < 0 ) {
-								if ( *cluster == CLUSTER_UNMAPPED ) {
-									VectorSet( luxel, 255, 204, 0 );
-								}
-								else if ( *cluster == CLUSTER_OCCLUDED ) {
-									VectorSet( luxel, 255, 0, 255 );
-								}
-								else if ( *cluster == CLUSTER_FLOODED ) {
-									VectorSet( luxel, 0, 32, 255 );
-								}
+							/* handle occluded or unmapped luxels */
+							else
+							{
 								VectorAdd( occludedSample, luxel, occludedSample );
-								occludedSamples += 1.0f;
+								occludedSamples += luxel[ 3 ];
 							}
 
-							/* normal luxel handling */
-							else if ( luxel[ 3 ] > 0.0f ) {
-								/* handle lit or flooded luxels */
-								if ( *cluster > 0 || *cluster == CLUSTER_FLOODED ) {
-									VectorAdd( sample, luxel, sample );
-									samples += luxel[ 3 ];
-								}
-
-								/* handle occluded or unmapped luxels */
-								else
-								{
-									VectorAdd( occludedSample, luxel, occludedSample );
-									occludedSamples += luxel[ 3 ];
-								}
-
-								/* handle style debugging */
-								if ( debug && lightmapNum > 0 && x < 2 && y < 2 ) {
-									VectorCopy( debugColors[ 0 ], sample );
-									samples = 1;
-								}
+							/* handle style debugging */
+							if ( debug && lightmapNum > 0 && x < 2 && y < 2 ) {
+								VectorCopy( debugColors[ 0 ], sample );
+								samples = 1;
 							}
 						}
 					}
+				}
 
-					/* only use occluded samples if necessary */
-					if ( samples <= 0.0f ) {
-						VectorCopy( occludedSample, sample );
-						samples = occludedSamples;
-					}
+				/* only use occluded samples if necessary */
+				if ( samples <= 0.0f ) {
+					VectorCopy( occludedSample, sample );
+					samples = occludedSamples;
+				}
 
-					/* get luxels */
-					luxel = SUPER_LUXEL( lightmapNum, x, y );
-					deluxel = SUPER_DELUXEL( x, y );
+				/* get luxels */
+				luxel = SUPER_LUXEL( lightmapNum, x, y );
+				deluxel = SUPER_DELUXEL( x, y );
 
-					/* store light direction */
-					if ( deluxemap && lightmapNum == 0 ) {
-						VectorCopy( dirSample, deluxel );
-					}
+				/* store light direction */
+				if ( deluxemap && lightmapNum == 0 ) {
+					VectorCopy( dirSample, deluxel );
+				}
 
-					/* store the sample back in super luxels */
-					if ( samples > 0.01f ) {
-						VectorScale( sample, ( 1.0f / samples ), luxel );
-						luxel[ 3 ] = 1.0f;
-					}
+				/* store the sample back in super luxels */
+				if ( samples > 0.01f ) {
+					VectorScale( sample, ( 1.0f / samples ), luxel );
+					luxel[ 3 ] = 1.0f;
+				}
 
-					/* if any samples were mapped in any way, store ambient color */
-					else if ( mappedSamples > 0 ) {
-						if ( lightmapNum == 0 ) {
-							VectorCopy( ambientColor, luxel );
-						}
-						else{
-							VectorClear( luxel );
-						}
-						luxel[ 3 ] = 1.0f;
+				/* if any samples were mapped in any way, store ambient color */
+				else if ( mappedSamples > 0 ) {
+					if ( lightmapNum == 0 ) {
+						VectorCopy( ambientColor, luxel );
 					}
-
-					/* store a bogus value to be fixed later */
-					else
-					{
+					else{
 						VectorClear( luxel );
-						luxel[ 3 ] = -1.0f;
 					}
+					luxel[ 3 ] = 1.0f;
+				}
+
+				/* store a bogus value to be fixed later */
+				else
+				{
+					VectorClear( luxel );
+					luxel[ 3 ] = -1.0f;
 				}
 			}
+		}
 
-			/* setup */
-			lm->used = 0;
-			ClearBounds( colorMins, colorMaxs );
+		/* setup */
+		lm->used = 0;
+		ClearBounds( colorMins, colorMaxs );
 
-			/* clean up and store into bsp luxels */
-			for ( y = 0; y < lm->h; y++ )
+		/* clean up and store into bsp luxels */
+		for ( y = 0; y < lm->h; y++ )
+		{
+			for ( x = 0; x < lm->w; x++ )
 			{
-				for ( x = 0; x < lm->w; x++ )
-				{
-					/* get luxels */
-					luxel = SUPER_LUXEL( lightmapNum, x, y );
-					deluxel = SUPER_DELUXEL( x, y );
+				/* get luxels */
+				luxel = SUPER_LUXEL( lightmapNum, x, y );
+				deluxel = SUPER_DELUXEL( x, y );
 
-					/* copy light direction */
-					if ( deluxemap && lightmapNum == 0 ) {
-						VectorCopy( deluxel, dirSample );
-					}
+				/* copy light direction */
+				if ( deluxemap && lightmapNum == 0 ) {
+					VectorCopy( deluxel, dirSample );
+				}
 
-					/* is this a valid sample? */
-					if ( luxel[ 3 ] > 0.0f ) {
-						VectorCopy( luxel, sample );
-						samples = luxel[ 3 ];
-						numUsed++;
-						lm->used++;
+				/* is this a valid sample? */
+				if ( luxel[ 3 ] > 0.0f ) {
+					VectorCopy( luxel, sample );
+					samples = luxel[ 3 ];
+					THREAD_STAT( numUsedLuxels )++;
+					lm->used++;
 
-						/* fix negative samples */
-						for ( j = 0; j < 3; j++ )
-						{
-							if ( sample[ j ] < 0.0f ) {
-								sample[ j ] = 0.0f;
-							}
+					/* fix negative samples */
+					for ( j = 0; j < 3; j++ )
+					{
+						if ( sample[ j ] < 0.0f ) {
+							sample[ j ] = 0.0f;
 						}
 					}
-					else
+				}
+				else
+				{
+					/* nick an average value from the neighbors */
+					VectorClear( sample );
+					VectorClear( dirSample );
+					samples = 0.0f;
+
+					/* fixme: why is this disabled?? */
+					for ( sy = ( y - 1 ); sy <= ( y + 1 ); sy++ )
 					{
-						/* nick an average value from the neighbors */
-						VectorClear( sample );
-						VectorClear( dirSample );
-						samples = 0.0f;
+						if ( sy < 0 || sy >= lm->h ) {
+							continue;
+						}
 
-						/* fixme: why is this disabled?? */
-						for ( sy = ( y - 1 ); sy <= ( y + 1 ); sy++ )
+						for ( sx = ( x - 1 ); sx <= ( x + 1 ); sx++ )
 						{
-							if ( sy < 0 || sy >= lm->h ) {
+							if ( sx < 0 || sx >= lm->w || ( sx == x && sy == y ) ) {
 								continue;
 							}
 
-							for ( sx = ( x - 1 ); sx <= ( x + 1 ); sx++ )
-							{
-								if ( sx < 0 || sx >= lm->w || ( sx == x && sy == y ) ) {
-									continue;
-								}
-
-								/* get neighbor's particulars */
-								luxel = SUPER_LUXEL( lightmapNum, sx, sy );
-								if ( luxel[ 3 ] < 0.0f ) {
-									continue;
-								}
-								VectorAdd( sample, luxel, sample );
-								samples += luxel[ 3 ];
+							/* get neighbor's particulars */
+							luxel = SUPER_LUXEL( lightmapNum, sx, sy );
+							if ( luxel[ 3 ] < 0.0f ) {
+								continue;
 							}
+							VectorAdd( sample, luxel, sample );
+							samples += luxel[ 3 ];
 						}
+					}
 
-						/* no samples? */
-						if ( samples == 0.0f ) {
-							VectorSet( sample, -1.0f, -1.0f, -1.0f );
-							samples = 1.0f;
-						}
-						else
-						{
-							numUsed++;
-							lm->used++;
+					/* no samples? */
+					if ( samples == 0.0f ) {
+						VectorSet( sample, -1.0f, -1.0f, -1.0f );
+						samples = 1.0f;
+					}
+					else
+					{
+						THREAD_STAT( numUsedLuxels )++;
+						lm->used++;
 
-							/* fix negative samples */
-							for ( j = 0; j < 3; j++ )
-							{
-								if ( sample[ j ] < 0.0f ) {
-									sample[ j ] = 0.0f;
-								}
+						/* fix negative samples */
+						for ( j = 0; j < 3; j++ )
+						{
+							if ( sample[ j ] < 0.0f ) {
+								sample[ j ] = 0.0f;
 							}
 						}
 					}
+				}
 
-					/* scale the sample */
-					VectorScale( sample, ( 1.0f / samples ), sample );
+				/* scale the sample */
+				VectorScale( sample, ( 1.0f / samples ), sample );
 
-					/* store the sample in the radiosity luxels */
-					if ( bounce > 0 ) {
-						radLuxel = RAD_LUXEL( lightmapNum, x, y );
-						VectorCopy( sample, radLuxel );
+				/* store the sample in the radiosity luxels */
+				if ( bounce > 0 ) {
+					radLuxel = RAD_LUXEL( lightmapNum, x, y );
+					VectorCopy( sample, radLuxel );
 
-						/* if only storing bounced light, early out here */
-						if ( bounceOnly && !bouncing ) {
-							continue;
-						}
+					/* if only storing bounced light, early out here */
+					if ( bounceOnly && !bouncing ) {
+						continue;
 					}
+				}
 
-					/* store the sample in the bsp luxels */
-					bspLuxel = BSP_LUXEL( lightmapNum, x, y );
-					bspDeluxel = BSP_DELUXEL( x, y );
+				/* store the sample in the bsp luxels */
+				bspLuxel = BSP_LUXEL( lightmapNum, x, y );
+				bspDeluxel = BSP_DELUXEL( x, y );
 
-					VectorAdd( bspLuxel, sample, bspLuxel );
-					if ( deluxemap && lightmapNum == 0 ) {
-						VectorAdd( bspDeluxel, dirSample, bspDeluxel );
-					}
+				VectorAdd( bspLuxel, sample, bspLuxel );
+				if ( deluxemap && lightmapNum == 0 ) {
+					VectorAdd( bspDeluxel, dirSample, bspDeluxel );
+				}
 
-					/* add color to bounds for solid checking */
-					if ( samples > 0.0f ) {
-						AddPointToBounds( bspLuxel, colorMins, colorMaxs );
-					}
+				/* add color to bounds for solid checking */
+				if ( samples > 0.0f ) {
+					AddPointToBounds( bspLuxel, colorMins, colorMaxs );
 				}
 			}
+		}
 
-			/* set solid color */
-			lm->solid[ lightmapNum ] = qfalse;
-			VectorAdd( colorMins, colorMaxs, lm->solidColor[ lightmapNum ] );
-			VectorScale( lm->solidColor[ lightmapNum ], 0.5f, lm->solidColor[ lightmapNum ] );
-
-			/* nocollapse prevents solid lightmaps */
-			if ( noCollapse == qfalse ) {
-				/* check solid color */
-				VectorSubtract( colorMaxs, colorMins, sample );
-				if ( ( sample[ 0 ] <= SOLID_EPSILON && sample[ 1 ] <= SOLID_EPSILON && sample[ 2 ] <= SOLID_EPSILON ) ||
-					 ( lm->w <= 2 && lm->h <= 2 ) ) { /* small lightmaps get forced to solid color */
-					/* set to solid */
-					VectorCopy( colorMins, lm->solidColor[ lightmapNum ] );
-					lm->solid[ lightmapNum ] = qtrue;
-					numSolidLightmaps++;
-				}
+		/* set solid color */
+		lm->solid[ lightmapNum ] = qfalse;
+		VectorAdd( colorMins, colorMaxs, lm->solidColor[ lightmapNum ] );
+		VectorScale( lm->solidColor[ lightmapNum ], 0.5f, lm->solidColor[ lightmapNum ] );
 
-				/* if all lightmaps aren't solid, then none of them are solid */
-				if ( lm->solid[ lightmapNum ] != lm->solid[ 0 ] ) {
-					for ( y = 0; y < MAX_LIGHTMAPS; y++ )
-					{
-						if ( lm->solid[ y ] ) {
-							numSolidLightmaps--;
-						}
-						lm->solid[ y ] = qfalse;
-					}
-				}
+		/* nocollapse prevents solid lightmaps */
+		if ( noCollapse == qfalse ) {
+			/* check solid color */
+			VectorSubtract( colorMaxs, colorMins, sample );
+			if ( ( sample[ 0 ] <= SOLID_EPSILON && sample[ 1 ] <= SOLID_EPSILON && sample[ 2 ] <= SOLID_EPSILON ) ||
+				 ( lm->w <= 2 && lm->h <= 2 ) ) { /* small lightmaps get forced to solid color */
+				/* set to solid */
+				VectorCopy( colorMins, lm->solidColor[ lightmapNum ] );
+				lm->solid[ lightmapNum ] = qtrue;
+				THREAD_STAT( numSolidLightmaps )++;
 			}
 
-			/* wrap bsp luxels if necessary */
-			if ( lm->wrap[ 0 ] ) {
-				for ( y = 0; y < lm->h; y++ )
+			/* if all lightmaps aren't solid, then none of them are solid */
+			if ( lm->solid[ lightmapNum ] != lm->solid[ 0 ] ) {
+				for ( y = 0; y < MAX_LIGHTMAPS; y++ )
 				{
-					bspLuxel = BSP_LUXEL( lightmapNum, 0, y );
-					bspLuxel2 = BSP_LUXEL( lightmapNum, lm->w - 1, y );
-					VectorAdd( bspLuxel, bspLuxel2, bspLuxel );
-					VectorScale( bspLuxel, 0.5f, bspLuxel );
-					VectorCopy( bspLuxel, bspLuxel2 );
-					if ( deluxemap && lightmapNum == 0 ) {
-						bspDeluxel = BSP_DELUXEL( 0, y );
-						bspDeluxel2 = BSP_DELUXEL( lm->w - 1, y );
-						VectorAdd( bspDeluxel, bspDeluxel2, bspDeluxel );
-						VectorScale( bspDeluxel, 0.5f, bspDeluxel );
-						VectorCopy( bspDeluxel, bspDeluxel2 );
+					if ( lm->solid[ y ] ) {
+						THREAD_STAT( numSolidLightmaps )--;
 					}
+					lm->solid[ y ] = qfalse;
 				}
 			}
-			if ( lm->wrap[ 1 ] ) {
-				for ( x = 0; x < lm->w; x++ )
-				{
-					bspLuxel = BSP_LUXEL( lightmapNum, x, 0 );
-					bspLuxel2 = BSP_LUXEL( lightmapNum, x, lm->h - 1 );
-					VectorAdd( bspLuxel, bspLuxel2, bspLuxel );
-					VectorScale( bspLuxel, 0.5f, bspLuxel );
-					VectorCopy( bspLuxel, bspLuxel2 );
-					if ( deluxemap && lightmapNum == 0 ) {
-						bspDeluxel = BSP_DELUXEL( x, 0 );
-						bspDeluxel2 = BSP_DELUXEL( x, lm->h - 1 );
-						VectorAdd( bspDeluxel, bspDeluxel2, bspDeluxel );
-						VectorScale( bspDeluxel, 0.5f, bspDeluxel );
-						VectorCopy( bspDeluxel, bspDeluxel2 );
-					}
+		}
+
+		/* wrap bsp luxels if necessary */
+		if ( lm->wrap[ 0 ] ) {
+			for ( y = 0; y < lm->h; y++ )
+			{
+				bspLuxel = BSP_LUXEL( lightmapNum, 0, y );
+				bspLuxel2 = BSP_LUXEL( lightmapNum, lm->w - 1, y );
+				VectorAdd( bspLuxel, bspLuxel2, bspLuxel );
+				VectorScale( bspLuxel, 0.5f, bspLuxel );
+				VectorCopy( bspLuxel, bspLuxel2 );
+				if ( deluxemap && lightmapNum == 0 ) {
+					bspDeluxel = BSP_DELUXEL( 0, y );
+					bspDeluxel2 = BSP_DELUXEL( lm->w - 1, y );
+					VectorAdd( bspDeluxel, bspDeluxel2, bspDeluxel );
+					VectorScale( bspDeluxel, 0.5f, bspDeluxel );
+					VectorCopy( bspDeluxel, bspDeluxel2 );
+				}
+			}
+		}
+		if ( lm->wrap[ 1 ] ) {
+			for ( x = 0; x < lm->w; x++ )
+			{
+				bspLuxel = BSP_LUXEL( lightmapNum, x, 0 );
+				bspLuxel2 = BSP_LUXEL( lightmapNum, x, lm->h - 1 );
+				VectorAdd( bspLuxel, bspLuxel2, bspLuxel );
+				VectorScale( bspLuxel, 0.5f, bspLuxel );
+				VectorCopy( bspLuxel, bspLuxel2 );
+				if ( deluxemap && lightmapNum == 0 ) {
+					bspDeluxel = BSP_DELUXEL( x, 0 );
+					bspDeluxel2 = BSP_DELUXEL( x, lm->h - 1 );
+					VectorAdd( bspDeluxel, bspDeluxel2, bspDeluxel );
+					VectorScale( bspDeluxel, 0.5f, bspDeluxel );
+					VectorCopy( bspDeluxel, bspDeluxel2 );
 				}
 			}
 		}
 	}
 
-	/* -----------------------------------------------------------------
-	   convert modelspace deluxemaps to tangentspace
-	   ----------------------------------------------------------------- */
-	/* note it */
-	if ( !bouncing ) {
-		if ( deluxemap && deluxemode == 1 ) {
-			vec3_t worldUp, myNormal, myTangent, myBinormal;
-			float dist;
-
-			Sys_Printf( "converting..." );
-
-			for ( i = 0; i < numRawLightmaps; i++ )
+	/* convert modelspace deluxemaps to tangentspace */
+	if ( !bouncing && deluxemap && deluxemode == 1 ) {
+		/* walk lightmap samples */
+		for ( y = 0; y < lm->sh; y++ )
+		{
+			for ( x = 0; x < lm->sw; x++ )
 			{
-				/* get lightmap */
-				lm = &rawLightmaps[ i ];
+				/* get normal and deluxel */
+				normal = SUPER_NORMAL( x, y );
+				cluster = SUPER_CLUSTER( x, y );
+				bspDeluxel = BSP_DELUXEL( x, y );
+				deluxel = SUPER_DELUXEL( x, y );
 
-				/* walk lightmap samples */
-				for ( y = 0; y < lm->sh; y++ )
+				/* get normal */
+				VectorSet( myNormal, normal[0], normal[1], normal[2] );
+
+				/* get tangent vectors */
+				if ( myNormal[ 0 ] == 0.0f && myNormal[ 1 ] == 0.0f ) {
+					if ( myNormal[ 2 ] == 1.0f ) {
+						VectorSet( myTangent, 1.0f, 0.0f, 0.0f );
+						VectorSet( myBinormal, 0.0f, 1.0f, 0.0f );
+					}
+					else if ( myNormal[ 2 ] == -1.0f ) {
+						VectorSet( myTangent, -1.0f, 0.0f, 0.0f );
+						VectorSet( myBinormal,  0.0f, 1.0f, 0.0f );
+					}
+				}
+				else
 				{
-					for ( x = 0; x < lm->sw; x++ )
-					{
-						/* get normal and deluxel */
-						normal = SUPER_NORMAL( x, y );
-						cluster = SUPER_CLUSTER( x, y );
-						bspDeluxel = BSP_DELUXEL( x, y );
-						deluxel = SUPER_DELUXEL( x, y );
-
-						/* get normal */
-						VectorSet( myNormal, normal[0], normal[1], normal[2] );
-
-						/* get tangent vectors */
-						if ( myNormal[ 0 ] == 0.0f && myNormal[ 1 ] == 0.0f ) {
-							if ( myNormal[ 2 ] == 1.0f ) {
-								VectorSet( myTangent, 1.0f, 0.0f, 0.0f );
-								VectorSet( myBinormal, 0.0f, 1.0f, 0.0f );
-							}
-							else if ( myNormal[ 2 ] == -1.0f ) {
-								VectorSet( myTangent, -1.0f, 0.0f, 0.0f );
-								VectorSet( myBinormal,  0.0f, 1.0f, 0.0f );
-							}
-						}
-						else
-						{
-							VectorSet( worldUp, 0.0f, 0.0f, 1.0f );
-							CrossProduct( myNormal, worldUp, myTangent );
-							VectorNormalize( myTangent, myTangent );
-							CrossProduct( myTangent, myNormal, myBinormal );
-							VectorNormalize( myBinormal, myBinormal );
-						}
+					VectorSet( worldUp, 0.0f, 0.0f, 1.0f );
+					CrossProduct( myNormal, worldUp, myTangent );
+					VectorNormalize( myTangent, myTangent );
+					CrossProduct( myTangent, myNormal, myBinormal );
+					VectorNormalize( myBinormal, myBinormal );
+				}
 
-						/* project onto plane */
-						dist = -DotProduct( myTangent, myNormal );
-						VectorMA( myTangent, dist, myNormal, myTangent );
-						dist = -DotProduct( myBinormal, myNormal );
-						VectorMA( myBinormal, dist, myNormal, myBinormal );
-
-						/* renormalize */
-						VectorNormalize( myTangent, myTangent );
-						VectorNormalize( myBinormal, myBinormal );
-
-						/* convert modelspace deluxel to tangentspace */
-						dirSample[0] = bspDeluxel[0];
-						dirSample[1] = bspDeluxel[1];
-						dirSample[2] = bspDeluxel[2];
-						VectorNormalize( dirSample, dirSample );
-
-						/* fix tangents to world matrix */
-						if ( myNormal[0] > 0 || myNormal[1] < 0 || myNormal[2] < 0 ) {
-							VectorNegate( myTangent, myTangent );
-						}
+				/* project onto plane */
+				dist = -DotProduct( myTangent, myNormal );
+				VectorMA( myTangent, dist, myNormal, myTangent );
+				dist = -DotProduct( myBinormal, myNormal );
+				VectorMA( myBinormal, dist, myNormal, myBinormal );
 
-						/* build tangentspace vectors */
-						bspDeluxel[0] = DotProduct( dirSample, myTangent );
-						bspDeluxel[1] = DotProduct( dirSample, myBinormal );
-						bspDeluxel[2] = DotProduct( dirSample, myNormal );
-					}
+				/* renormalize */
+				VectorNormalize( myTangent, myTangent );
+				VectorNormalize( myBinormal, myBinormal );
+
+				/* convert modelspace deluxel to tangentspace */
+				dirSample[0] = bspDeluxel[0];
+				dirSample[1] = bspDeluxel[1];
+				dirSample[2] = bspDeluxel[2];
+				VectorNormalize( dirSample, dirSample );
+
+				/* fix tangents to world matrix */
+				if ( myNormal[0] > 0 || myNormal[1] < 0 || myNormal[2] < 0 ) {
+					VectorNegate( myTangent, myTangent );
 				}
+
+				/* build tangentspace vectors */
+				bspDeluxel[0] = DotProduct( dirSample, myTangent );
+				bspDeluxel[1] = DotProduct( dirSample, myBinormal );
+				bspDeluxel[2] = DotProduct( dirSample, myNormal );
 			}
 		}
 	}
 
+	ReleaseSuperBuffers( lm );
+}
+
+
+
+void SubsampleRawLightmaps( void ){
+	int i, lightmapNum;
+	bspDrawSurface_t    *ds;
+	surfaceInfo_t       *info;
+
+
+	/* note it */
+	Sys_Printf( "--- SubsampleRawLightmaps ---\n" );
+	ProfileBeginPhase( "SubsampleRawLightmaps" );
+
+	/* -----------------------------------------------------------------
+	   average the sampled luxels into the bsp luxels
+	   ----------------------------------------------------------------- */
+
+	/* note it, modelspace deluxemaps are converted to tangentspace along the way */
+	Sys_Printf( "Subsampling..." );
+	if ( !bouncing && deluxemap && deluxemode == 1 ) {
+		Sys_Printf( "converting..." );
+	}
+
+	/* walk the list of raw lightmaps */
+	numUsedLuxels = 0;
+	numSolidLightmaps = 0;
+	RunThreadsOnIndividual( numRawLightmaps, qfalse, SubsampleRawLightmap );
+
 	/* -----------------------------------------------------------------
 	   blend lightmaps
 	   ----------------------------------------------------------------- */
@@ -2974,6 +3363,138 @@ void StoreSurfaceLightmaps()
 	}
 #endif
 
+	/* -----------------------------------------------------------------
+	   set the surface styles radiosity creates its lights with
+	   ----------------------------------------------------------------- */
+
+	/* StoreSurfaceLightmaps() sets them the same way when it projects the lightmaps */
+	for ( i = 0; i < numBSPDrawSurfaces; i++ )
+	{
+		ds = &bspDrawSurfaces[ i ];
+		info = &surfaceInfos[ i ];
+		if ( info->parentSurfaceNum >= 0 ) {
+			continue;
+		}
+		for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+			ds->lightmapStyles[ lightmapNum ] = info->lm != NULL ? info->lm->styles[ lightmapNum ] : ds->vertexStyles[ lightmapNum ];
+	}
+	for ( i = 0; i < numBSPDrawSurfaces; i++ )
+	{
+		info = &surfaceInfos[ i ];
+		if ( info->parentSurfaceNum >= 0 ) {
+			memcpy( bspDrawSurfaces[ i ].lightmapStyles, bspDrawSurfaces[ info->parentSurfaceNum ].lightmapStyles, sizeof( bspDrawSurfaces[ i ].lightmapStyles ) );
+		}
+	}
+
+	Sys_Printf( "done.\n" );
+	ProfileEndPhase();
+}
+
+
+
+/*
+   StoreOutLightmap()
+   fills an output lightmap, copies it into the bsp lightmap lump and writes it out
+   when it is external, the external numbers are handed out in order beforehand
+ */
+
+static char outLightmapDir[ 1024 ];
+
+static void StoreOutLightmap( int outLightmapNum ){
+	outLightmap_t       *olm;
+	byte                *lb;
+	char filename[ 1024 ];
+
+
+	/* get output lightmap */
+	olm = &outLightmaps[ outLightmapNum ];
+
+	/* fill output lightmap */
+	if ( lightmapFill ) {
+		FillOutLightmap( olm );
+	}
+
+	/* is this a valid bsp lightmap? */
+	if ( olm->lightmapNum >= 0 && !externalLightmaps ) {
+		/* copy lighting data */
+		lb = bspLightBytes + ( olm->lightmapNum * game->lightmapSize * game->lightmapSize * 3 );
+		memcpy( lb, olm->bspLightBytes, game->lightmapSize * game->lightmapSize * 3 );
+
+		/* copy direction data */
+		if ( deluxemap ) {
+			lb = bspLightBytes + ( ( olm->lightmapNum + 1 ) * game->lightmapSize * game->lightmapSize * 3 );
+			memcpy( lb, olm->bspDirBytes, game->lightmapSize * game->lightmapSize * 3 );
+		}
+	}
+
+	/* external lightmap? */
+	if ( olm->extLightmapNum >= 0 ) {
+		/* write lightmap */
+		sprintf( filename, "%s/" EXTERNAL_LIGHTMAP, outLightmapDir, olm->extLightmapNum );
+		Sys_FPrintf( SYS_VRB, "\nwriting %s", filename );
+		WriteTGA24( filename, olm->bspLightBytes, olm->customWidth, olm->customHeight, qtrue );
+
+		/* write deluxemap */
+		if ( deluxemap ) {
+			sprintf( filename, "%s/" EXTERNAL_LIGHTMAP, outLightmapDir, olm->extLightmapNum + 1 );
+			Sys_FPrintf( SYS_VRB, "\nwriting %s", filename );
+			WriteTGA24( filename, olm->bspDirBytes, olm->customWidth, olm->customHeight, qtrue );
+
+			if ( debugDeluxemap ) {
+				olm->extLightmapNum++;
+			}
+		}
+	}
+}
+
+
+
+/*
+   StoreSurfaceLightmaps()
+   stores the surface lightmaps into the bsp as byte rgb triplets, from the bsp luxels
+   SubsampleRawLightmaps() has accumulated
+ */
+
+#define MAX_VERTEX_COLORS   64
+
+void StoreSurfaceLightmaps()
+{
+	int i, j, k, c, numColors;
+	int style, lightmapNum, lightmapNum2;
+	float               *luxel;
+	int numTwins, numTwinLuxels, numStored;
+	float lmx, lmy, efficiency;
+	vec3_t colors[ MAX_VERTEX_COLORS ];
+	bspDrawSurface_t    *ds, *parent, dsTemp;
+	surfaceInfo_t       *info;
+	rawLightmap_t       *lm, *lm2;
+	outLightmap_t       *olm;
+	bspDrawVert_t       *dv, *ydv, *dvParent;
+	char dirname[ 1024 ], filename[ 1024 ];
+	shaderInfo_t        *csi;
+	char lightmapName[ 128 ];
+	const char              *rgbGenValues[ 256 ];
+	const char              *alphaGenValues[ 256 ];
+
+
+	/* note it */
+	Sys_Printf( "--- StoreSurfaceLightmaps ---\n" );
+	ProfileBeginPhase( "StoreSurfaceLightmaps" );
+
+	/* setup */
+	if ( lmCustomDir ) {
+		strcpy( dirname, lmCustomDir );
+	}
+	else
+	{
+		strcpy( dirname, source );
+		StripExtension( dirname );
+	}
+	memset( rgbGenValues, 0, sizeof( rgbGenValues ) );
+	memset( alphaGenValues, 0, sizeof( alphaGenValues ) );
+	numTwins = 0;
+	numTwinLuxels = 0;
+
 	/* -----------------------------------------------------------------
 	   collapse non-unique lightmaps
 	   ----------------------------------------------------------------- */
@@ -3073,6 +3594,7 @@ void StoreSurfaceLightmaps()
 		for ( i = 0; i < numOutLightmaps; i++ )
 		{
 			free( outLightmaps[ i ].lightBits );
+			free( outLightmaps[ i ].lightRows );
 			free( outLightmaps[ i ].bspLightBytes );
 		}
 		free( outLightmaps );
@@ -3084,6 +3606,9 @@ void StoreSurfaceLightmaps()
 	numBSPLightmaps = 0;
 	numExtLightmaps = 0;
 
+	/* test which lightmaps can be approximated with vertex colors */
+	RunThreadsOnIndividual( numRawLightmaps, qfalse, ApproximateRawLightmap );
+
 	/* find output lightmap */
 	for ( i = 0; i < numRawLightmaps; i++ )
 	{
@@ -3091,6 +3616,9 @@ void StoreSurfaceLightmaps()
 		FindOutLightmaps( lm );
 	}
 
+	/* store the luxels on the output lightmaps */
+	RunThreadsOnIndividual( numRawLightmaps, qfalse, StoreRawLightmapBytes );
+
 	/* set output numbers in twinned lightmaps */
 	for ( i = 0; i < numRawLightmaps; i++ )
 	{
@@ -3136,58 +3664,28 @@ void StoreSurfaceLightmaps()
 		memset( bspLightBytes, 0, numBSPLightBytes );
 	}
 
-	/* walk the list of output lightmaps */
+	/* set external lightmap numbers */
 	for ( i = 0; i < numOutLightmaps; i++ )
 	{
 		/* get output lightmap */
 		olm = &outLightmaps[ i ];
 
-		/* fill output lightmap */
-		if ( lightmapFill ) {
-			FillOutLightmap( olm );
-		}
-
-		/* is this a valid bsp lightmap? */
-		if ( olm->lightmapNum >= 0 && !externalLightmaps ) {
-			/* copy lighting data */
-			lb = bspLightBytes + ( olm->lightmapNum * game->lightmapSize * game->lightmapSize * 3 );
-			memcpy( lb, olm->bspLightBytes, game->lightmapSize * game->lightmapSize * 3 );
-
-			/* copy direction data */
-			if ( deluxemap ) {
-				lb = bspLightBytes + ( ( olm->lightmapNum + 1 ) * game->lightmapSize * game->lightmapSize * 3 );
-				memcpy( lb, olm->bspDirBytes, game->lightmapSize * game->lightmapSize * 3 );
-			}
-		}
-
 		/* external lightmap? */
 		if ( olm->lightmapNum < 0 || olm->extLightmapNum >= 0 || externalLightmaps ) {
 			/* make a directory for the lightmaps */
-			Q_mkdir( dirname );
+			if ( numExtLightmaps == 0 ) {
+				Q_mkdir( dirname );
+			}
 
-			/* set external lightmap number */
 			olm->extLightmapNum = numExtLightmaps;
-
-			/* write lightmap */
-			sprintf( filename, "%s/" EXTERNAL_LIGHTMAP, dirname, numExtLightmaps );
-			Sys_FPrintf( SYS_VRB, "\nwriting %s", filename );
-			WriteTGA24( filename, olm->bspLightBytes, olm->customWidth, olm->customHeight, qtrue );
-			numExtLightmaps++;
-
-			/* write deluxemap */
-			if ( deluxemap ) {
-				sprintf( filename, "%s/" EXTERNAL_LIGHTMAP, dirname, numExtLightmaps );
-				Sys_FPrintf( SYS_VRB, "\nwriting %s", filename );
-				WriteTGA24( filename, olm->bspDirBytes, olm->customWidth, olm->customHeight, qtrue );
-				numExtLightmaps++;
-
-				if ( debugDeluxemap ) {
-					olm->extLightmapNum++;
-				}
-			}
+			numExtLightmaps += ( deluxemap ? 2 : 1 );
 		}
 	}
 
+	/* fill, copy and write the output lightmaps */
+	strcpy( outLightmapDir, dirname );
+	RunThreadsOnIndividual( numOutLightmaps, qfalse, StoreOutLightmap );
+
 	if ( numExtLightmaps > 0 ) {
 		Sys_Printf( "\n" );
 	}
@@ -3308,34 +3806,36 @@ void StoreSurfaceLightmaps()
 
 		/* store vertex colors */
 		dv = &bspDrawVerts[ ds->firstVert ];
-		for ( j = 0; j < ds->numVerts; j++ )
+		for ( j = 0; j < ds->numVerts && !info->si->noVertexLight; j += numColors )
 		{
+			numColors = ( ds->numVerts - j < MAX_VERTEX_COLORS ? ds->numVerts - j : MAX_VERTEX_COLORS );
+
 			/* walk lightmaps */
 			for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
 			{
-				/* handle unused style */
-				if ( ds->vertexStyles[ lightmapNum ] == LS_NONE ) {
-					VectorClear( color );
-				}
-				else
+				for ( k = 0; k < numColors; k++ )
 				{
+					/* handle unused style */
+					if ( ds->vertexStyles[ lightmapNum ] == LS_NONE ) {
+						VectorClear( colors[ k ] );
+						continue;
+					}
+
 					/* get vertex color */
-					luxel = VERTEX_LUXEL( lightmapNum, ds->firstVert + j );
-					VectorCopy( luxel, color );
+					luxel = VERTEX_LUXEL( lightmapNum, ds->firstVert + j + k );
+					VectorCopy( luxel, colors[ k ] );
 
 					/* set minimum light */
 					if ( lightmapNum == 0 ) {
-						for ( k = 0; k < 3; k++ )
-							if ( color[ k ] < minVertexLight[ k ] ) {
-								color[ k ] = minVertexLight[ k ];
+						for ( c = 0; c < 3; c++ )
+							if ( colors[ k ][ c ] < minVertexLight[ c ] ) {
+								colors[ k ][ c ] = minVertexLight[ c ];
 							}
 					}
 				}
 
 				/* store to bytes */
-				if ( !info->si->noVertexLight ) {
-					ColorToBytes( color, dv[ j ].color[ lightmapNum ], info->si->vertexScale );
-				}
+				ColorsToBytes( colors[ 0 ], 3, dv[ j ].color[ lightmapNum ], sizeof( *dv ), numColors, info->si->vertexScale );
 			}
 		}
 
@@ -3495,10 +3995,10 @@ void StoreSurfaceLightmaps()
 	numStored = numBSPLightBytes / 3;
 	efficiency = ( numStored <= 0 )
 				 ? 0
-				 : (float) numUsed / (float) numStored;
+				 : (float) numUsedLuxels / (float) numStored;
 
 	/* print stats */
-	Sys_Printf( "%9d luxels used\n", numUsed );
+	Sys_Printf( "%9d luxels used\n", numUsedLuxels );
 	Sys_Printf( "%9d luxels stored (%3.2f percent efficiency)\n", numStored, efficiency * 100.0f );
 	Sys_Printf( "%9d solid surface lightmaps\n", numSolidLightmaps );
 	Sys_Printf( "%9d identical surface lightmaps, using %d luxels\n", numTwins, numTwinLuxels );
@@ -3510,4 +4010,5 @@ void StoreSurfaceLightmaps()
 
 	/* write map shader file */
 	WriteMapShaderFile();
+	ProfileEndPhase();
 }
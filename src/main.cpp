@@ -120,6 +120,8 @@ void printOptions(const std::vector<OptionResult> &options)
 int main(int argc, char **argv) {
 	int i, r;
 	double start, end;
+	const char *stage = "bsp";
+	char profilePath[ 1024 ];
 
 
 	/* we want consistent 'randomness' */
@@ -180,6 +182,20 @@ int main(int argc, char **argv) {
 			numthreads = atoi(argv[i]);
 		}
 
+		/* pin worker threads to cpus */
+		else if (!Q_stricmp(argv[i], "-threadaffinity")) {
+			threadAffinity = qtrue;
+		}
+
+		/* per-phase profiling report */
+		else if (!Q_stricmp(argv[i], "-profile") || !Q_stricmp(argv[i], "--profile")) {
+			i++;
+			if (i >= argc || Q_stricmp(argv[i], "json")) {
+				Error("Unsupported profile format, expected: %s json", argv[i - 1]);
+			}
+			profiling = qtrue;
+		}
+
 		else if (Q_stricmp(argv[i], "-game") == 0) {
 			if (++i >= argc) {
 				Error("Out of arguments: No game specified after %s", argv[i - 1]);
@@ -239,66 +255,77 @@ int main(int argc, char **argv) {
 	for (int i = 0; i < argc; i++) {
 		/* fixaas */
 		if (!Q_stricmp(argv[i], "-fixaas")) {
+			stage = "fixaas";
 			r = FixAASMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* analyze */
 		else if (!Q_stricmp(argv[i], "-analyze")) {
+			stage = "analyze";
 			r = AnalyzeBSPMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* info */
 		else if (!Q_stricmp(argv[i], "-info")) {
+			stage = "info";
 			r = BSPInfoMain(argc - 2, argv + 2);
 			break;
 		}
 
 		/* vis */
 		else if (!Q_stricmp(argv[i], "-vis")) {
+			stage = "vis";
 			r = VisMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* light */
 		else if (!Q_stricmp(argv[i], "-light")) {
+			stage = "light";
 			r = LightMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* QBall: export entities */
 		else if (!Q_stricmp(argv[i], "-exportents")) {
+			stage = "exportents";
 			r = ExportEntitiesMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* ydnar: lightmap export */
 		else if (!Q_stricmp(argv[i], "-export")) {
+			stage = "export";
 			r = ExportLightmapsMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* ydnar: lightmap import */
 		else if (!Q_stricmp(argv[i], "-import")) {
+			stage = "import";
 			r = ImportLightmapsMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* ydnar: bsp scaling */
 		else if (!Q_stricmp(argv[i], "-scale")) {
+			stage = "scale";
 			r = ScaleBSPMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* ydnar: bsp conversion */
 		else if (!Q_stricmp(argv[i], "-convert")) {
+			stage = "convert";
 			r = ConvertBSPMain(argc - 1, argv + 1);
 			break;
 		}
 
 		/* div0: minimap */
 		else if (!Q_stricmp(argv[i], "-minimap")) {
+			stage = "minimap";
 			r = MiniMapBSPMain(argc - 1, argv + 1);
 			break;
 		}
@@ -312,6 +339,14 @@ int main(int argc, char **argv) {
 	end = I_FloatTime();
 	Sys_Printf( "%9.0f seconds elapsed\n", end - start );
 
+	/* write the profile next to the bsp */
+	if ( profiling && source[ 0 ] != '\0' ) {
+		strcpy( profilePath, source );
+		StripExtension( profilePath );
+		sprintf( profilePath + strlen( profilePath ), ".%s.profile.json", stage );
+		ProfileWrite( profilePath, stage );
+	}
+
 	/* shut down connection */
 	Broadcast_Shutdown();
 
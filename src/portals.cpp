@@ -554,8 +554,10 @@ void MakeTreePortals_r( node_t *node ){
  */
 void MakeTreePortals( tree_t *tree ){
 	Sys_FPrintf( SYS_VRB, "--- MakeTreePortals ---\n" );
+	ProfileBeginPhase( "MakeTreePortals" );
 	MakeHeadnodePortals( tree );
 	MakeTreePortals_r( tree->headnode );
+	ProfileEndPhase();
 	Sys_FPrintf( SYS_VRB, "%9d tiny portals\n", c_tinyportals );
 	Sys_FPrintf( SYS_VRB, "%9d bad portals\n", c_badportals );  /* ydnar */
 }
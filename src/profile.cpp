@@ -0,0 +1,343 @@
+/*
+   Copyright (C) 1999-2006 Id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* dependencies */
+#include "cmdlib.h"
+#include "inout.h"
+#include "profile.h"
+#include <string>
+#include <vector>
+
+
+
+/*
+   profiling
+   every phase records its wall time. threaded phases (one per RunThreadsOnIndividual call,
+   named after the work function) also record how long each thread spent on work items,
+   a log2 histogram of item times and the slowest items. the report is written as json.
+ */
+
+#define PROFILE_BUCKETS         32      /* bucket n holds items that took less than 2^n microseconds */
+#define PROFILE_SLOWEST         10
+
+typedef struct profileItem_s
+{
+	int item;
+	int thread;
+	double time;
+}
+profileItem_t;
+
+typedef struct profileThread_s
+{
+	double busy;
+	int numItems;
+	int histogram[ PROFILE_BUCKETS ];
+	int numSlowest;
+	profileItem_t slowest[ PROFILE_SLOWEST ];
+	char pad[ 64 ];                     /* keep threads off each other's cache lines */
+}
+profileThread_t;
+
+typedef struct profilePhase_s
+{
+	std::string name;
+	std::string parent;
+	double start, wall;
+	qboolean threaded;
+	int numItems;
+	std::vector<double> busy;
+	std::vector<int> items;
+	int histogram[ PROFILE_BUCKETS ];
+	std::vector<profileItem_t> slowest;
+}
+profilePhase_t;
+
+qboolean profiling = qfalse;
+
+static std::vector<profilePhase_t> profilePhases;
+static std::vector<int> openPhases;
+static std::vector<profileThread_t> profileThreads;
+
+
+
+/*
+   ProfileBeginPhase()
+   starts timing a named phase, phases may nest
+ */
+
+void ProfileBeginPhase( const char *name ){
+	profilePhase_t phase;
+
+	if ( !profiling ) {
+		return;
+	}
+
+	phase.name = name;
+	if ( !openPhases.empty() ) {
+		phase.parent = profilePhases[ openPhases.back() ].name;
+	}
+	phase.start = I_PreciseTime();
+	phase.wall = 0.0;
+	phase.threaded = qfalse;
+	phase.numItems = 0;
+	memset( phase.histogram, 0, sizeof( phase.histogram ) );
+
+	openPhases.push_back( profilePhases.size() );
+	profilePhases.push_back( phase );
+}
+
+
+
+/*
+   ProfileEndPhase()
+   stops timing the innermost open phase
+ */
+
+void ProfileEndPhase( void ){
+	profilePhase_t *phase;
+
+	if ( !profiling || openPhases.empty() ) {
+		return;
+	}
+
+	phase = &profilePhases[ openPhases.back() ];
+	phase->wall = I_PreciseTime() - phase->start;
+	openPhases.pop_back();
+}
+
+
+
+/*
+   ProfileBeginThreads()
+   opens a phase for one threaded run and clears the per-thread counters
+ */
+
+void ProfileBeginThreads( const char *name, int numThreads ){
+	int i;
+
+	if ( !profiling ) {
+		return;
+	}
+
+	ProfileBeginPhase( name );
+	profilePhases.back().threaded = qtrue;
+
+	if ( numThreads < 1 ) {
+		numThreads = 1;
+	}
+	profileThreads.resize( numThreads );
+	for ( i = 0; i < numThreads; i++ )
+	{
+		memset( &profileThreads[ i ], 0, sizeof( profileThread_t ) );
+	}
+}
+
+
+
+/*
+   ProfileWorkItem()
+   called by the worker threads after every work item, only touches the thread's own counters
+ */
+
+void ProfileWorkItem( int threadNum, int item, double time ){
+	profileThread_t *pt;
+	int i, bucket;
+	double us;
+
+	if ( threadNum < 0 || threadNum >= (int) profileThreads.size() ) {
+		threadNum = 0;
+	}
+	pt = &profileThreads[ threadNum ];
+
+	pt->busy += time;
+	pt->numItems++;
+
+	/* histogram */
+	us = time * 1000000.0;
+	for ( bucket = 0; bucket < PROFILE_BUCKETS - 1 && us >= (double) ( 1u << bucket ); bucket++ ) ;
+	pt->histogram[ bucket ]++;
+
+	/* keep the slowest few, sorted slowest first */
+	if ( pt->numSlowest == PROFILE_SLOWEST && time <= pt->slowest[ PROFILE_SLOWEST - 1 ].time ) {
+		return;
+	}
+	if ( pt->numSlowest < PROFILE_SLOWEST ) {
+		pt->numSlowest++;
+	}
+	for ( i = pt->numSlowest - 1; i > 0 && pt->slowest[ i - 1 ].time < time; i-- )
+		pt->slowest[ i ] = pt->slowest[ i - 1 ];
+	pt->slowest[ i ].item = item;
+	pt->slowest[ i ].thread = threadNum;
+	pt->slowest[ i ].time = time;
+}
+
+
+
+/*
+   ProfileEndThreads()
+   merges the per-thread counters into the phase opened by ProfileBeginThreads()
+ */
+
+void ProfileEndThreads( void ){
+	profilePhase_t *phase;
+	profileThread_t *pt;
+	size_t i, j;
+	int b;
+
+	if ( !profiling || openPhases.empty() ) {
+		return;
+	}
+
+	phase = &profilePhases[ openPhases.back() ];
+	for ( i = 0; i < profileThreads.size(); i++ )
+	{
+		pt = &profileThreads[ i ];
+		phase->busy.push_back( pt->busy );
+		phase->items.push_back( pt->numItems );
+		phase->numItems += pt->numItems;
+		for ( b = 0; b < PROFILE_BUCKETS; b++ )
+			phase->histogram[ b ] += pt->histogram[ b ];
+		for ( j = 0; j < (size_t) pt->numSlowest; j++ )
+			phase->slowest.push_back( pt->slowest[ j ] );
+	}
+
+	/* keep the slowest of all threads */
+	for ( i = 1; i < phase->slowest.size(); i++ )
+	{
+		profileItem_t item = phase->slowest[ i ];
+		for ( j = i; j > 0 && phase->slowest[ j - 1 ].time < item.time; j-- )
+			phase->slowest[ j ] = phase->slowest[ j - 1 ];
+		phase->slowest[ j ] = item;
+	}
+	if ( phase->slowest.size() > PROFILE_SLOWEST ) {
+		phase->slowest.resize( PROFILE_SLOWEST );
+	}
+
+	ProfileEndPhase();
+}
+
+
+
+/*
+   ProfileWriteString()
+   writes a json string, escaping what needs escaping
+ */
+
+static void ProfileWriteString( FILE *file, const char *s ){
+	fputc( '"', file );
+	for ( ; *s; s++ )
+	{
+		if ( *s == '"' || *s == '\\' ) {
+			fprintf( file, "\\%c", *s );
+		}
+		else if ( (unsigned char) *s < 0x20 ) {
+			fprintf( file, "\\u%04x", *s );
+		}
+		else{
+			fputc( *s, file );
+		}
+	}
+	fputc( '"', file );
+}
+
+
+
+/*
+   ProfileWrite()
+   writes all recorded phases to a json file
+ */
+
+void ProfileWrite( const char *path, const char *stage ){
+	FILE *file;
+	size_t i, j;
+	int b;
+	const char *sep;
+	profilePhase_t *phase;
+
+
+	if ( !profiling ) {
+		return;
+	}
+
+	/* close anything left open by an early return */
+	while ( !openPhases.empty() )
+		ProfileEndPhase();
+
+	file = fopen( path, "w" );
+	if ( file == NULL ) {
+		Sys_FPrintf( SYS_WRN, "WARNING: Unable to write profile %s\n", path );
+		return;
+	}
+	Sys_Printf( "Writing %s\n", path );
+
+	fprintf( file, "{\n\t\"version\": 1,\n\t\"stage\": " );
+	ProfileWriteString( file, stage );
+	fprintf( file, ",\n\t\"histogramUnit\": \"log2 microseconds\",\n\t\"phases\": [" );
+
+	for ( i = 0; i < profilePhases.size(); i++ )
+	{
+		phase = &profilePhases[ i ];
+		fprintf( file, "%s\n\t\t{\n\t\t\t\"name\": ", i ? "," : "" );
+		ProfileWriteString( file, phase->name.c_str() );
+		if ( !phase->parent.empty() ) {
+			fprintf( file, ",\n\t\t\t\"parent\": " );
+			ProfileWriteString( file, phase->parent.c_str() );
+		}
+		fprintf( file, ",\n\t\t\t\"wall\": %.6f", phase->wall );
+
+		if ( phase->threaded ) {
+			fprintf( file, ",\n\t\t\t\"threads\": %d,\n\t\t\t\"items\": %d", (int) phase->busy.size(), phase->numItems );
+
+			fprintf( file, ",\n\t\t\t\"busy\": [" );
+			for ( j = 0; j < phase->busy.size(); j++ )
+				fprintf( file, "%s%.6f", j ? ", " : "", phase->busy[ j ] );
+			fprintf( file, "],\n\t\t\t\"idle\": [" );
+			for ( j = 0; j < phase->busy.size(); j++ )
+				fprintf( file, "%s%.6f", j ? ", " : "", phase->wall > phase->busy[ j ] ? phase->wall - phase->busy[ j ] : 0.0 );
+			fprintf( file, "],\n\t\t\t\"itemsPerThread\": [" );
+			for ( j = 0; j < phase->items.size(); j++ )
+				fprintf( file, "%s%d", j ? ", " : "", phase->items[ j ] );
+
+			/* histogram, upper bound in microseconds -> item count */
+			fprintf( file, "],\n\t\t\t\"histogram\": {" );
+			sep = "";
+			for ( b = 0; b < PROFILE_BUCKETS; b++ )
+			{
+				if ( phase->histogram[ b ] ) {
+					fprintf( file, "%s\"%u\": %d", sep, 1u << b, phase->histogram[ b ] );
+					sep = ", ";
+				}
+			}
+
+			fprintf( file, "},\n\t\t\t\"slowest\": [" );
+			for ( j = 0; j < phase->slowest.size(); j++ )
+				fprintf( file, "%s{ \"item\": %d, \"thread\": %d, \"time\": %.6f }", j ? ", " : "",
+						 phase->slowest[ j ].item, phase->slowest[ j ].thread, phase->slowest[ j ].time );
+			fprintf( file, "]" );
+		}
+
+		fprintf( file, "\n\t\t}" );
+	}
+
+	fprintf( file, "\n\t]\n}\n" );
+	fclose( file );
+}
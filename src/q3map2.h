@@ -67,12 +67,14 @@
 #include "polylib.h"
 #include "imagelib.h"
 #include "qthreads.h"
+#include "profile.h"
 #include "inout.h"
 #include "md4.h"
 #include <stdlib.h>
 #include "assets_loader.hpp"
 #include <vector>
 #include <string>
+#include <stdint.h>
 
 /* -------------------------------------------------------------------------------
 
@@ -238,7 +240,14 @@
 #define LIGHT_WOLF_DEFAULT      ( LIGHT_ATTEN_LINEAR | LIGHT_ATTEN_DISTANCE | LIGHT_GRID | LIGHT_SURFACES | LIGHT_FAST )
 
 #define MAX_TRACE_TEST_NODES    256
+#define TRACE_PACKET_TILE       4           /* luxels/grid points traced together are 4x4 tiles */
+#define MAX_TRACE_PACKET        ( TRACE_PACKET_TILE * TRACE_PACKET_TILE )
+#define SHADOW_CACHE_TILE       8           /* 8x8 luxels/grid points share a shadow cache entry per light */
+#define SHADOW_CACHE_SIZE       1024        /* shadow cache entries per thread, power of two */
 #define DEFAULT_INHIBIT_RADIUS  1.5f
+#define MAX_SKY_VIS_RESOLUTION  16          /* -skyvis bins a sample can keep: 16 x 16 octahedral cells */
+#define MAX_SKY_BINS            ( MAX_SKY_VIS_RESOLUTION * MAX_SKY_VIS_RESOLUTION )
+#define MAX_SKY_VIS_SIZE        ( 3 * MAX_SKY_BINS / 64 )
 
 #define LUXEL_EPSILON           0.125f
 #define VERTEX_EPSILON          -0.125f
@@ -1300,6 +1309,9 @@ typedef struct light_s
 
 	float falloffTolerance;                 /* ydnar: minimum attenuation threshold */
 	float filterRadius;                 /* ydnar: lightmap filter radius in world units, 0 == default */
+
+	int skyBin;                         /* -skyvis: sky visibility bin + 1 of a sun, 0 when it is traced on its own */
+	struct lightCut_s   *cut;           /* -bouncecut: light tree this light stands for, see CreateLightCuts() */
 }
 light_t;
 
@@ -1322,6 +1334,7 @@ typedef struct
 	int cluster;
 	vec3_t origin, normal;
 	vec_t inhibitRadius;                /* sphere in which occluding geometry is ignored */
+	uint64_t            *skyVis;        /* -skyvis: traced, open and filtered bits of every sky bin at the origin, or NULL */
 
 	/* per-light input */
 	light_t             *light;
@@ -1343,13 +1356,26 @@ typedef struct
 	qboolean opaque;
 	vec_t forceSubsampling;           /* needs subsampling (alphashadow), value = max color contribution possible from it */
 
+	int occluder;                       /* trace triangle that made it opaque, -1 if none or texture dependent */
+
 	/* working data */
+	int skyBinPending;                  /* sky bin + 1 whose ray is being traced instead of the sun's */
 	int numTestNodes;
 	int testNodes[ MAX_TRACE_TEST_NODES ];
 }
 trace_t;
 
 
+/* the last triangle that shadowed a tile of samples from a light */
+typedef struct shadowCacheEntry_s
+{
+	const light_t       *light;
+	int tile;
+	int triangleNum;
+}
+shadowCacheEntry_t;
+
+
 
 /* must be identical to bspDrawVert_t except for float color! */
 typedef struct
@@ -1390,6 +1416,8 @@ typedef struct outLightmap_s
 	int numShaders;
 	shaderInfo_t        *shaders[ MAX_LIGHTMAP_SHADERS ];
 	byte                *lightBits;
+	uint64_t            *lightRows;     /* lightBits as rows of words, set past the right edge */
+	int rowWords;
 	byte                *bspLightBytes;
 	byte                *bspDirBytes;
 }
@@ -1423,6 +1451,7 @@ typedef struct rawLightmap_s
 	qboolean solid[ MAX_LIGHTMAPS ];
 	vec3_t solidColor[ MAX_LIGHTMAPS ];
 
+	qboolean approximated;                  /* vertex colors are close enough, set before placement */
 	int numStyledTwins;
 	struct rawLightmap_s    *twins[ MAX_LIGHTMAPS ];
 
@@ -1441,6 +1470,9 @@ typedef struct rawLightmap_s
 	float                   *superDeluxels; /* average light direction */
 	float                   *bspDeluxels;
 	float                   *superFloodLight;
+
+	struct compactSuper_s   *compact;       /* packed super buffers with -compactsuper */
+	int superRefs;
 }
 rawLightmap_t;
 
@@ -1455,6 +1487,28 @@ typedef struct rawGridPoint_s
 rawGridPoint_t;
 
 
+/* light statistics, every thread counts into its own block while a threaded phase runs */
+typedef struct threadStats_s
+{
+	int numLuxelsMapped, numLuxelsOccluded, numLuxelsIlluminated, numVertsIlluminated;
+	int lightsBoundsCulled, lightsEnvelopeCulled, lightsPlaneCulled, lightsClusterCulled;
+	int gridBoundsCulled, gridEnvelopeCulled;
+	int numDiffuseLights, numBrushDiffuseLights, numTriangleDiffuseLights, numPatchDiffuseLights;
+	int numPacketRays, numSingleRays;
+	int shadowCacheHits, shadowCacheMisses;
+	int irrCacheTraced, irrCacheInterpolated;
+	int skyVisTraced, skyVisReused;
+	int lightCutSamples, lightCutRays;
+	int numUsedLuxels, numSolidLightmaps, numSurfsVertexForced, numSurfsVertexApproximated;
+	int numLuxelsStitched;
+	double lightCutSize, lightCutLights;    /* summed over samples, would overflow an int */
+	char pad[ 64 ];                     /* keep threads off each other's cache lines */
+}
+threadStats_t;
+
+#define THREAD_STAT( name )     ( *( threaded ? &threadStats[ GetThreadNum() ].name : &name ) )
+
+
 typedef struct surfaceInfo_s
 {
 	int modelindex;
@@ -1753,17 +1807,57 @@ void                        PassagePortalFlow( int portalnum );
 
 /* light.c  */
 float                       PointToPolygonFormFactor( const vec3_t point, const vec3_t normal, const winding_t *w );
+void                        SetupSkyVisibility( void );
 int                         LightContributionToSample( trace_t *trace );
+void                        LightContributionToSamplePacket( trace_t **traces, int numTraces, int cacheTile, int *results );
 void LightingAtSample( trace_t * trace, byte styles[ MAX_LIGHTMAPS ], vec3_t colors[ MAX_LIGHTMAPS ] );
 int                         LightContributionToPoint( trace_t *trace );
+void                        LightContributionToPointPacket( trace_t **traces, int numTraces, int cacheTile, int *results );
 int                         LightMain( int argc, char **argv );
+void                        MergeThreadStats( void );
 
 
 /* light_trace.c */
 void                        SetupTraceNodes( void );
 void                        TraceLine( trace_t *trace );
+void                        TraceLinePacket( trace_t **traces, int numTraces, int cacheTile );
 float                       SetupTrace( trace_t *trace );
-
+void                        SetupShadowGeometryHash( void );
+uint64_t                    ShadowGeometryHash( const vec3_t mins, const vec3_t maxs );
+
+
+/* light_checkpoint.c */
+struct OptionResult;
+#define HASH_INIT                   14695981039346656037ULL
+uint64_t                    HashBytes( uint64_t hash, const void *data, size_t size );
+void                        CheckpointOpen( const char *BSPFilePath, const std::vector<OptionResult> &options );
+void                        CheckpointClose( qboolean finished );
+void                        CheckpointBSPWritten( const char *BSPFilePath );
+void                        CheckpointWriteGridTile( int tile, const int *nums, int numPoints );
+qboolean                    CheckpointRestoreGridTile( int tile );
+void                        CheckpointWriteRawLightmap( int rawLightmapNum );
+qboolean                    CheckpointRestoreRawLightmap( int rawLightmapNum );
+void                        CheckpointWriteVertexes( void );
+qboolean                    CheckpointRestoreVertexes( void );
+void                        CheckpointWriteBounce( int b );
+int                         CheckpointBounce( void );
+void                        CheckpointRestoreBounce( void );
+void                        LightCacheOpen( const std::vector<OptionResult> &options );
+void                        LightCacheStats( void );
+uint64_t                    LightCacheRawLightmapKey( int rawLightmapNum, light_t **lights, int numLights );
+qboolean                    LightCacheRestoreRawLightmap( int rawLightmapNum, uint64_t key );
+void                        LightCacheWriteRawLightmap( int rawLightmapNum, uint64_t key );
+uint64_t                    LightCacheGridTileKey( trace_t *traces, const int *nums, int numPoints );
+qboolean                    LightCacheRestoreGridTile( uint64_t key );
+void                        LightCacheWriteGridTile( uint64_t key, const int *nums, int numPoints );
+
+
+/* light_compact.c */
+void                        AcquireSuperBuffers( rawLightmap_t *lm );
+void                        ReleaseSuperBuffers( rawLightmap_t *lm );
+void                        CompactSuperStats( void );
+void                        CompactSuperOpen( const char *BSPFilePath );
+void                        CompactSuperClose( void );
 
 /* light_bounce.c */
 qboolean RadSampleImage( byte * pixels, int width, int height, float st[ 2 ], float color[ 4 ] );
@@ -1771,9 +1865,14 @@ void                        RadLightForTriangles( int num, int lightmapNum, rawL
 void                        RadLightForPatch( int num, int lightmapNum, rawLightmap_t *lm, shaderInfo_t *si, float scale, float subdivide, clipWork_t *cw );
 void                        RadCreateDiffuseLights( void );
 void                        RadFreeLights();
+light_t                     **CreateLightCuts( light_t **lights, int numLights, int *numCutLights );
+void                        FreeLightCuts( light_t **cutLights, int numCutLights );
+int                         LightCutContribution( trace_t *trace );
 
 
 /* light_ydnar.c */
+void                        SetupColorTables( void );
+void                        ColorsToBytes( const float *colors, int colorStride, byte *colorBytes, int byteStride, int numColors, float scale );
 void                        ColorToBytes( const float *color, byte *colorBytes, float scale );
 void                        SmoothNormals( void );
 
@@ -1781,6 +1880,7 @@ void                        MapRawLightmap( int num );
 
 void                        SetupDirt();
 float                       DirtForSample( trace_t *trace );
+void                        DirtForSamplePacket( trace_t **traces, int numTraces, float *dirts );
 void                        DirtyRawLightmap( int num );
 
 void                        SetupFloodLight();
@@ -1788,8 +1888,11 @@ void                        FloodlightRawLightmaps();
 void                        FloodlightIlluminateLightmap( rawLightmap_t *lm );
 float                       FloodLightForSample( trace_t *trace, float floodLightDistance, qboolean floodLightLowQuality );
 void                        FloodLightRawLightmap( int num );
+qboolean                    DirtFloodFused( void );
+void                        DirtyFloodlightRawLightmap( int num );
 
 void                        IlluminateRawLightmap( int num );
+void                        IlluminateRawLightmaps( void );
 void                        IlluminateVertexes( int num );
 
 void                        SetupBrushesFlags( unsigned int mask_any, unsigned int test_any, unsigned int mask_all, unsigned int test_all );
@@ -1803,6 +1906,7 @@ int                         ClusterForPointExtFilter( vec3_t point, float epsilo
 int                         ShaderForPointInLeaf( vec3_t point, int leafNum, float epsilon, int wantContentFlags, int wantSurfaceFlags, int *contentFlags, int *surfaceFlags );
 void                        SetupEnvelopes( qboolean forGrid, qboolean fastFlag );
 void                        FreeTraceLights( trace_t *trace );
+void                        ResetTraceLightArenas( void );
 void                        CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int numClusters, int *clusters, int flags, trace_t *trace );
 void                        CreateTraceLightsForSurface( int num, trace_t *trace );
 
@@ -1813,8 +1917,10 @@ void                        ExportLightmaps( void );
 int                         ExportLightmapsMain( int argc, char **argv );
 int                         ImportLightmapsMain( int argc, char **argv );
 
+void                        AllocateSuperBuffers( rawLightmap_t *lm );
 void                        SetupSurfaceLightmaps( void );
 void                        StitchSurfaceLightmaps( void );
+void                        SubsampleRawLightmaps( void );
 void                        StoreSurfaceLightmaps();
 
 
@@ -2242,6 +2348,7 @@ Q_EXTERN qboolean noGridLighting Q_ASSIGN( qfalse );
 
 Q_EXTERN qboolean noTrace Q_ASSIGN( qfalse );
 Q_EXTERN qboolean noSurfaces Q_ASSIGN( qfalse );
+Q_EXTERN qboolean oldTraceTree Q_ASSIGN( qfalse );
 Q_EXTERN qboolean patchShadows Q_ASSIGN( qfalse );
 Q_EXTERN qboolean g_forceVertex Q_ASSIGN( qfalse );
 
@@ -2257,6 +2364,13 @@ Q_EXTERN qboolean fastbounce Q_ASSIGN( qfalse );
 Q_EXTERN qboolean cheap Q_ASSIGN( qfalse );
 Q_EXTERN qboolean cheapgrid Q_ASSIGN( qfalse );
 Q_EXTERN int bounce Q_ASSIGN( 0 );
+Q_EXTERN float bounceCut Q_ASSIGN( 0.0f );             /* -bouncecut, light tree error bound for diffuse lights, 0 traces every light */
+Q_EXTERN qboolean compactSuper Q_ASSIGN( qfalse );       /* -compactsuper, packs the super buffers of idle raw lightmaps */
+Q_EXTERN int64_t memBudget Q_ASSIGN( 0 );                /* -membudget, bytes of packed super buffers kept in memory, 0 keeps them all */
+Q_EXTERN int bounceCheckpoint Q_ASSIGN( 0 );          /* write the bsp every N bounces, 0 only writes it at the end */
+Q_EXTERN qboolean lightCheckpoint Q_ASSIGN( qfalse );  /* -checkpoint, store finished work in <mapname>.light.checkpoint */
+Q_EXTERN qboolean lightResume Q_ASSIGN( qfalse );      /* -resume, pick up the work stored in the checkpoint */
+Q_EXTERN char *lightCacheDir Q_ASSIGN( NULL );          /* -lightcache, directory of first pass results keyed by their inputs */
 Q_EXTERN qboolean bounceOnly Q_ASSIGN( qfalse );
 Q_EXTERN qboolean bouncing Q_ASSIGN( qfalse );
 Q_EXTERN qboolean bouncegrid Q_ASSIGN( qfalse );
@@ -2268,11 +2382,15 @@ Q_EXTERN int superSample Q_ASSIGN( 0 );
 Q_EXTERN int lightSamples Q_ASSIGN( 1 );
 Q_EXTERN qboolean lightRandomSamples Q_ASSIGN( qfalse );
 Q_EXTERN int lightSamplesSearchBoxSize Q_ASSIGN( 1 );
+Q_EXTERN float irrCacheError Q_ASSIGN( 0.0f );         /* -irrcache, 0 traces every luxel */
+Q_EXTERN int skyVisResolution Q_ASSIGN( 0 );          /* -skyvis, suns are binned on an N x N octahedral map of the sky, 0 traces every sun */
+Q_EXTERN int skyVisSize Q_ASSIGN( 0 );                /* uint64_t words of sky visibility per sample, 0 without sky bins */
 Q_EXTERN qboolean filter Q_ASSIGN( qfalse );
 Q_EXTERN qboolean dark Q_ASSIGN( qfalse );
 Q_EXTERN qboolean sunOnly Q_ASSIGN( qfalse );
 Q_EXTERN int approximateTolerance Q_ASSIGN( 0 );
 Q_EXTERN qboolean noCollapse Q_ASSIGN( qfalse );
+Q_EXTERN qboolean noStitch Q_ASSIGN( qfalse );
 Q_EXTERN int lightmapSearchBlockSize Q_ASSIGN( 0 );
 Q_EXTERN qboolean exportLightmaps Q_ASSIGN( qfalse );
 Q_EXTERN qboolean externalLightmaps Q_ASSIGN( qfalse );
@@ -2408,6 +2526,22 @@ Q_EXTERN int lightsEnvelopeCulled;
 Q_EXTERN int lightsPlaneCulled;
 Q_EXTERN int lightsClusterCulled;
 
+Q_EXTERN int numPacketRays;
+Q_EXTERN int numSingleRays;
+Q_EXTERN int shadowCacheHits;
+Q_EXTERN int shadowCacheMisses;
+Q_EXTERN int irrCacheTraced;
+Q_EXTERN int irrCacheInterpolated;
+Q_EXTERN int skyVisTraced;
+Q_EXTERN int skyVisReused;
+Q_EXTERN int lightCutSamples;
+Q_EXTERN int lightCutRays;
+Q_EXTERN double lightCutSize;
+Q_EXTERN double lightCutLights;
+
+Q_EXTERN threadStats_t      *threadStats Q_ASSIGN( NULL );
+Q_EXTERN shadowCacheEntry_t *shadowCaches Q_ASSIGN( NULL );    /* SHADOW_CACHE_SIZE entries per thread */
+
 /* ydnar: radiosity */
 Q_EXTERN float diffuseSubdivide Q_ASSIGN( 256.0f );
 Q_EXTERN float minDiffuseSubdivide Q_ASSIGN( 64.0f );
@@ -2437,6 +2571,8 @@ Q_EXTERN float              *radVertexLuxels[ MAX_LIGHTMAPS ];
 
 /* bsp lightmaps */
 Q_EXTERN int numLightmapShaders Q_ASSIGN( 0 );
+Q_EXTERN int numUsedLuxels Q_ASSIGN( 0 );
+Q_EXTERN int numLuxelsStitched Q_ASSIGN( 0 );
 Q_EXTERN int numSolidLightmaps Q_ASSIGN( 0 );
 Q_EXTERN int numOutLightmaps Q_ASSIGN( 0 );
 Q_EXTERN int numBSPLightmaps Q_ASSIGN( 0 );
@@ -23,10 +23,19 @@
 #include "bytebool.h"
 
 extern int numthreads;
+extern qboolean threadAffinity;
+extern qboolean threaded;
+
+/* called on the main thread after every RunThreadsOnIndividual, e.g. to merge per-thread data */
+extern void ( *threadPhaseEnd )( void );
 
 void ThreadSetDefault( void );
 int GetThreadWork( void );
-void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, void ( *func )( int ) );
+int GetThreadNum( void );
+void RunThreadsOnIndividualNamed( const char *name, int workcnt, qboolean showpacifier, void ( *func )( int ) );
 void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) );
 void ThreadLock( void );
 void ThreadUnlock( void );
+
+/* threaded phases show up in the profile under the name of their work function */
+#define RunThreadsOnIndividual( workcnt, showpacifier, func ) RunThreadsOnIndividualNamed( #func, workcnt, showpacifier, func )
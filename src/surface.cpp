@@ -1859,6 +1859,8 @@ void ClipSidesIntoTree( entity_t *e, tree_t *tree ){
 	shaderInfo_t    *si;
 
 
+	ProfileBeginPhase( "ClipSidesIntoTree" );
+
 	/* ydnar: cull brush sides */
 	CullSides( e );
 
@@ -1924,6 +1926,8 @@ void ClipSidesIntoTree( entity_t *e, tree_t *tree ){
 			DrawSurfaceForSide( e, b, newSide, w );
 		}
 	}
+
+	ProfileEndPhase();
 }
 
 
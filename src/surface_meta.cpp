@@ -1902,6 +1902,7 @@ void MergeMetaTriangles( void ){
 
 	/* note it */
 	Sys_FPrintf( SYS_VRB, "--- MergeMetaTriangles ---\n" );
+	ProfileBeginPhase( "MergeMetaTriangles" );
 
 	/* sort the triangles by shader major, fognum minor */
 	qsort( metaTriangles, numMetaTriangles, sizeof( metaTriangle_t ), CompareMetaTriangles );
@@ -1940,6 +1941,7 @@ void MergeMetaTriangles( void ){
 
 	/* clear meta triangle list */
 	ClearMetaTriangles();
+	ProfileEndPhase();
 
 	/* print time */
 	if ( i ) {
@@ -25,44 +25,164 @@
 // pthreads extensions like pthread_mutexattr_settype
 #define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #endif
 
 #include "cmdlib.h"
 #include "mathlib.h"
 #include "inout.h"
 #include "qthreads.h"
+#include "profile.h"
 
-#define MAX_THREADS 64
+#include <atomic>
+#include <stdint.h>
+
+/* largest run of items a worker takes off its own range at once */
+#define MAX_WORK_CHUNK  32
 
-int dispatch;
 int workcount;
-int oldf;
+std::atomic<int> dispatch;
+std::atomic<int> oldf;
 qboolean pacifier;
 
 qboolean threaded;
+qboolean threadAffinity;
+void ( *threadPhaseEnd )( void );
 
 /*
-   =============
-   GetThreadWork
+   work-stealing dispatch
+   every worker owns a contiguous range of work slots, packed as [begin, end)
+   into a single 64 bit word so it can be updated with one compare-and-swap.
+   the owner pops small chunks off the front, idle workers steal the upper
+   half of someone else's range. no lock is taken per item.
+ */
 
-   =============
+typedef struct threadWork_s
+{
+	std::atomic<uint64_t> range;
+	int chunkBegin, chunkEnd;           /* private to the owning thread */
+	char pad[ 64 - sizeof( std::atomic<uint64_t> ) - 2 * sizeof( int ) ];
+} threadWork_t;
+
+static threadWork_t *threadWork;
+static int numThreadWork, maxThreadWork;
+static int workPerThread, workRemainder;
+static thread_local int threadNum;
+
+#define WORK_RANGE( begin, end )    ( ( (uint64_t) (uint32_t) ( end ) << 32 ) | (uint32_t) ( begin ) )
+#define WORK_BEGIN( range )         ( (int) (uint32_t) ( range ) )
+#define WORK_END( range )           ( (int) (uint32_t) ( ( range ) >> 32 ) )
+
+
+
+/*
+   SetupThreadWork()
+   splits the work items evenly between the threads and resets the progress counters
  */
-int GetThreadWork( void ){
-	int r;
-	int f;
 
-	ThreadLock();
+static void SetupThreadWork( int workcnt, qboolean showpacifier ){
+	int i, begin, end;
+
+	workcount = workcnt;
+	dispatch = 0;
+	oldf = -1;
+	pacifier = showpacifier;
 
-	if ( dispatch == workcount ) {
-		ThreadUnlock();
-		return -1;
+	numThreadWork = numthreads < 1 ? 1 : numthreads;
+	if ( numThreadWork > maxThreadWork ) {
+		delete[] threadWork;
+		threadWork = new threadWork_t[ numThreadWork ];
+		maxThreadWork = numThreadWork;
 	}
+	workPerThread = workcnt / numThreadWork;
+	workRemainder = workcnt % numThreadWork;
+	for ( i = 0; i < numThreadWork; i++ )
+	{
+		begin = i * workPerThread + ( i < workRemainder ? i : workRemainder );
+		end = begin + workPerThread + ( i < workRemainder ? 1 : 0 );
+		threadWork[ i ].range = WORK_RANGE( begin, end );
+		threadWork[ i ].chunkBegin = threadWork[ i ].chunkEnd = 0;
+	}
+}
+
 
-	f = 40 * dispatch / workcount;
-	if ( f < oldf ) {
-		Sys_Printf( "warning: progress went backwards (should never happen)\n" );
-		oldf = f;
+
+/*
+   WorkItem()
+   ranges are made of slots, thread n's initial range holds items n, n + numthreads, n + 2 * numthreads...
+   so all threads move through the item list together and callers that sort their work
+   (largest first, cheapest portals first) get it handed out in that order
+ */
+
+static int WorkItem( int slot ){
+	int thread, index;
+
+	if ( slot < workRemainder * ( workPerThread + 1 ) ) {
+		thread = slot / ( workPerThread + 1 );
+		index = slot % ( workPerThread + 1 );
+	}
+	else
+	{
+		slot -= workRemainder * ( workPerThread + 1 );
+		thread = workRemainder + slot / workPerThread;
+		index = slot % workPerThread;
 	}
+
+	return index * numThreadWork + thread;
+}
+
+
+
+/*
+   StealThreadWork()
+   moves the upper half of another thread's range into our own, returns false if everybody is out of work
+ */
+
+static bool StealThreadWork( threadWork_t *self, int self_num ){
+	int i, begin, end, mid;
+	uint64_t range;
+	threadWork_t *victim;
+
+	for ( i = 1; i < numThreadWork; i++ )
+	{
+		victim = &threadWork[ ( self_num + i ) % numThreadWork ];
+		range = victim->range.load( std::memory_order_acquire );
+		while ( 1 )
+		{
+			begin = WORK_BEGIN( range );
+			end = WORK_END( range );
+			if ( begin >= end ) {
+				break;
+			}
+
+			/* leave the lower half to the owner, it is working its way up from there */
+			mid = begin + ( end - begin ) / 2;
+			if ( victim->range.compare_exchange_weak( range, WORK_RANGE( begin, mid ), std::memory_order_acq_rel ) ) {
+				self->range.store( WORK_RANGE( mid, end ), std::memory_order_release );
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+
+/*
+   UpdatePacifier()
+   only the thread that crosses a 2.5% mark touches stdout
+ */
+
+static void UpdatePacifier( int work ){
+	int f;
+
+	f = (int64_t) 40 * work / workcount;
+	if ( f <= oldf.load( std::memory_order_relaxed ) ) {
+		return;
+	}
+
+	ThreadLock();
 	while ( f > oldf )
 	{
 		++oldf;
@@ -76,20 +196,71 @@ int GetThreadWork( void ){
 			fflush( stdout );   /* ydnar */
 		}
 	}
-
-	r = dispatch;
-	dispatch++;
 	ThreadUnlock();
+}
+
+
+
+/*
+   =============
+   GetThreadWork
+
+   =============
+ */
+int GetThreadWork( void ){
+	int r, begin, end, chunk, num;
+	uint64_t range;
+	threadWork_t *self;
+
+	num = threadNum < numThreadWork ? threadNum : 0;
+	self = &threadWork[ num ];
+
+	while ( self->chunkBegin >= self->chunkEnd )
+	{
+		/* take a chunk off the front of our own range */
+		range = self->range.load( std::memory_order_acquire );
+		begin = WORK_BEGIN( range );
+		end = WORK_END( range );
+		if ( begin < end ) {
+			chunk = ( end - begin ) / ( 2 * numThreadWork );
+			chunk = chunk < 1 ? 1 : chunk > MAX_WORK_CHUNK ? MAX_WORK_CHUNK : chunk;
+			if ( self->range.compare_exchange_weak( range, WORK_RANGE( begin + chunk, end ), std::memory_order_acq_rel ) ) {
+				self->chunkBegin = begin;
+				self->chunkEnd = begin + chunk;
+			}
+			continue;
+		}
+
+		/* our range is empty, go help someone else */
+		if ( !StealThreadWork( self, num ) ) {
+			return -1;
+		}
+	}
+
+	r = WorkItem( self->chunkBegin++ );
+	UpdatePacifier( dispatch.fetch_add( 1, std::memory_order_relaxed ) );
 
 	return r;
 }
 
 
+/*
+   GetThreadNum()
+   index of the calling worker thread, 0 outside of threaded phases
+ */
+
+int GetThreadNum( void ){
+	return threadNum;
+}
+
+
 void ( *workfunction )( int );
 
 void ThreadWorkerFunction( int threadnum ){
 	int work;
+	double start;
 
+	threadNum = threadnum;
 	while ( 1 )
 	{
 		work = GetThreadWork();
@@ -97,16 +268,28 @@ void ThreadWorkerFunction( int threadnum ){
 			break;
 		}
 //Sys_Printf ("thread %i, work %i\n", threadnum, work);
-		workfunction( work );
+		if ( profiling ) {
+			start = I_PreciseTime();
+			workfunction( work );
+			ProfileWorkItem( threadnum, work, I_PreciseTime() - start );
+		}
+		else{
+			workfunction( work );
+		}
 	}
 }
 
-void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
+void RunThreadsOnIndividualNamed( const char *name, int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 	if ( numthreads == -1 ) {
 		ThreadSetDefault();
 	}
 	workfunction = func;
+	ProfileBeginThreads( name, numthreads );
 	RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction );
+	if ( threadPhaseEnd ) {
+		threadPhaseEnd();
+	}
+	ProfileEndThreads();
 }
 
 
@@ -127,13 +310,16 @@ int numthreads = -1;
 CRITICAL_SECTION crit;
 static int enter;
 
-void ThreadSetDefault( void ){
-	SYSTEM_INFO info;
+/* persistent worker pool, created on first use and parked between phases */
+static CRITICAL_SECTION poolCrit;
+static CONDITION_VARIABLE poolWake, poolDone;
+static void ( *poolFunc )( int );
+static int poolSize, poolActive, poolBusy, poolGeneration;
 
+void ThreadSetDefault( void ){
 	if ( numthreads == -1 ) { // not set manually
-		GetSystemInfo( &info );
-		numthreads = info.dwNumberOfProcessors;
-		if ( numthreads < 1 || numthreads > 32 ) {
+		numthreads = GetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+		if ( numthreads < 1 ) {
 			numthreads = 1;
 		}
 	}
@@ -164,55 +350,125 @@ void ThreadUnlock( void ){
 	LeaveCriticalSection( &crit );
 }
 
+
+
+/*
+   PinThread()
+   binds the calling thread to one of the processors the process may run on
+ */
+
+static void PinThread( int threadnum ){
+	DWORD_PTR processMask, systemMask, mask;
+	int i, n, count;
+
+	if ( !GetProcessAffinityMask( GetCurrentProcess(), &processMask, &systemMask ) || processMask == 0 ) {
+		return;
+	}
+
+	/* pick the nth allowed processor */
+	for ( count = 0, mask = processMask; mask; mask &= mask - 1 )
+		count++;
+	n = threadnum % count;
+	for ( i = 0; ; i++ )
+	{
+		if ( ( processMask >> i ) & 1 ) {
+			if ( n-- == 0 ) {
+				break;
+			}
+		}
+	}
+	SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR) 1 << i );
+}
+
+
+
+/*
+   PoolThread()
+   worker main loop, sleeps until RunThreadsOn starts a new phase
+ */
+
+static DWORD WINAPI PoolThread( LPVOID param ){
+	int threadnum = (int) (size_t) param;
+	int generation = -1;
+
+	if ( threadAffinity ) {
+		PinThread( threadnum );
+	}
+
+	while ( 1 )
+	{
+		EnterCriticalSection( &poolCrit );
+		while ( generation == poolGeneration )
+			SleepConditionVariableCS( &poolWake, &poolCrit, INFINITE );
+		generation = poolGeneration;
+		LeaveCriticalSection( &poolCrit );
+
+		/* threads beyond the current thread count sit this phase out */
+		if ( threadnum >= poolActive ) {
+			continue;
+		}
+
+		poolFunc( threadnum );
+
+		EnterCriticalSection( &poolCrit );
+		if ( --poolBusy == 0 ) {
+			WakeConditionVariable( &poolDone );
+		}
+		LeaveCriticalSection( &poolCrit );
+	}
+
+	return 0;
+}
+
 /*
    =============
    RunThreadsOn
    =============
  */
 void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
-	int threadid[MAX_THREADS];
-	HANDLE threadhandle[MAX_THREADS];
-	int i;
+	HANDLE thread;
 	int start, end;
 
 	start = I_FloatTime();
-	dispatch = 0;
-	workcount = workcnt;
-	oldf = -1;
-	pacifier = showpacifier;
-	threaded = qtrue;
-
-	//
-	// run threads in parallel
-	//
-	InitializeCriticalSection( &crit );
+	SetupThreadWork( workcnt, showpacifier );
 
 	if ( numthreads == 1 ) { // use same thread
 		func( 0 );
 	}
 	else
 	{
-		for ( i = 0 ; i < numthreads ; i++ )
-		{
-			threadhandle[i] = CreateThread(
-				NULL,   // LPSECURITY_ATTRIBUTES lpsa,
-			    //0,		// DWORD cbStack,
-
-			    /* ydnar: cranking stack size to eliminate radiosity crash with 1MB stack on win32 */
-				( 4096 * 1024 ),
+		if ( poolSize == 0 ) {
+			InitializeCriticalSection( &crit );
+			InitializeCriticalSection( &poolCrit );
+			InitializeConditionVariable( &poolWake );
+			InitializeConditionVariable( &poolDone );
+		}
+		threaded = qtrue;
 
-				(LPTHREAD_START_ROUTINE)func,   // LPTHREAD_START_ROUTINE lpStartAddr,
-				(LPVOID)i,  // LPVOID lpvThreadParm,
-				0,          //   DWORD fdwCreate,
-				reinterpret_cast<LPDWORD>(&threadid[i]) );
+		/* new workers can't grab the lock before this phase is published, so they never miss it */
+		EnterCriticalSection( &poolCrit );
+		for ( ; poolSize < numthreads; poolSize++ )
+		{
+			/* ydnar: cranking stack size to eliminate radiosity crash with 1MB stack on win32 */
+			thread = CreateThread( NULL, ( 4096 * 1024 ), PoolThread, (LPVOID) (size_t) poolSize, 0, NULL );
+			if ( thread == NULL ) {
+				Error( "CreateThread failed" );
+			}
+			CloseHandle( thread );
 		}
 
-		for ( i = 0 ; i < numthreads ; i++ )
-			WaitForSingleObject( threadhandle[i], INFINITE );
+		poolFunc = func;
+		poolActive = numthreads;
+		poolBusy = numthreads;
+		poolGeneration++;
+		WakeAllConditionVariable( &poolWake );
+		while ( poolBusy > 0 )
+			SleepConditionVariableCS( &poolDone, &poolCrit, INFINITE );
+		LeaveCriticalSection( &poolCrit );
+
+		threaded = qfalse;
 	}
-	DeleteCriticalSection( &crit );
 
-	threaded = qfalse;
 	end = I_FloatTime();
 	if ( pacifier ) {
 		Sys_Printf( " (%i)\n", end - start );
@@ -266,17 +522,14 @@ void ThreadUnlock( void ){
  */
 void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 	int i;
-	pthread_t work_threads[MAX_THREADS];
+	pthread_t *work_threads;
 	pthread_addr_t status;
 	pthread_attr_t attrib;
 	pthread_mutexattr_t mattrib;
 	int start, end;
 
 	start = I_FloatTime();
-	dispatch = 0;
-	workcount = workcnt;
-	oldf = -1;
-	pacifier = showpacifier;
+	SetupThreadWork( workcnt, showpacifier );
 	threaded = qtrue;
 
 	if ( pacifier ) {
@@ -303,6 +556,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 		Error( "pthread_attr_setstacksize failed" );
 	}
 
+	work_threads = static_cast<pthread_t *>( safe_malloc( numthreads * sizeof( *work_threads ) ) );
 	for ( i = 0 ; i < numthreads ; i++ )
 	{
 		if ( pthread_create( &work_threads[i], attrib
@@ -317,6 +571,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 			Error( "pthread_join failed" );
 		}
 	}
+	free( work_threads );
 
 	threaded = qfalse;
 
@@ -373,15 +628,11 @@ void ThreadUnlock( void ){
    =============
  */
 void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
-	int i;
-	int pid[MAX_THREADS];
+	int i, pid;
 	int start, end;
 
 	start = I_FloatTime();
-	dispatch = 0;
-	workcount = workcnt;
-	oldf = -1;
-	pacifier = showpacifier;
+	SetupThreadWork( workcnt, showpacifier );
 	threaded = qtrue;
 
 	if ( pacifier ) {
@@ -392,9 +643,9 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 
 	for ( i = 0 ; i < numthreads - 1 ; i++ )
 	{
-		pid[i] = sprocsp( ( void ( * )( void *, size_t ) )func, PR_SALL, (void *)i
-						  , NULL, 0x200000 ); // 2 meg stacks
-		if ( pid[i] == -1 ) {
+		pid = sprocsp( ( void ( * )( void *, size_t ) )func, PR_SALL, (void *)i
+					   , NULL, 0x200000 ); // 2 meg stacks
+		if ( pid == -1 ) {
 			perror( "sproc" );
 			Error( "sproc failed" );
 		}
@@ -527,34 +778,148 @@ void recursive_mutex_init( pthread_mutexattr_t attribs ){
 	pt_mutex->lock = 0;
 }
 
+/* persistent worker pool, created on first use and parked between phases */
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static void ( *poolFunc )( int );
+static int poolSize, poolActive, poolBusy, poolGeneration;
+
+
+
 /*
-   =============
-   RunThreadsOn
-   =============
+   PinThread()
+   binds the calling thread to one of the cpus the process may run on
  */
-void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
+
+static void PinThread( int threadnum ){
+#if GDEF_OS_LINUX
+	cpu_set_t allowed, set;
+	int cpu, n, count;
+
+	if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 ) {
+		return;
+	}
+	count = CPU_COUNT( &allowed );
+	if ( count <= 0 ) {
+		return;
+	}
+
+	/* pick the nth allowed cpu */
+	n = threadnum % count;
+	for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+	{
+		if ( CPU_ISSET( cpu, &allowed ) && n-- == 0 ) {
+			break;
+		}
+	}
+
+	CPU_ZERO( &set );
+	CPU_SET( cpu, &set );
+	if ( pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) != 0 ) {
+		Sys_FPrintf( SYS_VRB, "Could not pin thread %d to cpu %d\n", threadnum, cpu );
+	}
+#endif
+}
+
+
+
+/*
+   PoolThread()
+   worker main loop, sleeps until RunThreadsOn starts a new phase
+ */
+
+static void *PoolThread( void *param ){
+	int threadnum = (int) (size_t) param;
+	int generation = -1;
+
+	if ( threadAffinity ) {
+		PinThread( threadnum );
+	}
+
+	while ( 1 )
+	{
+		pthread_mutex_lock( &poolMutex );
+		while ( generation == poolGeneration )
+			pthread_cond_wait( &poolWake, &poolMutex );
+		generation = poolGeneration;
+		pthread_mutex_unlock( &poolMutex );
+
+		/* threads beyond the current thread count sit this phase out */
+		if ( threadnum >= poolActive ) {
+			continue;
+		}
+
+		poolFunc( threadnum );
+
+		pthread_mutex_lock( &poolMutex );
+		if ( --poolBusy == 0 ) {
+			pthread_cond_signal( &poolDone );
+		}
+		pthread_mutex_unlock( &poolMutex );
+	}
+
+	return NULL;
+}
+
+
+
+/*
+   GrowThreadPool()
+   starts workers until there are numthreads of them, must be called with poolMutex held
+ */
+
+static void GrowThreadPool( void ){
 	pthread_mutexattr_t mattrib;
 	pthread_attr_t attr;
-	pthread_t work_threads[MAX_THREADS];
+	pthread_t thread;
 	size_t stacksize;
 
-	int start, end;
-	int i = 0;
-
-	start     = I_FloatTime();
-	pacifier  = showpacifier;
+	if ( poolSize >= numthreads ) {
+		return;
+	}
 
-	dispatch  = 0;
-	oldf      = -1;
-	workcount = workcnt;
+	/* first time through, set up the global lock */
+	if ( poolSize == 0 ) {
+		if ( pthread_mutexattr_init( &mattrib ) != 0 ) {
+			Error( "pthread_mutexattr_init failed" );
+		}
+		if ( pthread_mutexattr_settype( &mattrib, PTHREAD_MUTEX_ERRORCHECK ) != 0 ) {
+			Error( "pthread_mutexattr_settype failed" );
+		}
+		recursive_mutex_init( mattrib );
+		pthread_mutexattr_destroy( &mattrib );
+	}
 
 	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
 	if ( pthread_attr_setstacksize( &attr, 8388608 ) != 0 ) {
 		stacksize = 0;
 		pthread_attr_getstacksize( &attr, &stacksize );
 		Sys_Printf( "Could not set a per-thread stack size of 8 MB, using only %.2f MB\n", stacksize / 1048576.0 );
 	}
 
+	for ( ; poolSize < numthreads; poolSize++ )
+	{
+		if ( pthread_create( &thread, &attr, PoolThread, (void*)(size_t) poolSize ) != 0 ) {
+			Error( "pthread_create failed" );
+		}
+	}
+
+	pthread_attr_destroy( &attr );
+}
+
+/*
+   =============
+   RunThreadsOn
+   =============
+ */
+void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
+	int start, end;
+
+	start     = I_FloatTime();
+	SetupThreadWork( workcnt, showpacifier );
+
 	if ( numthreads == 1 ) {
 		func( 0 );
 	}
@@ -566,28 +931,21 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 			setbuf( stdout, NULL );
 		}
 
-		if ( pthread_mutexattr_init( &mattrib ) != 0 ) {
-			Error( "pthread_mutexattr_init failed" );
-		}
-		if ( pthread_mutexattr_settype( &mattrib, PTHREAD_MUTEX_ERRORCHECK ) != 0 ) {
-			Error( "pthread_mutexattr_settype failed" );
-		}
-		recursive_mutex_init( mattrib );
+		/* new workers can't grab the lock before this phase is published, so they never miss it */
+		pthread_mutex_lock( &poolMutex );
+		GrowThreadPool();
+
+		poolFunc = func;
+		poolActive = numthreads;
+		poolBusy = numthreads;
+		poolGeneration++;
+		pthread_cond_broadcast( &poolWake );
+
+		/* wait for every worker to finish before the next phase can start */
+		while ( poolBusy > 0 )
+			pthread_cond_wait( &poolDone, &poolMutex );
+		pthread_mutex_unlock( &poolMutex );
 
-		for ( i = 0 ; i < numthreads ; i++ )
-		{
-			/* Default pthread attributes: joinable & non-realtime scheduling */
-			if (pthread_create(&work_threads[i], &attr, (void *(*)(void *)) func, (void*)(size_t)i ) != 0 ) {
-				Error( "pthread_create failed" );
-			}
-		}
-		for ( i = 0 ; i < numthreads ; i++ )
-		{
-			if ( pthread_join( work_threads[i], NULL ) != 0 ) {
-				Error( "pthread_join failed" );
-			}
-		}
-		pthread_mutexattr_destroy( &mattrib );
 		threaded = qfalse;
 	}
 
@@ -630,10 +988,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 	int i;
 	int start, end;
 
-	dispatch = 0;
-	workcount = workcnt;
-	oldf = -1;
-	pacifier = showpacifier;
+	SetupThreadWork( workcnt, showpacifier );
 	start = I_FloatTime();
 	func( 0 );
 